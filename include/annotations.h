@@ -2,12 +2,27 @@
 #include <tr1/unordered_map>
 #include <vector>
 #include <string>
+#include <string_view>
 #include <sys/stat.h>
+#include <signal.h>
+#include <errno.h>
+#include <stdio.h>
 #include <set>
+#include <map>
 #include "hashfile.h"
 #include "logfile.h"
 #include "utils.h"
 #include "btreefile.h"
+#include "gappedhashfile.h"
+#include "encodedhashfile.h"
+#include "valueset.h"
+#include "extsort.h"
+#include "probeengine.h"
+#include "snapshot.h"
+#include "trace.h"
+
+#ifndef ANNOTATIONS_H
+#define ANNOTATIONS_H
     
 using namespace std;
 using namespace tr1;
@@ -28,33 +43,148 @@ typedef struct
 
 }	CacheLine;
 
+// the A,C pair of a cacheLine, in binary form
+typedef struct
+{
+	Digest A, C;
+}	CachePair;
+
+inline bool operator==(const CachePair &p1, const CachePair &p2)
+{
+	return(p1.A == p2.A && p1.C == p2.C);
+}
+
+struct CachePairHash
+{
+	size_t operator()(const CachePair &pair) const
+	{
+		return DigestHash()(pair.A) * 31 + DigestHash()(pair.C);
+	}
+};
+
+// the memory maps are keyed by the binary form of each key, so that a lookup
+// needs no string of its own. dirty keys compare against string_views directly
+typedef tr1::unordered_map<Digest, ValueSet, DigestHash> DigestMap;
+typedef tr1::unordered_map<CachePair, CacheLine, CachePairHash> CacheMap;
+typedef set<string, less<> > KeySet;
+
+// read counts per key, for finding the hot keys
+typedef tr1::unordered_map<Digest, unsigned long, DigestHash> AccessMap;
+
 class AnnotationSet
 {
 	public:
-		AnnotationSet(string directory_path, string hashTableType = "");
+		AnnotationSet(string directory_path, string hashTableType = "", unsigned int shardBits = 0, unsigned int shardIndex = 0,
+					  unsigned int keyWidth = SHA_WIDTH);
 		~AnnotationSet();
 		void initialize();
-		void annotate_entry(string A, string C);
-		void unannotate_entry(string A, string C);
-		set<string> list_annotations(string C);
-		set<string> list_entries(string A);
+		void annotate_entry(string_view A, string_view C);
+		void unannotate_entry(string_view A, string_view C);
+		set<string> list_annotations(string_view C);
+		set<string> list_entries(string_view A);
+		ValuePage list_annotations(string_view C, unsigned long limit, string_view cursor = "");
+		ValuePage list_entries(string_view A, unsigned long limit, string_view cursor = "");
+		bool has_annotation(string_view A, string_view C);
+		unsigned long count_entries(string_view A);
+		unsigned long count_annotations(string_view C);
+		map<string, set<string> > list_entries_by_prefix(string prefix);
+		map<string, set<string> > list_entries_in_range(string low, string high);
+		map<string, set<string> > list_annotations_by_prefix(string prefix);
+		map<string, set<string> > list_annotations_in_range(string low, string high);
+		set<string> intersect_entries(vector<string> As);
+		set<string> union_entries(vector<string> As);
+		set<string> intersect_annotations(vector<string> Cs);
+		set<string> union_annotations(vector<string> Cs);
+		vector<set<string> > list_entries_batch(vector<string> As);
+		vector<set<string> > list_annotations_batch(vector<string> Cs);
+		void sweep_entries(vector<string> As, SweepCallback callback);
+		void sweep_annotations(vector<string> Cs, SweepCallback callback);
 		void commit_to_disk();
+		void set_commit_memory_limit(unsigned long bytes);
+		void set_search_mode(SearchMode mode);
+		void tune_index(unsigned long lookups = DEFAULT_TUNE_LOOKUPS);
+		void bulk_load(string snapshot_filename, unsigned long memory_limit = 256ul << 20, unsigned int threads = 2);
+		void bulk_load(ExternalSorter *A2C_Sorter, ExternalSorter *C2A_Sorter);
+		void set_hot_key_capacity(unsigned long keys);
+		void set_prefetch_on_start(bool prefetch);
+		void save_hot_keys();
+		void hot_keys(vector<string> &As, vector<string> &Cs);
+		void prefetch(vector<string> As, vector<string> Cs);
+		void prefetch_hot_keys();
+		unsigned int keyWidth();
+		AnnotationSnapshot snapshot();
+		AnnotationScanner scan_entries();
+		AnnotationScanner scan_annotations();
+
+		static void read_commit_state(string directory_path, char &state, unsigned long &generation);
+
+		const static unsigned long DEFAULT_TUNE_LOOKUPS = 4096;
 
 	private:
-		set<string>& hash_lookup(string key, unordered_map<string, set<string> > &map, HashFile *h);
-		void modify_entry(string cmd, string A, string C, bool writeLog = true);
-		void modify_entry_in_table( unordered_map<string, set<string> > &table, string cache_key, 
-									HashFile *hashfile, string cmd, string key, string value );
+		ValueSet& hash_lookup(string_view key, DigestMap &map, HashFile *h, DigestArena &arena);
+		map<string, set<string> > range_lookup(string low, string high, DigestMap &map, KeySet &dirty_keys, HashFile *h);
+		set<string> intersect_lookup(vector<string> keys, DigestMap &map, HashFile *h);
+		set<string> union_lookup(vector<string> keys, DigestMap &map, HashFile *h);
+		unsigned long count_lookup(string_view key, DigestMap &map, HashFile *h);
+		ValuePage page_lookup(string_view key, unsigned long limit, string_view cursor, DigestMap &map, HashFile *h);
+		vector<set<string> > batch_lookup(vector<string> keys, DigestMap &map, HashFile *h, DigestArena &arena, AccessMap &counts);
+		void batch_load(const vector<string> &keys, vector<ValueSet*> &lists, DigestMap &map, HashFile *h, DigestArena &arena);
+		void sweep_lookup(vector<string> keys, SweepCallback callback, DigestMap &map, HashFile *h);
+		void modify_entry(Log::Op cmd, string_view A, string_view C, bool writeLog = true);
+		void modify_entry_in_table( DigestMap &table, DigestArena &arena, KeySet &dirty_keys, const CachePair &cache_key,
+									HashFile *hashfile, Log::Op cmd, string_view key, const Digest &value );
 	
+		bool owns_key(string_view key);
+		bool owns_digest(const Digest &key);
+		AnnotationSnapshot scan_snapshot(bool entries);
+		shared_ptr<SnapshotFiles> snapshot_files();
+		shared_ptr<const SnapshotDelta> snapshot_delta(bool A2C, bool C2A);
 		void compact_log();
+		void publish_tmp_state();
+		void clear_caches();
+		void record_access(string_view key, AccessMap &counts);
+		void load_hot_keys();
+		void remove_stale_snapshots();
 		void atomic_write(char value);
 		char atomic_read();
 
 		string directory_path, atomic_log_filename;
+		unsigned int shard_bits, shard_index, key_width;
 		HashFile *A2C_File, *C2A_File;	
 		LogFile Log;
-		unordered_map<string, set<string> > A2C_Memory_Map, C2A_Memory_Map;
-		unordered_map<string, CacheLine> Cache_Table;
-};
 
+		// value sets are carved from these, so they must outlive the memory maps
+		DigestArena A2C_Arena, C2A_Arena;
+		DigestMap A2C_Memory_Map, C2A_Memory_Map;
+
+		// keys modified since the last commit, in order, so range queries can
+		// merge them in (including keys not yet present on disk)
+		KeySet A2C_Dirty_Keys, C2A_Dirty_Keys;
+		CacheMap Cache_Table;
+
+		// created on the first batch lookup
+		ProbeEngine *Probe_Engine;
+
+		// reads per key since the set was opened, seeded from the hot keys saved
+		// by the last commit. once a map tracks ACCESS_TRACK_FACTOR times the
+		// capacity, it is cut down to twice the capacity and its counts halved,
+		// so keys that were hot long ago fade
+		AccessMap A2C_Access, C2A_Access;
+		unsigned long hot_key_capacity;
+		bool prefetch_on_start;
+
+		const static unsigned long DEFAULT_HOT_KEYS = 1024;
+		const static unsigned int ACCESS_TRACK_FACTOR = 8;
+
+		// the generation counts publishes of new files, and is kept in the atomic
+		// log; the sequence counts changes. the files and delta of the latest
+		// snapshot are shared by the next one, as long as they are still current
+		// and some snapshot still holds them
+		string hash_table_type;
+		unsigned long generation, sequence;
+		weak_ptr<SnapshotFiles> Snapshot_Files;
+		weak_ptr<const SnapshotDelta> Snapshot_Delta;
+		unsigned long snapshot_sequence;
+};
 
+#endif
@@ -0,0 +1,223 @@
+#include <string>
+#include <set>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <memory>
+#include <functional>
+#include "workpool.h"
+
+#ifndef ASYNCSET_H
+#define ASYNCSET_H
+
+using namespace std;
+
+enum AsyncStatus
+{
+	ASYNC_PENDING,		// queued, not started
+	ASYNC_RUNNING,
+	ASYNC_DONE,
+	ASYNC_CANCELLED,	// cancel() was called before it started
+	ASYNC_EXPIRED,		// its deadline passed before it started
+	ASYNC_REJECTED		// the pool was full when it was submitted
+};
+
+// The outcome of an asynchronous call, shared between the caller and the worker
+// that runs it. copies refer to the same call
+
+template<class T>
+class AsyncResult
+{
+	public:
+		typedef function<void(AsyncResult<T>)> Callback;
+
+		AsyncResult(Callback callback = NULL) : state(new State)
+		{
+			state->status = ASYNC_PENDING;
+			state->callback = callback;
+		}
+
+		AsyncStatus status()
+		{
+			unique_lock<mutex> guard(state->lock);
+			return state->status;
+		}
+
+		bool ready()
+		{
+			AsyncStatus s = status();
+			return(s != ASYNC_PENDING && s != ASYNC_RUNNING);
+		}
+
+		AsyncStatus wait()
+		{
+			unique_lock<mutex> guard(state->lock);
+
+			while(state->status == ASYNC_PENDING || state->status == ASYNC_RUNNING)
+				state->finished.wait(guard);
+
+			return state->status;
+		}
+
+		// waits at most timeout_ms; returns the status at that point
+		AsyncStatus waitFor(unsigned long timeout_ms)
+		{
+			unique_lock<mutex> guard(state->lock);
+			chrono::steady_clock::time_point until = chrono::steady_clock::now() + chrono::milliseconds(timeout_ms);
+
+			while(state->status == ASYNC_PENDING || state->status == ASYNC_RUNNING)
+				if(state->finished.wait_until(guard, until) == cv_status::timeout)
+					break;
+
+			return state->status;
+		}
+
+		// waits, then returns the value; a default T unless the call is ASYNC_DONE
+		T get()
+		{
+			wait();
+			return state->value;
+		}
+
+		// a call can only be cancelled before it starts. returns whether it was
+		bool cancel()
+		{
+			unique_lock<mutex> guard(state->lock);
+
+			if(state->status != ASYNC_PENDING)
+				return false;
+
+			state->status = ASYNC_CANCELLED;
+			state->finished.notify_all();
+			return true;
+		}
+
+		// used by the worker: move from pending to running, unless cancelled
+		bool claim()
+		{
+			unique_lock<mutex> guard(state->lock);
+
+			if(state->status != ASYNC_PENDING)
+				return false;
+
+			state->status = ASYNC_RUNNING;
+			return true;
+		}
+
+		// used by the worker: record the outcome, wake waiters, then run the
+		// callback on the current thread. cancelled calls get no callback
+		void finish(AsyncStatus status, const T &value = T())
+		{
+			{
+				unique_lock<mutex> guard(state->lock);
+				state->status = status;
+				state->value = value;
+				state->finished.notify_all();
+			}
+
+			if(state->callback)
+				state->callback(*this);
+		}
+
+	private:
+		typedef struct
+		{
+			mutex lock;
+			condition_variable finished;
+			AsyncStatus status;
+			T value;
+			Callback callback;
+		} State;
+
+		shared_ptr<State> state;
+};
+
+// Non-blocking access to an AnnotationSet or ShardedAnnotationSet: every call
+// returns at once with an AsyncResult, and runs on a bounded work-stealing pool.
+// calls reach the store one at a time. writes and commits are applied in the
+// order they were submitted, so a commit covers every write queued before it;
+// lookups run in any order, so one submitted after a write may or may not see
+// it. the store must not be used directly while this wrapper exists. a non-zero timeout_ms is a
+// deadline for the call to start by; one that cannot start in time is dropped
+// as ASYNC_EXPIRED. a callback, if given, runs on the worker once the call ends
+
+template<class Store>
+class AsyncAnnotationSet
+{
+	public:
+		typedef AsyncResult<set<string> > SetResult;
+		typedef AsyncResult<bool> WriteResult;
+
+		AsyncAnnotationSet(Store *s, unsigned int threads = 2, unsigned long maxPending = 4096)
+			: store(s), pool(threads, maxPending) {}
+
+		SetResult list_entries_async(string A, unsigned long timeout_ms = 0, typename SetResult::Callback callback = NULL)
+		{
+			return run<set<string> >([this, A]() { return store->list_entries(A); }, false, timeout_ms, callback);
+		}
+
+		SetResult list_annotations_async(string C, unsigned long timeout_ms = 0, typename SetResult::Callback callback = NULL)
+		{
+			return run<set<string> >([this, C]() { return store->list_annotations(C); }, false, timeout_ms, callback);
+		}
+
+		// writes resolve to true once applied (and logged)
+		WriteResult annotate_entry_async(string A, string C, unsigned long timeout_ms = 0,
+										 typename WriteResult::Callback callback = NULL)
+		{
+			return run<bool>([this, A, C]() { store->annotate_entry(A, C); return true; }, true, timeout_ms, callback);
+		}
+
+		WriteResult unannotate_entry_async(string A, string C, unsigned long timeout_ms = 0,
+										   typename WriteResult::Callback callback = NULL)
+		{
+			return run<bool>([this, A, C]() { store->unannotate_entry(A, C); return true; }, true, timeout_ms, callback);
+		}
+
+		WriteResult commit_async(unsigned long timeout_ms = 0, typename WriteResult::Callback callback = NULL)
+		{
+			return run<bool>([this]() { store->commit_to_disk(); return true; }, true, timeout_ms, callback);
+		}
+
+	private:
+		template<class T>
+		AsyncResult<T> run(function<T()> call, bool ordered, unsigned long timeout_ms, typename AsyncResult<T>::Callback callback)
+		{
+			AsyncResult<T> result(callback);
+			chrono::steady_clock::time_point deadline = chrono::steady_clock::now() + chrono::milliseconds(timeout_ms);
+
+			function<void()> task = [this, result, call, deadline, timeout_ms]() mutable
+			{
+				if(!result.claim())
+					return;
+
+				if(timeout_ms != 0 && chrono::steady_clock::now() > deadline)
+				{
+					result.finish(ASYNC_EXPIRED);
+					return;
+				}
+
+				T value;
+				{
+					unique_lock<mutex> guard(store_lock);
+					value = call();
+				}
+				result.finish(ASYNC_DONE, value);
+			};
+
+			bool queued = (ordered ? pool.submitOrdered(task) : pool.submit(task));
+
+			if(!queued && result.claim())
+				result.finish(ASYNC_REJECTED);
+
+			return result;
+		}
+
+		Store *store;
+		mutex store_lock;
+
+		// declared last, so queued calls drain before the lock goes away
+		WorkPool pool;
+};
+
+#endif
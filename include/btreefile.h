@@ -1,49 +1,111 @@
 #include <set>
 #include <string>
+#include <vector>
+#include <chrono>
+#include <random>
 #include <iostream>
 #include <fstream>
 #include <sstream>
 #include <assert.h>
 #include <math.h>
+#include <string.h>
 
 #include "hashfile.h"
 
 #ifndef BTREEFILE_H
 #define BTREEFILE_H
 
-#define SHA_WIDTH 40
-
 using namespace std;
 
+// the shape of a BTreeFile's trie. a node holds an entry for each value of the
+// next mask_size hex digits of a key, so 16^mask_size of them; an entry is a
+// flag and two line numbers of num_width bytes. nodes are padded to a multiple
+// of alignment bytes (a cache line, or a page), and the table starts on such a
+// boundary. a range of fewer than min_children lines ends the walk, and is
+// binary searched in the HashFile
+typedef struct
+{
+	unsigned int mask_size, num_width, alignment;
+	unsigned long min_children;
+}	BTreeGeometry;
+
+bool operator==(const BTreeGeometry &g1, const BTreeGeometry &g2);
+
+// the geometry is recorded in the header of BTreeFile.txt, and lookups follow
+// the one the file was built with. builds use the geometry given to the
+// constructor or setGeometry, or else the one of the file last opened
+
 class BTreeFile : public HashFile
 {
 	public:
-		BTreeFile(string path, unsigned long minChildrenPerNode = 128);
+		BTreeFile(string path);
+		BTreeFile(string path, BTreeGeometry geometry);
 		~BTreeFile();
 		void setPath(string path);
-		set<string> get(string key);
+		void get(string key, ValueSet &values);
+		bool has(string key, string value);
+		bool getKeyBounds(string key, unsigned long &begin, unsigned long &end);
+		unsigned long lowerBound(string key);
+		void getPage(string key, string after, unsigned long limit, vector<string> &values);
 		void commit(string newPath, LogFile &log, bool reverseLog);
+		void buildIndex(string newPath);
 		void moveState(string dirPathInit, string dirPathFinal);
 		void copyState(string newPath);
+		void getLayout(IndexLayout &layout);
+		void tuneIndex(unsigned long lookups);
+		void setGeometry(BTreeGeometry geometry);
+		BTreeGeometry geometry();
+		BTreeGeometry tuneGeometry(const vector<BTreeGeometry> &candidates, const vector<string> &keys,
+								   vector<double> &nanosPerLookup);
+
+		static BTreeGeometry defaultGeometry();
+		static vector<BTreeGeometry> candidateGeometries();
+		static unsigned long nodeWidth(BTreeGeometry geometry);
+
+		const static char LINE_IDX_FLAG = 0x01, TABLE_PTR_FLAG = 0x02, EMPTY_FLAG = 0x00;
+		const static unsigned int DEFAULT_MASK_SIZE = 2, DEFAULT_NUM_WIDTH = 7, DEFAULT_ALIGNMENT = 4096;
+		const static unsigned long DEFAULT_MIN_CHILDREN = 128;
+
+	protected:
+		unsigned long seekBound(string key, unsigned long from);
+
 	private:
-		void createTableLine(string newPath, string mask, unsigned long &line_cursor);
-		string getLineInTable(unsigned long line);
+		bool getWindow(string key, unsigned long &low, unsigned long &high);
+		void createTableLine(string mask, unsigned long &line_cursor, unsigned long window_low, unsigned long window_high);
 		void getEntryInTable(char *buf, unsigned long line, int line_index);
 		unsigned long getEntryLeftNumber(string entry);
 		unsigned long getEntryRightNumber(string entry);
 
-		void write_header(string newPath, unsigned long n, bool truncate);
-		void write_line_at_index(string newPath, unsigned long index, char *line);
+		void read_header(const unsigned long *header);
+		void write_header(unsigned long table_lines);
+		void write_line_at_index(unsigned long index, char *line);
 
 		string filename;
 		fstream file;
+		MappedFile mapping;
 		string path;
 
-		const static int MASK_SIZE = 2, NUM_WIDTH = 4, FLAG_WIDTH = 1, ENTRY_WIDTH = 2 * NUM_WIDTH + 1;
-		const static char LINE_IDX_FLAG = 0x01, TABLE_PTR_FLAG = 0x02, EMPTY_FLAG = 0x00;
+		// the geometry of the open file, and the one builds use
+		BTreeGeometry file_geometry, build_geometry;
+		bool geometry_set;
+
+		int LINE_WIDTH, ENTRY_WIDTH;
+		unsigned long _table_region_ptr, table_size;
+
+		// the table being built
+		fstream output;
+		unsigned long build_line_width, build_entry_width, build_table_offset;
+
+		// the header is HEADER_FIELDS 8-byte words: the magic, the table lines,
+		// the geometry, the table offset and the node width. files from before it
+		// hold a 4-byte table size, then packed nodes of the legacy geometry
+		const static unsigned long HEADER_MAGIC = 0x3154524545525442ul;
+		const static unsigned int HEADER_FIELDS = 8, FLAG_WIDTH = 1, MIN_NUM_WIDTH = 4, MAX_NUM_WIDTH = 8, MAX_MASK_SIZE = 3;
+		const static unsigned int LEGACY_MASK_SIZE = 2, LEGACY_NUM_WIDTH = 4, LEGACY_HEADER_WIDTH = 4;
 
-		int LINE_WIDTH, _table_region_ptr;
-		unsigned long table_size, last_table_line_written, min_children_per_node;
+		// lookups of the sampled keys, per candidate geometry, of which the
+		// fastest counts
+		const static unsigned int TUNE_ROUNDS = 3;
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,80 @@
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "hashfile.h"
+
+#ifndef ENCODEDHASHFILE_H
+#define ENCODEDHASHFILE_H
+
+using namespace std;
+
+// A HashFile stored dictionary-encoded. every distinct key and value of the
+// file is listed once, in binary and in order, in a dictionary; its rank there
+// is its ID, so IDs sort as their digests do. each key's values are kept as a
+// sorted list of IDs, written as varint gaps. HashFile.txt holds, after its
+// header, the dictionary, then a table with each key's ID, the index of its
+// first pair and where its list starts, then the lists.
+//
+// the dictionary and the table are mapped, and binary searched in place; a
+// lookup reads a single list, and translates IDs back to digests only for the
+// values it returns. a commit merges the log as a plain HashFile does, then
+// encodes the result, holding neither the dictionary nor the table in memory
+
+class EncodedHashFile : public HashFile
+{
+	public:
+		EncodedHashFile(string path);
+		void setPath(string path);
+		void get(string key, ValueSet &values);
+		bool has(string key, string value);
+		unsigned long count(string key);
+		bool getKeyBounds(string key, unsigned long &begin, unsigned long &end);
+		unsigned long lowerBound(string key);
+		void getPage(string key, string after, unsigned long limit, vector<string> &values);
+		void intersect(string key, vector<Digest> &candidates);
+		void sweep(const vector<string> &keys, function<void(const string &key, ValueSet &values)> callback);
+		void commit(string newPath, LogFile &log, bool reverseLog);
+		void buildIndex(string newPath);
+		void getLayout(IndexLayout &layout);
+		unsigned long dictionarySize();
+
+	protected:
+		unsigned long scanLines(int fd, unsigned long index, char *buffer, unsigned long lines);
+		unsigned long seekBound(string key, unsigned long from);
+
+	private:
+		void load_tables();
+		unsigned int key_id(unsigned long k);
+		unsigned long key_start(unsigned long k);
+		unsigned long list_offset(unsigned long k);
+		unsigned long id_position(unsigned long id);
+		unsigned long start_position(unsigned long index, bool strict);
+		bool find_key(const string &key, unsigned long &k);
+		unsigned long key_bound(const string &target, bool strict);
+		bool find_id(const string &hex, unsigned int &id);
+		void id_digest(unsigned int id, Digest &digest);
+		string id_hex(unsigned int id);
+		void read_list(unsigned long k, vector<unsigned int> &ids);
+
+		string path;
+		unsigned int digest_bytes;
+		unsigned long postings_offset, digests, keys;
+
+		// HashFile.txt, mapped, and in it the dictionary and the table: per key
+		// its ID, the index of its first pair and the offset of its list. the
+		// table has one more entry, past the keys, for where they all end
+		MappedFile tables;
+		const char *dictionary, *table;
+
+		// table entries are a 4-byte ID and two 8-byte offsets, in host order
+		const static unsigned int TABLE_ENTRY_BYTES = 20;
+
+		// what an empty file's dictionary and table are read from
+		static const char empty_table[TABLE_ENTRY_BYTES];
+};
+
+#endif
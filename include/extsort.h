@@ -0,0 +1,67 @@
+#include <string>
+#include <vector>
+#include <fstream>
+#include <thread>
+#include <string.h>
+
+#ifndef EXTSORT_H
+#define EXTSORT_H
+
+using namespace std;
+
+// reads back one spilled run through a fixed-size buffer
+
+class RunReader
+{
+	public:
+		RunReader(string filename, unsigned int recordWidth, unsigned long bufferBytes);
+		~RunReader();
+		const char *current();
+		bool advance();
+
+	private:
+		fstream file;
+		string filename;
+		char *buffer;
+		unsigned int record_width;
+		unsigned long buffer_records, buffered, pos;
+};
+
+// sorts fixed-width records (compared with memcmp) within a memory budget.
+// records are collected into a buffer; when it fills it is handed to a background
+// thread that sorts it and spills it to a run file, while a fresh buffer keeps
+// filling. once all records are in, next() k-way merges the runs back in order.
+// if everything fits in one buffer nothing touches the disk
+
+class ExternalSorter
+{
+	public:
+		ExternalSorter(string tmpPrefix, unsigned int recordWidth, unsigned long memoryLimit, unsigned int threads = 1);
+		~ExternalSorter();
+		void add(const char *record);
+		void finish();
+		const char *next();
+		unsigned long size();
+
+	private:
+		void spill();
+
+		string tmp_prefix;
+		unsigned int record_width, max_threads;
+		unsigned long buffer_records, buffered, total_records, memory_limit;
+		char *buffer;
+
+		vector<string> run_files;
+		vector<thread*> workers;
+
+		// merge state
+		bool finished, in_memory;
+		vector<char*> memory_order;
+		unsigned long memory_pos;
+		vector<RunReader*> readers;
+		vector<unsigned long> heap;
+		bool heap_primed;
+		long last_run;
+};
+
+#endif
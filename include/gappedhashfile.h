@@ -0,0 +1,93 @@
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "hashfile.h"
+
+#ifndef GAPPEDHASHFILE_H
+#define GAPPEDHASHFILE_H
+
+using namespace std;
+
+// A HashFile whose lines are kept in fixed-size pages with slack left in each,
+// like the leaves of a B+-tree. the lines of a page are packed at its start,
+// and the pages hold the key space in the order the page table lists them,
+// wherever they lie in the file. the table, with the first line of every page
+// as its fence, is held in memory, so a lookup reads a single page.
+//
+// a commit rewrites only the pages its delta falls in. a page that overflows
+// is split, locally, into pages filled to the fill factor. rewritten pages are
+// appended to the file rather than written over the old ones, so snapshots and
+// readers holding the file keep a consistent view, and a commit publishes by
+// replacing the table alone. once more of the file is dead pages than live, a
+// commit writes a fresh, packed file instead
+
+class GappedHashFile : public HashFile
+{
+	public:
+		GappedHashFile(string path, unsigned int pageLines = DEFAULT_PAGE_LINES, double fillFactor = DEFAULT_FILL_FACTOR);
+		void setPath(string path);
+		void get(string key, ValueSet &values);
+		bool has(string key, string value);
+		unsigned long count(string key);
+		bool getKeyBounds(string key, unsigned long &begin, unsigned long &end);
+		unsigned long lowerBound(string key);
+		void getPage(string key, string after, unsigned long limit, vector<string> &values);
+		void intersect(string key, vector<Digest> &candidates);
+		void commit(string newPath, LogFile &log, bool reverseLog);
+		void buildIndex(string newPath);
+		void copyState(string newPath);
+		void moveState(string dirPathInit, string dirPathFinal);
+		void getLayout(IndexLayout &layout);
+		unsigned long pageCount();
+		unsigned long pagesWritten();
+
+		const static unsigned int DEFAULT_PAGE_LINES = 64;
+		constexpr static double DEFAULT_FILL_FACTOR = 0.75;
+
+	protected:
+		unsigned long scanExtent(unsigned long index, unsigned long &offset);
+		unsigned long seekBound(string key, unsigned long from);
+
+	private:
+		bool locate(const string &target, bool strict, unsigned long &page, unsigned long &pos, string &block);
+		bool next_line(unsigned long &page, unsigned long &pos, string &block);
+		bool fence_precedes(unsigned long page, const string &target, bool strict);
+		void read_page(unsigned long page, string &block);
+		void load_table();
+		void set_geometry(unsigned int pageLines, unsigned int fillLines);
+
+		bool record_precedes_fence(const char *record, unsigned long page);
+		void merge_page(const string &block, unsigned long lines, ExternalSorter &sorter, const char *&record,
+						unsigned long end_page);
+		void add_line(const char *line);
+		void finish_run();
+		void write_page(const char *lines, unsigned long count);
+		void open_output(string newPath, bool fresh);
+		void write_table(string newPath);
+
+		string path;
+		unsigned int page_lines, fill_lines, line_width, fence_width;
+		unsigned long file_slots;
+
+		// the page table: the slot each page lies in, the index of its first
+		// line (plus the line count, at the end), and its first line
+		vector<unsigned long> page_slots, page_starts;
+		string fences;
+
+		// the table being built by a commit, and the pages it has written
+		fstream output;
+		unsigned long output_slot, pages_written;
+		vector<unsigned long> new_slots, new_counts;
+		string new_fences, run;
+
+		// a compaction writes a fresh file once this many slots are in use for
+		// each live page, and there are at least MIN_COMPACT_SLOTS
+		const static unsigned int COMPACT_RATIO = 2;
+		const static unsigned long MIN_COMPACT_SLOTS = 64;
+};
+
+#endif
@@ -5,46 +5,204 @@
 #include <set>
 #include <sys/stat.h>
 #include <assert.h>
+#include <algorithm>
+#include <functional>
+#include <fcntl.h>
+#include <unistd.h>
 #include "logfile.h"
 #include "utils.h"
+#include "valueset.h"
+#include "extsort.h"
+#include "keywidth.h"
+#include "trace.h"
 
 #ifndef HASHFILE_H
 #define HASHFILE_H
 
-#define SHA_WIDTH 40
-
 using namespace std;
 
+class HashFileScanner;
+class HashFileWriter;
+
+// on-disk geometry of an index, for readers that issue their own positioned
+// reads rather than going through the HashFile interface
+
+typedef struct
+{
+	string hash_filename;
+	unsigned long data_offset, data_size;
+	int line_width;
+	unsigned int key_width;
+
+	// BTreeFile trie table; table_size is 0 when there is none
+	string table_filename;
+	unsigned long table_offset, table_size;
+	int table_line_width, entry_width, mask_size, num_width;
+} IndexLayout;
+
+// how a HashFile locates a key. SHA keys are close to uniformly distributed, so
+// interpolation can estimate a key's line from its value and usually lands
+// within a few lines of it; binary search needs about log2(N) probes
+
+enum SearchMode { SEARCH_BINARY, SEARCH_INTERPOLATION };
+
 class HashFile
 {
 	public:
-		HashFile(){}
+		HashFile() : search_probes(0), map_files(false), commit_memory_limit(DEFAULT_COMMIT_MEMORY_LIMIT), partition_bits(0),
+					 partition_index(0), search_mode(SEARCH_BINARY), key_width(SHA_WIDTH),
+					 line_width(2 * SHA_WIDTH + 2) {}
 		HashFile(string path);
 		virtual ~HashFile();
 		virtual void setPath(string path);
-		virtual set<string> get(string key);
+		virtual void get(string key, ValueSet &values);
+		virtual bool has(string key, string value);
+		virtual unsigned long count(string key);
+		virtual bool getKeyBounds(string key, unsigned long &begin, unsigned long &end);
+		virtual unsigned long lowerBound(string key);
+		virtual void getPage(string key, string after, unsigned long limit, vector<string> &values);
+		virtual void intersect(string key, vector<Digest> &candidates);
+		virtual void sweep(const vector<string> &keys, function<void(const string &key, ValueSet &values)> callback);
 		virtual void commit(string filename, LogFile &logFile, bool);
+		virtual void buildIndex(string newPath);
+		virtual void tuneIndex(unsigned long lookups);
+		void setCommitMemoryLimit(unsigned long bytes);
+		void setPartition(unsigned int bits, unsigned int index);
+		void setSearchMode(SearchMode mode);
+		void setKeyWidth(unsigned int width);
+		void setMapped(bool mapped);
+		unsigned int keyWidth();
+		unsigned long searchProbes();
+		virtual void getLayout(IndexLayout &layout);
 		virtual void copyState(string newDirPath);
 		virtual void moveState(string dirPathInit, string dirPathFinal);
 
 	protected:
 		unsigned long getIndexOfKey(string key, unsigned long window_low, unsigned long window_high);
 		string getKeyAtIndex(unsigned long index);
-		set<string> get(string key, unsigned long window_low, unsigned long window_high);
+		void get(string key, unsigned long window_low, unsigned long window_high, ValueSet &values);
+		bool has(string key, string value, unsigned long window_low, unsigned long window_high);
+		void getPage(string key, string after, unsigned long limit, unsigned long window_low,
+					 unsigned long window_high, vector<string> &values);
+		bool getKeyBounds(string key, unsigned long window_low, unsigned long window_high,
+						  unsigned long &begin, unsigned long &end);
 		unsigned long getIndexOfKey(string key);
 		unsigned long length();
+		void readLines(unsigned long index, unsigned long count, string &block);
+		void readBytes(unsigned long offset, unsigned long size, string &block);
+		unsigned long lineOffset(unsigned long index);
+		void sortLog(ExternalSorter &sorter, LogFile &log, bool reverseLog);
+		virtual unsigned long scanExtent(unsigned long index, unsigned long &offset);
+		virtual unsigned long scanLines(int fd, unsigned long index, char *buffer, unsigned long lines);
+		virtual unsigned long seekBound(string key, unsigned long from);
+
+		// lines (and trie entries) read while locating keys, for benchmarking
+		unsigned long search_probes;
+
+		// read through shared read-only mappings rather than file streams
+		bool map_files;
+		unsigned long commit_memory_limit;
 
 	private:
 		unsigned long get_aligned_index(unsigned long index, int mode);
+		unsigned long get_bound_index(string target, unsigned long window_low, unsigned long window_high, bool strict);
+		unsigned long interpolate_bound_index(string target, bool strict);
+		bool interpolation_probe(unsigned long index, const string &target, bool strict, unsigned long &low,
+								 unsigned long &high, double &key_low, double &key_high, bool &precedes);
+		unsigned long gallop_bound_index(string target, unsigned long from, unsigned long window_high, bool strict);
+		unsigned long gallop_back_bound_index(string target, unsigned long low, unsigned long index, bool strict);
+		unsigned long bisect_bound_index(string target, unsigned long low, unsigned long high, bool strict);
+		unsigned long scan_bound_index(string target, unsigned long low, unsigned long high, bool strict);
+		bool line_precedes(unsigned long index, const string &target, bool strict, string *line = NULL);
+		template <class Key>
+		void merge_log(ExternalSorter &sorter, HashFileScanner &scanner, HashFileWriter &writer);
 		string get_line_at_index(unsigned long index);
 		string get_key_at_index(unsigned long index);
 		string get_val_at_index(unsigned long index);
 
 		fstream file;
+		MappedFile mapping;
 		string filename;
 		int _data_region_ptr;
 		unsigned long data_size;		
-		const static int LINE_WIDTH = SHA_WIDTH * 2 + 2;
+		unsigned int partition_bits, partition_index;
+		SearchMode search_mode;
+
+		// hex digits per key, recorded in the header; lines are "key value\n"
+		unsigned int key_width;
+		int line_width;
+		const static unsigned long DEFAULT_COMMIT_MEMORY_LIMIT = 64ul << 20;
+
+		const static int GALLOP_RATIO = 16;
+		const static unsigned int INTERPOLATION_ROUNDS = 6;
+
+		// lines in about one 4 KB block
+		const static unsigned long SEARCH_BLOCK_LINES = 48;
+
+		// a sweep reads this many lines at a time: enough to run through the gaps
+		// of a dense batch, few enough that a seek in a sparse one stays cheap
+		const static unsigned long SWEEP_BLOCK_LINES = 256;
+
+		// a page is read a search block at first, then in reads doubling up
+		// to this many lines, so a large limit reads little past the key's lines
+		const static unsigned long PAGE_BLOCK_LINES = 4096;
+
+		friend class HashFileScanner;
+		friend class HashFileValueAccessor;
+		friend class HashFileWriter;
+};
+
+// writes a new HashFile sequentially through a large buffer. lines must be
+// appended in sorted order; the line count and key width are filled into the
+// header on close
+
+class HashFileWriter
+{
+	public:
+		HashFileWriter(string newPath, unsigned int keyWidth = SHA_WIDTH);
+		~HashFileWriter();
+		void append(const char *key, const char *value);
+		void close();
+		unsigned long length();
+
+	private:
+		void flush();
+
+		const static unsigned long WRITE_BLOCK_LINES = 4096;
+
+		fstream file;
+		char *buffer;
+		unsigned long buffered, lines;
+		unsigned int key_width;
+		int line_width;
+};
+
+// streams the lines of a HashFile in order, starting from a given index. reads
+// up to blockLines lines at a time through its own file handle, so scanning
+// does not disturb the seek position used by lookups. the file says where each
+// read starts and how far its lines run on contiguously
+
+class HashFileScanner
+{
+	public:
+		HashFileScanner(HashFile *hashfile, unsigned long start_index = 0, unsigned long blockLines = SCAN_BLOCK_LINES);
+		~HashFileScanner();
+		bool next(string &key, string &value);
+		const char *nextLine();
+		void seek(unsigned long index);
+		unsigned long bufferedLines();
+
+		const static unsigned long SCAN_BLOCK_LINES = 4096;
+
+	private:
+		bool fill();
+
+		HashFile *hashfile;
+		int fd;
+		char *buffer;
+		unsigned long index, buffered, buffer_pos, block_lines;
+		unsigned int key_width;
+		int line_width;
 };
 
 
@@ -0,0 +1,41 @@
+#include <string.h>
+
+#ifndef KEYWIDTH_H
+#define KEYWIDTH_H
+
+// hex digits in a key. SHA-1 is the default, and the width of every store
+// written before widths were recorded in the HashFile header
+#define SHA_WIDTH 40
+#define SHA256_WIDTH 64
+#define MAX_KEY_WIDTH SHA256_WIDTH
+
+// The fixed layout of one key width. every size is a compile-time constant, so
+// kernels instantiated on a KeyFormat compare and copy fixed-size blocks, which
+// the compiler inlines and vectorizes instead of calling out to memcmp
+
+template <unsigned int Width>
+struct KeyFormat
+{
+	// "key value\n" in a HashFile
+	static const unsigned int KEY_WIDTH = Width, LINE_WIDTH = 2 * Width + 2;
+
+	static inline int compare(const char *k1, const char *k2)
+	{
+		return memcmp(k1, k2, Width);
+	}
+
+	static inline void copy(char *dst, const char *src)
+	{
+		memcpy(dst, src, Width);
+	}
+};
+
+typedef KeyFormat<SHA_WIDTH> Sha1Key;
+typedef KeyFormat<SHA256_WIDTH> Sha256Key;
+
+inline bool validKeyWidth(unsigned int width)
+{
+	return(width == SHA_WIDTH || width == SHA256_WIDTH);
+}
+
+#endif
@@ -1,26 +1,36 @@
 #include <fstream>
 #include <string>
+#include <string_view>
 #include <vector>
+#include <algorithm>
 #include <tr1/unordered_map>
+#include <unistd.h>
+#include <fcntl.h>
+#include "keywidth.h"
 
 #ifndef LOGFILE_H
 #define LOGFILE_H
 
-#define SHA_WIDTH 40
-
 using namespace std;
 using namespace tr1;
 
 namespace Log{
+	// the opcode of an entry is its first character in the log
+	enum Op
+	{
+		ANNOTATE = 'A',
+		UNANNOTATE = 'U'
+	};
+
 	typedef struct 
 	{
-		string cmd; // can be 'A' or 'U' for Annotate & Unannotate
+		Op cmd;
 		string A;
 		string C;
 
 		string toString()
 		{
-			return( cmd + " " + A + " " + C );
+			return( string(1, (char) cmd) + " " + A + " " + C );
 		}
 	} command;
 
@@ -32,17 +42,40 @@ namespace Log{
 class LogFile
 {
 	public:
-		LogFile(){}
+		LogFile() : fd(-1) {}
 		LogFile(string path);
+		~LogFile();
 		void setPath(string path);
 		string getFilename();
 		vector<Log::command> readEntries();
-		void addEntry(string cmd, string A, string C);
+		void addEntry(Log::Op cmd, string_view A, string_view C);
+		void close();
 		void clear();
 
 	private:
 		string filename;	
 		fstream file;	
+
+		// kept open for appending between entries; -1 until the first one
+		int fd;
+};
+
+// streams the entries of a LogFile one at a time through a large read buffer,
+// for consumers that must not hold the whole log in memory
+
+class LogFileReader
+{
+	public:
+		LogFileReader(LogFile &log);
+		~LogFileReader();
+		bool next(Log::command &entry);
+
+	private:
+		const static unsigned long READ_BUFFER_SIZE = 1 << 20;
+
+		fstream file;
+		char *buffer;
+		string line;
 };
 
 #endif
\ No newline at end of file
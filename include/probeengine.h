@@ -0,0 +1,117 @@
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "hashfile.h"
+#include "btreefile.h"
+#include "valueset.h"
+
+#ifndef PROBEENGINE_H
+#define PROBEENGINE_H
+
+using namespace std;
+
+// a single positioned read. user_data identifies whoever issued it, and result
+// holds the number of bytes read (or -errno) once it completes
+
+typedef struct
+{
+	int fd;
+	unsigned long offset;
+	unsigned int length;
+	char *buffer;
+	void *user_data;
+	long result;
+} ReadRequest;
+
+// an asynchronous source of positioned reads: requests are queued by submit(),
+// and complete() blocks until at least one has finished, returning all that have
+
+class IOBackend
+{
+	public:
+		virtual ~IOBackend() {}
+		virtual void submit(ReadRequest *request) = 0;
+		virtual void complete(vector<ReadRequest*> &done) = 0;
+		virtual const char *name() = 0;
+};
+
+// io_uring, driven through the raw system calls
+
+class UringBackend : public IOBackend
+{
+	public:
+		UringBackend(unsigned int queueDepth);
+		~UringBackend();
+		bool good();
+		void submit(ReadRequest *request);
+		void complete(vector<ReadRequest*> &done);
+		const char *name();
+
+	private:
+		int ring_fd;
+		unsigned int pending_submissions, in_flight;
+
+		void *sq_ring, *cq_ring, *sqes;
+		unsigned long sq_ring_size, cq_ring_size, sqes_size;
+		unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+		unsigned int *cq_head, *cq_tail, *cq_mask;
+		void *cqes;
+};
+
+// portable fallback: a pool of threads each issuing blocking pread()s
+
+class PreadPoolBackend : public IOBackend
+{
+	public:
+		PreadPoolBackend(unsigned int threads);
+		~PreadPoolBackend();
+		void submit(ReadRequest *request);
+		void complete(vector<ReadRequest*> &done);
+		const char *name();
+
+	private:
+		void worker();
+
+		vector<thread*> workers;
+		mutex lock;
+		condition_variable submitted, completed;
+		deque<ReadRequest*> submit_queue, complete_queue;
+		bool stopping;
+};
+
+// resolves many key lookups against one index at once. each lookup is a small
+// state machine (trie walk, then binary search, then a scan of the key's run)
+// that issues one read at a time; up to queueDepth lookups are kept in flight,
+// each advancing as soon as its previous read completes
+
+class ProbeEngine
+{
+	public:
+		ProbeEngine(unsigned int queueDepth = 64, bool usePreadPool = false);
+		~ProbeEngine();
+		void lookup(HashFile *index, const vector<string> &keys, vector<ValueSet*> &results);
+		const char *backendName();
+
+	private:
+		struct Probe;
+
+		void start(Probe *probe);
+		void advance(Probe *probe);
+		void issue(Probe *probe, int fd, unsigned long offset, unsigned int length);
+		void issue_search(Probe *probe);
+		void issue_scan(Probe *probe);
+
+		const static unsigned int SCAN_LINES = 64;
+
+		IOBackend *backend;
+		unsigned int queue_depth;
+
+		// layout of the index currently being probed
+		IndexLayout layout;
+		int hash_fd, table_fd;
+};
+
+#endif
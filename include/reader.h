@@ -0,0 +1,70 @@
+#include <string>
+#include <string_view>
+#include <set>
+#include <map>
+#include <chrono>
+#include "annotations.h"
+#include "snapshot.h"
+
+#ifndef READER_H
+#define READER_H
+
+using namespace std;
+
+// A read-only view of the committed state of a set, for query processes that
+// run alongside the one writing it. it opens the committed A2C/C2A files and
+// nothing else: the log is not replayed, no rollback is done, nothing is
+// created or written, and no lock is taken. the files are mapped shared, so
+// every reader of a store uses one page-cache copy of them.
+//
+// each publish bumps the generation in the set's atomic log. the reader checks
+// it at most once per refresh interval, and reopens the files when it moved;
+// reading the log before and after opening them tells a consistent pair of
+// files from one torn by a publish. while a publish is under way it keeps
+// reading the files it has. one thread at a time
+
+class AnnotationReader
+{
+	public:
+		AnnotationReader(string directory_path, string hashTableType = "");
+		~AnnotationReader();
+		bool refresh();
+		void set_refresh_interval(unsigned long milliseconds);
+		unsigned long generation();
+		unsigned int keyWidth();
+		AnnotationSnapshot snapshot();
+
+		set<string> list_annotations(string_view C);
+		set<string> list_entries(string_view A);
+		ValuePage list_annotations(string_view C, unsigned long limit, string_view cursor = "");
+		ValuePage list_entries(string_view A, unsigned long limit, string_view cursor = "");
+		void sweep_entries(vector<string> As, SweepCallback callback);
+		void sweep_annotations(vector<string> Cs, SweepCallback callback);
+		bool has_annotation(string_view A, string_view C);
+		unsigned long count_entries(string_view A);
+		unsigned long count_annotations(string_view C);
+		map<string, set<string> > list_entries_by_prefix(string prefix);
+		map<string, set<string> > list_entries_in_range(string low, string high);
+		map<string, set<string> > list_annotations_by_prefix(string prefix);
+		map<string, set<string> > list_annotations_in_range(string low, string high);
+		AnnotationScanner scan_entries();
+		AnnotationScanner scan_annotations();
+
+	private:
+		typedef chrono::steady_clock Clock;
+
+		AnnotationSnapshot &current();
+		AnnotationSnapshot *open_files(unsigned long generation);
+
+		string directory_path, hash_table_type;
+		AnnotationSnapshot *files;
+		unsigned long files_generation;
+
+		Clock::duration refresh_interval;
+		Clock::time_point last_refresh;
+
+		const static unsigned long DEFAULT_REFRESH_MILLISECONDS = 100;
+		const static unsigned int OPEN_RETRY_MICROSECONDS = 1000;
+};
+
+#endif
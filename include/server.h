@@ -0,0 +1,170 @@
+#include <string>
+#include <string_view>
+#include <vector>
+#include <set>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include "shardedset.h"
+
+#ifndef SERVER_H
+#define SERVER_H
+
+using namespace std;
+
+// The daemon protocol, over a Unix domain stream socket. integers are little
+// endian, and keys travel in binary: half as many bytes as the store's key
+// width in hex digits. on connecting, the server sends a greeting:
+//
+//   u32 SERVER_MAGIC, u8 key width in hex digits
+//
+// then every request is answered by one response, in the order sent, so a
+// client may send many requests before reading any answer, or shut down its
+// side of the socket and still read every answer. both are framed as
+//
+//   request:  u32 body length, u8 op,     u32 tag, body
+//   response: u32 body length, u8 status, u32 tag, body
+//
+// where the tag is the client's own, echoed back. request bodies are the keys
+// of the op: A, C, or A then C. response bodies, when the status is OK:
+//
+//   SERVER_LIST_*:  u32 count, then count keys
+//   SERVER_HAS:     u8 0 or 1
+//   SERVER_COUNT_*: u64
+//   otherwise:      empty
+
+enum ServerOp
+{
+	SERVER_ANNOTATE = 1,			// A, C
+	SERVER_UNANNOTATE = 2,			// A, C
+	SERVER_LIST_ENTRIES = 3,		// A
+	SERVER_LIST_ANNOTATIONS = 4,	// C
+	SERVER_HAS = 5,					// A, C
+	SERVER_COUNT_ENTRIES = 6,		// A
+	SERVER_COUNT_ANNOTATIONS = 7,	// C
+	SERVER_COMMIT = 8				// nothing
+};
+
+enum ServerStatus
+{
+	SERVER_OK = 0,
+	SERVER_BAD_REQUEST = 1			// unknown op, or a body the wrong size for it
+};
+
+const unsigned int SERVER_MAGIC = 0x41534e44;
+const unsigned int SERVER_FRAME_HEADER = 9;
+
+// bodies larger than this end the connection
+const unsigned int SERVER_MAX_REQUEST = 1 << 16;
+
+// a connection with this many bytes of responses unsent, or of requests not
+// yet applied, is not read from until its responses drain
+const unsigned long SERVER_HIGH_WATER = 1 << 20;
+
+// each worker reads into one buffer of this size, whatever the connection
+const unsigned int SERVER_READ_BYTES = 1 << 16;
+
+// Serves a ShardedAnnotationSet on a Unix domain socket. each of the worker
+// threads runs an epoll loop over its share of the connections; a connection
+// is accepted by whichever worker wakes for it, and stays with that worker.
+// a worker reads all it can from a connection, and applies every complete
+// request in it as one batch, under a single hold of the store lock, then
+// writes the responses back together. pipelined clients thus pay for the lock,
+// and the system calls, once per batch rather than once per request. a client
+// that sends faster than it reads is held to SERVER_HIGH_WATER: past it, the
+// rest of its requests wait in the socket until its responses are written
+
+class AnnotationServer
+{
+	public:
+		AnnotationServer(ShardedAnnotationSet *store, string socketPath, unsigned int threads = 2);
+		~AnnotationServer();
+		bool start();
+		void stop();
+		void warm_cache();
+
+	private:
+		typedef struct
+		{
+			int fd;
+			string input, output;
+
+			// paused while output drains past SERVER_HIGH_WATER; read_closed
+			// once the peer has stopped sending. events is what epoll watches
+			// the descriptor for
+			bool paused, read_closed;
+			unsigned int events;
+		} Connection;
+
+		void worker();
+		void warm();
+		bool serve(int epoll_fd, Connection *connection, char *buffer);
+		bool read_input(Connection *connection, char *buffer);
+		bool apply_input(Connection *connection);
+		bool flush_output(Connection *connection);
+		bool has_request(Connection *connection);
+		void watch(int epoll_fd, Connection *connection);
+		void apply(unsigned char op, unsigned int tag, string_view body, string &output);
+		void accept_connections(int epoll_fd, set<Connection*> &connections);
+
+		ShardedAnnotationSet *store;
+		mutex store_lock;
+		string socket_path;
+		unsigned int key_width, key_bytes, threads;
+
+		int listen_fd, stop_fd;
+		vector<thread*> workers;
+
+		// reads the store's hot keys back in while the workers serve, a chunk
+		// of WARM_CHUNK_KEYS per hold of the store lock
+		thread *warmer;
+		atomic<bool> stop_warming;
+
+		const static unsigned int WARM_CHUNK_KEYS = 64;
+};
+
+typedef struct
+{
+	unsigned char status;
+	unsigned int tag;
+	string body;
+} ServerResponse;
+
+// A blocking client of AnnotationServer. the point calls send one request and
+// wait for its answer. to pipeline, queue() any number of requests, flush()
+// them in one write, then receive() their responses in the same order
+
+class AnnotationClient
+{
+	public:
+		AnnotationClient(string socketPath);
+		~AnnotationClient();
+		bool connected();
+		unsigned int keyWidth();
+
+		void annotate_entry(string_view A, string_view C);
+		void unannotate_entry(string_view A, string_view C);
+		set<string> list_entries(string_view A);
+		set<string> list_annotations(string_view C);
+		bool has_annotation(string_view A, string_view C);
+		unsigned long count_entries(string_view A);
+		unsigned long count_annotations(string_view C);
+		void commit_to_disk();
+
+		unsigned int queue(ServerOp op, string_view first = "", string_view second = "");
+		bool flush();
+		bool finish();
+		bool receive(ServerResponse &response);
+		set<string> decodeKeys(const ServerResponse &response);
+		unsigned long decodeCount(const ServerResponse &response);
+
+	private:
+		ServerResponse call(ServerOp op, string_view first = "", string_view second = "");
+		bool read_exactly(char *buf, unsigned long bytes);
+
+		int fd;
+		unsigned int key_width, next_tag;
+		string output;
+};
+
+#endif
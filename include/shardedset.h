@@ -0,0 +1,95 @@
+#include <string>
+#include <vector>
+#include <set>
+#include <map>
+#include <thread>
+#include "annotations.h"
+
+#ifndef SHARDEDSET_H
+#define SHARDEDSET_H
+
+using namespace std;
+
+// An AnnotationSet split into 2^shardBits shards by the leading bits of each key.
+// every shard is a complete AnnotationSet directory (log, caches, A2C/C2A files)
+// holding the A2C entries of its A keys and the C2A entries of its C keys, so a
+// lookup goes to exactly one shard, while a write touches at most two. a write
+// spanning two shards is first logged in the set's own cross-shard log, which
+// initialize replays into both shards, so a crash between the two shard writes
+// cannot leave the A2C and C2A sides disagreeing.
+// commits, replay and bulk loads run on all shards in parallel. the shard count
+// is fixed when the directory is created; use reshard_directory to change it.
+// as with AnnotationSet, a key width the build cannot hold throws KeyWidthError
+
+class ShardedAnnotationSet
+{
+	public:
+		ShardedAnnotationSet(string directory_path, string hashTableType = "", unsigned int shardBits = 4,
+							 unsigned int keyWidth = SHA_WIDTH);
+		~ShardedAnnotationSet();
+		void initialize();
+		void annotate_entry(string_view A, string_view C);
+		void unannotate_entry(string_view A, string_view C);
+		set<string> list_annotations(string_view C);
+		set<string> list_entries(string_view A);
+		ValuePage list_annotations(string_view C, unsigned long limit, string_view cursor = "");
+		ValuePage list_entries(string_view A, unsigned long limit, string_view cursor = "");
+		bool has_annotation(string_view A, string_view C);
+		unsigned long count_entries(string_view A);
+		unsigned long count_annotations(string_view C);
+		map<string, set<string> > list_entries_by_prefix(string prefix);
+		map<string, set<string> > list_entries_in_range(string low, string high);
+		map<string, set<string> > list_annotations_by_prefix(string prefix);
+		map<string, set<string> > list_annotations_in_range(string low, string high);
+		set<string> intersect_entries(vector<string> As);
+		set<string> union_entries(vector<string> As);
+		set<string> intersect_annotations(vector<string> Cs);
+		set<string> union_annotations(vector<string> Cs);
+		vector<set<string> > list_entries_batch(vector<string> As);
+		vector<set<string> > list_annotations_batch(vector<string> Cs);
+		void sweep_entries(vector<string> As, SweepCallback callback);
+		void sweep_annotations(vector<string> Cs, SweepCallback callback);
+		void commit_to_disk();
+		void set_commit_memory_limit(unsigned long bytes);
+		void set_search_mode(SearchMode mode);
+		void tune_index(unsigned long lookups = AnnotationSet::DEFAULT_TUNE_LOOKUPS);
+		void bulk_load(string snapshot_filename, unsigned long memory_limit = 256ul << 20, unsigned int threads = 2);
+		void set_hot_key_capacity(unsigned long keys);
+		void set_prefetch_on_start(bool prefetch);
+		void save_hot_keys();
+		void hot_keys(vector<string> &As, vector<string> &Cs);
+		void prefetch(vector<string> As, vector<string> Cs);
+		void prefetch_hot_keys();
+		unsigned int shardBits();
+		unsigned int keyWidth();
+
+	private:
+		AnnotationSet *shard_for(string_view key);
+		void run_parallel(void (AnnotationSet::*method)());
+		void shard_range(string low, string high, unsigned int &first, unsigned int &last);
+		set<string> multi_lookup(vector<string> keys, bool entries, bool intersect);
+		vector<set<string> > batch_lookup(vector<string> keys, bool entries);
+		void sweep_lookup(vector<string> keys, SweepCallback callback, bool entries);
+		void modify_entry(Log::Op cmd, string_view A, string_view C);
+		void replay_cross_log();
+
+		string directory_path;
+		unsigned int shard_bits, key_width;
+		vector<AnnotationSet*> shards;
+
+		// pairs whose sides live in different shards, since the last commit
+		LogFile Cross_Log;
+};
+
+// rewrite an existing AnnotationSet or ShardedAnnotationSet directory with a new
+// shard count. pending changes are committed first; the new store is built aside
+// by bulk load and then swapped in for the old one. returns false if the swap
+// could not be completed, in which case it is left for finish_reshard
+bool reshard_directory(string directory_path, unsigned int shardBits, string hashTableType = "");
+
+// complete or undo a reshard interrupted at any point, so that directory_path
+// holds exactly one of the old or new stores. the ShardedAnnotationSet
+// constructor calls this first. returns false if a rename still fails
+bool finish_reshard(string directory_path);
+
+#endif
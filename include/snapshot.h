@@ -0,0 +1,144 @@
+#include <string>
+#include <string_view>
+#include <set>
+#include <map>
+#include <vector>
+#include <memory>
+#include <sys/stat.h>
+#include "hashfile.h"
+#include "btreefile.h"
+#include "gappedhashfile.h"
+#include "encodedhashfile.h"
+#include "utils.h"
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+using namespace std;
+
+// The committed files of one generation, hard-linked into a directory of their
+// own so that later commits, which replace the live files, leave them alone.
+// the directory is removed once the last snapshot holding it is released.
+// a read-only reader instead refers to the live files themselves: it opens
+// them, and later commits rename new files over them rather than change them
+
+class SnapshotFiles
+{
+	public:
+		SnapshotFiles(string directory_path, string snapshot_path);
+		SnapshotFiles(string directory_path);
+		~SnapshotFiles();
+		string getPath();
+
+	private:
+		void link_directory(string from, string to);
+
+		string snapshot_path;
+		bool linked;
+};
+
+// one uncommitted change, from one side: a key, a value whose state for it
+// differs from the files, and whether the pair is bound now
+typedef struct
+{
+	Digest key, value;
+	bool bound;
+} DeltaChange;
+
+inline bool operator<(const DeltaChange &c1, const DeltaChange &c2)
+{
+	return(c1.key < c2.key || (c1.key == c2.key && c1.value < c2.value));
+}
+
+typedef vector<DeltaChange> DeltaList;
+
+// the uncommitted changes as of one sequence number, each side sorted by its
+// own keys, then values
+typedef struct
+{
+	DeltaList A2C, C2A;
+} SnapshotDelta;
+
+class AnnotationScanner;
+
+// A read-only view of an AnnotationSet at one point in time: the files of the
+// generation that was current, plus the changes made up to the sequence number
+// it was taken at. it shares nothing that the set goes on to change, so it can
+// be read while writes and commits continue. the files are mapped, and shared
+// with every other process reading them. copies share one view; a view is
+// read by one thread at a time
+
+class AnnotationSnapshot
+{
+	public:
+		AnnotationSnapshot(shared_ptr<SnapshotFiles> files, shared_ptr<const SnapshotDelta> delta,
+						   string hashTableType, unsigned long generation, unsigned long sequence);
+		set<string> list_annotations(string_view C);
+		set<string> list_entries(string_view A);
+		ValuePage list_annotations(string_view C, unsigned long limit, string_view cursor = "");
+		ValuePage list_entries(string_view A, unsigned long limit, string_view cursor = "");
+		void sweep_entries(vector<string> As, SweepCallback callback);
+		void sweep_annotations(vector<string> Cs, SweepCallback callback);
+		bool has_annotation(string_view A, string_view C);
+		unsigned long count_entries(string_view A);
+		unsigned long count_annotations(string_view C);
+		map<string, set<string> > list_entries_by_prefix(string prefix);
+		map<string, set<string> > list_entries_in_range(string low, string high);
+		map<string, set<string> > list_annotations_by_prefix(string prefix);
+		map<string, set<string> > list_annotations_in_range(string low, string high);
+		AnnotationScanner scan_entries();
+		AnnotationScanner scan_annotations();
+		unsigned long generation();
+		unsigned long sequence();
+		unsigned int keyWidth();
+
+	private:
+		set<string> point_lookup(string_view key, const DeltaList &delta, HashFile *h);
+		unsigned long count_lookup(string_view key, const DeltaList &delta, HashFile *h);
+		ValuePage page_lookup(string_view key, unsigned long limit, string_view cursor, const DeltaList &delta, HashFile *h);
+		void sweep_lookup(vector<string> keys, SweepCallback callback, const DeltaList &delta, HashFile *h);
+		void apply_changes(set<string> &values, string_view key, const DeltaList &delta);
+		map<string, set<string> > range_lookup(string low, string high, const DeltaList &delta, HashFile *h);
+
+		typedef struct
+		{
+			shared_ptr<SnapshotFiles> files;
+			shared_ptr<const SnapshotDelta> delta;
+			HashFile *A2C_File, *C2A_File;
+			DigestArena arena;
+			unsigned long generation, sequence;
+		} State;
+
+		static void release(State *state);
+
+		shared_ptr<State> state;
+
+		friend class AnnotationScanner;
+};
+
+// Streams every bound pair of a snapshot, ordered by key and then value: the
+// lines of the file, read sequentially, merged on the fly with the changes.
+// holds one read block and the snapshot's changes, whatever the file size
+
+class AnnotationScanner
+{
+	public:
+		AnnotationScanner(AnnotationSnapshot snapshot, bool entries);
+		AnnotationScanner(const AnnotationScanner &other) = delete;
+		~AnnotationScanner();
+		bool next(string &key, string &value);
+
+	private:
+		void read_change();
+
+		AnnotationSnapshot snapshot;
+		HashFileScanner *scanner;
+
+		// the next line of the file, and the next change, if any
+		string file_key, file_value, change_key, change_value;
+		bool file_valid;
+		DeltaList::const_iterator change, changes_end;
+		unsigned int key_width;
+};
+
+#endif
@@ -0,0 +1,108 @@
+#include <string>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+
+#ifndef TRACE_H
+#define TRACE_H
+
+using namespace std;
+
+// Timeline tracing. each thread records the spans it completes into a ring
+// buffer of its own, which only that thread writes, so recording takes no
+// lock; when a buffer is full the oldest spans are overwritten. dump() writes
+// every buffer out in Chrome's trace-event format (chrome://tracing, Perfetto)
+//
+// the trace points in the library are compiled in only when TRACE is defined
+// (make TRACE=1); otherwise the macros below expand to nothing. compiled in but
+// not started, a trace point costs one relaxed load
+
+class Trace
+{
+	public:
+		static const unsigned long BUFFER_EVENTS = 1 << 16;
+
+		static void start(unsigned long slowLookupNanos = 1000000);
+		static void stop();
+		static bool enabled() { return recording.load(memory_order_relaxed); }
+		static unsigned long slowLookupNanos();
+		static bool dump(string filename);
+		static void clear();
+
+		static unsigned long long now()
+		{
+			return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+		}
+
+		static void record(const char *name, unsigned long long begin, unsigned long long end);
+
+	private:
+		typedef struct
+		{
+			const char *name;
+			unsigned long long begin, end;
+		} Event;
+
+		typedef struct
+		{
+			Event events[BUFFER_EVENTS];
+			atomic<unsigned long> written;
+			unsigned long thread_id;
+		} Buffer;
+
+		static Buffer *thread_buffer();
+
+		static atomic<bool> recording;
+		static atomic<unsigned long> slow_lookup_nanos;
+		static mutex buffers_lock;
+		static vector<Buffer*> buffers;
+};
+
+// records the span from its construction to its destruction. a slow-only span
+// is dropped if it is shorter than the threshold given to start(), so only the
+// slow ones reach the buffer. name must outlive the trace: a string literal
+
+class TraceScope
+{
+	public:
+		TraceScope(const char *name, bool slowOnly = false)
+		{
+			this->name = name;
+			begin = threshold = 0;
+
+			if(Trace::enabled())
+			{
+				threshold = (slowOnly ? Trace::slowLookupNanos() : 0);
+				begin = Trace::now();
+			}
+		}
+
+		~TraceScope()
+		{
+			if(begin == 0)
+				return;
+
+			unsigned long long end = Trace::now();
+
+			if(end - begin >= threshold)
+				Trace::record(name, begin, end);
+		}
+
+	private:
+		const char *name;
+		unsigned long long begin, threshold;
+};
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+
+#ifdef TRACE
+#define TRACE_SCOPE(name) TraceScope TRACE_CONCAT(trace_scope_, __LINE__)(name)
+#define TRACE_SLOW_SCOPE(name) TraceScope TRACE_CONCAT(trace_scope_, __LINE__)(name, true)
+#else
+#define TRACE_SCOPE(name)
+#define TRACE_SLOW_SCOPE(name)
+#endif
+
+#endif
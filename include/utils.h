@@ -1,7 +1,14 @@
 #include <fstream>
 #include <string>
+#include <string_view>
 #include <sstream>
 #include <dirent.h>
+#include <unistd.h>
+#include <string.h>
+#include <algorithm>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #ifndef UTILS_H
 #define UTILS_H
@@ -22,4 +29,30 @@ string convertIntToString(int n, unsigned int width = 0);
 
 void swapString(string &first, string &second);
 
+unsigned int convertKeyToShard(string_view key, unsigned int bits);
+
+// A whole file mapped read-only and shared, so that every process reading it
+// uses the one page-cache copy. the mapping, and the descriptor kept with it,
+// hold on to the file they were opened on even once another is renamed over
+// its name. the file must not be rewritten in place while mapped
+
+class MappedFile
+{
+	public:
+		MappedFile();
+		~MappedFile();
+		MappedFile(const MappedFile &other) = delete;
+		bool open(string filename);
+		void close();
+		const char *data();
+		unsigned long size();
+		int descriptor();
+		bool read(char *buf, unsigned long offset, unsigned long bytes);
+
+	private:
+		int fd;
+		char *map;
+		unsigned long length;
+};
+
 #endif
\ No newline at end of file
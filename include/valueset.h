@@ -0,0 +1,265 @@
+#include <string>
+#include <string_view>
+#include <set>
+#include <vector>
+#include <algorithm>
+#include <functional>
+#include <iterator>
+#include <stdexcept>
+#include <limits.h>
+#include <string.h>
+#include "keywidth.h"
+
+#ifndef VALUESET_H
+#define VALUESET_H
+
+// bytes per Digest: enough for the widest key. a build that only ever indexes
+// SHA-1 keys can define DIGEST_WIDTH as 20 to shrink the keys of the caches;
+// stores of wider keys then refuse to open (see supportedKeyWidth)
+#ifndef DIGEST_WIDTH
+#define DIGEST_WIDTH (MAX_KEY_WIDTH / 2)
+#endif
+
+using namespace std;
+
+// a key width this build can hold in a Digest without cutting keys short
+inline bool supportedKeyWidth(unsigned int width)
+{
+	return(validKeyWidth(width) && width <= 2 * DIGEST_WIDTH);
+}
+
+// thrown by the constructors of stores (and of the server) whose key width is
+// not supportedKeyWidth
+class KeyWidthError : public invalid_argument
+{
+	public:
+		KeyWidthError(unsigned int width)
+			: invalid_argument("keys of " + to_string(width) + " hex digits need a build with DIGEST_WIDTH of at least "
+							   + to_string(width / 2)) {}
+};
+
+// binary form of a hex-digit key, zero-padded to DIGEST_WIDTH bytes. bytes are
+// stored most-significant first, so memcmp order matches the lexicographic
+// order of hex strings of one width
+
+typedef struct
+{
+	unsigned char bytes[DIGEST_WIDTH];
+} Digest;
+
+inline bool operator<(const Digest &d1, const Digest &d2)
+{
+	return memcmp(d1.bytes, d2.bytes, DIGEST_WIDTH) < 0;
+}
+
+inline bool operator==(const Digest &d1, const Digest &d2)
+{
+	return memcmp(d1.bytes, d2.bytes, DIGEST_WIDTH) == 0;
+}
+
+// keys are hashes already, so their leading bytes hash them as well as anything
+struct DigestHash
+{
+	size_t operator()(const Digest &digest) const
+	{
+		size_t h;
+		memcpy(&h, digest.bytes, sizeof(h));
+		return h;
+	}
+};
+
+// digits past 2 * DIGEST_WIDTH are dropped; stores never hold keys that long
+void convertHexToDigest(Digest &digest, string_view hex);
+
+string convertDigestToHex(const Digest &digest, unsigned int width = SHA_WIDTH);
+
+// hands out blocks for power-of-two numbers of values, carved from large
+// chunks. released blocks are kept on per-size free lists and reused, and all
+// memory is returned at once when the arena is destroyed. the arena also
+// records the key width of the values held in its sets; each value takes half
+// as many bytes, so a SHA-1 store keeps 20-byte values in any build. until the
+// width is set, values take a whole Digest
+
+class DigestArena
+{
+	public:
+		DigestArena();
+		~DigestArena();
+		unsigned char *allocate(unsigned int capacity);
+		void release(unsigned char *block, unsigned int capacity);
+		unsigned long bytesReserved();
+		void setKeyWidth(unsigned int width);
+		unsigned int keyWidth();
+		unsigned int digestBytes();
+
+	private:
+		int size_class(unsigned int capacity);
+
+		const static int NUM_CLASSES = 32;
+		const static unsigned long CHUNK_SIZE = 1 << 20;
+
+		vector<char*> chunks;
+		char *chunk_cursor;
+		unsigned long chunk_remaining, bytes_reserved;
+		unsigned int key_width, digest_bytes;
+		unsigned char *free_lists[NUM_CLASSES];
+};
+
+// a set of Digests stored contiguously: a sorted prefix followed by a small
+// unsorted insert buffer, which is merged into the prefix once it fills up
+// (or before the set is iterated). each value keeps only the leading bytes
+// its arena's key width needs (a whole Digest without an arena); iterating
+// reads them back out as zero-padded Digests
+
+class ValueSet
+{
+	public:
+		class const_iterator
+		{
+			public:
+				typedef random_access_iterator_tag iterator_category;
+				typedef Digest value_type;
+				typedef long difference_type;
+				typedef const Digest *pointer;
+				typedef Digest reference;
+
+				const_iterator(const unsigned char *Value = NULL, unsigned int Width = DIGEST_WIDTH)
+					: value(Value), width(Width) {}
+
+				Digest operator*() const
+				{
+					Digest digest;
+					memcpy(digest.bytes, value, width);
+					memset(digest.bytes + width, 0, DIGEST_WIDTH - width);
+					return digest;
+				}
+
+				Digest operator[](long n) const { return *(*this + n); }
+
+				const_iterator& operator++() { value += width; return *this; }
+				const_iterator& operator--() { value -= width; return *this; }
+				const_iterator operator++(int) { const_iterator old = *this; value += width; return old; }
+				const_iterator operator--(int) { const_iterator old = *this; value -= width; return old; }
+				const_iterator& operator+=(long n) { value += n * (long) width; return *this; }
+				const_iterator& operator-=(long n) { value -= n * (long) width; return *this; }
+				const_iterator operator+(long n) const { return const_iterator(value + n * (long) width, width); }
+				const_iterator operator-(long n) const { return const_iterator(value - n * (long) width, width); }
+				long operator-(const const_iterator &other) const { return (value - other.value) / (long) width; }
+
+				bool operator==(const const_iterator &other) const { return value == other.value; }
+				bool operator!=(const const_iterator &other) const { return value != other.value; }
+				bool operator<(const const_iterator &other) const { return value < other.value; }
+
+			private:
+				const unsigned char *value;
+				unsigned int width;
+		};
+
+		ValueSet(DigestArena *arena = NULL);
+		ValueSet(const ValueSet &other);
+		ValueSet& operator=(const ValueSet &other);
+		~ValueSet();
+
+		bool insert(const Digest &value);
+		bool erase(const Digest &value);
+		bool contains(const Digest &value) const;
+		void appendSorted(const Digest &value);
+		unsigned long size() const;
+		void clear();
+
+		const_iterator begin();
+		const_iterator end();
+		set<string> toStringSet();
+
+	private:
+		void merge_pending();
+		void reserve(unsigned int new_capacity);
+		void release();
+		unsigned int lower_bound_of(const Digest &value) const;
+
+		unsigned char *slot(unsigned int i) const
+		{
+			return values + (unsigned long) i * width;
+		}
+
+		int compare(unsigned int i, const Digest &value) const
+		{
+			return memcmp(slot(i), value.bytes, width);
+		}
+
+		const static unsigned int PENDING_LIMIT = 8;
+
+		DigestArena *arena;
+		unsigned char *values;
+		unsigned int sorted_count, pending_count, capacity, width;
+};
+
+// one page of a key's values, in order. the cursor resumes the listing after
+// the page, and is empty once there is nothing more. a limit of ULONG_MAX
+// lists every value
+typedef struct
+{
+	vector<string> values;
+	string cursor;
+} ValuePage;
+
+// handed each key of a sweep, with its values, in key order
+typedef function<void(const string &key, const set<string> &values)> SweepCallback;
+
+// filters sorted candidates down to those also present in the sorted sequence
+// [0, length), read through at(i). each search gallops forward from the previous
+// match, so a candidate costs O(log distance) reads rather than O(log length)
+
+template <class Accessor>
+void gallopIntersect(vector<Digest> &candidates, Accessor &at, unsigned long length)
+{
+	unsigned long pos = 0, bound, step, mid, kept = 0;
+
+	for(unsigned long i=0; i<candidates.size() && pos < length; i++)
+	{
+		const Digest target = candidates[i];
+
+		// probe pos, pos+1, pos+3, pos+7 ... until we pass target
+		for(step = 1, bound = pos; bound < length && at(bound) < target; step *= 2)
+		{
+			pos = bound + 1;
+			bound = pos + step;
+		}
+
+		if(bound > length)
+			bound = length;
+
+		// then binary search the last step for target's lower bound
+		while(pos < bound)
+		{
+			mid = pos + (bound - pos) / 2;
+
+			if(at(mid) < target)
+				pos = mid + 1;
+			else
+				bound = mid;
+		}
+
+		if(pos < length && at(pos) == target)
+		{
+			candidates[kept++] = target;
+			pos++;
+		}
+	}
+
+	candidates.resize(kept);
+}
+
+// accessor over the sorted values of a ValueSet, for gallopIntersect
+
+class DigestArrayAccessor
+{
+	public:
+		DigestArrayAccessor(ValueSet::const_iterator Values) : values(Values) {}
+		Digest operator()(unsigned long i) { return values[i]; }
+
+	private:
+		ValueSet::const_iterator values;
+};
+
+#endif
@@ -0,0 +1,61 @@
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+
+#ifndef WORKPOOL_H
+#define WORKPOOL_H
+
+using namespace std;
+
+// A fixed set of worker threads, each with its own task queue. submit() spreads
+// tasks across the queues; a worker runs its own tasks newest first and, once
+// its queue is empty, steals the oldest task from another. submitOrdered()
+// instead appends to a single queue whose tasks run one at a time, in the order
+// submitted: one worker at a time claims it and drains it. at most maxPending
+// tasks of both kinds may be queued at once, after which submit() refuses new
+// ones rather than blocking the caller. queued tasks are all run before the
+// pool is destroyed
+
+class WorkPool
+{
+	public:
+		WorkPool(unsigned int threads, unsigned long maxPending);
+		~WorkPool();
+		bool submit(function<void()> task);
+		bool submitOrdered(function<void()> task);
+		unsigned long pending();
+
+	private:
+		typedef struct
+		{
+			mutex lock;
+			deque<function<void()> > tasks;
+		} TaskQueue;
+
+		void worker(unsigned int index);
+		bool take(unsigned int index, function<void()> &task);
+		bool take_ordered(bool draining, function<void()> &task);
+		void task_taken();
+
+		vector<TaskQueue*> queues;
+		vector<thread*> workers;
+
+		mutex idle_lock;
+		condition_variable wakeup;
+		atomic<unsigned long> queued, stealable;
+
+		// guarded by idle_lock. ordered_draining is set while a worker owns
+		// the ordered queue, so that no other worker starts its next task
+		deque<function<void()> > ordered;
+		bool ordered_draining;
+
+		atomic<unsigned int> next_queue;
+		unsigned long max_pending;
+		bool stopping;
+};
+
+#endif
@@ -0,0 +1,133 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <chrono>
+#include <new>
+#include <stdlib.h>
+
+#include "utils.h"
+#include "annotations.h"
+
+using namespace std;
+
+// Counts heap allocations on the steady-state read and write paths: every pair
+// of the snapshot is annotated once so its keys are in the memory maps, then
+// each operation is repeated over all pairs while operator new is counted.
+// writes, membership tests and counts should not allocate at all
+
+static atomic<unsigned long> allocations(0);
+
+void *operator new(size_t size)
+{
+	allocations++;
+
+	void *p = malloc(size == 0 ? 1 : size);
+	if(p == NULL)
+		throw bad_alloc();
+	return p;
+}
+
+void *operator new[](size_t size)
+{
+	return operator new(size);
+}
+
+void operator delete(void *p) noexcept
+{
+	free(p);
+}
+
+void operator delete[](void *p) noexcept
+{
+	free(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+	free(p);
+}
+
+void operator delete[](void *p, size_t) noexcept
+{
+	free(p);
+}
+
+typedef chrono::steady_clock Clock;
+
+const unsigned int ROUNDS = 4;
+
+vector<pair<string, string> > read_pairs(string filename)
+{
+	vector<pair<string, string> > pairs;
+	fstream file(filename.c_str(), fstream::in);
+	string line;
+
+	while(getline(file, line))
+		pairs.push_back(make_pair(line.substr(0, SHA_WIDTH), line.substr(SHA_WIDTH + 1, SHA_WIDTH)));
+
+	file.close();
+	return pairs;
+}
+
+template <class Op>
+void measure(string name, vector<pair<string, string> > &pairs, Op op)
+{
+	unsigned long before = allocations;
+	Clock::time_point start = Clock::now();
+
+	for(unsigned int r=0; r<ROUNDS; r++)
+		for(unsigned long i=0; i<pairs.size(); i++)
+			op(pairs[i].first, pairs[i].second);
+
+	double ns = chrono::duration_cast<chrono::nanoseconds>(Clock::now() - start).count();
+	unsigned long ops = ROUNDS * pairs.size(), allocated = allocations - before;
+
+	cout << name << ": " << (double) allocated / ops << " allocations/op, "
+		 << (unsigned long)(ns / ops) << " ns/op" << endl;
+}
+
+int main(int argc, char *argv[])
+{
+	string test_bed_directory("testbed");
+	string hashTableType("");
+
+	if(argc < 2)
+	{
+		cout << "USAGE: [A2C SNAPSHOT FILE] [BTreeFile]" << endl;
+		return 0;
+	}
+
+	if(argc > 2)
+		hashTableType = string(argv[2]);
+
+	dir_delete(test_bed_directory);
+
+	AnnotationSet *AS = new AnnotationSet(test_bed_directory, hashTableType);
+	AS->initialize();
+	AS->bulk_load(string(argv[1]));
+	delete(AS);
+
+	vector<pair<string, string> > pairs = read_pairs(string(argv[1]));
+	volatile unsigned long sink = 0;
+
+	AS = new AnnotationSet(test_bed_directory, hashTableType);
+	AS->initialize();
+
+	// first touch reads each key in from disk, and is expected to allocate
+	measure("annotate (first touch)", pairs, [&](const string &A, const string &C) { AS->annotate_entry(A, C); });
+
+	measure("annotate", pairs, [&](const string &A, const string &C) { AS->annotate_entry(A, C); });
+	measure("has_annotation", pairs, [&](const string &A, const string &C) { sink += AS->has_annotation(A, C); });
+	measure("count_entries", pairs, [&](const string &A, const string &C) { sink += AS->count_entries(A); });
+
+	// returns a set of strings, so it allocates for the result alone
+	measure("list_entries", pairs, [&](const string &A, const string &C) { sink += AS->list_entries(A).size(); });
+
+	measure("unannotate", pairs, [&](const string &A, const string &C) { AS->unannotate_entry(A, C); });
+
+	delete(AS);
+	dir_delete(test_bed_directory);
+
+	return 0;
+}
@@ -0,0 +1,78 @@
+#include <iostream>
+#include <string>
+#include <signal.h>
+#include <stdlib.h>
+
+#include "server.h"
+
+using namespace std;
+
+// The annotation daemon: owns a (sharded) annotation set directory and serves
+// it on a Unix domain socket until SIGINT or SIGTERM. changes are logged as
+// they are made, and committed when a client asks, or on shutdown. the hot keys
+// saved by the last commit are read back in the background once serving starts
+
+int main(int argc, char *argv[])
+{
+	string hashTableType("");
+	unsigned int threads = 2, shardBits = 4;
+
+	if(argc < 3)
+	{
+		cout << "USAGE: [DIRECTORY] [SOCKET PATH] [optional: THREADS] [optional: SHARD BITS] [optional: \"BTreeFile\"]" << endl;
+		return 0;
+	}
+
+	if(argc > 3)
+		threads = atoi(argv[3]);
+	if(argc > 4)
+		shardBits = atoi(argv[4]);
+	if(argc > 5)
+		hashTableType = string(argv[5]);
+
+	// wait for the signals on this thread alone; the workers inherit the mask
+	sigset_t signals;
+	int signal_number;
+
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+	ShardedAnnotationSet *store;
+
+	try
+	{
+		store = new ShardedAnnotationSet(string(argv[1]), hashTableType, shardBits);
+	}
+	catch(KeyWidthError &error)
+	{
+		cout << "cannot open " << argv[1] << ": " << error.what() << endl;
+		return 1;
+	}
+
+	store->set_prefetch_on_start(false);
+	store->initialize();
+
+	AnnotationServer *server = new AnnotationServer(store, string(argv[2]), threads);
+
+	if(!server->start())
+	{
+		cout << "cannot listen on " << argv[2] << endl;
+		delete(server);
+		delete(store);
+		return 1;
+	}
+
+	server->warm_cache();
+	cout << "serving " << argv[1] << " on " << argv[2] << endl;
+	sigwait(&signals, &signal_number);
+
+	server->stop();
+	store->commit_to_disk();
+
+	delete(server);
+	delete(store);
+
+	return 0;
+}
@@ -1,10 +1,23 @@
 #include "annotations.h"
 
-// type: refers to HashFile implementation. 'btree' or blank
+// type: refers to HashFile implementation. "BTreeFile", "GappedHashFile", "EncodedHashFile" or blank
+// shardBits/shardIndex: when this set is one shard of 2^shardBits, it only holds
+// the A2C entries of A keys, and the C2A entries of C keys, in shard shardIndex
+// keyWidth: hex digits per key (SHA_WIDTH or SHA256_WIDTH) of a new set. an
+// existing set keeps the width recorded in its HashFile headers. throws
+// KeyWidthError, having created nothing past the directories, if either width
+// does not fit a Digest of this build
 
-AnnotationSet::AnnotationSet(string dir_path, string hashTableType)
+AnnotationSet::AnnotationSet(string dir_path, string hashTableType, unsigned int shardBits, unsigned int shardIndex,
+							 unsigned int keyWidth)
 {
 	directory_path = dir_path;
+	shard_bits = shardBits;
+	shard_index = shardIndex;
+	hash_table_type = hashTableType;
+	generation = sequence = snapshot_sequence = 0;
+	hot_key_capacity = DEFAULT_HOT_KEYS;
+	prefetch_on_start = true;
 
 	mkdir(directory_path.c_str(),0777);
 	mkdir((directory_path + "/A2C/").c_str(),0777);
@@ -17,78 +30,736 @@ AnnotationSet::AnnotationSet(string dir_path, string hashTableType)
 
 	atomic_log_filename = directory_path + "/" + "atomic_log.txt";
 
+	char state;
+	read_commit_state(directory_path, state, generation);
+
 	Log.setPath(directory_path + "/LOG/");
 
+	// give a new set headers of its own, so the width survives a reopen even
+	// before the first commit
+	struct stat st;
+
+	if(stat((directory_path + "/A2C/HashFile.txt").c_str(), &st) != 0 && validKeyWidth(keyWidth))
+	{
+		if(!supportedKeyWidth(keyWidth))
+			throw KeyWidthError(keyWidth);
+
+		HashFileWriter(directory_path + "/A2C/", keyWidth).close();
+		HashFileWriter(directory_path + "/C2A/", keyWidth).close();
+	}
+
 	if(hashTableType == string("BTreeFile"))
 	{
 		A2C_File = new BTreeFile(directory_path + "/A2C/");
 		C2A_File = new BTreeFile(directory_path + "/C2A/");
 	}
+	else if(hashTableType == string("GappedHashFile"))
+	{
+		A2C_File = new GappedHashFile(directory_path + "/A2C/");
+		C2A_File = new GappedHashFile(directory_path + "/C2A/");
+	}
+	else if(hashTableType == string("EncodedHashFile"))
+	{
+		A2C_File = new EncodedHashFile(directory_path + "/A2C/");
+		C2A_File = new EncodedHashFile(directory_path + "/C2A/");
+	}
 	else
 	{
 
 		A2C_File = new HashFile(directory_path + "/A2C/" );
 		C2A_File = new HashFile(directory_path + "/C2A/" );
 	}
+
+	A2C_File->setPartition(shard_bits, shard_index);
+	C2A_File->setPartition(shard_bits, shard_index);
+
+	key_width = A2C_File->keyWidth();
+
+	if(!supportedKeyWidth(key_width))
+	{
+		delete(A2C_File);
+		delete(C2A_File);
+		throw KeyWidthError(key_width);
+	}
+
+	A2C_Arena.setKeyWidth(key_width);
+	C2A_Arena.setKeyWidth(key_width);
+
+	Probe_Engine = NULL;
+
+	remove_stale_snapshots();
+}
+
+unsigned int AnnotationSet::keyWidth()
+{
+	return key_width;
+}
+
+// snapshots do not outlive the process that took them. their directories are
+// named SNAP-<pid>-<generation>, and those of processes no longer running are
+// removed; those of other processes with the set open are left alone
+
+void AnnotationSet::remove_stale_snapshots()
+{
+	struct dirent *de = NULL;
+	DIR *d = NULL;
+	vector<string> stale;
+
+	if((d = opendir(directory_path.c_str())) == NULL)
+		return;
+
+	while((de = readdir(d)) != NULL)
+	{
+		int pid = 0;
+
+		if(strncmp(de->d_name, "SNAP-", 5) != 0)
+			continue;
+
+		// a process we may not signal is still running
+		if(sscanf(de->d_name + 5, "%d-", &pid) != 1 || pid <= 0 || (kill(pid, 0) != 0 && errno == ESRCH))
+			stale.push_back(directory_path + "/" + de->d_name);
+	}
+
+	closedir(d);
+
+	for(unsigned long i=0; i<stale.size(); i++)
+		dir_delete(stale[i]);
+}
+
+// A point-in-time view for readers that must not see later changes. the files
+// of the current generation are shared with every other snapshot of it, and
+// the uncommitted changes are copied once per sequence number, as sorted
+// binary pairs. both go once the last snapshot holding them is released
+
+AnnotationSnapshot AnnotationSet::snapshot()
+{
+	shared_ptr<const SnapshotDelta> delta = Snapshot_Delta.lock();
+
+	if(!delta || snapshot_sequence != sequence)
+	{
+		delta = snapshot_delta(true, true);
+		Snapshot_Delta = delta;
+		snapshot_sequence = sequence;
+	}
+
+	return AnnotationSnapshot(snapshot_files(), delta, hash_table_type, generation, sequence);
+}
+
+// Full scans, in A2C or C2A order, of a snapshot taken for the purpose: the
+// scan sees the pairs as they are now, and forces no commit. it reads the
+// changes of one side only, so unless the latest snapshot's are current, just
+// those are copied
+
+AnnotationScanner AnnotationSet::scan_entries()
+{
+	return AnnotationScanner(scan_snapshot(true), true);
+}
+
+AnnotationScanner AnnotationSet::scan_annotations()
+{
+	return AnnotationScanner(scan_snapshot(false), false);
+}
+
+AnnotationSnapshot AnnotationSet::scan_snapshot(bool entries)
+{
+	shared_ptr<const SnapshotDelta> delta = Snapshot_Delta.lock();
+
+	if(!delta || snapshot_sequence != sequence)
+		delta = snapshot_delta(entries, !entries);
+
+	return AnnotationSnapshot(snapshot_files(), delta, hash_table_type, generation, sequence);
+}
+
+shared_ptr<SnapshotFiles> AnnotationSet::snapshot_files()
+{
+	shared_ptr<SnapshotFiles> files = Snapshot_Files.lock();
+
+	if(!files)
+	{
+		files = make_shared<SnapshotFiles>(directory_path, directory_path + "/SNAP-" + to_string(getpid()) + "-" + to_string(generation) + "/");
+		Snapshot_Files = files;
+	}
+
+	return files;
+}
+
+// the uncommitted changes of the sides asked for; the others are left empty
+
+shared_ptr<const SnapshotDelta> AnnotationSet::snapshot_delta(bool A2C, bool C2A)
+{
+	shared_ptr<SnapshotDelta> delta = make_shared<SnapshotDelta>();
+
+	for(CacheMap::iterator it = Cache_Table.begin(); it != Cache_Table.end(); it++)
+	{
+		if(it->second.file_state == it->second.memory_state)
+			continue;
+
+		bool bound = (it->second.memory_state == 1);
+		DeltaChange A2C_change = {it->first.A, it->first.C, bound}, C2A_change = {it->first.C, it->first.A, bound};
+
+		if(A2C && owns_digest(it->first.A))
+			delta->A2C.push_back(A2C_change);
+		if(C2A && owns_digest(it->first.C))
+			delta->C2A.push_back(C2A_change);
+	}
+
+	sort(delta->A2C.begin(), delta->A2C.end());
+	sort(delta->C2A.begin(), delta->C2A.end());
+
+	return delta;
+}
+
+bool AnnotationSet::owns_key(string_view key)
+{
+	return(convertKeyToShard(key, shard_bits) == shard_index);
+}
+
+// owns_key for a key in binary: its leading bits are those of its first bytes
+
+bool AnnotationSet::owns_digest(const Digest &key)
+{
+	if(shard_bits == 0)
+		return true;
+
+	unsigned int n = (key.bytes[0] << 24) | (key.bytes[1] << 16) | (key.bytes[2] << 8) | key.bytes[3];
+	return((n >> (32 - shard_bits)) == shard_index);
 }
 
 AnnotationSet::~AnnotationSet()
 {
 	delete(A2C_File);
 	delete(C2A_File);
+	delete(Probe_Engine);
 }
 
 void AnnotationSet::initialize()
 {	
+	TRACE_SCOPE("AnnotationSet::initialize");
+
 	//A WAL state of 1 means we need to roll-back a failed commit
 
 	if(atomic_read() == '1')
 	{
+		TRACE_SCOPE("initialize: roll back commit");
+
+		// readers of the files rolled back over must reopen
+		generation++;
+
 		A2C_File->moveState(directory_path + "/A2C-bak/", directory_path + "/A2C/");
 		C2A_File->moveState(directory_path + "/C2A-bak/", directory_path + "/C2A/");
 		
+		Log.close();
 		rename((Log.getFilename() + ".bak").c_str(), Log.getFilename().c_str());
 
 		atomic_write('0');
 	}
 
-	vector<Log::command> logEntries = Log.readEntries();
+	LogFileReader reader(Log);
+	Log::command entry;
 
 	// now load all commands from the log file, lazily populating the in-memory hashtable
 	// when necessary
 
-	for(unsigned long i=0; i<logEntries.size(); i++)
-		modify_entry(logEntries[i].cmd, logEntries[i].A, logEntries[i].C, /*writeLog*/ false);
+	TRACE_SCOPE("initialize: replay log");
+
+	while(reader.next(entry))
+		modify_entry(entry.cmd, entry.A, entry.C, /*writeLog*/ false);
+
+	// pick up the read counts of the last run, and read its hottest keys back in
+	load_hot_keys();
+
+	if(prefetch_on_start)
+	{
+		TRACE_SCOPE("initialize: prefetch hot keys");
+		prefetch_hot_keys();
+	}
+}
+
+void AnnotationSet::annotate_entry(string_view A, string_view C)
+{
+	modify_entry(Log::ANNOTATE, A, C, /*writeLog*/ true);
+}
+
+void AnnotationSet::unannotate_entry(string_view A, string_view C)
+{
+	modify_entry(Log::UNANNOTATE, A, C, /*writeLog*/ true);
 }
 
-void AnnotationSet::annotate_entry(string A, string C)
+set<string> AnnotationSet::list_annotations(string_view C)
 {
-	modify_entry("A", A, C, /*writeLog*/ true);
+	record_access(C, C2A_Access);
+	return hash_lookup(C, C2A_Memory_Map, C2A_File, C2A_Arena).toStringSet();
 }
 
-void AnnotationSet::unannotate_entry(string A, string C)
+set<string> AnnotationSet::list_entries(string_view A)
 {
-	modify_entry("U", A, C, /*writeLog*/ true);
+	record_access(A, A2C_Access);
+	return hash_lookup(A, A2C_Memory_Map, A2C_File, A2C_Arena).toStringSet();
 }
 
-set<string> AnnotationSet::list_annotations(string C)
+// Answer many keys at once. Like list_entries, results are kept in the memory
+// map; the keys not already there are read from disk together by the probe
+// engine, with many reads in flight instead of one blocking seek at a time
+
+vector<set<string> > AnnotationSet::list_entries_batch(vector<string> As)
 {
-	return hash_lookup(C, C2A_Memory_Map, C2A_File);
+	return batch_lookup(As, A2C_Memory_Map, A2C_File, A2C_Arena, A2C_Access);
 }
 
-set<string> AnnotationSet::list_entries(string A)
+vector<set<string> > AnnotationSet::list_annotations_batch(vector<string> Cs)
 {
-	return hash_lookup(A, A2C_Memory_Map, A2C_File);
+	return batch_lookup(Cs, C2A_Memory_Map, C2A_File, C2A_Arena, C2A_Access);
+}
+
+vector<set<string> > AnnotationSet::batch_lookup(
+	vector<string> keys,
+	DigestMap &hash_map,
+	HashFile *hash_file,
+	DigestArena &arena,
+	AccessMap &counts
+	)
+{
+	vector<set<string> > results(keys.size());
+	vector<ValueSet*> lists;
+
+	for(unsigned long i=0; i<keys.size(); i++)
+		record_access(keys[i], counts);
+
+	batch_load(keys, lists, hash_map, hash_file, arena);
+
+	for(unsigned long i=0; i<keys.size(); i++)
+		results[i] = lists[i]->toStringSet();
+
+	return results;
+}
+
+// find the value set of every key in the memory map, reading the keys not yet
+// there in one batch
+
+void AnnotationSet::batch_load(
+	const vector<string> &keys,
+	vector<ValueSet*> &lists,
+	DigestMap &hash_map,
+	HashFile *hash_file,
+	DigestArena &arena
+	)
+{
+	vector<string> missing;
+	vector<ValueSet*> targets;
+	Digest digest;
+
+	lists.resize(keys.size());
+
+	for(unsigned long i=0; i<keys.size(); i++)
+	{
+		convertHexToDigest(digest, keys[i]);
+		pair<DigestMap::iterator, bool> entry = hash_map.insert(make_pair(digest, ValueSet(&arena)));
+		lists[i] = &entry.first->second;
+
+		if(!entry.second)
+			continue;
+
+		missing.push_back(keys[i]);
+		targets.push_back(lists[i]);
+	}
+
+	if(!missing.empty())
+	{
+		if(Probe_Engine == NULL)
+			Probe_Engine = new ProbeEngine();
+
+		Probe_Engine->lookup(hash_file, missing, targets);
+	}
+}
+
+// Sweeps resolve a batch of keys in key order, each once, handing each key's
+// values to callback as they are found. keys with changes pending are answered
+// from the memory maps, between the file's own; the rest are read in one
+// ordered pass over the file. nothing is loaded into the memory maps, so a
+// batch of any size holds the values of one key at a time
+
+void AnnotationSet::sweep_entries(vector<string> As, SweepCallback callback)
+{
+	sweep_lookup(As, callback, A2C_Memory_Map, A2C_File);
+}
+
+void AnnotationSet::sweep_annotations(vector<string> Cs, SweepCallback callback)
+{
+	sweep_lookup(Cs, callback, C2A_Memory_Map, C2A_File);
+}
+
+void AnnotationSet::sweep_lookup(
+	vector<string> keys,
+	SweepCallback callback,
+	DigestMap &hash_map,
+	HashFile *hash_file
+	)
+{
+	vector<string> on_file;
+	unsigned long next = 0;
+	Digest digest;
+
+	sort(keys.begin(), keys.end());
+	keys.erase(unique(keys.begin(), keys.end()), keys.end());
+
+	for(unsigned long i=0; i<keys.size(); i++)
+	{
+		convertHexToDigest(digest, keys[i]);
+
+		if(hash_map.find(digest) == hash_map.end())
+			on_file.push_back(keys[i]);
+	}
+
+	// hand over the keys held in memory that sort before until (all, if NULL)
+	auto from_memory = [&](const string *until)
+	{
+		for(; next < keys.size() && (until == NULL || keys[next] < *until); next++)
+		{
+			convertHexToDigest(digest, keys[next]);
+			DigestMap::iterator it = hash_map.find(digest);
+
+			if(it != hash_map.end())
+				callback(keys[next], it->second.toStringSet());
+		}
+	};
+
+	hash_file->sweep(on_file, [&](const string &key, ValueSet &values)
+	{
+		from_memory(&key);
+		callback(key, values.toStringSet());
+	});
+
+	from_memory(NULL);
+}
+
+// Point queries never populate the memory maps. Any key with pending changes is
+// already loaded into its memory map (modify_entry reads both sides in), so a key
+// missing from the maps can be answered from disk alone
+
+bool AnnotationSet::has_annotation(string_view A, string_view C)
+{
+	Digest A_digest, C_digest;
+
+	convertHexToDigest(A_digest, A);
+	convertHexToDigest(C_digest, C);
+
+	DigestMap::iterator it = A2C_Memory_Map.find(A_digest);
+
+	if(it != A2C_Memory_Map.end())
+		return it->second.contains(C_digest);
+
+	it = C2A_Memory_Map.find(C_digest);
+
+	if(it != C2A_Memory_Map.end())
+		return it->second.contains(A_digest);
+
+	return A2C_File->has(string(A), string(C));
+}
+
+unsigned long AnnotationSet::count_entries(string_view A)
+{
+	record_access(A, A2C_Access);
+	return count_lookup(A, A2C_Memory_Map, A2C_File);
+}
+
+unsigned long AnnotationSet::count_annotations(string_view C)
+{
+	record_access(C, C2A_Access);
+	return count_lookup(C, C2A_Memory_Map, C2A_File);
+}
+
+unsigned long AnnotationSet::count_lookup(
+	string_view key,
+	DigestMap &hash_map,
+	HashFile *hash_file
+	)
+{
+	Digest digest;
+	convertHexToDigest(digest, key);
+
+	DigestMap::iterator it = hash_map.find(digest);
+
+	if(it != hash_map.end())
+		return it->second.size();
+
+	return hash_file->count(string(key));
+}
+
+// Paged lookups return up to limit of a key's values, in order, after the one
+// the cursor names. a key with changes pending is paged through its value set;
+// any other is read straight from the file, a page at a time, without loading
+// the rest of its values. one value more than the page is read, to tell whether
+// the listing goes on
+
+ValuePage AnnotationSet::list_entries(string_view A, unsigned long limit, string_view cursor)
+{
+	record_access(A, A2C_Access);
+	return page_lookup(A, limit, cursor, A2C_Memory_Map, A2C_File);
+}
+
+ValuePage AnnotationSet::list_annotations(string_view C, unsigned long limit, string_view cursor)
+{
+	record_access(C, C2A_Access);
+	return page_lookup(C, limit, cursor, C2A_Memory_Map, C2A_File);
+}
+
+ValuePage AnnotationSet::page_lookup(
+	string_view key,
+	unsigned long limit,
+	string_view cursor,
+	DigestMap &hash_map,
+	HashFile *hash_file
+	)
+{
+	ValuePage page;
+	Digest digest;
+
+	if(limit == 0)
+	{
+		page.cursor = string(cursor);
+		return page;
+	}
+
+	// room for the one extra value read from the file
+	limit = min(limit, ULONG_MAX - 1);
+
+	convertHexToDigest(digest, key);
+	DigestMap::iterator it = hash_map.find(digest);
+
+	if(it != hash_map.end())
+	{
+		ValueSet::const_iterator value = it->second.begin(), end = it->second.end();
+
+		if(!cursor.empty())
+		{
+			Digest after;
+			convertHexToDigest(after, cursor);
+			value = upper_bound(value, end, after);
+		}
+
+		for(; value != end && page.values.size() <= limit; value++)
+			page.values.push_back(convertDigestToHex(*value, key_width));
+	}
+	else
+		hash_file->getPage(string(key), string(cursor), limit + 1, page.values);
+
+	if(page.values.size() > limit)
+	{
+		page.values.pop_back();
+		page.cursor = page.values.back();
+	}
+
+	return page;
+}
+
+// Range queries return every key whose SHA starts with prefix, or whose leading
+// characters fall within [low, high]; bounds may be partial keys
+
+map<string, set<string> > AnnotationSet::list_entries_by_prefix(string prefix)
+{
+	return range_lookup(prefix, prefix, A2C_Memory_Map, A2C_Dirty_Keys, A2C_File);
+}
+
+map<string, set<string> > AnnotationSet::list_entries_in_range(string low, string high)
+{
+	return range_lookup(low, high, A2C_Memory_Map, A2C_Dirty_Keys, A2C_File);
+}
+
+map<string, set<string> > AnnotationSet::list_annotations_by_prefix(string prefix)
+{
+	return range_lookup(prefix, prefix, C2A_Memory_Map, C2A_Dirty_Keys, C2A_File);
+}
+
+map<string, set<string> > AnnotationSet::list_annotations_in_range(string low, string high)
+{
+	return range_lookup(low, high, C2A_Memory_Map, C2A_Dirty_Keys, C2A_File);
+}
+
+// seek once to the first key >= low, and stream the run of keys up to high.
+// dirty keys are skipped on disk and taken from the memory map instead, which
+// also picks up keys that have not been committed yet
+
+map<string, set<string> > AnnotationSet::range_lookup(
+	string low,
+	string high,
+	DigestMap &hash_map,
+	KeySet &dirty_keys,
+	HashFile *hash_file
+	)
+{
+	map<string, set<string> > result;
+	HashFileScanner scanner(hash_file, hash_file->lowerBound(low));
+	string key, value, curr_key;
+	set<string> *curr_list = NULL;
+	bool curr_dirty = false;
+
+	while(scanner.next(key, value) && key.compare(0, high.size(), high) <= 0)
+	{
+		if(key != curr_key)
+		{
+			curr_key = key;
+			curr_dirty = (dirty_keys.find(key) != dirty_keys.end());
+			curr_list = (curr_dirty ? NULL : &result[key]);
+		}
+
+		if(!curr_dirty)
+			curr_list->insert(curr_list->end(), value);
+	}
+
+	KeySet::iterator it;
+	Digest digest;
+
+	for(it = dirty_keys.lower_bound(low); it != dirty_keys.end() && it->compare(0, high.size(), high) <= 0; it++)
+	{
+		convertHexToDigest(digest, *it);
+		ValueSet &list = hash_map.find(digest)->second;
+
+		if(list.size() != 0)
+			result[*it] = list.toStringSet();
+	}
+
+	return result;
+}
+
+// Multi-key queries: the set of values carried by all (intersect) or any (union)
+// of the given keys. like point queries, they do not populate the memory maps
+
+set<string> AnnotationSet::intersect_entries(vector<string> As)
+{
+	return intersect_lookup(As, A2C_Memory_Map, A2C_File);
+}
+
+set<string> AnnotationSet::union_entries(vector<string> As)
+{
+	return union_lookup(As, A2C_Memory_Map, A2C_File);
+}
+
+set<string> AnnotationSet::intersect_annotations(vector<string> Cs)
+{
+	return intersect_lookup(Cs, C2A_Memory_Map, C2A_File);
+}
+
+set<string> AnnotationSet::union_annotations(vector<string> Cs)
+{
+	return union_lookup(Cs, C2A_Memory_Map, C2A_File);
+}
+
+// order the keys by cardinality and read only the smallest set in full; every
+// other key filters the remaining candidates, either galloping through its
+// in-memory set or probing its on-disk run. stops as soon as nothing is left
+
+set<string> AnnotationSet::intersect_lookup(
+	vector<string> keys,
+	DigestMap &hash_map,
+	HashFile *hash_file
+	)
+{
+	set<string> result;
+	vector<pair<unsigned long, string> > ordered;
+
+	for(unsigned long i=0; i<keys.size(); i++)
+	{
+		unsigned long n = count_lookup(keys[i], hash_map, hash_file);
+
+		if(n == 0)
+			return result;
+
+		ordered.push_back(make_pair(n, keys[i]));
+	}
+
+	if(ordered.empty())
+		return result;
+
+	sort(ordered.begin(), ordered.end());
+
+	vector<Digest> candidates;
+	Digest digest;
+
+	convertHexToDigest(digest, ordered[0].second);
+	DigestMap::iterator it = hash_map.find(digest);
+
+	if(it != hash_map.end())
+		candidates.assign(it->second.begin(), it->second.end());
+	else
+	{
+		ValueSet values;
+		hash_file->get(ordered[0].second, values);
+		candidates.assign(values.begin(), values.end());
+	}
+
+	for(unsigned long i=1; i<ordered.size() && !candidates.empty(); i++)
+	{
+		convertHexToDigest(digest, ordered[i].second);
+		it = hash_map.find(digest);
+
+		if(it != hash_map.end())
+		{
+			DigestArrayAccessor at(it->second.begin());
+			gallopIntersect(candidates, at, it->second.size());
+		}
+		else
+			hash_file->intersect(ordered[i].second, candidates);
+	}
+
+	for(unsigned long i=0; i<candidates.size(); i++)
+		result.insert(result.end(), convertDigestToHex(candidates[i], key_width));
+
+	return result;
+}
+
+set<string> AnnotationSet::union_lookup(
+	vector<string> keys,
+	DigestMap &hash_map,
+	HashFile *hash_file
+	)
+{
+	vector<Digest> values;
+	Digest digest;
+
+	for(unsigned long i=0; i<keys.size(); i++)
+	{
+		convertHexToDigest(digest, keys[i]);
+		DigestMap::iterator it = hash_map.find(digest);
+
+		if(it != hash_map.end())
+			values.insert(values.end(), it->second.begin(), it->second.end());
+		else
+		{
+			ValueSet disk_values;
+			hash_file->get(keys[i], disk_values);
+			values.insert(values.end(), disk_values.begin(), disk_values.end());
+		}
+	}
+
+	sort(values.begin(), values.end());
+	values.erase(unique(values.begin(), values.end()), values.end());
+
+	set<string> result;
+
+	for(unsigned long i=0; i<values.size(); i++)
+		result.insert(result.end(), convertDigestToHex(values[i], key_width));
+
+	return result;
 }
 
 // Perform either an Annotate or Unannotate action
 // Both A2C and C2A in-memory hashtables need to be updated, as well as read from disk if currently empty
 // Finally, write this action to the log file
+// once both keys are in the memory maps, nothing on this path allocates
 
-void AnnotationSet::modify_entry(string cmd, string A, string C, bool writeLog)
+void AnnotationSet::modify_entry(Log::Op cmd, string_view A, string_view C, bool writeLog)
 {
-	modify_entry_in_table(A2C_Memory_Map, A+C, A2C_File, cmd, A, C);
-	modify_entry_in_table(C2A_Memory_Map, A+C, C2A_File, cmd, C, A);
+	CachePair cache_key;
+
+	sequence++;
+	convertHexToDigest(cache_key.A, A);
+	convertHexToDigest(cache_key.C, C);
+
+	// a shard only updates the side(s) it owns, but logs the pair either way
+	if(owns_key(A))
+		modify_entry_in_table(A2C_Memory_Map, A2C_Arena, A2C_Dirty_Keys, cache_key, A2C_File, cmd, A, cache_key.C);
+	if(owns_key(C))
+		modify_entry_in_table(C2A_Memory_Map, C2A_Arena, C2A_Dirty_Keys, cache_key, C2A_File, cmd, C, cache_key.A);
 
 	// record action to log, except if we are initializing
 	if(writeLog)
@@ -97,40 +768,59 @@ void AnnotationSet::modify_entry(string cmd, string A, string C, bool writeLog)
 
 // returns whether or not the entry was found
 void AnnotationSet::modify_entry_in_table(
-	unordered_map<string, set<string> > &table, 
-	string cache_key,
+	DigestMap &table, 
+	DigestArena &arena,
+	KeySet &dirty_keys,
+	const CachePair &cache_key,
 	HashFile *hashfile,
-	string cmd, 
-	string key, 
-	string value
+	Log::Op cmd, 
+	string_view key, 
+	const Digest &value
 	)
 {
-	set<string> *list = &hash_lookup(key, table, hashfile);
+	ValueSet *list = &hash_lookup(key, table, hashfile, arena);
 
-	if(Cache_Table.count(cache_key) == 0)
-		Cache_Table[cache_key].file_state = list->count(value);
+	// one probe finds the cache line, or adds it along with the state on file
+	pair<CacheMap::iterator, bool> cached = Cache_Table.insert(make_pair(cache_key, CacheLine()));
+	CacheLine &cache_line = cached.first->second;
 
-	if(cmd == "A")
-		list->insert(value).second;
+	if(cached.second)
+		cache_line.file_state = list->contains(value);
 
-	if(cmd == "U")
+	if(cmd == Log::ANNOTATE)
+		list->insert(value);
+
+	if(cmd == Log::UNANNOTATE)
 		list->erase(value);
 
-	Cache_Table[cache_key].memory_state = (cmd == "A" ? 1 : 0);	
+	if(dirty_keys.find(key) == dirty_keys.end())
+		dirty_keys.insert(string(key));
+
+	cache_line.memory_state = (cmd == Log::ANNOTATE ? 1 : 0);	
 }
 
 // return by reference, of in-memory hashtable (populates from disk if necessary)
-set<string>& AnnotationSet::hash_lookup(
-	string key,
-	unordered_map<string, set<string> > &hash_map,
-	HashFile *hash_file
+ValueSet& AnnotationSet::hash_lookup(
+	string_view key,
+	DigestMap &hash_map,
+	HashFile *hash_file,
+	DigestArena &arena
 	)
 {
-	// read annotation from disk via binary search, and update in-memory table
-	if(hash_map.count(key) == 0)
-		hash_map[key] = hash_file->get(key);
+	Digest digest;
+	convertHexToDigest(digest, key);
+
+	// a single probe either finds the key, or adds an empty set to be read
+	// from disk via binary search
+	pair<DigestMap::iterator, bool> entry = hash_map.insert(make_pair(digest, ValueSet(&arena)));
+
+	if(entry.second)
+	{
+		TRACE_SLOW_SCOPE("hash_lookup: slow read");
+		hash_file->get(string(key), entry.first->second);
+	}
 
-	return hash_map[key];
+	return entry.first->second;
 }
 
 char AnnotationSet::atomic_read()
@@ -142,18 +832,43 @@ char AnnotationSet::atomic_read()
 	return state;
 }
 
+// the state is followed by the generation, which readers of the committed files
+// compare to tell whether a new commit was published
+
 void AnnotationSet::atomic_write(char state)
 {
 	fstream file(atomic_log_filename.c_str(), fstream::out | fstream:: trunc);
-	file.write(&state, 1);
+	file << state << " " << generation;
 	file.flush();
 	file.close();		
 }
 
+// the state ('0' unless a publish is under way or awaits rollback) and the
+// generation recorded in a set's atomic log. a set never committed is at '0' and
+// generation 0; a log caught while it is rewritten reads as neither
+
+void AnnotationSet::read_commit_state(string directory_path, char &state, unsigned long &generation)
+{
+	fstream file((directory_path + "/atomic_log.txt").c_str(), fstream::in);
+
+	state = '0';
+	generation = 0;
+
+	if(!file.is_open())
+		return;
+
+	// logs written before the generation was recorded hold the state alone
+	if(!(file >> state))
+		state = '\0';
+	else if(!(file >> generation))
+		generation = 0;
+
+	file.close();
+}
+
 void AnnotationSet::commit_to_disk()
 {
-	
-	string log_backup_filename = Log.getFilename() + ".bak";
+	TRACE_SCOPE("AnnotationSet::commit_to_disk");
 
 	//in this implementation, logfile MUST be compacted for commit to properly work
 	compact_log();
@@ -162,12 +877,63 @@ void AnnotationSet::commit_to_disk()
 	A2C_File->commit(directory_path + "/A2C-tmp/", Log, false);
 	C2A_File->commit(directory_path + "/C2A-tmp/", Log, true);
 
+	publish_tmp_state();
+
+	// the files now agree with the memory maps, which stay on as read caches.
+	// every cache line is clean, so start tracking afresh; the next commit then
+	// only walks the pairs changed after this one
+	Cache_Table.clear();
+	A2C_Dirty_Keys.clear();
+	C2A_Dirty_Keys.clear();
+
+	save_hot_keys();
+}
+
+// bound the memory each index uses to sort the log during a commit; larger
+// deltas are spilled to sorted runs in the temp directories and merged
+
+void AnnotationSet::set_commit_memory_limit(unsigned long bytes)
+{
+	A2C_File->setCommitMemoryLimit(bytes);
+	C2A_File->setCommitMemoryLimit(bytes);
+}
+
+void AnnotationSet::set_search_mode(SearchMode mode)
+{
+	A2C_File->setSearchMode(mode);
+	C2A_File->setSearchMode(mode);
+}
+
+// let the index files try the layouts they support on lookups of their own
+// keys (a BTreeFile its trie geometries), then commit, which rebuilds them in
+// the layouts found fastest. a layout chosen is recorded in the files, and kept
+// by later commits
+
+void AnnotationSet::tune_index(unsigned long lookups)
+{
+	A2C_File->tuneIndex(lookups);
+	C2A_File->tuneIndex(lookups);
+	commit_to_disk();
+}
+
+// swap the hashtables written to the temp directories in for the live ones,
+// such that a crash at any point either rolls back or completes on initialize()
+
+void AnnotationSet::publish_tmp_state()
+{
+	TRACE_SCOPE("AnnotationSet::publish_tmp_state");
+
+	string log_backup_filename = Log.getFilename() + ".bak";
+
 	//copy originals to backup files (for rollback purposes)
 	A2C_File->copyState(directory_path + "/A2C-bak/");
 	C2A_File->copyState(directory_path + "/C2A-bak/");
 
 	file_copy(Log.getFilename().c_str(), log_backup_filename.c_str());
 
+	// readers see the new generation come in along with the new files
+	generation++;
+
 	///////////////////////// ATOMIC ACTION ////////////////////////////////////
 	atomic_write('1');
 	A2C_File->moveState(directory_path + "/A2C-tmp/", directory_path + "/A2C/");
@@ -176,25 +942,283 @@ void AnnotationSet::commit_to_disk()
 	atomic_write('0');
 	////////////////////////////////////////////////////////////////////////////
 
+	// snapshots taken from here on get the new files
+	Snapshot_Files.reset();
+	Snapshot_Delta.reset();
+}
+
+// write one sorted index from its sorter, dropping duplicate pairs, then build
+// any secondary index over it
+
+static void write_sorted_index(ExternalSorter *sorter, HashFile *hash_file, string newPath)
+{
+	unsigned int width = hash_file->keyWidth();
+	HashFileWriter writer(newPath, width);
+	const char *record, *prev = NULL;
+	char prev_record[2 * MAX_KEY_WIDTH];
+
+	while((record = sorter->next()) != NULL)
+	{
+		if(prev != NULL && memcmp(prev, record, 2 * width) == 0)
+			continue;
+
+		writer.append(record, record + width);
+
+		memcpy(prev_record, record, 2 * width);
+		prev = prev_record;
+	}
+
+	writer.close();
+	hash_file->buildIndex(newPath);
+}
+
+// Replace the committed contents of the set with the pairs in a snapshot file
+// ("A C" per line), discarding any uncommitted changes. the snapshot is
+// external-sorted once by A and once by C within memory_limit, both indices are
+// written directly into the temp directories, and then published atomically.
+// a shard keeps only the sides of each pair it owns
+
+void AnnotationSet::bulk_load(string snapshot_filename, unsigned long memory_limit, unsigned int threads)
+{
+	unsigned int sort_threads = max(threads / 2, 1u);
+	ExternalSorter A2C_Sorter(directory_path + "/A2C-tmp/bulk-", 2 * key_width, memory_limit / 2, sort_threads);
+	ExternalSorter C2A_Sorter(directory_path + "/C2A-tmp/bulk-", 2 * key_width, memory_limit / 2, sort_threads);
+
+	fstream file(snapshot_filename.c_str(), fstream::in);
+	string line;
+	char record[2 * MAX_KEY_WIDTH];
+
+	while(getline(file, line))
+	{
+		if(line.size() < 2 * key_width + 1)
+			continue;
+
+		string A = line.substr(0, key_width), C = line.substr(key_width + 1, key_width);
+
+		if(owns_key(A))
+		{
+			memcpy(record, A.c_str(), key_width);
+			memcpy(record + key_width, C.c_str(), key_width);
+			A2C_Sorter.add(record);
+		}
+
+		if(owns_key(C))
+		{
+			memcpy(record, C.c_str(), key_width);
+			memcpy(record + key_width, A.c_str(), key_width);
+			C2A_Sorter.add(record);
+		}
+	}
+
+	file.close();
+	bulk_load(&A2C_Sorter, &C2A_Sorter);
+}
+
+// the second half of a bulk load: the pairs have all been added to the two
+// sorters, keyed by A and by C, and make up the whole of the set
+
+void AnnotationSet::bulk_load(ExternalSorter *A2C_Sorter, ExternalSorter *C2A_Sorter)
+{
+	// merge and write both indices at once
+	thread C2A_Writer(write_sorted_index, C2A_Sorter, C2A_File, directory_path + "/C2A-tmp/");
+	write_sorted_index(A2C_Sorter, A2C_File, directory_path + "/A2C-tmp/");
+	C2A_Writer.join();
+
+	// the log only holds changes against the old contents; publishing drops it,
+	// and everything cached from them goes too
+	publish_tmp_state();
+	clear_caches();
+}
+
+void AnnotationSet::clear_caches()
+{
+	A2C_Memory_Map.clear();
+	C2A_Memory_Map.clear();
+	Cache_Table.clear();
+	A2C_Dirty_Keys.clear();
+	C2A_Dirty_Keys.clear();
 }
 
 void AnnotationSet::compact_log()
 {
+	TRACE_SCOPE("AnnotationSet::compact_log");
+
 	LogFile log_temp(Log.getFilename() + ".tmp");
-	unordered_map<string, CacheLine>::iterator it;
+	CacheMap::iterator it;
+	unsigned long changes = 0;
 
 	for(it = Cache_Table.begin(); it != Cache_Table.end(); it++)
 	{
-		string A = it->first.substr(0, SHA_WIDTH);
-		string C = it->first.substr(SHA_WIDTH, SHA_WIDTH);
 		CacheLine cache_line = it->second;
 
 		if(cache_line.file_state == cache_line.memory_state)
 			continue;
-			
-		log_temp.addEntry(cache_line.file_state == 0 ? "A" : "U", A, C);
+
+		string A = convertDigestToHex(it->first.A, key_width);
+		string C = convertDigestToHex(it->first.C, key_width);
+
+		log_temp.addEntry(cache_line.file_state == 0 ? Log::ANNOTATE : Log::UNANNOTATE, A, C);
+		changes++;
+	}
+
+	// with nothing to change, no temp log was written; the commit must then see
+	// an empty log rather than the uncompacted one
+	if(changes == 0)
+		Log.clear();
+	else
+	{
+		Log.close();
+		rename(log_temp.getFilename().c_str(), Log.getFilename().c_str());
 	}
+}
+
+// Hot keys: the keys read most often, per side, are saved beside the files on
+// every commit (and whenever save_hot_keys is called), hottest first, as
+// "A <key> <reads>" and "C <key> <reads>" lines. initialize() seeds the read
+// counts from them, and unless told otherwise reads their value sets into the
+// memory maps, so a restarted set answers its busiest keys from memory at once.
+// a capacity of 0 stops both the counting and the saving
+
+void AnnotationSet::set_hot_key_capacity(unsigned long keys)
+{
+	hot_key_capacity = keys;
 
-	rename(log_temp.getFilename().c_str(), Log.getFilename().c_str());
+	if(keys == 0)
+	{
+		A2C_Access.clear();
+		C2A_Access.clear();
+	}
+}
+
+void AnnotationSet::set_prefetch_on_start(bool prefetch)
+{
+	prefetch_on_start = prefetch;
+}
+
+// the keep most read keys of counts, most read first, ties in key order
+
+static void rank_access(const AccessMap &counts, unsigned long keep, vector<pair<unsigned long, Digest> > &ranked)
+{
+	ranked.clear();
+
+	for(AccessMap::const_iterator it = counts.begin(); it != counts.end(); it++)
+		ranked.push_back(make_pair(it->second, it->first));
+
+	keep = min(keep, (unsigned long) ranked.size());
+
+	partial_sort(ranked.begin(), ranked.begin() + keep, ranked.end(),
+		[](const pair<unsigned long, Digest> &a, const pair<unsigned long, Digest> &b)
+		{
+			return(a.first > b.first || (a.first == b.first && a.second < b.second));
+		});
+
+	ranked.resize(keep);
+}
+
+void AnnotationSet::record_access(string_view key, AccessMap &counts)
+{
+	if(hot_key_capacity == 0)
+		return;
+
+	Digest digest;
+	convertHexToDigest(digest, key);
+	counts[digest]++;
+
+	if(counts.size() <= ACCESS_TRACK_FACTOR * hot_key_capacity)
+		return;
+
+	vector<pair<unsigned long, Digest> > ranked;
+	rank_access(counts, 2 * hot_key_capacity, ranked);
+	counts.clear();
+
+	for(unsigned long i=0; i<ranked.size(); i++)
+		counts[ranked[i].second] = (ranked[i].first + 1) / 2;
+}
+
+void AnnotationSet::hot_keys(vector<string> &As, vector<string> &Cs)
+{
+	vector<pair<unsigned long, Digest> > ranked;
+
+	As.clear();
+	Cs.clear();
+
+	rank_access(A2C_Access, hot_key_capacity, ranked);
+
+	for(unsigned long i=0; i<ranked.size(); i++)
+		As.push_back(convertDigestToHex(ranked[i].second, key_width));
+
+	rank_access(C2A_Access, hot_key_capacity, ranked);
+
+	for(unsigned long i=0; i<ranked.size(); i++)
+		Cs.push_back(convertDigestToHex(ranked[i].second, key_width));
+}
+
+// written aside and renamed in, so a crash leaves the old list or the new one
+
+void AnnotationSet::save_hot_keys()
+{
+	if(hot_key_capacity == 0)
+		return;
+
+	string filename = directory_path + "/HotKeys.txt";
+	fstream file((filename + ".tmp").c_str(), fstream::out | fstream::trunc);
+	vector<pair<unsigned long, Digest> > ranked;
+
+	rank_access(A2C_Access, hot_key_capacity, ranked);
+
+	for(unsigned long i=0; i<ranked.size(); i++)
+		file << "A " << convertDigestToHex(ranked[i].second, key_width) << " " << ranked[i].first << "\n";
+
+	rank_access(C2A_Access, hot_key_capacity, ranked);
+
+	for(unsigned long i=0; i<ranked.size(); i++)
+		file << "C " << convertDigestToHex(ranked[i].second, key_width) << " " << ranked[i].first << "\n";
+
+	file.flush();
+	file.close();
+
+	rename((filename + ".tmp").c_str(), filename.c_str());
+}
+
+// keys of another width, or of another shard, are left out
+
+void AnnotationSet::load_hot_keys()
+{
+	if(hot_key_capacity == 0)
+		return;
+
+	fstream file((directory_path + "/HotKeys.txt").c_str(), fstream::in);
+	string side, key;
+	unsigned long reads;
+	Digest digest;
+
+	while(file >> side >> key >> reads)
+	{
+		if((side != "A" && side != "C") || key.size() != key_width || !owns_key(key))
+			continue;
+
+		convertHexToDigest(digest, key);
+		(side == "A" ? A2C_Access : C2A_Access)[digest] += reads;
+	}
+
+	file.close();
+}
+
+// read the value sets of the given keys into the memory maps, in one batch per
+// side, without counting them as reads
+
+void AnnotationSet::prefetch(vector<string> As, vector<string> Cs)
+{
+	vector<ValueSet*> lists;
+
+	batch_load(As, lists, A2C_Memory_Map, A2C_File, A2C_Arena);
+	batch_load(Cs, lists, C2A_Memory_Map, C2A_File, C2A_Arena);
+}
+
+void AnnotationSet::prefetch_hot_keys()
+{
+	vector<string> As, Cs;
 
+	hot_keys(As, Cs);
+	prefetch(As, Cs);
 }
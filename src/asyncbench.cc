@@ -0,0 +1,175 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <set>
+#include <chrono>
+#include <algorithm>
+
+#include "utils.h"
+#include "annotations.h"
+#include "asyncset.h"
+
+using namespace std;
+
+// Compares an event loop serving lookups through the blocking API against one
+// using the asynchronous API. every request is a list_entries followed by a
+// little handler work on the loop thread; the loop also has to stay responsive,
+// so the longest single iteration (a stall) is reported next to the throughput
+
+typedef chrono::steady_clock Clock;
+
+const unsigned long HANDLER_SPIN = 2000, WINDOW = 256;
+
+static unsigned long handler_sink = 0;
+
+void handleRequest(const set<string> &result)
+{
+	for(unsigned long i=0; i<HANDLER_SPIN; i++)
+		handler_sink += i ^ result.size();
+}
+
+double microseconds(Clock::duration d)
+{
+	return chrono::duration_cast<chrono::nanoseconds>(d).count() / 1000.0;
+}
+
+vector<string> read_keys(string filename)
+{
+	set<string> keys;
+	fstream file(filename.c_str(), fstream::in);
+	string line;
+
+	while(getline(file, line))
+		keys.insert(line.substr(0, SHA_WIDTH));
+
+	file.close();
+
+	vector<string> shuffled(keys.begin(), keys.end());
+	random_shuffle(shuffled.begin(), shuffled.end());
+	return shuffled;
+}
+
+void report(string name, unsigned long requests, Clock::duration total, Clock::duration stall)
+{
+	cout << name << ": " << (unsigned long)(requests / (microseconds(total) / 1e6)) << " requests/s, "
+		 << "longest loop stall " << (unsigned long) microseconds(stall) << " us" << endl;
+}
+
+void runBlocking(AnnotationSet *AS, vector<string> &keys)
+{
+	Clock::time_point start = Clock::now();
+	Clock::duration stall = Clock::duration::zero();
+
+	for(unsigned long i=0; i<keys.size(); i++)
+	{
+		Clock::time_point t = Clock::now();
+		handleRequest(AS->list_entries(keys[i]));
+		stall = max(stall, Clock::now() - t);
+	}
+
+	report("blocking", keys.size(), Clock::now() - start, stall);
+}
+
+// keep up to WINDOW lookups outstanding; completions are queued back to the
+// loop by the callbacks and handled there
+
+void runAsync(AnnotationSet *AS, vector<string> &keys, unsigned int threads)
+{
+	mutex lock;
+	condition_variable ready;
+	deque<set<string> > completed;
+
+	// declared after what the callbacks touch, so its workers finish first
+	AsyncAnnotationSet<AnnotationSet> async(AS, threads, WINDOW);
+
+	Clock::time_point start = Clock::now();
+	Clock::duration stall = Clock::duration::zero();
+	unsigned long issued = 0, handled = 0;
+
+	AsyncAnnotationSet<AnnotationSet>::SetResult::Callback callback =
+		[&](AsyncAnnotationSet<AnnotationSet>::SetResult result)
+		{
+			set<string> values = result.get();
+			unique_lock<mutex> guard(lock);
+			completed.push_back(values);
+			ready.notify_one();
+		};
+
+	while(handled < keys.size())
+	{
+		Clock::time_point t = Clock::now();
+		deque<set<string> > batch;
+
+		while(issued < keys.size() && issued - handled < WINDOW)
+			async.list_entries_async(keys[issued++], 0, callback);
+
+		stall = max(stall, Clock::now() - t);
+
+		{
+			unique_lock<mutex> guard(lock);
+			batch.swap(completed);
+		}
+
+		// handling one completion is one loop iteration's worth of work
+		for(unsigned long i=0; i<batch.size(); i++)
+		{
+			Clock::time_point h = Clock::now();
+			handleRequest(batch[i]);
+			stall = max(stall, Clock::now() - h);
+		}
+
+		handled += batch.size();
+
+		if(batch.empty())
+		{
+			unique_lock<mutex> guard(lock);
+			if(completed.empty())
+				ready.wait_for(guard, chrono::milliseconds(1));
+		}
+	}
+
+	report("async (" + to_string(threads) + " threads)", keys.size(), Clock::now() - start, stall);
+}
+
+int main(int argc, char *argv[])
+{
+	string test_bed_directory("testbed");
+	string hashTableType("");
+
+	if(argc < 2)
+	{
+		cout << "USAGE: [A2C SNAPSHOT FILE] [BTreeFile]" << endl;
+		return 0;
+	}
+
+	if(argc > 2)
+		hashTableType = string(argv[2]);
+
+	dir_delete(test_bed_directory);
+
+	AnnotationSet *AS = new AnnotationSet(test_bed_directory, hashTableType);
+	AS->initialize();
+	AS->bulk_load(string(argv[1]));
+	delete(AS);
+
+	vector<string> keys = read_keys(string(argv[1]));
+
+	// each run gets a fresh set, so lookups are answered from disk
+	AS = new AnnotationSet(test_bed_directory, hashTableType);
+	AS->initialize();
+	runBlocking(AS, keys);
+	delete(AS);
+
+	unsigned int thread_counts[] = { 1, 4 };
+
+	for(unsigned int i=0; i<2; i++)
+	{
+		AS = new AnnotationSet(test_bed_directory, hashTableType);
+		AS->initialize();
+		runAsync(AS, keys, thread_counts[i]);
+		delete(AS);
+	}
+
+	return 0;
+}
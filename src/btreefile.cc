@@ -1,9 +1,21 @@
 #include "btreefile.h"
 
-BTreeFile::BTreeFile(string path, unsigned long minChildrenPerNode) : HashFile()
+bool operator==(const BTreeGeometry &g1, const BTreeGeometry &g2)
 {
-	min_children_per_node = minChildrenPerNode;
-	LINE_WIDTH = ENTRY_WIDTH * pow(16.0, (int)MASK_SIZE);
+	return(g1.mask_size == g2.mask_size && g1.num_width == g2.num_width && g1.alignment == g2.alignment &&
+		   g1.min_children == g2.min_children);
+}
+
+BTreeFile::BTreeFile(string path) : HashFile()
+{
+	build_geometry = defaultGeometry();
+	geometry_set = false;
+	setPath(path);
+}
+
+BTreeFile::BTreeFile(string path, BTreeGeometry geometry) : HashFile()
+{
+	setGeometry(geometry);
 	setPath(path);
 }
 
@@ -12,8 +24,79 @@ BTreeFile::~BTreeFile()
 	file.close();
 }
 
+// 256-way nodes of 15-byte entries, 3840 bytes padded to a 4 KB page, so a
+// node never straddles two pages
+
+BTreeGeometry BTreeFile::defaultGeometry()
+{
+	BTreeGeometry geometry;
+
+	geometry.mask_size = DEFAULT_MASK_SIZE;
+	geometry.num_width = DEFAULT_NUM_WIDTH;
+	geometry.alignment = DEFAULT_ALIGNMENT;
+	geometry.min_children = DEFAULT_MIN_CHILDREN;
+
+	return geometry;
+}
+
+// the geometries tuneIndex tries: 16-way nodes of three cache lines, 256-way
+// nodes of 9-byte entries on cache lines or, as by default, of 15-byte entries
+// on pages, and 4096-way nodes of nine pages; each with short and long leaf
+// ranges
+
+vector<BTreeGeometry> BTreeFile::candidateGeometries()
+{
+	const unsigned int shapes[][3] = { {1, 4, 64}, {2, 4, 64}, {2, 7, 4096}, {3, 4, 4096} };
+	const unsigned long leaves[] = { 16, 128 };
+	vector<BTreeGeometry> candidates;
+	BTreeGeometry geometry;
+
+	for(unsigned int s=0; s<4; s++)
+		for(unsigned int l=0; l<2; l++)
+		{
+			geometry.mask_size = shapes[s][0];
+			geometry.num_width = shapes[s][1];
+			geometry.alignment = shapes[s][2];
+			geometry.min_children = leaves[l];
+			candidates.push_back(geometry);
+		}
+
+	return candidates;
+}
+
+unsigned long BTreeFile::nodeWidth(BTreeGeometry geometry)
+{
+	unsigned long width = (FLAG_WIDTH + 2 * geometry.num_width) << (4 * geometry.mask_size);
+
+	return (width + geometry.alignment - 1) / geometry.alignment * geometry.alignment;
+}
+
+// fan-outs past 4096 and line numbers past 8 bytes are refused; alignments are
+// rounded up to a power of two, and numbers are at least MIN_NUM_WIDTH bytes
+
+void BTreeFile::setGeometry(BTreeGeometry geometry)
+{
+	unsigned int alignment = 1;
+
+	while(alignment < geometry.alignment && alignment < (1u << 16))
+		alignment <<= 1;
+
+	build_geometry.mask_size = min(max(geometry.mask_size, 1u), (unsigned int) MAX_MASK_SIZE);
+	build_geometry.num_width = min(max(geometry.num_width, (unsigned int) MIN_NUM_WIDTH), (unsigned int) MAX_NUM_WIDTH);
+	build_geometry.alignment = alignment;
+	build_geometry.min_children = max(geometry.min_children, 1ul);
+	geometry_set = true;
+}
+
+BTreeGeometry BTreeFile::geometry()
+{
+	return file_geometry;
+}
+
 void BTreeFile::setPath(string Path)
 {
+	unsigned long header[HEADER_FIELDS];
+
 	path = Path;
 
 	HashFile::setPath(path);
@@ -21,219 +104,438 @@ void BTreeFile::setPath(string Path)
 	if(file.is_open())
 		file.close();
 
+	mapping.close();
 	filename = path + "BTreeFile.txt";
-	
-	file.open(filename.c_str(), fstream::in | fstream::binary);
+	memset(header, 0, sizeof(header));
 
-	if(!file.good())
+	if(map_files && mapping.open(filename))
+		mapping.read((char *) header, 0, sizeof(header));
+	else
 	{
-		table_size = 0;
-		return;
+		file.open(filename.c_str(), fstream::in | fstream::binary);
+
+		if(file.good())
+		{
+			file.read((char *) header, sizeof(header));
+			file.clear();
+		}
 	}
 
-	// read first 4 bytes (encoding table size) and set _table_region_ptr
-	table_size = 0;
-	file.read((char *) &table_size, 4);
-	_table_region_ptr = file.tellg();
+	read_header(header);
 }
 
-// write first-line (encoding table size) to a file.  if truncate == true
-// overwrite any existing file
+// a header that does not hold a geometry this build can read leaves the table
+// empty, so lookups fall back to the HashFile
 
-void BTreeFile::write_header(string newPath, unsigned long size, bool truncate)
+void BTreeFile::read_header(const unsigned long *header)
 {
-	fstream newFile;
-	string newFilename = newPath + "BTreeFile.txt";
-
-	if(truncate)
-		newFile.open(newFilename.c_str(), fstream::out | fstream::trunc | fstream::binary);
+	if(header[0] == HEADER_MAGIC)
+	{
+		table_size = header[1];
+		file_geometry.mask_size = header[2];
+		file_geometry.num_width = header[3];
+		file_geometry.alignment = header[4];
+		file_geometry.min_children = header[5];
+		_table_region_ptr = header[6];
+		LINE_WIDTH = header[7];
+	}
 	else
-		newFile.open(newFilename.c_str(), fstream::in | fstream::out | fstream::binary);
+	{
+		table_size = header[0] & 0xffffffff;
+		file_geometry.mask_size = LEGACY_MASK_SIZE;
+		file_geometry.num_width = LEGACY_NUM_WIDTH;
+		file_geometry.alignment = 1;
+		file_geometry.min_children = DEFAULT_MIN_CHILDREN;
+		_table_region_ptr = LEGACY_HEADER_WIDTH;
+		LINE_WIDTH = nodeWidth(file_geometry);
+	}
 
-	newFile.write((char *) &size, 4);
-	_table_region_ptr = newFile.tellp();
+	if(file_geometry.mask_size < 1 || file_geometry.mask_size > MAX_MASK_SIZE || file_geometry.num_width < 1 ||
+	   file_geometry.num_width > MAX_NUM_WIDTH ||
+	   LINE_WIDTH < (int)((FLAG_WIDTH + 2 * file_geometry.num_width) << (4 * file_geometry.mask_size)))
+	{
+		table_size = 0;
+		file_geometry = build_geometry;
+		LINE_WIDTH = nodeWidth(file_geometry);
+	}
 
-	newFile.flush();
-	newFile.close();
+	ENTRY_WIDTH = FLAG_WIDTH + 2 * file_geometry.num_width;
+
+	// a file without a table has no geometry of its own to keep
+	if(!geometry_set && table_size != 0)
+		build_geometry = file_geometry;
 }
 
-// write to the specified index in the table; however, if this index
-// is out of bounds with regards to the current file size, add the appropriate
-// empty spacing
+// the header is written once the table is complete, and zeros pad it out to the
+// table's first node
 
-void BTreeFile::write_line_at_index(string newPath, unsigned long index, char *line)
+void BTreeFile::write_header(unsigned long table_lines)
 {
-	fstream newFile;
-	string newFilename = newPath + "BTreeFile.txt";
+	unsigned long header[HEADER_FIELDS] = { HEADER_MAGIC, table_lines, build_geometry.mask_size, build_geometry.num_width,
+											build_geometry.alignment, build_geometry.min_children, build_table_offset,
+											build_line_width };
 
-	if(last_table_line_written < index - 1)
-	{
-		newFile.open(newFilename.c_str(), fstream::out | fstream::app | fstream::binary);
-		char fill = 0x00;
+	output.seekp(0);
+	output.write((char *) header, sizeof(header));
 
-		while(last_table_line_written < index - 1)
-		{
-			for(int i = 0; i < LINE_WIDTH; i++)
-				newFile.write(&fill, 1);
-
-			last_table_line_written++;
-		}		
-		newFile.flush();
-		newFile.close();
-	}	
-	else if(last_table_line_written == index - 1)
-		last_table_line_written++;
-
-	newFile.open(newFilename.c_str(), fstream::in | fstream::out | fstream::binary);
-	newFile.seekp(LINE_WIDTH * index + _table_region_ptr);
-	newFile.write(line, LINE_WIDTH);
-	newFile.flush();
-	newFile.close();
+	if(table_lines == 0 && build_table_offset > sizeof(header))
+	{
+		string fill(build_table_offset - sizeof(header), (char) EMPTY_FLAG);
+		output.write(fill.data(), fill.size());
+	}
 }
 
+// lines are written as their sub-tables complete, so out of order; writing
+// past the end of the file leaves the lines skipped over zeroed until their turn
 
-string BTreeFile::getLineInTable(unsigned long line_index)
+void BTreeFile::write_line_at_index(unsigned long index, char *line)
 {
-	string line;
-	file.seekg(_table_region_ptr + line_index * LINE_WIDTH);
-	getline(file, line);
-	return line;
+	output.seekp(build_table_offset + index * build_line_width);
+	output.write(line, build_line_width);
 }
 
 void BTreeFile::getEntryInTable(char *buf, unsigned long line_num, int line_index)
 {
-	 
-	file.seekg(_table_region_ptr + line_num * LINE_WIDTH + line_index * ENTRY_WIDTH);
-	file.read(buf, ENTRY_WIDTH);
+	unsigned long offset = _table_region_ptr + line_num * LINE_WIDTH + line_index * ENTRY_WIDTH;
+
+	if(mapping.data() != NULL)
+		mapping.read(buf, offset, ENTRY_WIDTH);
+	else
+	{
+		file.seekg(offset);
+		file.read(buf, ENTRY_WIDTH);
+	}
+
+	search_probes++;
 }
 
 // Iteratively follow the pointers in the table until we get to a line marked
-// LINE_IDX_FLAG or EMPTY_FLAG
+// LINE_IDX_FLAG or EMPTY_FLAG. On success, [low, high] is the HashFile window
+// that holds every line of key
 
-set<string> BTreeFile::get(string key)
+bool BTreeFile::getWindow(string key, unsigned long &low, unsigned long &high)
 {
-	set<string> list;
 	string masked_key;
 	int mask_index = 0, table_index;
 	unsigned long table_line = 0;
+	unsigned int mask_size = file_geometry.mask_size, num_width = file_geometry.num_width;
 
-	char *table_entry = new char[ENTRY_WIDTH];
+	char table_entry[FLAG_WIDTH + 2 * MAX_NUM_WIDTH];
 
 	if(table_size == 0)
-		return list;
-	
+		return false;
+
 	do
 	{
-		masked_key = key.substr(mask_index, MASK_SIZE);
+		masked_key = key.substr(mask_index, mask_size);
 		table_index = convertHexToInt(masked_key);
 		getEntryInTable(table_entry, table_line, table_index);
 
 		table_line = 0;
-		memcpy(&table_line, &table_entry[NUM_WIDTH + 1], NUM_WIDTH);
-		mask_index += MASK_SIZE;	
+		memcpy(&table_line, &table_entry[num_width + 1], num_width);
+		mask_index += mask_size;
 
 	} while(table_entry[0] == TABLE_PTR_FLAG);
 
 	if(table_entry[0] == EMPTY_FLAG)
-		return list;
+		return false;
 
 	// table_line now contains index into HashFile of where to begin/end search
-	unsigned long low = 0, high = 0;
-	memcpy(&low, &table_entry[1], NUM_WIDTH);
-	memcpy(&high, &table_entry[NUM_WIDTH+1], NUM_WIDTH);
+	low = high = 0;
+	memcpy(&low, &table_entry[1], num_width);
+	memcpy(&high, &table_entry[num_width+1], num_width);
+	return true;
+}
+
+void BTreeFile::get(string key, ValueSet &values)
+{
+	unsigned long low, high;
+
+	// call HashFile::get to extract set of values
+	if(getWindow(key, low, high))
+		HashFile::get(key, low, high, values);
+}
+
+void BTreeFile::getPage(string key, string after, unsigned long limit, vector<string> &values)
+{
+	unsigned long low, high;
+
+	if(getWindow(key, low, high))
+		HashFile::getPage(key, after, limit, low, high, values);
+}
+
+bool BTreeFile::has(string key, string value)
+{
+	unsigned long low, high;
 
-	// call HashFile::get to extract set of values 
-	return HashFile::get(key, low, high);
+	if(!getWindow(key, low, high))
+		return false;
+
+	return HashFile::has(key, value, low, high);
+}
+
+bool BTreeFile::getKeyBounds(string key, unsigned long &begin, unsigned long &end)
+{
+	unsigned long low, high;
+
+	begin = end = 0;
+
+	if(!getWindow(key, low, high))
+		return false;
+
+	return HashFile::getKeyBounds(key, low, high, begin, end);
 }
 
-void BTreeFile::createTableLine(string newPath, string mask, unsigned long &line_cursor)
-{	
+// a partial key has the same lower bound as the smallest full-width key it
+// prefixes, so pad it out before walking the trie. keys under an empty mask fall
+// back to the full binary search
+
+unsigned long BTreeFile::lowerBound(string key)
+{
+	unsigned long low, high, begin, end;
+
+	if(key.size() < keyWidth())
+		key.append(keyWidth() - key.size(), '0');
+
+	if(!getWindow(key, low, high))
+		return HashFile::lowerBound(key);
+
+	HashFile::getKeyBounds(key, low, high, begin, end);
+	return begin;
+}
+
+// a sweep skips a gap by walking the trie, as a lookup does
+
+unsigned long BTreeFile::seekBound(string key, unsigned long from)
+{
+	return max(lowerBound(key), from);
+}
+
+// the lines under mask, and the first line past them, lie in [window_low,
+// window_high], so the searches for its entries need look nowhere else
+
+void BTreeFile::createTableLine(string mask, unsigned long &line_cursor, unsigned long window_low, unsigned long window_high)
+{
 	// line_cursor lets us know the next free line available in the table
 	unsigned long curr_line_pos = line_cursor;
 	line_cursor++;
-	char *line = new char[LINE_WIDTH];
-	char *entry = new char[ENTRY_WIDTH];
+	unsigned int mask_size = build_geometry.mask_size, num_width = build_geometry.num_width;
+	char *line = new char[build_line_width];
+	char *entry = new char[build_entry_width];
+
+	// masks absent from the HashFile are left as EMPTY_FLAG entries, as is the
+	// padding past the last entry
+	memset(line, EMPTY_FLAG, build_line_width);
 
 	// iterate through all integers covering the mask
 	// for each mask:
 	//     1.  if the key does not exist in HashTable, mark entry as EMPTY_FLAG
-	//     2.  if the key spans less than min_children_per_node entries, mark entry as 'LINE_IDX_FLAG[begin idx][end idx]'
+	//     2.  if the key spans less than min_children entries, holds the lines of
+	//         a single key, or no further mask fits in a key, mark entry as
+	//         'LINE_IDX_FLAG[begin idx][end idx]'
 	//     3.  else mark entry as 'TABLE_PTR_FLAG[table-line]' and recursively generate sub-table
-	for(int i=0; i<pow(16.0, (int)MASK_SIZE); i++)
+	for(unsigned long i=0; i < (1ul << (4 * mask_size)); i++)
 	{
 
-		string new_mask = mask + convertIntToHex(i, MASK_SIZE);
+		string new_mask = mask + convertIntToHex(i, mask_size);
 
 		//new_mask_begin = new_mask + 0000000000...
 		//new_mask_end   = new_mask + ffffffffff...
 		string new_mask_begin = new_mask;
 		string new_mask_end = new_mask;
 
-		new_mask_begin.append(SHA_WIDTH - new_mask.size(), '0');
-		new_mask_end.append(SHA_WIDTH - new_mask.size(), 'f');		
+		new_mask_begin.append(keyWidth() - new_mask.size(), '0');
+		new_mask_end.append(keyWidth() - new_mask.size(), 'f');
 
-		unsigned long index_begin = HashFile::getIndexOfKey(new_mask_begin);
+		unsigned long index_begin = HashFile::getIndexOfKey(new_mask_begin, window_low, window_high);
 
 		string key = HashFile::getKeyAtIndex(index_begin);
 
 		// check if this mask is even present in HashFile
 		if(key.substr(0, new_mask.size()) != new_mask)
-		{			
-			entry[0] = EMPTY_FLAG;
 			continue;
-		}
 
-		unsigned long index_end = HashFile::getIndexOfKey(new_mask_end);
+		unsigned long index_end = HashFile::getIndexOfKey(new_mask_end, window_low, window_high);
 
-		// only create a sub-table through recursion, if the range covered by the 
-		// new mask exceeds min_children_per_node. Otherwise, record the line# in the table
+		memset(entry, EMPTY_FLAG, build_entry_width);
+
+		// only create a sub-table through recursion, if the range covered by the
+		// new mask exceeds min_children. Otherwise, record the line# in the table
 		// note that 'children' corresponds to unique key/val pairs; may infact cover the same key more than once
-		if(index_end - index_begin < min_children_per_node)
+		bool leaf = (index_end - index_begin < build_geometry.min_children || new_mask.size() + mask_size > keyWidth());
+
+		// further levels cannot split the lines of one key. index_end is past
+		// the mask's lines, unless they run to the end of the file
+		if(!leaf)
+		{
+			string last = HashFile::getKeyAtIndex(index_end);
+
+			if(last.compare(0, new_mask.size(), new_mask) != 0)
+				last = HashFile::getKeyAtIndex(index_end - 1);
+
+			leaf = (last == key);
+		}
+
+		if(leaf)
 		{
 			entry[0] = LINE_IDX_FLAG;
-			memcpy(&entry[1], &index_begin, NUM_WIDTH);
-			memcpy(&entry[1+NUM_WIDTH], &index_end, NUM_WIDTH);
+			memcpy(&entry[1], &index_begin, num_width);
+			memcpy(&entry[1+num_width], &index_end, num_width);
 		}
 		else
 		{
 			unsigned long line_cursor_stored = line_cursor;
-			createTableLine(newPath, new_mask, line_cursor);
+			createTableLine(new_mask, line_cursor, index_begin, index_end);
 
 			// create a pointer to the recursively created sub-table
 			entry[0] = TABLE_PTR_FLAG;
-			memcpy(&entry[1+NUM_WIDTH], &line_cursor_stored, NUM_WIDTH);
+			memcpy(&entry[1+num_width], &line_cursor_stored, num_width);
 		}
 
-		memcpy(&line[i * ENTRY_WIDTH], entry, ENTRY_WIDTH);
+		memcpy(&line[i * build_entry_width], entry, build_entry_width);
 	}
 
-	write_line_at_index(newPath, curr_line_pos, line);
+	write_line_at_index(curr_line_pos, line);
+
+	delete[] line;
+	delete[] entry;
 }
 
 void BTreeFile::commit(string newPath, LogFile &log, bool reverseLog = false)
 {
+	TRACE_SCOPE("BTreeFile::commit");
+
 	//since this data-structure is dependent on a coherent HashFile, we commit it first
 	HashFile::commit(newPath, log, reverseLog);
+	buildIndex(newPath);
+}
+
+// build the table over the HashFile already written to newPath, in the build
+// geometry. line numbers are widened if the file has more lines than they hold
+
+void BTreeFile::buildIndex(string newPath)
+{
+	TRACE_SCOPE("BTreeFile::buildIndex");
+
 	HashFile::setPath(newPath);
 
+	while(build_geometry.num_width < MAX_NUM_WIDTH && (HashFile::length() >> (8 * build_geometry.num_width)) != 0)
+		build_geometry.num_width++;
+
 	unsigned long line_cursor = 0;
-	last_table_line_written = -1;
+
+	build_entry_width = FLAG_WIDTH + 2 * build_geometry.num_width;
+	build_line_width = nodeWidth(build_geometry);
+	build_table_offset = (HEADER_FIELDS * sizeof(unsigned long) + build_geometry.alignment - 1)
+						 / build_geometry.alignment * build_geometry.alignment;
 
 	//create new file
-	write_header(newPath, 0, /*truncate existing file*/ true);
+	output.open((newPath + "BTreeFile.txt").c_str(), fstream::out | fstream::trunc | fstream::binary);
 
+	//create the table recursively
 	if(HashFile::length() != 0)
-	{
-		//create the table recursively
-		createTableLine(newPath, string(""), line_cursor);
+		createTableLine(string(""), line_cursor, 0, HashFile::length() - 1);
+
+	//and finally write the table-size to the header
+	write_header(line_cursor);
+
+	output.flush();
+	output.close();
 
-		//and finally write the table-size to the first-line_cursor_stored
-		write_header(newPath, line_cursor, false);
-	}
 	//revert to initial path
 	HashFile::setPath(path);
 }
 
+// Try each candidate geometry on the HashFile at hand: build its table in a
+// scratch directory, over the same lines, and time the lookup of keys, taking
+// the best of TUNE_ROUNDS rounds. the fastest becomes the build geometry, and
+// is returned; nanosPerLookup gets every candidate's time
+
+BTreeGeometry BTreeFile::tuneGeometry(const vector<BTreeGeometry> &candidates, const vector<string> &keys,
+									  vector<double> &nanosPerLookup)
+{
+	typedef chrono::steady_clock Clock;
+
+	string scratch = path + "tune/";
+	unsigned long best = 0;
+
+	nanosPerLookup.assign(candidates.size(), 0);
+
+	if(candidates.empty() || keys.empty())
+		return build_geometry;
+
+	dir_delete(scratch);
+	mkdir(scratch.c_str(), 0777);
+
+	if(link((path + "HashFile.txt").c_str(), (scratch + "HashFile.txt").c_str()) != 0)
+		file_copy((path + "HashFile.txt").c_str(), (scratch + "HashFile.txt").c_str());
+
+	for(unsigned long c=0; c<candidates.size(); c++)
+	{
+		BTreeFile candidate(scratch, candidates[c]);
+		DigestArena arena;
+
+		candidate.setMapped(map_files);
+		candidate.buildIndex(scratch);
+		candidate.setPath(scratch);
+
+		for(unsigned int r=0; r<TUNE_ROUNDS; r++)
+		{
+			Clock::time_point start = Clock::now();
+
+			for(unsigned long i=0; i<keys.size(); i++)
+			{
+				ValueSet values(&arena);
+				candidate.get(keys[i], values);
+			}
+
+			double nanos = chrono::duration_cast<chrono::nanoseconds>(Clock::now() - start).count() / (double) keys.size();
+
+			if(r == 0 || nanos < nanosPerLookup[c])
+				nanosPerLookup[c] = nanos;
+		}
+
+		if(nanosPerLookup[c] < nanosPerLookup[best])
+			best = c;
+	}
+
+	dir_delete(scratch);
+	setGeometry(candidates[best]);
+
+	return candidates[best];
+}
+
+// tune on keys of the file itself, spread evenly over it and looked up in a
+// shuffled order
+
+void BTreeFile::tuneIndex(unsigned long lookups)
+{
+	unsigned long lines = HashFile::length();
+	vector<string> keys;
+	vector<double> nanos;
+
+	if(lines == 0 || lookups == 0)
+		return;
+
+	for(unsigned long i=0; i<lookups; i++)
+		keys.push_back(HashFile::getKeyAtIndex(i * lines / lookups));
+
+	shuffle(keys.begin(), keys.end(), minstd_rand(1));
+	tuneGeometry(candidateGeometries(), keys, nanos);
+}
+
+void BTreeFile::getLayout(IndexLayout &layout)
+{
+	HashFile::getLayout(layout);
+
+	layout.table_filename = filename;
+	layout.table_offset = _table_region_ptr;
+	layout.table_size = table_size;
+	layout.table_line_width = LINE_WIDTH;
+	layout.entry_width = ENTRY_WIDTH;
+	layout.mask_size = file_geometry.mask_size;
+	layout.num_width = file_geometry.num_width;
+}
 
 void BTreeFile::copyState(string dir_path)
 {
@@ -0,0 +1,114 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <stdlib.h>
+
+#include "utils.h"
+#include "annotations.h"
+
+using namespace std;
+
+// A long-running writer: every round flips a fixed number of random pairs from
+// a fixed universe, then commits. every key is read in before the first round,
+// so the memory maps are full from the start, and anything that still grows is
+// state carried over from one commit to the next. reports the resident set size
+// and the commit time as the rounds go by; both should stay flat
+
+typedef chrono::steady_clock Clock;
+
+const unsigned long UNIVERSE = 20000, CHANGES_PER_ROUND = 1000, REPORT_EVERY = 10;
+
+string random_key()
+{
+	const char *digits = "0123456789abcdef";
+	string key(SHA_WIDTH, '0');
+
+	for(unsigned int i=0; i<SHA_WIDTH; i++)
+		key[i] = digits[rand() % 16];
+
+	return key;
+}
+
+unsigned long resident_kb()
+{
+	fstream file("/proc/self/statm", fstream::in);
+	unsigned long size = 0, resident = 0;
+
+	file >> size >> resident;
+	return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+int main(int argc, char *argv[])
+{
+	string test_bed_directory("testbed");
+	string hashTableType("");
+	unsigned long rounds = 100;
+
+	if(argc < 2)
+	{
+		cout << "USAGE: [ROUNDS] [BTreeFile]" << endl;
+		return 0;
+	}
+
+	rounds = strtoul(argv[1], NULL, 10);
+
+	if(argc > 2)
+		hashTableType = string(argv[2]);
+
+	dir_delete(test_bed_directory);
+	srand(1);
+
+	vector<string> As, Cs;
+	vector<bool> bound(UNIVERSE, false);
+
+	for(unsigned long i=0; i<UNIVERSE; i++)
+	{
+		As.push_back(random_key());
+		Cs.push_back(random_key());
+	}
+
+	AnnotationSet *AS = new AnnotationSet(test_bed_directory, hashTableType);
+	AS->initialize();
+
+	for(unsigned long i=0; i<UNIVERSE; i++)
+	{
+		AS->list_entries(As[i]);
+		AS->list_annotations(Cs[i]);
+	}
+
+	Clock::duration commit_time = Clock::duration::zero();
+
+	for(unsigned long round=1; round<=rounds; round++)
+	{
+		for(unsigned long i=0; i<CHANGES_PER_ROUND; i++)
+		{
+			unsigned long n = rand() % UNIVERSE;
+
+			if(bound[n])
+				AS->unannotate_entry(As[n], Cs[n]);
+			else
+				AS->annotate_entry(As[n], Cs[n]);
+
+			bound[n] = !bound[n];
+		}
+
+		Clock::time_point start = Clock::now();
+		AS->commit_to_disk();
+		commit_time += Clock::now() - start;
+
+		if(round % REPORT_EVERY == 0)
+		{
+			cout << "round " << round << ": resident " << resident_kb() << " KB, commit "
+				 << chrono::duration_cast<chrono::microseconds>(commit_time).count() / REPORT_EVERY / 1000.0
+				 << " ms" << endl;
+
+			commit_time = Clock::duration::zero();
+		}
+	}
+
+	delete(AS);
+	dir_delete(test_bed_directory);
+
+	return 0;
+}
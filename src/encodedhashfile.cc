@@ -0,0 +1,593 @@
+#include "encodedhashfile.h"
+
+// lists are written as varints: seven bits to a byte, low bits first, with
+// the top bit set on every byte but the last. each ID is written as its gap
+// from the one before it
+
+static void append_varint(string &out, unsigned long value)
+{
+	while(value >= 0x80)
+	{
+		out += (char)((value & 0x7f) | 0x80);
+		value >>= 7;
+	}
+
+	out += (char) value;
+}
+
+static unsigned long read_varint(const char *&in)
+{
+	unsigned long value = 0;
+	int shift = 0;
+
+	while(*in & 0x80)
+	{
+		value |= (unsigned long)(*in++ & 0x7f) << shift;
+		shift += 7;
+	}
+
+	return value | (unsigned long)(*in++) << shift;
+}
+
+static void decode_list(const char *in, unsigned long count, vector<unsigned int> &ids)
+{
+	unsigned long id = 0;
+
+	ids.resize(count);
+
+	for(unsigned long i=0; i<count; i++)
+		ids[i] = id += read_varint(in);
+}
+
+// the first ID, from low on, whose digest does not sort before digest (or, if
+// strict, the first that sorts after it), in a dictionary of count digests
+
+static unsigned long dictionary_bound(const char *dictionary, unsigned long count, unsigned int bytes,
+									  const Digest &digest, unsigned long low, bool strict)
+{
+	unsigned long high = count, mid;
+
+	while(low < high)
+	{
+		mid = low + (high - low) / 2;
+		int cmp = memcmp(dictionary + mid * bytes, digest.bytes, bytes);
+
+		if(cmp < 0 || (strict && cmp == 0))
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	return low;
+}
+
+const char EncodedHashFile::empty_table[EncodedHashFile::TABLE_ENTRY_BYTES] = {0};
+
+EncodedHashFile::EncodedHashFile(string path) : HashFile()
+{
+	setPath(path);
+}
+
+void EncodedHashFile::setPath(string Path)
+{
+	path = Path;
+
+	HashFile::setPath(path);
+	load_tables();
+}
+
+// the header is "pairs key_width digests keys list_bytes". a file with none of
+// the counts past the width, as HashFileWriter leaves a new set's, is empty.
+// the dictionary and the table are mapped rather than read, so opening a file
+// costs nothing per key, and only the pages lookups touch are loaded
+
+void EncodedHashFile::load_tables()
+{
+	unsigned long pairs = 0, list_bytes = 0;
+	unsigned int width;
+	string header;
+
+	digest_bytes = keyWidth() / 2;
+	digests = keys = 0;
+
+	readBytes(0, lineOffset(0), header);
+
+	if(!(istringstream(header) >> pairs >> width >> digests >> keys >> list_bytes))
+		digests = keys = 0;
+
+	postings_offset = lineOffset(0) + digests * digest_bytes + (keys + 1) * TABLE_ENTRY_BYTES;
+
+	// a file cut short is read as empty, rather than past its end
+	if(!tables.open(path + "HashFile.txt") || tables.size() < postings_offset)
+	{
+		tables.close();
+		digests = keys = 0;
+		postings_offset = lineOffset(0) + TABLE_ENTRY_BYTES;
+		dictionary = table = empty_table;
+		return;
+	}
+
+	dictionary = tables.data() + lineOffset(0);
+	table = dictionary + digests * digest_bytes;
+}
+
+unsigned long EncodedHashFile::dictionarySize()
+{
+	return digests;
+}
+
+// the fields of the table entry of key k; k may be one past the keys
+
+unsigned int EncodedHashFile::key_id(unsigned long k)
+{
+	unsigned int id;
+
+	memcpy(&id, table + k * TABLE_ENTRY_BYTES, 4);
+	return id;
+}
+
+unsigned long EncodedHashFile::key_start(unsigned long k)
+{
+	unsigned long start;
+
+	memcpy(&start, table + k * TABLE_ENTRY_BYTES + 4, 8);
+	return start;
+}
+
+unsigned long EncodedHashFile::list_offset(unsigned long k)
+{
+	unsigned long offset;
+
+	memcpy(&offset, table + k * TABLE_ENTRY_BYTES + 12, 8);
+	return offset;
+}
+
+// the first table position whose key's ID is not below id
+
+unsigned long EncodedHashFile::id_position(unsigned long id)
+{
+	unsigned long low = 0, high = keys, mid;
+
+	while(low < high)
+	{
+		mid = low + (high - low) / 2;
+
+		if(key_id(mid) < id)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	return low;
+}
+
+// the first table position, up to the one past the keys, whose first pair
+// lies after index (or, if not strict, is not before it)
+
+unsigned long EncodedHashFile::start_position(unsigned long index, bool strict)
+{
+	unsigned long low = 0, high = keys + 1, mid;
+
+	while(low < high)
+	{
+		mid = low + (high - low) / 2;
+
+		if(key_start(mid) < index || (strict && key_start(mid) == index))
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	return low;
+}
+
+void EncodedHashFile::id_digest(unsigned int id, Digest &digest)
+{
+	memset(digest.bytes, 0, DIGEST_WIDTH);
+	memcpy(digest.bytes, dictionary + (unsigned long) id * digest_bytes, digest_bytes);
+}
+
+string EncodedHashFile::id_hex(unsigned int id)
+{
+	Digest digest;
+
+	id_digest(id, digest);
+	return convertDigestToHex(digest, keyWidth());
+}
+
+// the ID of a full-width key or value, if the file holds it
+
+bool EncodedHashFile::find_id(const string &hex, unsigned int &id)
+{
+	Digest digest;
+
+	if(hex.size() != keyWidth())
+		return false;
+
+	convertHexToDigest(digest, hex);
+	id = dictionary_bound(dictionary, digests, digest_bytes, digest, 0, false);
+
+	return(id < digests && memcmp(dictionary + (unsigned long) id * digest_bytes, digest.bytes, digest_bytes) == 0);
+}
+
+// the table position of key, if the file holds it
+
+bool EncodedHashFile::find_key(const string &key, unsigned long &k)
+{
+	unsigned int id;
+
+	if(!find_id(key, id))
+		return false;
+
+	k = id_position(id);
+	return(k < keys && key_id(k) == id);
+}
+
+// the first table position whose key does not sort before target (or, if
+// strict, the first that sorts after it), over target.size() hex digits, so
+// target may be a partial key. a full key is placed by its ID alone
+
+unsigned long EncodedHashFile::key_bound(const string &target, bool strict)
+{
+	unsigned long low = 0, high = keys, mid;
+
+	if(target.size() == keyWidth())
+	{
+		Digest digest;
+
+		convertHexToDigest(digest, target);
+		return id_position(dictionary_bound(dictionary, digests, digest_bytes, digest, 0, strict));
+	}
+
+	while(low < high)
+	{
+		mid = low + (high - low) / 2;
+		int cmp = id_hex(key_id(mid)).compare(0, target.size(), target);
+
+		if(cmp < 0 || (strict && cmp == 0))
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	return low;
+}
+
+void EncodedHashFile::read_list(unsigned long k, vector<unsigned int> &ids)
+{
+	string block;
+
+	readBytes(postings_offset + list_offset(k), list_offset(k + 1) - list_offset(k), block);
+	decode_list(block.data(), key_start(k + 1) - key_start(k), ids);
+	search_probes++;
+}
+
+void EncodedHashFile::get(string key, ValueSet &values)
+{
+	vector<unsigned int> ids;
+	unsigned long k;
+	Digest value;
+
+	if(!find_key(key, k))
+		return;
+
+	read_list(k, ids);
+
+	// IDs sort as their digests do, so the values append straight onto the set
+	for(unsigned long i=0; i<ids.size(); i++)
+	{
+		id_digest(ids[i], value);
+		values.appendSorted(value);
+	}
+}
+
+bool EncodedHashFile::has(string key, string value)
+{
+	vector<unsigned int> ids;
+	unsigned long k;
+	unsigned int id;
+
+	if(!find_key(key, k) || !find_id(value, id))
+		return false;
+
+	read_list(k, ids);
+	return binary_search(ids.begin(), ids.end(), id);
+}
+
+// the table holds where each key's pairs start, so no list is read
+
+unsigned long EncodedHashFile::count(string key)
+{
+	unsigned long k;
+
+	if(!find_key(key, k))
+		return 0;
+
+	return key_start(k + 1) - key_start(k);
+}
+
+bool EncodedHashFile::getKeyBounds(string key, unsigned long &begin, unsigned long &end)
+{
+	begin = key_start(key_bound(key, false));
+	end = key_start(key_bound(key, true));
+
+	return(begin < end);
+}
+
+unsigned long EncodedHashFile::lowerBound(string key)
+{
+	return key_start(key_bound(key, false));
+}
+
+void EncodedHashFile::getPage(string key, string after, unsigned long limit, vector<string> &values)
+{
+	vector<unsigned int> ids;
+	unsigned long k, i = 0, added = 0;
+	Digest digest;
+
+	if(limit == 0 || !find_key(key, k))
+		return;
+
+	read_list(k, ids);
+
+	// the cursor need not be in the dictionary; the page starts at the first ID
+	// that sorts after it
+	if(!after.empty())
+	{
+		convertHexToDigest(digest, after);
+		unsigned long first = dictionary_bound(dictionary, digests, digest_bytes, digest, 0, true);
+		i = lower_bound(ids.begin(), ids.end(), first) - ids.begin();
+	}
+
+	for(; i < ids.size() && added < limit; i++, added++)
+		values.push_back(id_hex(ids[i]));
+}
+
+// the candidates are turned into IDs, in order, and intersected with the
+// key's list as integers. a candidate not in the dictionary cannot be a value
+
+void EncodedHashFile::intersect(string key, vector<Digest> &candidates)
+{
+	vector<unsigned int> ids;
+	unsigned long k, id = 0, pos = 0, kept = 0;
+
+	if(!find_key(key, k))
+	{
+		candidates.clear();
+		return;
+	}
+
+	read_list(k, ids);
+
+	for(unsigned long i=0; i<candidates.size() && pos < ids.size(); i++)
+	{
+		id = dictionary_bound(dictionary, digests, digest_bytes, candidates[i], id, false);
+
+		if(id >= digests || memcmp(dictionary + id * digest_bytes, candidates[i].bytes, digest_bytes) != 0)
+			continue;
+
+		pos = lower_bound(ids.begin() + pos, ids.end(), (unsigned int) id) - ids.begin();
+
+		if(pos < ids.size() && ids[pos] == id)
+			candidates[kept++] = candidates[i];
+	}
+
+	candidates.resize(kept);
+}
+
+// the table is in memory, so a sweep needs no scan: each key's list is read in
+// turn, and the lists are read in the order they lie in the file
+
+void EncodedHashFile::sweep(const vector<string> &keys, function<void(const string &key, ValueSet &values)> callback)
+{
+	TRACE_SCOPE("EncodedHashFile::sweep");
+
+	DigestArena arena;
+
+	arena.setKeyWidth(keyWidth());
+	ValueSet values(&arena);
+
+	for(unsigned long i=0; i<keys.size(); i++)
+	{
+		values.clear();
+		get(keys[i], values);
+		callback(keys[i], values);
+	}
+}
+
+// a scan decodes the lists of the keys the lines fall in, read in one go, back
+// into the lines of a plain HashFile
+
+unsigned long EncodedHashFile::scanLines(int fd, unsigned long index, char *buffer, unsigned long lines)
+{
+	const unsigned int width = keyWidth(), line_width = 2 * width + 2;
+	unsigned long written = 0;
+	vector<unsigned int> ids;
+	string block, key;
+
+	if(index >= key_start(keys) || lines == 0)
+		return 0;
+
+	unsigned long first = start_position(index, true) - 1;
+	unsigned long last = min(start_position(index + lines, false), keys);
+
+	block.assign(list_offset(last) - list_offset(first), '\0');
+
+	if(pread(fd, &block[0], block.size(), postings_offset + list_offset(first)) != (long) block.size())
+		return 0;
+
+	for(unsigned long k=first; k<last && written < lines; k++)
+	{
+		decode_list(block.data() + list_offset(k) - list_offset(first), key_start(k + 1) - key_start(k), ids);
+		key = id_hex(key_id(k));
+
+		for(unsigned long i = (k == first ? index - key_start(k) : 0); i < ids.size() && written < lines; i++)
+		{
+			char *line = buffer + written * line_width;
+
+			memcpy(line, key.data(), width);
+			line[width] = ' ';
+			memcpy(line + width + 1, id_hex(ids[i]).data(), width);
+			line[line_width - 1] = '\n';
+			written++;
+		}
+	}
+
+	return written;
+}
+
+unsigned long EncodedHashFile::seekBound(string key, unsigned long from)
+{
+	return max(lowerBound(key), from);
+}
+
+// pairs are not at fixed offsets, so there is no layout to read directly; the
+// probe engine falls back to get()
+
+void EncodedHashFile::getLayout(IndexLayout &layout)
+{
+	HashFile::getLayout(layout);
+
+	layout.hash_filename = "";
+	layout.data_size = 0;
+}
+
+void EncodedHashFile::commit(string newPath, LogFile &log, bool reverseLog)
+{
+	TRACE_SCOPE("EncodedHashFile::commit");
+
+	HashFile::commit(newPath, log, reverseLog);
+	buildIndex(newPath);
+}
+
+// encode the plain HashFile written to newPath. one pass over it sorts every
+// key and value, within the commit memory limit, and writes them, once each,
+// to a dictionary file. a second pass looks each up there, through a mapping,
+// and writes the table and each key's list, as the IDs of its values, to files
+// of their own. the three then follow the header into the new HashFile.txt,
+// so memory use does not grow with the number of keys
+
+void EncodedHashFile::buildIndex(string newPath)
+{
+	TRACE_SCOPE("EncodedHashFile::buildIndex");
+
+	rename((newPath + "HashFile.txt").c_str(), (newPath + "dense-HashFile.txt").c_str());
+
+	HashFile *dense = new HashFile(newPath + "dense-");
+	const unsigned int width = dense->keyWidth(), bytes = width / 2;
+	unsigned long new_digests = 0, new_keys = 0, pairs = 0, offset = 0;
+	string list, header;
+	const char *line;
+	Digest digest;
+
+	{
+		ExternalSorter sorter(newPath + "dictionary-", width, commit_memory_limit);
+		HashFileScanner scanner(dense);
+		fstream dictionary_file((newPath + "dictionary-HashFile.txt").c_str(), fstream::out | fstream::trunc | fstream::binary);
+		const char *record, *previous = NULL;
+		char previous_record[MAX_KEY_WIDTH];
+
+		for(string key; (line = scanner.nextLine()) != NULL; )
+		{
+			if(key.compare(0, width, line, width) != 0)
+			{
+				key.assign(line, width);
+				sorter.add(line);
+			}
+
+			sorter.add(line + width + 1);
+		}
+
+		while((record = sorter.next()) != NULL)
+		{
+			if(previous != NULL && memcmp(previous, record, width) == 0)
+				continue;
+
+			convertHexToDigest(digest, string_view(record, width));
+			dictionary_file.write((const char *) digest.bytes, bytes);
+			new_digests++;
+
+			memcpy(previous_record, record, width);
+			previous = previous_record;
+		}
+
+		dictionary_file.close();
+	}
+
+	{
+		MappedFile dictionary_map;
+		HashFileScanner scanner(dense);
+		fstream lists((newPath + "lists-HashFile.txt").c_str(), fstream::out | fstream::trunc | fstream::binary);
+		fstream table_file((newPath + "table-HashFile.txt").c_str(), fstream::out | fstream::trunc | fstream::binary);
+		const char *new_dictionary = (dictionary_map.open(newPath + "dictionary-HashFile.txt") ? dictionary_map.data() : NULL);
+		unsigned long id, previous, key_id = 0;
+		char entry[TABLE_ENTRY_BYTES];
+
+		line = scanner.nextLine();
+
+		while(line != NULL)
+		{
+			string key(line, width);
+
+			// keys come in order too, so each is searched for from the last
+			convertHexToDigest(digest, key);
+			key_id = dictionary_bound(new_dictionary, new_digests, bytes, digest, key_id, false);
+			list.clear();
+			id = 0;
+
+			unsigned int entry_id = key_id;
+			memcpy(entry, &entry_id, 4);
+			memcpy(entry + 4, &pairs, 8);
+			memcpy(entry + 12, &offset, 8);
+			table_file.write(entry, TABLE_ENTRY_BYTES);
+			new_keys++;
+
+			// a key's values are sorted, so each is searched for from the last
+			for(; line != NULL && key.compare(0, width, line, width) == 0; line = scanner.nextLine(), pairs++)
+			{
+				previous = id;
+				convertHexToDigest(digest, string_view(line + width + 1, width));
+				id = dictionary_bound(new_dictionary, new_digests, bytes, digest, id, false);
+				append_varint(list, id - previous);
+			}
+
+			lists.write(list.data(), list.size());
+			offset += list.size();
+		}
+
+		// the entry one past the keys closes the last key's pairs and list
+		memset(entry, 0, 4);
+		memcpy(entry + 4, &pairs, 8);
+		memcpy(entry + 12, &offset, 8);
+		table_file.write(entry, TABLE_ENTRY_BYTES);
+
+		lists.close();
+		table_file.close();
+	}
+
+	header = to_string(pairs) + " " + to_string(width) + " " + to_string(new_digests) + " " +
+			 to_string(new_keys) + " " + to_string(offset) + "\n";
+
+	fstream output((newPath + "HashFile.txt").c_str(), fstream::out | fstream::trunc | fstream::binary);
+	string parts[] = { "dictionary-HashFile.txt", "table-HashFile.txt", "lists-HashFile.txt" };
+
+	output.write(header.data(), header.size());
+
+	// an empty part would set the output's failbit
+	for(unsigned int i=0; i<3; i++)
+	{
+		ifstream input((newPath + parts[i]).c_str(), fstream::in | fstream::binary);
+
+		if(input.peek() != EOF)
+			output << input.rdbuf();
+
+		input.close();
+		remove((newPath + parts[i]).c_str());
+	}
+
+	output.flush();
+	output.close();
+
+	delete(dense);
+	remove((newPath + "dense-HashFile.txt").c_str());
+}
@@ -0,0 +1,259 @@
+#include "extsort.h"
+#include <algorithm>
+#include <unistd.h>
+
+//////////////////////////////////// RunReader /////////////////////////////////
+
+RunReader::RunReader(string Filename, unsigned int recordWidth, unsigned long bufferBytes)
+{
+	filename = Filename;
+	record_width = recordWidth;
+	buffer_records = max(bufferBytes / record_width, 1ul);
+	buffer = new char[buffer_records * record_width];
+	buffered = pos = 0;
+
+	file.open(filename.c_str(), fstream::in | fstream::binary);
+	advance();
+}
+
+RunReader::~RunReader()
+{
+	file.close();
+	delete[] buffer;
+}
+
+const char *RunReader::current()
+{
+	return(pos < buffered ? buffer + pos * record_width : NULL);
+}
+
+// step to the next record, refilling the buffer when it runs out. returns
+// whether there is a current record afterwards
+
+bool RunReader::advance()
+{
+	if(buffered != 0)
+		pos++;
+
+	if(pos < buffered)
+		return true;
+
+	file.read(buffer, buffer_records * record_width);
+	buffered = file.gcount() / record_width;
+	pos = 0;
+
+	return(buffered != 0);
+}
+
+/////////////////////////////////// ExternalSorter /////////////////////////////
+
+class RecordLess
+{
+	public:
+		RecordLess(unsigned int width) : record_width(width) {}
+		bool operator()(const char *r1, const char *r2) const
+		{
+			return memcmp(r1, r2, record_width) < 0;
+		}
+	private:
+		unsigned int record_width;
+};
+
+// orders run indices for a min-heap over each run's current record
+
+class RunGreater
+{
+	public:
+		RunGreater(vector<RunReader*> *Readers, unsigned int width) : readers(Readers), record_width(width) {}
+		bool operator()(unsigned long r1, unsigned long r2) const
+		{
+			return memcmp((*readers)[r1]->current(), (*readers)[r2]->current(), record_width) > 0;
+		}
+	private:
+		vector<RunReader*> *readers;
+		unsigned int record_width;
+};
+
+// sort one full buffer and write it out as a run; runs on a worker thread,
+// which takes ownership of the buffer
+
+static void write_run(char *buf, unsigned long n, unsigned int width, string filename)
+{
+	vector<char*> order(n);
+
+	for(unsigned long i=0; i<n; i++)
+		order[i] = buf + i * width;
+
+	sort(order.begin(), order.end(), RecordLess(width));
+
+	const unsigned long OUT_RECORDS = 4096;
+	char *out = new char[OUT_RECORDS * width];
+	fstream file(filename.c_str(), fstream::out | fstream::trunc | fstream::binary);
+
+	for(unsigned long i=0; i<n; i += OUT_RECORDS)
+	{
+		unsigned long m = min(OUT_RECORDS, n - i);
+
+		for(unsigned long j=0; j<m; j++)
+			memcpy(out + j * width, order[i + j], width);
+
+		file.write(out, m * width);
+	}
+
+	file.close();
+	delete[] out;
+	delete[] buf;
+}
+
+ExternalSorter::ExternalSorter(string tmpPrefix, unsigned int recordWidth, unsigned long memoryLimit, unsigned int threads)
+{
+	tmp_prefix = tmpPrefix;
+	record_width = recordWidth;
+	memory_limit = memoryLimit;
+	max_threads = max(threads, 1u);
+
+	// one buffer filling plus one per in-flight worker, each record also costing
+	// a pointer while it is being sorted
+	buffer_records = memory_limit / ((max_threads + 1) * (record_width + sizeof(char*)));
+	buffer_records = max(buffer_records, 1024ul);
+
+	buffer = new char[buffer_records * record_width];
+	buffered = total_records = 0;
+
+	finished = in_memory = heap_primed = false;
+	memory_pos = 0;
+	last_run = -1;
+}
+
+ExternalSorter::~ExternalSorter()
+{
+	for(unsigned long i=0; i<workers.size(); i++)
+	{
+		workers[i]->join();
+		delete workers[i];
+	}
+
+	for(unsigned long i=0; i<readers.size(); i++)
+		delete readers[i];
+
+	for(unsigned long i=0; i<run_files.size(); i++)
+		unlink(run_files[i].c_str());
+
+	delete[] buffer;
+}
+
+unsigned long ExternalSorter::size()
+{
+	return total_records;
+}
+
+void ExternalSorter::add(const char *record)
+{
+	memcpy(buffer + buffered * record_width, record, record_width);
+	buffered++;
+	total_records++;
+
+	if(buffered == buffer_records)
+		spill();
+}
+
+// hand the current buffer to a worker thread, waiting for the oldest worker
+// first if all of them are busy
+
+void ExternalSorter::spill()
+{
+	if(workers.size() == max_threads)
+	{
+		workers[0]->join();
+		delete workers[0];
+		workers.erase(workers.begin());
+	}
+
+	string filename = tmp_prefix + "run-" + to_string(run_files.size()) + ".tmp";
+	run_files.push_back(filename);
+
+	workers.push_back(new thread(write_run, buffer, buffered, record_width, filename));
+
+	buffer = new char[buffer_records * record_width];
+	buffered = 0;
+}
+
+void ExternalSorter::finish()
+{
+	if(finished)
+		return;
+
+	finished = true;
+
+	// everything fit in memory: sort the buffer in place and serve from it
+	if(run_files.empty())
+	{
+		in_memory = true;
+		memory_order.resize(buffered);
+
+		for(unsigned long i=0; i<buffered; i++)
+			memory_order[i] = buffer + i * record_width;
+
+		sort(memory_order.begin(), memory_order.end(), RecordLess(record_width));
+		return;
+	}
+
+	if(buffered != 0)
+		spill();
+
+	for(unsigned long i=0; i<workers.size(); i++)
+	{
+		workers[i]->join();
+		delete workers[i];
+	}
+	workers.clear();
+
+	// all buffers have been released, so the whole budget goes to read-back
+	unsigned long reader_bytes = max(memory_limit / run_files.size(), 64ul * record_width);
+
+	for(unsigned long i=0; i<run_files.size(); i++)
+		readers.push_back(new RunReader(run_files[i], record_width, reader_bytes));
+}
+
+// returns the next record in sorted order, valid until the following call, or
+// NULL once all records have been returned
+
+const char *ExternalSorter::next()
+{
+	finish();
+
+	if(in_memory)
+		return(memory_pos < memory_order.size() ? memory_order[memory_pos++] : NULL);
+
+	RunGreater greater(&readers, record_width);
+
+	if(!heap_primed)
+	{
+		heap_primed = true;
+
+		for(unsigned long i=0; i<readers.size(); i++)
+			if(readers[i]->current() != NULL)
+				heap.push_back(i);
+
+		make_heap(heap.begin(), heap.end(), greater);
+	}
+
+	// the run that produced the previous record was kept off the heap until now,
+	// so that its record stayed valid for the caller
+	if(last_run != -1 && readers[last_run]->advance())
+	{
+		heap.push_back(last_run);
+		push_heap(heap.begin(), heap.end(), greater);
+	}
+
+	last_run = -1;
+
+	if(heap.empty())
+		return NULL;
+
+	pop_heap(heap.begin(), heap.end(), greater);
+	last_run = heap.back();
+	heap.pop_back();
+
+	return readers[last_run]->current();
+}
@@ -0,0 +1,571 @@
+#include "gappedhashfile.h"
+
+// pageLines: line slots per page. fillFactor: the share of them that pages
+// split from an overflowing one (or written by a build) are filled to. a file
+// already written keeps the geometry recorded in its table
+
+GappedHashFile::GappedHashFile(string path, unsigned int pageLines, double fillFactor) : HashFile()
+{
+	set_geometry(pageLines, (unsigned int)(pageLines * fillFactor));
+	pages_written = 0;
+	setPath(path);
+}
+
+void GappedHashFile::set_geometry(unsigned int pageLines, unsigned int fillLines)
+{
+	page_lines = max(pageLines, 2u);
+	fill_lines = min(max(fillLines, 1u), page_lines);
+}
+
+// the pages are kept in HashFile.txt, after its usual header, and the table in
+// GappedHashFile.txt
+
+void GappedHashFile::setPath(string Path)
+{
+	path = Path;
+
+	HashFile::setPath(path);
+
+	line_width = 2 * keyWidth() + 2;
+	fence_width = 2 * keyWidth() + 1;
+
+	load_table();
+}
+
+// the table is a header line, "pages page_lines fill_lines", then a line per
+// page: "slot count fence". a file with no table, as written by HashFileWriter,
+// reads as full pages in order
+
+void GappedHashFile::load_table()
+{
+	fstream table((path + "GappedHashFile.txt").c_str(), fstream::in);
+	string line, key, value, block;
+	unsigned long pages, slot, count;
+	unsigned int pageLines, fillLines;
+
+	page_slots.clear();
+	page_starts.assign(1, 0);
+	fences.clear();
+
+	if(getline(table, line) && (istringstream(line) >> pages >> pageLines >> fillLines))
+	{
+		set_geometry(pageLines, fillLines);
+
+		while(page_slots.size() < pages && getline(table, line))
+		{
+			istringstream entry(line);
+
+			if(!(entry >> slot >> count >> key >> value))
+				break;
+
+			page_slots.push_back(slot);
+			page_starts.push_back(page_starts.back() + count);
+			fences += key + " " + value;
+		}
+	}
+	else
+	{
+		for(slot = 0; slot * page_lines < HashFile::length(); slot++)
+		{
+			readLines(slot * page_lines, 1, block);
+
+			page_slots.push_back(slot);
+			page_starts.push_back(min(HashFile::length(), (slot + 1) * page_lines));
+			fences.append(block, 0, fence_width);
+		}
+	}
+
+	table.close();
+
+	// the slots the file has room for, counting any left by commits never published
+	struct stat st;
+	unsigned long page_bytes = (unsigned long) page_lines * line_width;
+
+	file_slots = 0;
+
+	if(stat((path + "HashFile.txt").c_str(), &st) == 0 && (unsigned long) st.st_size > lineOffset(0))
+		file_slots = (st.st_size - lineOffset(0) + page_bytes - 1) / page_bytes;
+}
+
+unsigned long GappedHashFile::pageCount()
+{
+	return page_slots.size();
+}
+
+// pages written by the last commit (or build), for benchmarking
+
+unsigned long GappedHashFile::pagesWritten()
+{
+	return pages_written;
+}
+
+void GappedHashFile::read_page(unsigned long page, string &block)
+{
+	readLines(page_slots[page] * page_lines, page_starts[page + 1] - page_starts[page], block);
+	search_probes++;
+}
+
+// whether the page's first line sorts before target (or, if strict, does not
+// sort after it), over the first target.size() characters
+
+bool GappedHashFile::fence_precedes(unsigned long page, const string &target, bool strict)
+{
+	int cmp = fences.compare(page * fence_width, target.size(), target);
+	return(cmp < 0 || (strict && cmp == 0));
+}
+
+// find the first line that does not sort before target (or, if strict, the first
+// that sorts after it): a search of the fences in memory picks the one page it
+// can be in, which is read into block. pos may be left just past the page's
+// end, when the line is the first of the next. returns false for an empty file
+
+bool GappedHashFile::locate(const string &target, bool strict, unsigned long &page, unsigned long &pos, string &block)
+{
+	unsigned long low = 0, high = page_slots.size(), mid, lines;
+
+	if(high == 0)
+		return false;
+
+	while(low < high)
+	{
+		mid = low + (high - low) / 2;
+
+		if(fence_precedes(mid, target, strict))
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	page = (low == 0 ? 0 : low - 1);
+	read_page(page, block);
+	lines = block.size() / line_width;
+
+	for(pos = 0; pos < lines; pos++)
+	{
+		int cmp = block.compare(pos * line_width, target.size(), target);
+
+		if(cmp > 0 || (cmp == 0 && !strict))
+			break;
+	}
+
+	return true;
+}
+
+// move on to the next page once pos is past the end of this one. returns
+// whether pos is at a line
+
+bool GappedHashFile::next_line(unsigned long &page, unsigned long &pos, string &block)
+{
+	if(pos < block.size() / line_width)
+		return true;
+
+	if(page + 1 >= page_slots.size())
+		return false;
+
+	read_page(++page, block);
+	pos = 0;
+
+	return true;
+}
+
+void GappedHashFile::get(string key, ValueSet &values)
+{
+	unsigned long page, pos;
+	string block;
+	Digest value;
+
+	if(!locate(key, false, page, pos, block))
+		return;
+
+	// entries are sorted by value within a key, so they append straight onto the set
+	for(; next_line(page, pos, block) && block.compare(pos * line_width, keyWidth(), key) == 0; pos++)
+	{
+		convertHexToDigest(value, string_view(block).substr(pos * line_width + keyWidth() + 1, keyWidth()));
+		values.appendSorted(value);
+	}
+}
+
+bool GappedHashFile::has(string key, string value)
+{
+	string target = key + " " + value, block;
+	unsigned long page, pos;
+
+	if(!locate(target, false, page, pos, block))
+		return false;
+
+	return(next_line(page, pos, block) && block.compare(pos * line_width, target.size(), target) == 0);
+}
+
+unsigned long GappedHashFile::count(string key)
+{
+	unsigned long begin, end;
+
+	if(!getKeyBounds(key, begin, end))
+		return 0;
+
+	return end - begin;
+}
+
+// line indices count the lines of the pages in order, leaving out the slack
+
+bool GappedHashFile::getKeyBounds(string key, unsigned long &begin, unsigned long &end)
+{
+	unsigned long page, pos;
+	string block;
+
+	begin = end = 0;
+
+	if(!locate(key, false, page, pos, block))
+		return false;
+
+	begin = page_starts[page] + pos;
+
+	locate(key, true, page, pos, block);
+	end = page_starts[page] + pos;
+
+	return(begin < end);
+}
+
+unsigned long GappedHashFile::lowerBound(string key)
+{
+	unsigned long page, pos;
+	string block;
+
+	if(!locate(key, false, page, pos, block))
+		return 0;
+
+	return page_starts[page] + pos;
+}
+
+void GappedHashFile::getPage(string key, string after, unsigned long limit, vector<string> &values)
+{
+	string target = (after.empty() ? key : key + " " + after), block;
+	unsigned long page, pos, added = 0;
+
+	if(limit == 0 || !locate(target, !after.empty(), page, pos, block))
+		return;
+
+	for(; added < limit && next_line(page, pos, block) && block.compare(pos * line_width, keyWidth(), key) == 0; pos++)
+	{
+		values.push_back(block.substr(pos * line_width + keyWidth() + 1, keyWidth()));
+		added++;
+	}
+}
+
+// the key's values are read in full, a page or two, and galloped through
+
+void GappedHashFile::intersect(string key, vector<Digest> &candidates)
+{
+	ValueSet values;
+	get(key, values);
+
+	DigestArrayAccessor at(values.begin());
+	gallopIntersect(candidates, at, values.size());
+}
+
+// a scan reads each page's lines, which lie back to back from its slot's start
+
+unsigned long GappedHashFile::scanExtent(unsigned long index, unsigned long &offset)
+{
+	offset = 0;
+
+	if(index >= page_starts.back())
+		return 0;
+
+	unsigned long page = upper_bound(page_starts.begin(), page_starts.end(), index) - page_starts.begin() - 1;
+
+	offset = lineOffset(page_slots[page] * page_lines + index - page_starts[page]);
+	return page_starts[page + 1] - index;
+}
+
+// a sweep skips a gap through the fences, reading only the page it lands in
+
+unsigned long GappedHashFile::seekBound(string key, unsigned long from)
+{
+	return max(lowerBound(key), from);
+}
+
+// lines are not at fixed offsets, so there is no layout to read directly; the
+// probe engine falls back to get()
+
+void GappedHashFile::getLayout(IndexLayout &layout)
+{
+	HashFile::getLayout(layout);
+
+	layout.hash_filename = "";
+	layout.data_size = 0;
+}
+
+// merge the sorted log into the pages it falls in, and write the new table to
+// newPath. pages no change falls in are kept where they are, and only the table
+// refers to them anew. the rewritten pages go on the end of the live file, so
+// the table alone is published, unless the commit compacts
+
+void GappedHashFile::commit(string newPath, LogFile &log, bool reverseLog)
+{
+	TRACE_SCOPE("GappedHashFile::commit");
+
+	ExternalSorter sorter(newPath + "commit-", 2 * keyWidth() + 1, commit_memory_limit);
+	sortLog(sorter, log, reverseLog);
+
+	unsigned long pages = page_slots.size();
+	bool compact = (file_slots >= MIN_COMPACT_SLOTS && file_slots > COMPACT_RATIO * pages);
+	const char *record = sorter.next();
+	string block;
+
+	open_output(newPath, compact);
+
+	for(unsigned long p=0; p<pages; p++)
+	{
+		// a page takes the changes that sort before the next page's fence
+		if(!compact && (record == NULL || (p + 1 < pages && !record_precedes_fence(record, p + 1))))
+		{
+			new_slots.push_back(page_slots[p]);
+			new_counts.push_back(page_starts[p + 1] - page_starts[p]);
+			new_fences.append(fences, p * fence_width, fence_width);
+			continue;
+		}
+
+		read_page(p, block);
+		merge_page(block, block.size() / line_width, sorter, record, p + 1);
+
+		// a compaction packs the pages into one run; otherwise each page's lines
+		// are redistributed over as few pages as they need
+		if(!compact)
+			finish_run();
+	}
+
+	if(pages == 0)
+		merge_page(block, 0, sorter, record, 0);
+
+	finish_run();
+	output.close();
+
+	write_table(newPath);
+}
+
+// whether the "key value cmd" record sorts before the page's fence
+
+bool GappedHashFile::record_precedes_fence(const char *record, unsigned long page)
+{
+	const char *fence = fences.data() + page * fence_width;
+	int cmp = memcmp(record, fence, keyWidth());
+
+	if(cmp == 0)
+		cmp = memcmp(record + keyWidth(), fence + keyWidth() + 1, keyWidth());
+
+	return(cmp < 0);
+}
+
+// merge the lines of a page with the records that sort before the fence of
+// end_page (or with all that remain, past the last page), as HashFile::merge_log
+// does, adding the result to the run
+
+void GappedHashFile::merge_page(const string &block, unsigned long lines, ExternalSorter &sorter, const char *&record,
+								unsigned long end_page)
+{
+	const unsigned int w = keyWidth();
+	char line[2 * MAX_KEY_WIDTH + 2];
+	unsigned long i = 0;
+
+	while(true)
+	{
+		bool in_page = (record != NULL && (end_page >= page_slots.size() || record_precedes_fence(record, end_page)));
+		const char *page_line = (i < lines ? block.data() + i * line_width : NULL);
+		int cmp;
+
+		if(page_line == NULL && !in_page)
+			break;
+
+		if(page_line == NULL)
+			cmp = 1;
+		else if(!in_page)
+			cmp = -1;
+		else
+		{
+			cmp = memcmp(page_line, record, w);
+			if(cmp == 0)
+				cmp = memcmp(page_line + w + 1, record + w, w);
+		}
+
+		if(cmp < 0)
+		{
+			add_line(page_line);
+			i++;
+		}
+		// a pair not on the page: added if annotated
+		else if(cmp > 0)
+		{
+			if(record[2 * w] == 'A')
+			{
+				memcpy(line, record, w);
+				line[w] = ' ';
+				memcpy(line + w + 1, record + w, w);
+				line[line_width - 1] = '\n';
+				add_line(line);
+			}
+			record = sorter.next();
+		}
+		// a pair on the page: dropped if unannotated
+		else
+		{
+			if(record[2 * w] == 'A')
+				add_line(page_line);
+
+			i++;
+			record = sorter.next();
+		}
+	}
+}
+
+// lines pile up in the run until they are written out as pages. a long run is
+// cut into filled pages as it grows, keeping enough back that its end can be
+// split evenly
+
+void GappedHashFile::add_line(const char *line)
+{
+	run.append(line, line_width);
+
+	if(run.size() >= 2ul * page_lines * line_width)
+	{
+		write_page(run.data(), fill_lines);
+		run.erase(0, (unsigned long) fill_lines * line_width);
+	}
+}
+
+// a run that fits in a page takes one page; a longer one is split evenly over
+// pages filled to the fill factor
+
+void GappedHashFile::finish_run()
+{
+	unsigned long lines = run.size() / line_width, pages, from = 0, to;
+
+	if(lines == 0)
+		return;
+
+	pages = (lines <= page_lines ? 1 : (lines + fill_lines - 1) / fill_lines);
+
+	for(unsigned long i=0; i<pages; i++, from = to)
+	{
+		to = lines * (i + 1) / pages;
+		write_page(run.data() + from * line_width, to - from);
+	}
+
+	run.clear();
+}
+
+// write lines to the next free slot, padding the rest of the page with blank lines
+
+void GappedHashFile::write_page(const char *lines, unsigned long count)
+{
+	string page(lines, count * line_width), blank(line_width - 1, ' ');
+
+	blank += "\n";
+
+	for(unsigned long i=count; i<page_lines; i++)
+		page += blank;
+
+	output.write(page.data(), page.size());
+
+	new_slots.push_back(output_slot++);
+	new_counts.push_back(count);
+	new_fences.append(lines, fence_width);
+	pages_written++;
+}
+
+// pages go on the end of the live file, past every slot in it, or into a fresh
+// file in newPath. a fresh file left in newPath by a commit never published
+// must not be published by this one
+
+void GappedHashFile::open_output(string newPath, bool fresh)
+{
+	new_slots.clear();
+	new_counts.clear();
+	new_fences.clear();
+	run.clear();
+	pages_written = 0;
+
+	remove((newPath + "HashFile.txt").c_str());
+	output.clear();
+
+	if(!fresh)
+	{
+		output.open((path + "HashFile.txt").c_str(), fstream::in | fstream::out | fstream::binary);
+		output_slot = file_slots;
+	}
+
+	if(!output.is_open())
+	{
+		output.clear();
+		HashFileWriter(newPath, keyWidth()).close();
+		output.open((newPath + "HashFile.txt").c_str(), fstream::in | fstream::out | fstream::binary);
+		output_slot = 0;
+	}
+
+	output.seekp(lineOffset(output_slot * page_lines));
+}
+
+void GappedHashFile::write_table(string newPath)
+{
+	fstream table((newPath + "GappedHashFile.txt").c_str(), fstream::out | fstream::trunc);
+	string lines = to_string(new_slots.size()) + " " + to_string(page_lines) + " " + to_string(fill_lines) + "\n";
+
+	for(unsigned long i=0; i<new_slots.size(); i++)
+	{
+		lines += to_string(new_slots[i]) + " " + to_string(new_counts[i]) + " ";
+		lines.append(new_fences, i * fence_width, fence_width);
+		lines += "\n";
+	}
+
+	table.write(lines.data(), lines.size());
+	table.flush();
+	table.close();
+}
+
+// turn the plain HashFile written to newPath into pages filled to the fill factor
+
+void GappedHashFile::buildIndex(string newPath)
+{
+	TRACE_SCOPE("GappedHashFile::buildIndex");
+
+	rename((newPath + "HashFile.txt").c_str(), (newPath + "dense-HashFile.txt").c_str());
+
+	{
+		HashFile dense(newPath + "dense-");
+		HashFileScanner scanner(&dense);
+		const char *line;
+
+		open_output(newPath, true);
+
+		while((line = scanner.nextLine()) != NULL)
+			add_line(line);
+
+		finish_run();
+		output.close();
+	}
+
+	remove((newPath + "dense-HashFile.txt").c_str());
+	write_table(newPath);
+}
+
+// pages are never written over, so a link to the file keeps every page the
+// copied table refers to, whatever later commits append
+
+void GappedHashFile::copyState(string dir_path)
+{
+	remove((dir_path + "GappedHashFile.txt").c_str());
+	remove((dir_path + "HashFile.txt").c_str());
+
+	file_copy((path + "GappedHashFile.txt").c_str(), (dir_path + "GappedHashFile.txt").c_str());
+
+	if(link((path + "HashFile.txt").c_str(), (dir_path + "HashFile.txt").c_str()) != 0)
+		file_copy((path + "HashFile.txt").c_str(), (dir_path + "HashFile.txt").c_str());
+}
+
+// the file is only in dir_path_init when it was written afresh
+
+void GappedHashFile::moveState(string dir_path_init, string dir_path_final)
+{
+	rename((dir_path_init + "GappedHashFile.txt").c_str(), (dir_path_final + "GappedHashFile.txt").c_str());
+	HashFile::moveState(dir_path_init, dir_path_final);
+}
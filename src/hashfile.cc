@@ -1,7 +1,15 @@
 #include "hashfile.h"
+#include <math.h>
 
 HashFile::HashFile(string path)
 {
+	commit_memory_limit = DEFAULT_COMMIT_MEMORY_LIMIT;
+	partition_bits = partition_index = 0;
+	search_mode = SEARCH_BINARY;
+	search_probes = 0;
+	map_files = false;
+	key_width = SHA_WIDTH;
+	line_width = 2 * SHA_WIDTH + 2;
 	setPath(path);
 }
 
@@ -18,22 +26,89 @@ void HashFile::setPath(string path)
 	if(file.is_open())
 		file.close();
 
+	mapping.close();
 	filename = path + "HashFile.txt";
 
-	file.open(filename.c_str(), fstream::in );
-
-	// read first line (encoding data size) and set _data_region_ptr
+	// read first line (encoding data size, then key width) and set _data_region_ptr.
+	// files written before the width was recorded hold SHA-1 keys. a mapped file
+	// is read from the mapping alone, so the header and the lines come from the
+	// same file even if another is renamed over it meanwhile
 
 	string line;
-	getline(file, line);	
-	data_size = atoi(line.c_str());
-	_data_region_ptr = file.tellg();
+	unsigned int width;
+	bool opened;
+
+	if(map_files && mapping.open(filename))
+	{
+		const char *end = (const char *) memchr(mapping.data(), '\n', mapping.size());
+
+		line.assign(mapping.data(), end != NULL ? end - mapping.data() : mapping.size());
+		_data_region_ptr = line.size() + 1;
+		opened = (end != NULL);
+	}
+	else
+	{
+		file.open(filename.c_str(), fstream::in );
+		getline(file, line);
+		_data_region_ptr = file.tellg();
+		opened = file.good();
+	}
+
+	istringstream header(line);
+	data_size = 0;
+
+	if(!(header >> data_size >> width))
+		width = SHA_WIDTH;
+
+	// a missing file keeps whatever width was asked for
+	if(opened && validKeyWidth(width))
+		setKeyWidth(width);
+}
+
+// switch between reading through a file stream and through a shared mapping,
+// reopening the current file. readers of files that are only ever replaced by
+// rename, never rewritten in place, can map them
+
+void HashFile::setMapped(bool mapped)
+{
+	map_files = mapped;
+	setPath(filename.substr(0, filename.size() - string("HashFile.txt").size()));
+}
+
+// the width of keys (and values) in hex digits. an existing file's header
+// overrides this when it is opened
+
+void HashFile::setKeyWidth(unsigned int width)
+{
+	key_width = width;
+	line_width = 2 * width + 2;
+}
+
+unsigned int HashFile::keyWidth()
+{
+	return key_width;
 }
 
 string HashFile::get_line_at_index(unsigned long index)
 {
 	string line;
-	file.seekg(_data_region_ptr + LINE_WIDTH * index);
+
+	if(mapping.data() != NULL)
+	{
+		unsigned long offset = _data_region_ptr + (unsigned long) line_width * index;
+
+		if(offset < mapping.size())
+		{
+			const char *begin = mapping.data() + offset;
+			const char *end = (const char *) memchr(begin, '\n', mapping.size() - offset);
+
+			line.assign(begin, end != NULL ? end - begin : mapping.size() - offset);
+		}
+
+		return line;
+	}
+
+	file.seekg(_data_region_ptr + line_width * index);
 	getline(file, line);
 	return line;
 }
@@ -41,13 +116,13 @@ string HashFile::get_line_at_index(unsigned long index)
 string HashFile::get_key_at_index(unsigned long index)
 {
 	string line = get_line_at_index(index);
-	return(line.substr(0,SHA_WIDTH));
+	return(line.substr(0, key_width));
 }
 
 string HashFile::get_val_at_index(unsigned long index)
 {
 	string line = get_line_at_index(index);
-	return(line.substr(SHA_WIDTH + 1,SHA_WIDTH));
+	return(line.substr(key_width + 1, key_width));
 }
 
 // mode -1: get index corresponding to beginning of this key entry
@@ -74,31 +149,541 @@ unsigned long HashFile::length()
 string HashFile::getKeyAtIndex(unsigned long index)
 {
 	string line = get_line_at_index(index);	
-	return(line.substr(0,SHA_WIDTH));
+	return(line.substr(0, key_width));
 }	
 
-// returns set of values for specified key; utilizes binary search
+// fills values with the set for specified key
 
-set<string> HashFile::get(string key)
+void HashFile::get(string key, ValueSet &values)
 {
-	return get(key, 0, data_size - 1);
+	get(key, 0, data_size - 1, values);
 }
 
 // this Protected function allows children objects to specify the beginning and 
 // ending indices to constrain the binary-search to
 
-set<string> HashFile::get(string key, unsigned long window_low, unsigned long window_high)
+void HashFile::get(string key, unsigned long window_low, unsigned long window_high, ValueSet &values)
 {
-	set<string> list;
-	unsigned long idx = getIndexOfKey(key, window_low, window_high);
+	Digest value;
 
+	if(data_size == 0)
+		return;
+
+	unsigned long idx = get_bound_index(key, window_low, window_high, false);
+
+	// entries are sorted by value within a key, so they append straight onto the set
 	while(idx < data_size && get_key_at_index(idx) == key)
 	{
-		list.insert(get_val_at_index(idx));
+		convertHexToDigest(value, get_val_at_index(idx));
+		values.appendSorted(value);
 		idx++;
 	}
+}
+
+// up to limit values of key that sort after `after` (from the first, if it is
+// empty), in order: one search for where the page starts, over the combined
+// "key value" prefix of each line, then reads of the lines that follow, a block
+// at a time until the key's lines end
+
+void HashFile::getPage(string key, string after, unsigned long limit, vector<string> &values)
+{
+	getPage(key, after, limit, 0, data_size - 1, values);
+}
+
+void HashFile::getPage(string key, string after, unsigned long limit, unsigned long window_low,
+					   unsigned long window_high, vector<string> &values)
+{
+	if(data_size == 0 || limit == 0)
+		return;
+
+	string target = (after.empty() ? key : key + " " + after), block;
+	unsigned long idx = get_bound_index(target, window_low, window_high, !after.empty());
+	unsigned long added = 0, count, i, block_lines = SEARCH_BLOCK_LINES;
+
+	for(; added < limit && idx <= window_high; idx += count, block_lines = min(2 * block_lines, (unsigned long) PAGE_BLOCK_LINES))
+	{
+		count = min(min(limit - added, window_high + 1 - idx), block_lines);
+		readLines(idx, count, block);
+
+		for(i = 0; i<count && block.compare(i * line_width, key_width, key) == 0; i++)
+			values.push_back(block.substr(i * line_width + key_width + 1, key_width));
+
+		added += i;
+
+		if(i < count)
+			break;
+	}
+}
+
+// read count lines, from index on, into block in one go
+
+void HashFile::readLines(unsigned long index, unsigned long count, string &block)
+{
+	readBytes(lineOffset(index), count * line_width, block);
+}
+
+// read size bytes of the file, from offset on, into block
+
+void HashFile::readBytes(unsigned long offset, unsigned long size, string &block)
+{
+	block.assign(size, '\0');
+
+	if(mapping.data() != NULL)
+		mapping.read(&block[0], offset, size);
+	else
+	{
+		file.seekg(offset);
+		file.read(&block[0], size);
+	}
+}
+
+// where the line at index starts in the file
+
+unsigned long HashFile::lineOffset(unsigned long index)
+{
+	return _data_region_ptr + (unsigned long) line_width * index;
+}
+
+// the lines from index on lie back to back, up to the end of the file. sets
+// offset to where the first starts, and returns how many there are
+
+unsigned long HashFile::scanExtent(unsigned long index, unsigned long &offset)
+{
+	offset = lineOffset(index);
+	return(index < data_size ? data_size - index : 0);
+}
+
+// fill buffer with up to `lines` lines, from index on, for a scanner reading
+// through fd, and have the kernel start on the lines after them while these are
+// consumed. returns how many were read
+
+unsigned long HashFile::scanLines(int fd, unsigned long index, char *buffer, unsigned long lines)
+{
+	unsigned long offset, extent = scanExtent(index, offset);
+	long n;
+
+	lines = min(extent, lines);
+
+	if(lines == 0)
+		return 0;
+
+	n = pread(fd, buffer, lines * line_width, offset);
+
+	if(n <= 0)
+		return 0;
+
+	if(extent > lines)
+		posix_fadvise(fd, offset + n, lines * line_width, POSIX_FADV_WILLNEED);
+
+	return n / line_width;
+}
+
+// returns whether the (key, value) pair is present, via a single binary search
+// over the combined "key value" prefix of each line
+
+bool HashFile::has(string key, string value)
+{
+	return has(key, value, 0, data_size - 1);
+}
+
+bool HashFile::has(string key, string value, unsigned long window_low, unsigned long window_high)
+{
+	if(data_size == 0)
+		return false;
+
+	string target = key + " " + value;
+	unsigned long idx = get_bound_index(target, window_low, window_high, false);
+
+	return(idx < data_size && get_line_at_index(idx).compare(0, target.size(), target) == 0);
+}
+
+// returns the number of values stored for specified key, as the width of its
+// run of lines; no values are read
+
+unsigned long HashFile::count(string key)
+{
+	unsigned long begin, end;
+
+	if(!getKeyBounds(key, begin, end))
+		return 0;
+
+	return end - begin;
+}
+
+// sets [begin, end) to the run of lines holding specified key, and returns
+// whether the key is present at all
+
+bool HashFile::getKeyBounds(string key, unsigned long &begin, unsigned long &end)
+{
+	return getKeyBounds(key, 0, data_size - 1, begin, end);
+}
+
+bool HashFile::getKeyBounds(string key, unsigned long window_low, unsigned long window_high,
+							unsigned long &begin, unsigned long &end)
+{
+	begin = end = 0;
+
+	if(data_size == 0)
+		return false;
+
+	begin = get_bound_index(key, window_low, window_high, false);
+
+	// runs are short, so under interpolation the end is found by galloping on
+	// from the beginning rather than by a second search of the window
+	if(search_mode == SEARCH_INTERPOLATION)
+		end = gallop_bound_index(key, begin, window_high, true);
+	else
+		end = get_bound_index(key, begin, window_high, true);
+
+	return(begin < end);
+}
+
+// reads the values of a run of lines by offset into the run, for galloping
+
+class HashFileValueAccessor
+{
+	public:
+		HashFileValueAccessor(HashFile *hashfile, unsigned long begin)
+		{
+			h = hashfile;
+			base = begin;
+		}
+
+		Digest operator()(unsigned long i)
+		{
+			Digest value;
+			convertHexToDigest(value, h->get_val_at_index(base + i));
+			return value;
+		}
+
+	private:
+		HashFile *h;
+		unsigned long base;
+};
+
+// keeps only those (sorted) candidates that are values of specified key. a run
+// that is short compared to the candidate list is streamed and merged, a long one
+// is galloped through so that most of it is never read
+
+void HashFile::intersect(string key, vector<Digest> &candidates)
+{
+	unsigned long begin, end;
+
+	if(!getKeyBounds(key, begin, end))
+	{
+		candidates.clear();
+		return;
+	}
+
+	if(end - begin > candidates.size() * GALLOP_RATIO)
+	{
+		HashFileValueAccessor at(this, begin);
+		gallopIntersect(candidates, at, end - begin);
+		return;
+	}
+
+	HashFileScanner scanner(this, begin);
+	string curr_key, curr_val;
+	Digest value;
+	unsigned long idx, c = 0, kept = 0;
+
+	for(idx = begin; idx < end && c < candidates.size() && scanner.next(curr_key, curr_val); idx++)
+	{
+		convertHexToDigest(value, curr_val);
+
+		while(c < candidates.size() && candidates[c] < value)
+			c++;
+
+		if(c < candidates.size() && candidates[c] == value)
+			candidates[kept++] = candidates[c++];
+	}
+
+	candidates.resize(kept);
+}
+
+// Resolve many keys in one pass: keys (sorted, without repeats) are merge-joined
+// with the lines through a single scanner, so the file is read in order, and
+// callback is handed each key's values in turn. a key whose lines lie within
+// the block already read is found by reading on; one further off is sought
+// with a search from the current line, so a dense batch reads the file
+// sequentially and a sparse one only the blocks it needs
+
+void HashFile::sweep(const vector<string> &keys, function<void(const string &key, ValueSet &values)> callback)
+{
+	TRACE_SCOPE("HashFile::sweep");
+
+	if(keys.empty())
+		return;
+
+	unsigned long pos = seekBound(keys[0], 0);
+	HashFileScanner scanner(this, pos, SWEEP_BLOCK_LINES);
+	const char *line = scanner.nextLine();
+	DigestArena arena;
+	Digest value;
+
+	arena.setKeyWidth(key_width);
+	ValueSet values(&arena);
+
+	for(unsigned long i=0; i<keys.size(); i++)
+	{
+		const string &key = keys[i];
+
+		// line is the one at pos, and every line before it sorts before key
+		for(; line != NULL && memcmp(line, key.data(), key_width) < 0 && scanner.bufferedLines() > 0; pos++)
+			line = scanner.nextLine();
+
+		if(line != NULL && memcmp(line, key.data(), key_width) < 0)
+		{
+			pos = max(seekBound(key, pos), pos);
+			scanner.seek(pos);
+			line = scanner.nextLine();
+		}
+
+		values.clear();
+
+		for(; line != NULL && memcmp(line, key.data(), key_width) == 0; pos++)
+		{
+			convertHexToDigest(value, string_view(line + key_width + 1, key_width));
+			values.appendSorted(value);
+			line = scanner.nextLine();
+		}
+
+		callback(key, values);
+	}
+}
+
+// the first index from `from` on whose line does not sort before key, for a
+// sweep. the file has no index, so the search gallops forward from `from`: the
+// cost grows with the distance, not the file
+
+unsigned long HashFile::seekBound(string key, unsigned long from)
+{
+	if(from >= data_size)
+		return data_size;
+
+	return gallop_bound_index(key, from, data_size - 1, false);
+}
+
+// returns the first index whose key does not sort before specified key, which
+// may be a partial (prefix) key
+
+unsigned long HashFile::lowerBound(string key)
+{
+	if(data_size == 0)
+		return 0;
+
+	return get_bound_index(key, 0, data_size - 1, false);
+}
+
+// returns the first index within [window_low, window_high + 1) whose line does not
+// sort before target, or if strict, the first whose line sorts after it. only the
+// first target.size() characters of each line take part in the comparison
+
+unsigned long HashFile::get_bound_index(string target, unsigned long window_low, unsigned long window_high, bool strict)
+{
+	if(window_high > data_size - 1)
+		window_high = data_size - 1;
+
+	// interpolation needs the key values at the window's edges; those are only
+	// known (as the ends of the key space) when the window is the whole file
+	if(search_mode == SEARCH_INTERPOLATION && window_low == 0 && window_high == data_size - 1)
+		return interpolate_bound_index(target, strict);
 
-	return list;
+	return bisect_bound_index(target, window_low, window_high + 1, strict);
+}
+
+// whether the line at index sorts before target (or, if strict, does not sort
+// after it); the line read is handed back through line when asked for
+
+bool HashFile::line_precedes(unsigned long index, const string &target, bool strict, string *line)
+{
+	string curr = get_line_at_index(index);
+	int cmp = curr.compare(0, target.size(), target);
+
+	search_probes++;
+
+	if(line != NULL)
+		line->swap(curr);
+
+	return(cmp < 0 || (strict && cmp == 0));
+}
+
+unsigned long HashFile::bisect_bound_index(string target, unsigned long low, unsigned long high, bool strict)
+{
+	unsigned long mid;
+
+	while(low < high && high - low > SEARCH_BLOCK_LINES)
+	{
+		mid = low + (high - low) / 2;
+
+		if(line_precedes(mid, target, strict))
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	return scan_bound_index(target, low, high, strict);
+}
+
+// finish a search whose window has narrowed to a block: read it in one go and
+// step through it, rather than probing lines one at a time
+
+unsigned long HashFile::scan_bound_index(string target, unsigned long low, unsigned long high, bool strict)
+{
+	if(low >= high)
+		return low;
+
+	string block;
+
+	readLines(low, high - low, block);
+	search_probes++;
+
+	for(unsigned long i=0; low + i < high; i++)
+	{
+		int cmp = block.compare(i * line_width, target.size(), target);
+
+		if(cmp > 0 || (cmp == 0 && !strict))
+			return low + i;
+	}
+
+	return high;
+}
+
+// the position of a key in the key space, from its leading 16 hex digits; a
+// partial key is padded out with pad
+
+static double key_position(const string &key, char pad)
+{
+	string digits = key.substr(0, min(key.size(), (size_t)16));
+	digits.append(16 - digits.size(), pad);
+
+	return (double) strtoull(digits.c_str(), NULL, 16);
+}
+
+// estimate target's line from where its value falls between the keys at either
+// end of the window, then probe a guard line sqrt(window) further on, which
+// usually brackets target in a window of that size. after INTERPOLATION_ROUNDS
+// rounds the rest is bisected, so a skewed file costs at most a few probes more
+// than a binary search
+
+unsigned long HashFile::interpolate_bound_index(string target, bool strict)
+{
+	unsigned long low = 0, high = data_size, mid, width, guard;
+	double key_low = 0, key_high = 18446744073709551616.0;
+	double key = key_position(target, strict ? 'f' : '0');
+	unsigned int rounds = 0;
+	bool bisect = false, precedes, in_run;
+
+	while(high - low > SEARCH_BLOCK_LINES)
+	{
+		width = high - low;
+
+		if(bisect || key_high <= key_low)
+			mid = low + width / 2;
+		else
+		{
+			double fraction = (key - key_low) / (key_high - key_low);
+			fraction = max(0.0, min(fraction, 1.0));
+			mid = low + min((unsigned long)(fraction * width), width - 1);
+		}
+
+		in_run = interpolation_probe(mid, target, strict, low, high, key_low, key_high, precedes);
+
+		if(!in_run && !bisect && high - low > SEARCH_BLOCK_LINES)
+		{
+			guard = (unsigned long) sqrt((double) width) + 1;
+
+			if(precedes && mid + guard < high)
+				in_run = interpolation_probe(mid + guard, target, strict, low, high, key_low, key_high, precedes);
+			else if(!precedes && mid >= low + guard)
+				in_run = interpolation_probe(mid - guard, target, strict, low, high, key_low, key_high, precedes);
+		}
+
+		// having landed in target's own run, the bound is only a few lines away
+		// on the side the window just shrank towards
+		if(in_run && low < high)
+			return(precedes ? gallop_bound_index(target, low, high - 1, strict)
+							: gallop_back_bound_index(target, low, high, strict));
+
+		bisect = (++rounds >= INTERPOLATION_ROUNDS);
+	}
+
+	return scan_bound_index(target, low, high, strict);
+}
+
+// probe one line for interpolate_bound_index, narrowing [low, high) and noting
+// the key values at its edges. returns whether the line is in target's own run
+
+bool HashFile::interpolation_probe(unsigned long index, const string &target, bool strict, unsigned long &low,
+								   unsigned long &high, double &key_low, double &key_high, bool &precedes)
+{
+	string line;
+
+	precedes = line_precedes(index, target, strict, &line);
+
+	if(precedes)
+	{
+		low = index + 1;
+		key_low = key_position(line, '0');
+	}
+	else
+	{
+		high = index;
+		key_high = key_position(line, '0');
+	}
+
+	return(line.compare(0, min(target.size(), (size_t)key_width), target, 0, key_width) == 0);
+}
+
+// the mirror image of gallop_bound_index: search back from index to (at least)
+// low, for the first line that does not precede target
+
+unsigned long HashFile::gallop_back_bound_index(string target, unsigned long low, unsigned long index, bool strict)
+{
+	unsigned long high = index, step = SEARCH_BLOCK_LINES;
+
+	while(high >= low + step)
+	{
+		unsigned long idx = high - step;
+
+		if(line_precedes(idx, target, strict))
+		{
+			low = idx + 1;
+			break;
+		}
+
+		high = idx;
+		step *= 2;
+	}
+
+	return bisect_bound_index(target, low, high, strict);
+}
+
+// search forward from index from, in steps doubling in size (from one block)
+// until one lands on a line that does not precede target, then bisect the last step
+
+unsigned long HashFile::gallop_bound_index(string target, unsigned long from, unsigned long window_high, bool strict)
+{
+	if(window_high > data_size - 1)
+		window_high = data_size - 1;
+
+	unsigned long low = from, high = window_high + 1, step = SEARCH_BLOCK_LINES;
+
+	while(low + step - 1 <= window_high)
+	{
+		unsigned long idx = low + step - 1;
+
+		if(!line_precedes(idx, target, strict))
+		{
+			high = idx;
+			break;
+		}
+
+		low = idx + 1;
+		step *= 2;
+	}
+
+	return bisect_bound_index(target, low, high, strict);
 }
 
 unsigned long HashFile::getIndexOfKey(string key)
@@ -166,102 +751,314 @@ void HashFile::moveState(string dir_path_init, string dir_path_final)
 }
 
 // perform a merge-sort of the HashFile and a compacted LogFile
-// and use the appropriate logic for annotation / unannotations
+// and use the appropriate logic for annotation / unannotations.
+// the log is sorted externally, within commit_memory_limit, and merged with
+// the existing file in one sequential pass using buffered reads and writes
 void HashFile::commit(string newPath, LogFile &log, bool reverseLog = false)
 {
-	vector<Log::command> logEntries = log.readEntries();	
-	unsigned long entriesDeleted = 0;
+	TRACE_SCOPE("HashFile::commit");
+
+	ExternalSorter sorter(newPath + "commit-", 2 * key_width + 1, commit_memory_limit);
+	sortLog(sorter, log, reverseLog);
+
+	HashFileScanner scanner(this);
+	HashFileWriter writer(newPath, key_width);
 
-	if(!reverseLog)
-		sort(logEntries.begin(), logEntries.end(), Log::sortA);
+	if(key_width == SHA256_WIDTH)
+		merge_log<Sha256Key>(sorter, scanner, writer);
 	else
-		sort(logEntries.begin(), logEntries.end(), Log::sortC);
-						
-	unsigned long hashIdx = 0, logIdx = 0;
-	string hashLine, key, val, logLine, logFirst, logSecond;
-	vector<string> commit_lines;
+		merge_log<Sha1Key>(sorter, scanner, writer);
 
-	string newFilename = newPath + "HashFile.txt";
-	fstream newFile(newFilename.c_str(), fstream::out | fstream::trunc);
+	writer.close();
+}
 
-	string blank(LINE_WIDTH - 1, ' ');
-	blank += "\n";
-	newFile.write(blank.c_str(), blank.size());
+// feed the log's changes to this file into sorter, as "key value cmd" records
+// with no separators, keyed by A (or by C, when reverseLog)
 
-	while(hashIdx < data_size || logIdx < logEntries.size())
-	{
-		if(hashIdx < data_size)
-		{
-			hashLine = get_line_at_index(hashIdx) + "\n";
-			key = get_key_at_index(hashIdx);
-			val = get_val_at_index(hashIdx);
-		}
+void HashFile::sortLog(ExternalSorter &sorter, LogFile &log, bool reverseLog)
+{
+	const int KEY = 0, VAL = key_width, CMD = 2 * key_width;
 
-		if(logIdx < logEntries.size())
-		{
-			logFirst = logEntries[logIdx].A;
-			logSecond = logEntries[logIdx].C;
-	
-			if(reverseLog)	
-				swapString(logFirst, logSecond);
+	LogFileReader reader(log);
+	Log::command entry;
+	char record[2 * MAX_KEY_WIDTH + 1];
 
-			logLine = logFirst + " " + logSecond + "\n";
-		}
+	while(reader.next(entry))
+	{
+		const string &first = (reverseLog ? entry.C : entry.A);
+		const string &second = (reverseLog ? entry.A : entry.C);
 
-		// we have finished writing from hash-file; simply flush remaining log file	
-		if(hashIdx == data_size)
-		{
-			newFile.write(logLine.c_str(), logLine.size());
-			logIdx++;
-			continue;
-		}	
-		// we have finished writing log file; simply flush remaining hash-file
-		if(logIdx == logEntries.size())
-		{
-			newFile.write(hashLine.c_str(), hashLine.size());
-			hashIdx++;
+		// a sharded log also carries pairs whose other side lives here
+		if(convertKeyToShard(first, partition_bits) != partition_index)
 			continue;
-		}
 
-		// if we have matching entries between hashfile & logfile,
-		// at the very least we need to increment BOTH indices.
-		// futhermore if the log is 'U', we skip writing anything to disk
-		if( key == logFirst && val == logSecond)
-		{
-			entriesDeleted++;
+		memcpy(record + KEY, first.c_str(), key_width);
+		memcpy(record + VAL, second.c_str(), key_width);
+		record[CMD] = (char) entry.cmd;
+		sorter.add(record);
+	}
+}
 
-			if(logEntries[logIdx].cmd == "A")
-				newFile.write(hashLine.c_str(), hashLine.size());
-			else
-				entriesDeleted++;
+// the merge itself, instantiated per key width: records are "key value cmd"
+// with no separators, lines are "key value\n"
 
-			hashIdx++;
-			logIdx++;
+template <class Key>
+void HashFile::merge_log(ExternalSorter &sorter, HashFileScanner &scanner, HashFileWriter &writer)
+{
+	const int KEY = 0, VAL = Key::KEY_WIDTH, CMD = 2 * Key::KEY_WIDTH;
 
-			continue;
+	const char *hashLine = scanner.nextLine();
+	const char *logRecord = sorter.next();
+
+	while(hashLine != NULL || logRecord != NULL)
+	{
+		int cmp;
+
+		// once either side runs out, simply flush the remainder of the other
+		if(hashLine == NULL)
+			cmp = 1;
+		else if(logRecord == NULL)
+			cmp = -1;
+		else
+		{
+			cmp = Key::compare(hashLine, logRecord + KEY);
+			if(cmp == 0)
+				cmp = Key::compare(hashLine + Key::KEY_WIDTH + 1, logRecord + VAL);
 		}
-		// if the hashfile has a smaller value than the logfile,
+
+		// the hashfile has a smaller value than the logfile;
 		// write hashline to disk and increment hash pointer
-		if( key < logFirst || key == logFirst && val < logSecond )
+		if(cmp < 0)
 		{
-			newFile.write(hashLine.c_str(), hashLine.size());
-			hashIdx++;
-			continue;
+			writer.append(hashLine, hashLine + Key::KEY_WIDTH + 1);
+			hashLine = scanner.nextLine();
 		}
-		else // else do the equivalent for logfile
+		// the logfile has a smaller value: an annotation of a new pair.
+		else if(cmp > 0)
 		{
-			newFile.write(logLine.c_str(), logLine.size());
-			logIdx++;
+			if(logRecord[CMD] == 'A')
+				writer.append(logRecord + KEY, logRecord + VAL);
+			logRecord = sorter.next();
+		}
+		// if we have matching entries between hashfile & logfile,
+		// at the very least we need to advance BOTH sides.
+		// futhermore if the log is 'U', we skip writing anything to disk
+		else
+		{
+			if(logRecord[CMD] == 'A')
+				writer.append(hashLine, hashLine + Key::KEY_WIDTH + 1);
+
+			hashLine = scanner.nextLine();
+			logRecord = sorter.next();
 		}
 	}
-	
-	stringstream ss;
-    ss << data_size + logEntries.size() - entriesDeleted;
-    string length = ss.str();
+}
+
+void HashFile::setCommitMemoryLimit(unsigned long bytes)
+{
+	commit_memory_limit = bytes;
+}
+
+// restrict this file to the keys of one shard: keys whose leading `bits` bits
+// equal index. log entries for other keys are ignored on commit
+
+void HashFile::setPartition(unsigned int bits, unsigned int index)
+{
+	partition_bits = bits;
+	partition_index = index;
+}
+
+// applies to searches over the whole file; windows handed down by a subclass
+// (such as a BTreeFile trie) are always bisected
+
+void HashFile::setSearchMode(SearchMode mode)
+{
+	search_mode = mode;
+}
+
+// layouts with settings of their own try them out on the file, and keep the
+// fastest for later builds; a plain HashFile has nothing to tune
+
+void HashFile::tuneIndex(unsigned long lookups)
+{
+}
+
+unsigned long HashFile::searchProbes()
+{
+	return search_probes;
+}
+
+void HashFile::getLayout(IndexLayout &layout)
+{
+	layout.hash_filename = filename;
+	layout.data_offset = _data_region_ptr;
+	layout.data_size = data_size;
+	layout.line_width = line_width;
+	layout.key_width = key_width;
+
+	layout.table_filename = "";
+	layout.table_offset = layout.table_size = 0;
+	layout.table_line_width = layout.entry_width = layout.mask_size = layout.num_width = 0;
+}
+
+// a plain HashFile has no secondary index to build over a freshly written file
+
+void HashFile::buildIndex(string newPath)
+{
+}
+
+/////////////////////////////// HashFileScanner ////////////////////////////////
+
+HashFileScanner::HashFileScanner(HashFile *hashFile, unsigned long start_index, unsigned long blockLines)
+{
+	hashfile = hashFile;
+	index = start_index;
+	key_width = hashfile->key_width;
+	line_width = hashfile->line_width;
+	buffered = buffer_pos = 0;
+	block_lines = blockLines;
+	buffer = new char[block_lines * line_width];
+
+	// a mapped file may have been renamed over since; read the one it maps
+	if(hashfile->mapping.descriptor() >= 0)
+		fd = dup(hashfile->mapping.descriptor());
+	else
+		fd = open(hashfile->filename.c_str(), O_RDONLY);
+
+	// the kernel reads ahead further on a file marked sequential
+	if(fd >= 0)
+		posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+}
+
+HashFileScanner::~HashFileScanner()
+{
+	if(fd >= 0)
+		close(fd);
+
+	delete[] buffer;
+}
+
+// read the next block of lines into the buffer
+
+bool HashFileScanner::fill()
+{
+	if(fd < 0)
+		return false;
+
+	buffered = hashfile->scanLines(fd, index, buffer, block_lines);
+	buffer_pos = 0;
+
+	return(buffered != 0);
+}
 
-	newFile.seekp(0);
-	newFile.write(length.c_str(), length.size());
+// returns the next raw line (key at offset 0, value at key width + 1), valid
+// until the following call, or NULL at the end of the file
 
-	newFile.flush();
-	newFile.close();
+const char *HashFileScanner::nextLine()
+{
+	if(buffer_pos == buffered && !fill())
+		return NULL;
+
+	char *line = buffer + buffer_pos * line_width;
+
+	buffer_pos++;
+	index++;
+	return line;
+}
+
+// move to the line at index: within the buffer if it holds the line, otherwise
+// by reading afresh from there
+
+void HashFileScanner::seek(unsigned long target)
+{
+	if(target >= index && target - index < buffered - buffer_pos)
+		buffer_pos += target - index;
+	else
+		buffered = buffer_pos = 0;
+
+	index = target;
+}
+
+// lines already read that nextLine() will return before reading again
+
+unsigned long HashFileScanner::bufferedLines()
+{
+	return buffered - buffer_pos;
+}
+
+bool HashFileScanner::next(string &key, string &value)
+{
+	const char *line = nextLine();
+
+	if(line == NULL)
+		return false;
+
+	key.assign(line, key_width);
+	value.assign(line + key_width + 1, key_width);
+	return true;
+}
+
+//////////////////////////////// HashFileWriter ////////////////////////////////
+
+HashFileWriter::HashFileWriter(string newPath, unsigned int keyWidth)
+{
+	key_width = keyWidth;
+	line_width = 2 * key_width + 2;
+	buffer = new char[WRITE_BLOCK_LINES * line_width];
+	buffered = lines = 0;
+
+	file.open((newPath + "HashFile.txt").c_str(), fstream::out | fstream::trunc | fstream::binary);
+
+	// reserve the header line; it is written over on close
+	string blank(line_width - 1, ' ');
+	blank += "\n";
+	file.write(blank.c_str(), blank.size());
+}
+
+HashFileWriter::~HashFileWriter()
+{
+	close();
+	delete[] buffer;
+}
+
+void HashFileWriter::append(const char *key, const char *value)
+{
+	char *line = buffer + buffered * line_width;
+
+	memcpy(line, key, key_width);
+	line[key_width] = ' ';
+	memcpy(line + key_width + 1, value, key_width);
+	line[line_width - 1] = '\n';
+
+	buffered++;
+	lines++;
+
+	if(buffered == WRITE_BLOCK_LINES)
+		flush();
+}
+
+void HashFileWriter::flush()
+{
+	file.write(buffer, buffered * line_width);
+	buffered = 0;
+}
+
+unsigned long HashFileWriter::length()
+{
+	return lines;
+}
+
+void HashFileWriter::close()
+{
+	if(!file.is_open())
+		return;
+
+	flush();
+
+	string header = to_string(lines) + " " + to_string(key_width);
+	file.seekp(0);
+	file.write(header.c_str(), header.size());
+
+	file.flush();
+	file.close();
 }
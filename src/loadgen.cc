@@ -0,0 +1,130 @@
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <stdlib.h>
+
+#include "server.h"
+
+using namespace std;
+
+// Load generator for annotationd. each connection, on a thread of its own,
+// sends its requests in pipelined batches of DEPTH: it queues a batch, flushes
+// it in one write, then reads the batch's responses. a request's latency runs
+// from its batch being flushed to its response arriving. WRITE PERCENT of the
+// requests annotate a random pair; the rest list the entries of a key written
+// before, or, at first, of a random one
+
+typedef chrono::steady_clock Clock;
+
+string random_key(unsigned int width, unsigned int &seed)
+{
+	const char *digits = "0123456789abcdef";
+	string key(width, '0');
+
+	for(unsigned int i=0; i<width; i++)
+		key[i] = digits[rand_r(&seed) % 16];
+
+	return key;
+}
+
+void run_connection(string socket_path, unsigned long requests, unsigned int depth, unsigned int write_percent,
+					unsigned int seed, vector<double> &latencies, bool &ok)
+{
+	AnnotationClient client(socket_path);
+	vector<string> written;
+	ServerResponse response;
+
+	ok = client.connected();
+
+	for(unsigned long sent = 0; ok && sent < requests; )
+	{
+		unsigned long batch = min((unsigned long) depth, requests - sent);
+
+		for(unsigned long i=0; i<batch; i++)
+		{
+			if((unsigned int)(rand_r(&seed) % 100) < write_percent)
+			{
+				written.push_back(random_key(client.keyWidth(), seed));
+				client.queue(SERVER_ANNOTATE, written.back(), random_key(client.keyWidth(), seed));
+			}
+			else if(!written.empty())
+				client.queue(SERVER_LIST_ENTRIES, written[rand_r(&seed) % written.size()]);
+			else
+				client.queue(SERVER_LIST_ENTRIES, random_key(client.keyWidth(), seed));
+		}
+
+		Clock::time_point start = Clock::now();
+		ok = client.flush();
+
+		for(unsigned long i=0; ok && i<batch; i++)
+		{
+			ok = (client.receive(response) && response.status == SERVER_OK);
+			latencies.push_back(chrono::duration_cast<chrono::nanoseconds>(Clock::now() - start).count() / 1000.0);
+		}
+
+		sent += batch;
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	if(argc < 2)
+	{
+		cout << "USAGE: [SOCKET PATH] [optional: CONNECTIONS] [optional: REQUESTS PER CONNECTION] "
+			 << "[optional: DEPTH] [optional: WRITE PERCENT]" << endl;
+		return 0;
+	}
+
+	string socket_path(argv[1]);
+	unsigned int connections = (argc > 2 ? atoi(argv[2]) : 4);
+	unsigned long requests = (argc > 3 ? strtoul(argv[3], NULL, 10) : 100000);
+	unsigned int depth = max(argc > 4 ? atoi(argv[4]) : 32, 1);
+	unsigned int write_percent = (argc > 5 ? atoi(argv[5]) : 10);
+
+	vector<vector<double> > latencies(connections);
+	vector<thread*> threads;
+	bool *ok = new bool[connections];
+
+	Clock::time_point start = Clock::now();
+
+	for(unsigned int i=0; i<connections; i++)
+		threads.push_back(new thread(run_connection, socket_path, requests, depth, write_percent, i + 1,
+									 ref(latencies[i]), ref(ok[i])));
+
+	for(unsigned int i=0; i<connections; i++)
+	{
+		threads[i]->join();
+		delete(threads[i]);
+	}
+
+	double seconds = chrono::duration_cast<chrono::microseconds>(Clock::now() - start).count() / 1e6;
+	vector<double> all;
+
+	for(unsigned int i=0; i<connections; i++)
+	{
+		if(!ok[i])
+			cout << "connection " << i << " failed" << endl;
+
+		all.insert(all.end(), latencies[i].begin(), latencies[i].end());
+	}
+
+	delete[] ok;
+
+	if(all.empty())
+		return 1;
+
+	sort(all.begin(), all.end());
+
+	cout << fixed << setprecision(1)
+		 << all.size() << " requests over " << connections << " connections, depth " << depth
+		 << ", " << write_percent << "% writes" << endl
+		 << "throughput " << all.size() / seconds << " requests/s" << endl
+		 << "latency (us): p50 " << all[all.size() / 2] << ", p90 " << all[all.size() * 9 / 10]
+		 << ", p99 " << all[all.size() * 99 / 100] << ", max " << all.back() << endl;
+
+	return 0;
+}
@@ -19,13 +19,19 @@ namespace Log
 	}
 };
 
-LogFile::LogFile(std::string path)
+LogFile::LogFile(std::string path) : fd(-1)
 {
 	setPath(path);
 }
 
+LogFile::~LogFile()
+{
+	close();
+}
+
 void LogFile::setPath(string path)
 {
+	close();
 	filename = path + "log.txt";
 }
 
@@ -34,20 +40,54 @@ string LogFile::getFilename()
 	return filename;
 }
 
+// the file must be closed before it is renamed or replaced, or later entries
+// would go to the old one. the next entry reopens it
+
+void LogFile::close()
+{
+	if(fd < 0)
+		return;
+
+	::close(fd);
+	fd = -1;
+}
+
 void LogFile::clear()
 {
+	close();
 	unlink(filename.c_str());
 }
 
-void LogFile::addEntry(string cmd, string A, string C)
+// each entry is built on the stack and handed to the OS in a single write, so
+// it is as durable as the flushed stream it replaces, without allocating
+
+void LogFile::addEntry(Log::Op cmd, string_view A, string_view C)
 {
-	file.open(filename.c_str(), fstream::out | fstream::app);
+	char line[2 * MAX_KEY_WIDTH + 4];
+	unsigned long size = 0;
+	unsigned long A_size = min(A.size(), (size_t)MAX_KEY_WIDTH), C_size = min(C.size(), (size_t)MAX_KEY_WIDTH);
+
+	if(fd < 0)
+		fd = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0666);
+
+	line[size++] = (char) cmd;
+	line[size++] = ' ';
+	memcpy(line + size, A.data(), A_size);
+	size += A_size;
+	line[size++] = ' ';
+	memcpy(line + size, C.data(), C_size);
+	size += C_size;
+	line[size++] = '\n';
+
+	for(unsigned long written = 0; written < size; )
+	{
+		long n = write(fd, line + written, size - written);
 
-	string line = cmd + " " + A + " " + C + "\n";
+		if(n <= 0)
+			break;
 
-	file.write(line.c_str(), line.size());
-	file.flush();
-	file.close();
+		written += n;
+	}
 }
 
 vector<Log::command> LogFile::readEntries() 
@@ -61,9 +101,12 @@ vector<Log::command> LogFile::readEntries()
 	{	
 		Log::command entry;
 
-		entry.cmd = line.substr(0, 1);
-		entry.A = line.substr(2, SHA_WIDTH);
-		entry.C = line.substr(SHA_WIDTH + 3, SHA_WIDTH);
+		// "cmd A C", where A and C share one width
+		unsigned int width = (line.size() - 3) / 2;
+
+		entry.cmd = (Log::Op) line[0];
+		entry.A = line.substr(2, width);
+		entry.C = line.substr(width + 3, width);
 		
 		log.push_back(entry);
 	}
@@ -71,4 +114,31 @@ vector<Log::command> LogFile::readEntries()
 	file.close();
 
 	return log;
-}
\ No newline at end of file
+}
+
+LogFileReader::LogFileReader(LogFile &log)
+{
+	buffer = new char[READ_BUFFER_SIZE];
+	file.rdbuf()->pubsetbuf(buffer, READ_BUFFER_SIZE);
+	file.open(log.getFilename().c_str(), fstream::in);
+}
+
+LogFileReader::~LogFileReader()
+{
+	file.close();
+	delete[] buffer;
+}
+
+bool LogFileReader::next(Log::command &entry)
+{
+	if(!getline(file, line))
+		return false;
+
+	unsigned int width = (line.size() - 3) / 2;
+
+	entry.cmd = (Log::Op) line[0];
+	entry.A.assign(line, 2, width);
+	entry.C.assign(line, width + 3, width);
+
+	return true;
+}
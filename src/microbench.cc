@@ -0,0 +1,411 @@
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <math.h>
+#include <stdlib.h>
+
+#include "utils.h"
+#include "hashfile.h"
+#include "btreefile.h"
+#include "gappedhashfile.h"
+#include "encodedhashfile.h"
+#include "logfile.h"
+#include "valueset.h"
+
+using namespace std;
+
+// Microbenchmarks of the storage primitives on generated data, at several sizes.
+// every case runs once to warm up, then REPETITIONS times; the time per
+// operation is reported as the median, mean, standard deviation and minimum
+// over the repetitions. an argument limits the run to cases whose name holds it
+
+typedef chrono::steady_clock Clock;
+
+const unsigned int REPETITIONS = 7;
+const unsigned long SIZES[] = { 1ul << 12, 1ul << 15, 1ul << 18 };
+const unsigned long FAN_OUTS[] = { 1, 16, 256 };
+const unsigned long LOOKUPS = 4096;
+const unsigned long DELTAS[] = { 16, 256, 4096, 65536 };
+const unsigned long BATCHES[] = { 256, 4096, 65536 };
+
+static string bench_directory("benchbed"), filter;
+
+// exposes the protected search of a HashFile
+class IndexProbe : public HashFile
+{
+	public:
+		IndexProbe(string path) : HashFile(path) {}
+		using HashFile::getIndexOfKey;
+};
+
+template <class Body>
+void run(string name, unsigned long ops, Body body)
+{
+	if(name.find(filter) == string::npos)
+		return;
+
+	vector<double> samples;
+
+	body();
+
+	for(unsigned int r=0; r<REPETITIONS; r++)
+	{
+		Clock::time_point start = Clock::now();
+		body();
+		samples.push_back(chrono::duration_cast<chrono::nanoseconds>(Clock::now() - start).count() / (double) ops);
+	}
+
+	sort(samples.begin(), samples.end());
+
+	double mean = 0, variance = 0;
+
+	for(unsigned int r=0; r<REPETITIONS; r++)
+		mean += samples[r] / REPETITIONS;
+
+	for(unsigned int r=0; r<REPETITIONS; r++)
+		variance += (samples[r] - mean) * (samples[r] - mean) / REPETITIONS;
+
+	cout << left << setw(48) << name << right << fixed << setprecision(1)
+		 << " median " << setw(10) << samples[REPETITIONS / 2] << " ns/op"
+		 << "  mean " << setw(10) << mean
+		 << "  sd " << setw(8) << sqrt(variance)
+		 << "  min " << setw(10) << samples[0] << endl;
+}
+
+string random_key()
+{
+	const char *digits = "0123456789abcdef";
+	string key(SHA_WIDTH, '0');
+
+	for(unsigned int i=0; i<SHA_WIDTH; i++)
+		key[i] = digits[rand() % 16];
+
+	return key;
+}
+
+// write a HashFile of size lines to path: size / fan_out random keys, each with
+// fan_out random values. returns the keys
+vector<string> write_hash_file(string path, unsigned long size, unsigned long fan_out)
+{
+	vector<pair<string, string> > lines;
+	vector<string> keys;
+
+	for(unsigned long i=0; i<size / fan_out; i++)
+	{
+		keys.push_back(random_key());
+
+		for(unsigned long j=0; j<fan_out; j++)
+			lines.push_back(make_pair(keys.back(), random_key()));
+	}
+
+	sort(lines.begin(), lines.end());
+
+	mkdir(path.c_str(), 0777);
+	HashFileWriter writer(path);
+
+	for(unsigned long i=0; i<lines.size(); i++)
+		writer.append(lines[i].first.c_str(), lines[i].second.c_str());
+
+	writer.close();
+	return keys;
+}
+
+// half present keys, half absent ones
+vector<string> lookup_keys(vector<string> &keys)
+{
+	vector<string> queries;
+
+	for(unsigned long i=0; i<LOOKUPS; i++)
+		queries.push_back(i % 2 == 0 ? keys[rand() % keys.size()] : random_key());
+
+	return queries;
+}
+
+string size_label(string name, unsigned long size)
+{
+	return name + " n=" + to_string(size);
+}
+
+void benchIndexSearch()
+{
+	for(unsigned long s=0; s<3; s++)
+		for(unsigned long f=0; f<3; f++)
+		{
+			string path = bench_directory + "/search/";
+			vector<string> queries;
+
+			dir_delete(path);
+			vector<string> keys = write_hash_file(path, SIZES[s], FAN_OUTS[f]);
+			queries = lookup_keys(keys);
+
+			IndexProbe index(path);
+
+			run(size_label("HashFile::getIndexOfKey", SIZES[s]) + " fan-out=" + to_string(FAN_OUTS[f]), queries.size(), [&]()
+			{
+				for(unsigned long i=0; i<queries.size(); i++)
+					index.getIndexOfKey(queries[i]);
+			});
+		}
+}
+
+// every candidate geometry of BTreeFile::tuneIndex, at each size
+
+void benchBTree()
+{
+	vector<BTreeGeometry> geometries = BTreeFile::candidateGeometries();
+
+	for(unsigned long s=0; s<3; s++)
+	{
+		string path = bench_directory + "/btree/";
+
+		dir_delete(path);
+		vector<string> keys = write_hash_file(path, SIZES[s], 4);
+		vector<string> queries = lookup_keys(keys);
+
+		for(unsigned long g=0; g<geometries.size(); g++)
+		{
+			string geometry = " fan-out=" + to_string(1ul << (4 * geometries[g].mask_size))
+							  + " entry=" + to_string(1 + 2 * geometries[g].num_width)
+							  + " align=" + to_string(geometries[g].alignment)
+							  + " min-children=" + to_string(geometries[g].min_children);
+			BTreeFile index(path, geometries[g]);
+
+			run(size_label("BTreeFile::buildIndex", SIZES[s]) + geometry, SIZES[s], [&]() { index.buildIndex(path); });
+
+			index.setPath(path);
+			DigestArena arena;
+
+			run(size_label("BTreeFile::get", SIZES[s]) + geometry, queries.size(), [&]()
+			{
+				for(unsigned long i=0; i<queries.size(); i++)
+				{
+					ValueSet values(&arena);
+					index.get(queries[i], values);
+				}
+			});
+		}
+	}
+}
+
+void benchLog()
+{
+	for(unsigned long s=0; s<3; s++)
+	{
+		string path = bench_directory + "/log/";
+		vector<string> As, Cs;
+
+		mkdir(path.c_str(), 0777);
+
+		for(unsigned long i=0; i<SIZES[s]; i++)
+		{
+			As.push_back(random_key());
+			Cs.push_back(random_key());
+		}
+
+		LogFile log(path);
+
+		run(size_label("LogFile::addEntry", SIZES[s]), SIZES[s], [&]()
+		{
+			log.clear();
+
+			for(unsigned long i=0; i<SIZES[s]; i++)
+				log.addEntry(i % 3 == 0 ? Log::UNANNOTATE : Log::ANNOTATE, As[i], Cs[i]);
+		});
+
+		run(size_label("LogFile::readEntries", SIZES[s]), SIZES[s], [&]() { log.readEntries(); });
+
+		log.clear();
+	}
+}
+
+// merge a log of a quarter as many changes into a file of each size
+void benchCommit()
+{
+	for(unsigned long s=0; s<3; s++)
+	{
+		string path = bench_directory + "/commit/", target = bench_directory + "/commit-out/";
+
+		dir_delete(path);
+		mkdir(target.c_str(), 0777);
+
+		vector<string> keys = write_hash_file(path, SIZES[s], 4);
+		LogFile log(path);
+		HashFile index(path);
+
+		for(unsigned long i=0; i<SIZES[s] / 4; i++)
+			log.addEntry(i % 2 == 0 ? Log::ANNOTATE : Log::UNANNOTATE, keys[rand() % keys.size()], random_key());
+
+		log.close();
+
+		run(size_label("HashFile::commit", SIZES[s]), SIZES[s], [&]() { index.commit(target, log, false); });
+	}
+}
+
+// commit logs of growing size into the largest file, packed densely and in
+// gapped pages. times are per commit: the dense file rewrites every line each
+// time, the gapped one only the pages the log falls in
+void benchCommitDelta()
+{
+	string path = bench_directory + "/delta/", gapped_path = bench_directory + "/delta-gapped/";
+	string log_path = bench_directory + "/delta-log/", target = bench_directory + "/delta-out/";
+
+	dir_delete(path);
+	dir_delete(gapped_path);
+	mkdir(gapped_path.c_str(), 0777);
+	mkdir(log_path.c_str(), 0777);
+	mkdir(target.c_str(), 0777);
+
+	vector<string> keys = write_hash_file(path, SIZES[2], 4);
+	HashFile index(path);
+
+	link((path + "HashFile.txt").c_str(), (gapped_path + "HashFile.txt").c_str());
+	GappedHashFile gapped(gapped_path);
+	gapped.buildIndex(gapped_path);
+	gapped.setPath(gapped_path);
+
+	for(unsigned long d=0; d<sizeof(DELTAS) / sizeof(DELTAS[0]); d++)
+	{
+		string label = " n=" + to_string(SIZES[2]) + " delta=" + to_string(DELTAS[d]);
+		LogFile log(log_path);
+
+		log.clear();
+
+		for(unsigned long i=0; i<DELTAS[d]; i++)
+			log.addEntry(i % 2 == 0 ? Log::ANNOTATE : Log::UNANNOTATE, keys[rand() % keys.size()], random_key());
+
+		log.close();
+
+		run("HashFile::commit" + label, 1, [&]() { index.commit(target, log, false); });
+		run("GappedHashFile::commit" + label, 1, [&]() { gapped.commit(target, log, false); });
+	}
+}
+
+// a batch of keys looked up one by one, against the same batch swept in order
+void benchSweep()
+{
+	string path = bench_directory + "/sweep/", encoded_path = bench_directory + "/sweep-encoded/";
+
+	dir_delete(path);
+	dir_delete(encoded_path);
+	vector<string> keys = write_hash_file(path, SIZES[2], 4);
+
+	HashFile index(path);
+	BTreeFile btree(path);
+	btree.buildIndex(path);
+	btree.setPath(path);
+
+	mkdir(encoded_path.c_str(), 0777);
+	link((path + "HashFile.txt").c_str(), (encoded_path + "HashFile.txt").c_str());
+	EncodedHashFile encoded(encoded_path);
+	encoded.buildIndex(encoded_path);
+	encoded.setPath(encoded_path);
+
+	HashFile *files[] = { &index, &btree, &encoded };
+	string names[] = { "HashFile", "BTreeFile", "EncodedHashFile" };
+
+	for(unsigned long b=0; b<sizeof(BATCHES) / sizeof(BATCHES[0]); b++)
+	{
+		string label = " n=" + to_string(SIZES[2]) + " batch=" + to_string(BATCHES[b]);
+		vector<string> batch;
+		volatile unsigned long sink = 0;
+
+		for(unsigned long i=0; i<BATCHES[b]; i++)
+			batch.push_back(keys[rand() % keys.size()]);
+
+		for(unsigned int f=0; f<3; f++)
+		{
+			DigestArena arena;
+
+			run(names[f] + "::get" + label, batch.size(), [&]()
+			{
+				for(unsigned long i=0; i<batch.size(); i++)
+				{
+					ValueSet values(&arena);
+					files[f]->get(batch[i], values);
+					sink += values.size();
+				}
+			});
+
+			run(names[f] + "::sweep" + label, batch.size(), [&]()
+			{
+				vector<string> sorted(batch);
+
+				sort(sorted.begin(), sorted.end());
+				sorted.erase(unique(sorted.begin(), sorted.end()), sorted.end());
+				files[f]->sweep(sorted, [&](const string &key, ValueSet &values) { sink += values.size(); });
+			});
+		}
+	}
+}
+
+void benchHex()
+{
+	const unsigned long n = SIZES[1];
+	vector<string> keys;
+	vector<Digest> digests(n);
+	unsigned char bytes[SHA_WIDTH / 2];
+	volatile unsigned long sink = 0;
+
+	for(unsigned long i=0; i<n; i++)
+		keys.push_back(random_key());
+
+	run(size_label("convertHexToInt", n), n, [&]()
+	{
+		for(unsigned long i=0; i<n; i++)
+			sink += convertHexToInt(keys[i].substr(0, 8));
+	});
+
+	run(size_label("convertIntToHex", n), n, [&]()
+	{
+		for(unsigned long i=0; i<n; i++)
+			sink += convertIntToHex(i, 8).size();
+	});
+
+	run(size_label("convertHexToByteArray", n), n, [&]()
+	{
+		for(unsigned long i=0; i<n; i++)
+			convertHexToByteArray(bytes, keys[i]);
+	});
+
+	run(size_label("convertKeyToShard", n), n, [&]()
+	{
+		for(unsigned long i=0; i<n; i++)
+			sink += convertKeyToShard(keys[i], 8);
+	});
+
+	run(size_label("convertHexToDigest", n), n, [&]()
+	{
+		for(unsigned long i=0; i<n; i++)
+			convertHexToDigest(digests[i], keys[i]);
+	});
+
+	run(size_label("convertDigestToHex", n), n, [&]()
+	{
+		for(unsigned long i=0; i<n; i++)
+			sink += convertDigestToHex(digests[i]).size();
+	});
+}
+
+int main(int argc, char *argv[])
+{
+	if(argc > 1)
+		filter = string(argv[1]);
+
+	srand(1);
+	dir_delete(bench_directory);
+	mkdir(bench_directory.c_str(), 0777);
+
+	benchIndexSearch();
+	benchBTree();
+	benchLog();
+	benchCommit();
+	benchCommitDelta();
+	benchSweep();
+	benchHex();
+
+	dir_delete(bench_directory);
+	return 0;
+}
@@ -0,0 +1,476 @@
+#include "probeengine.h"
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+////////////////////////////////// UringBackend ////////////////////////////////
+
+UringBackend::UringBackend(unsigned int queueDepth)
+{
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+
+	pending_submissions = in_flight = 0;
+	sq_ring = cq_ring = sqes = MAP_FAILED;
+
+	ring_fd = syscall(__NR_io_uring_setup, queueDepth, &params);
+
+	if(ring_fd < 0)
+		return;
+
+	sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+	cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+	// newer kernels map both rings with a single mmap
+	if(params.features & IORING_FEAT_SINGLE_MMAP)
+		sq_ring_size = cq_ring_size = max(sq_ring_size, cq_ring_size);
+
+	sq_ring = mmap(NULL, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+
+	if(params.features & IORING_FEAT_SINGLE_MMAP)
+		cq_ring = sq_ring;
+	else
+		cq_ring = mmap(NULL, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+
+	sqes = mmap(NULL, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+
+	if(sq_ring == MAP_FAILED || cq_ring == MAP_FAILED || sqes == MAP_FAILED)
+	{
+		close(ring_fd);
+		ring_fd = -1;
+		return;
+	}
+
+	sq_head = (unsigned int *)((char *)sq_ring + params.sq_off.head);
+	sq_tail = (unsigned int *)((char *)sq_ring + params.sq_off.tail);
+	sq_mask = (unsigned int *)((char *)sq_ring + params.sq_off.ring_mask);
+	sq_array = (unsigned int *)((char *)sq_ring + params.sq_off.array);
+
+	cq_head = (unsigned int *)((char *)cq_ring + params.cq_off.head);
+	cq_tail = (unsigned int *)((char *)cq_ring + params.cq_off.tail);
+	cq_mask = (unsigned int *)((char *)cq_ring + params.cq_off.ring_mask);
+	cqes = (char *)cq_ring + params.cq_off.cqes;
+}
+
+UringBackend::~UringBackend()
+{
+	if(sqes != MAP_FAILED)
+		munmap(sqes, sqes_size);
+	if(cq_ring != MAP_FAILED && cq_ring != sq_ring)
+		munmap(cq_ring, cq_ring_size);
+	if(sq_ring != MAP_FAILED)
+		munmap(sq_ring, sq_ring_size);
+	if(ring_fd >= 0)
+		close(ring_fd);
+}
+
+bool UringBackend::good()
+{
+	return(ring_fd >= 0);
+}
+
+const char *UringBackend::name()
+{
+	return "io_uring";
+}
+
+// queue a read on the submission ring; it is handed to the kernel on the next
+// complete(), together with everything else queued since
+
+void UringBackend::submit(ReadRequest *request)
+{
+	unsigned int tail = *sq_tail, index = tail & *sq_mask;
+	struct io_uring_sqe *sqe = &((struct io_uring_sqe *) sqes)[index];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = request->fd;
+	sqe->off = request->offset;
+	sqe->addr = (unsigned long) request->buffer;
+	sqe->len = request->length;
+	sqe->user_data = (unsigned long) request;
+
+	sq_array[index] = index;
+	__atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+	pending_submissions++;
+	in_flight++;
+}
+
+void UringBackend::complete(vector<ReadRequest*> &done)
+{
+	done.clear();
+
+	if(in_flight == 0)
+		return;
+
+	while(true)
+	{
+		unsigned int head = *cq_head;
+		unsigned int tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+
+		// submit anything queued, and only wait if no completion is ready yet
+		if(pending_submissions != 0 || head == tail)
+		{
+			int ret = syscall(__NR_io_uring_enter, ring_fd, pending_submissions, head == tail ? 1 : 0,
+							  IORING_ENTER_GETEVENTS, NULL, 0);
+
+			if(ret < 0 && errno == EINTR)
+				continue;
+
+			if(ret >= 0)
+				pending_submissions -= min((unsigned int) ret, pending_submissions);
+
+			tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+		}
+
+		for(; head != tail; head++)
+		{
+			struct io_uring_cqe *cqe = &((struct io_uring_cqe *) cqes)[head & *cq_mask];
+			ReadRequest *request = (ReadRequest *) cqe->user_data;
+
+			request->result = cqe->res;
+			done.push_back(request);
+		}
+
+		__atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+
+		if(!done.empty())
+			break;
+	}
+
+	in_flight -= done.size();
+}
+
+//////////////////////////////// PreadPoolBackend ///////////////////////////////
+
+PreadPoolBackend::PreadPoolBackend(unsigned int threads)
+{
+	stopping = false;
+
+	for(unsigned int i=0; i<max(threads, 1u); i++)
+		workers.push_back(new thread(&PreadPoolBackend::worker, this));
+}
+
+PreadPoolBackend::~PreadPoolBackend()
+{
+	{
+		unique_lock<mutex> guard(lock);
+		stopping = true;
+	}
+	submitted.notify_all();
+
+	for(unsigned long i=0; i<workers.size(); i++)
+	{
+		workers[i]->join();
+		delete workers[i];
+	}
+}
+
+const char *PreadPoolBackend::name()
+{
+	return "pread pool";
+}
+
+void PreadPoolBackend::worker()
+{
+	while(true)
+	{
+		ReadRequest *request;
+
+		{
+			unique_lock<mutex> guard(lock);
+
+			while(submit_queue.empty() && !stopping)
+				submitted.wait(guard);
+
+			if(submit_queue.empty())
+				return;
+
+			request = submit_queue.front();
+			submit_queue.pop_front();
+		}
+
+		long n = pread(request->fd, request->buffer, request->length, request->offset);
+		request->result = (n < 0 ? -errno : n);
+
+		{
+			unique_lock<mutex> guard(lock);
+			complete_queue.push_back(request);
+		}
+		completed.notify_one();
+	}
+}
+
+void PreadPoolBackend::submit(ReadRequest *request)
+{
+	{
+		unique_lock<mutex> guard(lock);
+		submit_queue.push_back(request);
+	}
+	submitted.notify_one();
+}
+
+void PreadPoolBackend::complete(vector<ReadRequest*> &done)
+{
+	unique_lock<mutex> guard(lock);
+
+	while(complete_queue.empty())
+		completed.wait(guard);
+
+	done.assign(complete_queue.begin(), complete_queue.end());
+	complete_queue.clear();
+}
+
+/////////////////////////////////// ProbeEngine /////////////////////////////////
+
+enum { PROBE_TRIE, PROBE_SEARCH, PROBE_SCAN, PROBE_DONE };
+
+struct ProbeEngine::Probe
+{
+	const string *key;
+	ValueSet *values;
+	int phase, mask_index;
+	unsigned long low, high, mid, table_line, scan_index;
+	vector<char> buffer;
+	ReadRequest request;
+};
+
+ProbeEngine::ProbeEngine(unsigned int queueDepth, bool usePreadPool)
+{
+	queue_depth = max(queueDepth, 1u);
+	backend = NULL;
+
+	if(!usePreadPool)
+	{
+		UringBackend *uring = new UringBackend(queue_depth);
+
+		if(uring->good())
+			backend = uring;
+		else
+			delete uring;
+	}
+
+	if(backend == NULL)
+		backend = new PreadPoolBackend(min(queue_depth, 16u));
+}
+
+ProbeEngine::~ProbeEngine()
+{
+	delete backend;
+}
+
+const char *ProbeEngine::backendName()
+{
+	return backend->name();
+}
+
+// fill results[i] with the values of keys[i] from index. results must point at
+// distinct sets, which are appended to in sorted order
+
+void ProbeEngine::lookup(HashFile *index, const vector<string> &keys, vector<ValueSet*> &results)
+{
+	index->getLayout(layout);
+
+	// an index whose lines are not laid out at fixed offsets is read through
+	// its own lookups, one key at a time
+	if(layout.hash_filename.empty())
+	{
+		for(unsigned long i=0; i<keys.size(); i++)
+			index->get(keys[i], *results[i]);
+
+		return;
+	}
+
+	if(layout.data_size == 0 || keys.empty())
+		return;
+
+	hash_fd = open(layout.hash_filename.c_str(), O_RDONLY);
+	table_fd = (layout.table_size != 0 ? open(layout.table_filename.c_str(), O_RDONLY) : -1);
+
+	if(hash_fd < 0)
+		return;
+
+	vector<Probe> probes(min((unsigned long) queue_depth, (unsigned long) keys.size()));
+	vector<ReadRequest*> done;
+	unsigned long next_key = 0, active = 0;
+
+	for(unsigned long i=0; i<probes.size(); i++)
+	{
+		probes[i].buffer.resize(max(SCAN_LINES * layout.line_width, (unsigned int) layout.entry_width));
+		probes[i].key = &keys[next_key];
+		probes[i].values = results[next_key++];
+		start(&probes[i]);
+		active++;
+	}
+
+	// as each probe finishes, reuse its slot for the next key
+	while(active > 0)
+	{
+		backend->complete(done);
+
+		for(unsigned long i=0; i<done.size(); i++)
+		{
+			Probe *probe = (Probe *) done[i]->user_data;
+			advance(probe);
+
+			if(probe->phase != PROBE_DONE)
+				continue;
+
+			active--;
+
+			if(next_key < keys.size())
+			{
+				probe->key = &keys[next_key];
+				probe->values = results[next_key++];
+				start(probe);
+				active++;
+			}
+		}
+	}
+
+	close(hash_fd);
+	if(table_fd >= 0)
+		close(table_fd);
+}
+
+void ProbeEngine::issue(Probe *probe, int fd, unsigned long offset, unsigned int length)
+{
+	probe->request.fd = fd;
+	probe->request.offset = offset;
+	probe->request.length = length;
+	probe->request.buffer = &probe->buffer[0];
+	probe->request.user_data = probe;
+	probe->request.result = 0;
+
+	backend->submit(&probe->request);
+}
+
+// walk the trie if there is one, otherwise binary search the whole file
+
+void ProbeEngine::start(Probe *probe)
+{
+	probe->mask_index = 0;
+	probe->table_line = 0;
+
+	if(table_fd >= 0)
+	{
+		probe->phase = PROBE_TRIE;
+		unsigned int entry = convertHexToInt(probe->key->substr(0, layout.mask_size));
+		issue(probe, table_fd, layout.table_offset + entry * layout.entry_width, layout.entry_width);
+		return;
+	}
+
+	probe->phase = PROBE_SEARCH;
+	probe->low = 0;
+	probe->high = layout.data_size;
+	issue_search(probe);
+}
+
+// read the middle line of [low, high), or once the window has closed, start
+// scanning the key's run at low
+
+void ProbeEngine::issue_search(Probe *probe)
+{
+	if(probe->low >= probe->high)
+	{
+		probe->phase = PROBE_SCAN;
+		probe->scan_index = probe->low;
+		issue_scan(probe);
+		return;
+	}
+
+	probe->mid = probe->low + (probe->high - probe->low) / 2;
+	issue(probe, hash_fd, layout.data_offset + probe->mid * layout.line_width, layout.line_width);
+}
+
+void ProbeEngine::issue_scan(Probe *probe)
+{
+	if(probe->scan_index >= layout.data_size)
+	{
+		probe->phase = PROBE_DONE;
+		return;
+	}
+
+	unsigned long lines = min((unsigned long) SCAN_LINES, layout.data_size - probe->scan_index);
+	issue(probe, hash_fd, layout.data_offset + probe->scan_index * layout.line_width, lines * layout.line_width);
+}
+
+// consume the read that just completed and issue the next one, if any
+
+void ProbeEngine::advance(Probe *probe)
+{
+	char *buf = &probe->buffer[0];
+
+	if(probe->request.result < (long) min(probe->request.length, (unsigned int) layout.line_width))
+	{
+		probe->phase = PROBE_DONE;
+		return;
+	}
+
+	if(probe->phase == PROBE_TRIE)
+	{
+		char flag = buf[0];
+		unsigned long low = 0, high = 0;
+
+		memcpy(&low, &buf[1], layout.num_width);
+		memcpy(&high, &buf[layout.num_width + 1], layout.num_width);
+
+		if(flag == BTreeFile::TABLE_PTR_FLAG && probe->mask_index + 2 * layout.mask_size <= (int) layout.key_width)
+		{
+			probe->mask_index += layout.mask_size;
+			probe->table_line = high;
+
+			unsigned int entry = convertHexToInt(probe->key->substr(probe->mask_index, layout.mask_size));
+			issue(probe, table_fd, layout.table_offset + probe->table_line * layout.table_line_width
+								   + entry * layout.entry_width, layout.entry_width);
+		}
+		else if(flag == BTreeFile::LINE_IDX_FLAG)
+		{
+			probe->phase = PROBE_SEARCH;
+			probe->low = low;
+			probe->high = min(high + 1, layout.data_size);
+			issue_search(probe);
+		}
+		else
+			probe->phase = PROBE_DONE;
+
+		return;
+	}
+
+	if(probe->phase == PROBE_SEARCH)
+	{
+		if(memcmp(buf, probe->key->c_str(), layout.key_width) < 0)
+			probe->low = probe->mid + 1;
+		else
+			probe->high = probe->mid;
+
+		issue_search(probe);
+		return;
+	}
+
+	// PROBE_SCAN: collect values while the key still matches
+	unsigned long lines = probe->request.result / layout.line_width;
+	Digest value;
+
+	for(unsigned long i=0; i<lines; i++)
+	{
+		char *line = buf + i * layout.line_width;
+
+		if(memcmp(line, probe->key->c_str(), layout.key_width) != 0)
+		{
+			probe->phase = PROBE_DONE;
+			return;
+		}
+
+		convertHexToDigest(value, string(line + layout.key_width + 1, layout.key_width));
+		probe->values->appendSorted(value);
+	}
+
+	probe->scan_index += lines;
+	issue_scan(probe);
+}
@@ -68,6 +68,60 @@ unsigned long readSystem(AnnotationSet *AS, vector<string> queries, int mode)
 
 }
 
+// the same reads, issued as one batch through the probe engine
+
+unsigned long readSystemBatch(AnnotationSet *AS, vector<string> queries, int mode)
+{
+	unsigned long timer = clock();
+
+	if(mode == 1)
+		AS->list_entries_batch(queries);
+	else
+		AS->list_annotations_batch(queries);
+
+	return clock() - timer;
+}
+
+// stream every pair of a full scan, and for comparison read the file it comes
+// from in large blocks, which is as fast as the scan could go
+
+unsigned long scanSystem(AnnotationScanner scan)
+{
+	unsigned long timer = clock();
+	string key, value;
+
+	while(scan.next(key, value))
+		;
+
+	return clock() - timer;
+}
+
+unsigned long readFile(string filename)
+{
+	unsigned long timer = clock();
+	fstream file(filename.c_str(), fstream::in | fstream::binary);
+	char *buffer = new char[1 << 20];
+
+	while(file.read(buffer, 1 << 20) || file.gcount() > 0)
+		;
+
+	delete[] buffer;
+	return clock() - timer;
+}
+
+// find where every key starts in one index, reporting time and probes (lines or trie
+// entries read) per key
+
+void searchIndex(string name, HashFile *index, vector<string> queries)
+{
+	unsigned long timer = clock(), probes = index->searchProbes();
+
+	for(unsigned long i=0; i<queries.size(); i++)
+		index->lowerBound(queries[i]);
+
+	cout << name << " (cycles): " << clock() - timer << ", probes per key: "
+		 << (double)(index->searchProbes() - probes) / queries.size() << endl;
+}
 
 int main(int argc, char *argv[]) 
 {
@@ -93,7 +147,6 @@ int main(int argc, char *argv[])
 	cout << "initializing... "; cout.flush();
 	for(unsigned long i=0; i<pairs.size(); i++)
 	{
-		AS->annotate_entry(pairs[i].annotation, pairs[i].message);
 		annotations.insert(pairs[i].annotation);
 		messages.insert(pairs[i].message);
 	}
@@ -101,8 +154,9 @@ int main(int argc, char *argv[])
 	vector<string> randAnnotations = generate_rand_vector_from_set(annotations);
 	vector<string> randMessages = generate_rand_vector_from_set(messages);
 
-
-	AS->commit_to_disk();
+	unsigned long timer = clock();
+	AS->bulk_load(string(argv[1]));
+	cout << "bulk_load (cycles): " << clock() - timer << endl;
 	delete(AS);
 	cout <<"done." << endl;
 	cout <<"running profiler... " << endl; cout.flush();
@@ -120,6 +174,47 @@ int main(int argc, char *argv[])
 	cout<<"list_annotations (cycles): " << annotations_time << endl;
 	delete(AS);
 
+	// a fresh set, so the batch reads from disk rather than the memory maps
+	AS = new AnnotationSet(test_bed_directory);
+	AS->initialize();
+
+	entries_time = readSystemBatch(AS, randAnnotations, 1);
+	annotations_time = readSystemBatch(AS, randMessages, 2);
+
+	cout<<"list_entries_batch (cycles): " << entries_time << endl;
+	cout<<"list_annotations_batch (cycles): " << annotations_time << endl;
+
+	cout<<"scan_entries (cycles): " << scanSystem(AS->scan_entries()) << endl;
+	cout<<"scan_annotations (cycles): " << scanSystem(AS->scan_annotations()) << endl;
+	cout<<"read A2C HashFile (cycles): " << readFile(test_bed_directory + "/A2C/HashFile.txt") << endl;
+	delete(AS);
+
+	// compare the search modes on the A2C index directly
+	HashFile *index = new HashFile(test_bed_directory + "/A2C/");
+	searchIndex("binary search", index, randAnnotations);
+	index->setSearchMode(SEARCH_INTERPOLATION);
+	searchIndex("interpolation search", index, randAnnotations);
+	delete(index);
+
+	if(hashTableType == "BTreeFile")
+	{
+		BTreeFile *tree = new BTreeFile(test_bed_directory + "/A2C/");
+		searchIndex("BTreeFile trie", tree, randAnnotations);
+
+		// tuning mode: every candidate geometry, built over the same file
+		vector<BTreeGeometry> geometries = BTreeFile::candidateGeometries();
+		vector<double> nanos;
+		BTreeGeometry best = tree->tuneGeometry(geometries, randAnnotations, nanos);
+
+		for(unsigned long g=0; g<geometries.size(); g++)
+			cout << "BTreeFile " << (1ul << (4 * geometries[g].mask_size)) << "-way, "
+				 << 1 + 2 * geometries[g].num_width << "-byte entries, " << geometries[g].alignment << "-byte aligned, "
+				 << "leaves under " << geometries[g].min_children << " lines (ns/lookup): " << nanos[g]
+				 << (geometries[g] == best ? " (fastest)" : "") << endl;
+
+		delete(tree);
+	}
+
 	// run test using BTreeFile
 	if(hashTableType == "BTreeFile")
 	{
@@ -131,9 +226,18 @@ int main(int argc, char *argv[])
 
 		cout<<"BTreeFile - list_entries (cycles): " << entries_time << endl;
 		cout<<"BTreeFile - list_annotations (cycles): " << annotations_time << endl;
+		delete(AS);
+
+		AS = new AnnotationSet(test_bed_directory, hashTableType);
+		AS->initialize();
+
+		entries_time = readSystemBatch(AS, randAnnotations, 1);
+		annotations_time = readSystemBatch(AS, randMessages, 2);
+
+		cout<<"BTreeFile - list_entries_batch (cycles): " << entries_time << endl;
+		cout<<"BTreeFile - list_annotations_batch (cycles): " << annotations_time << endl;
+		delete(AS);
 	}
-	
-	delete(AS);
 
 	return 0;
 }
\ No newline at end of file
@@ -0,0 +1,188 @@
+#include "reader.h"
+
+// the first open waits out a publish under way. a set whose last commit failed
+// midway is only consistent again once a writer has initialized it, and until
+// then the reader waits for that
+
+AnnotationReader::AnnotationReader(string dir_path, string hashTableType)
+{
+	directory_path = dir_path;
+	hash_table_type = hashTableType;
+	set_refresh_interval(DEFAULT_REFRESH_MILLISECONDS);
+	files = NULL;
+
+	while(files == NULL)
+	{
+		char state;
+		unsigned long generation;
+
+		AnnotationSet::read_commit_state(directory_path, state, generation);
+
+		if(state == '0')
+			files = open_files(generation);
+
+		files_generation = generation;
+
+		if(files == NULL)
+			usleep(OPEN_RETRY_MICROSECONDS);
+	}
+
+	last_refresh = Clock::now();
+}
+
+AnnotationReader::~AnnotationReader()
+{
+	delete(files);
+}
+
+// open the live files as a snapshot with no changes over them. they are of the
+// given generation if the atomic log still reads it, with no publish begun, once
+// they are open; otherwise a publish got in between, and NULL is returned
+
+AnnotationSnapshot *AnnotationReader::open_files(unsigned long generation)
+{
+	AnnotationSnapshot *opened = new AnnotationSnapshot(make_shared<SnapshotFiles>(directory_path),
+														make_shared<SnapshotDelta>(), hash_table_type, generation, 0);
+	char state;
+	unsigned long after;
+
+	AnnotationSet::read_commit_state(directory_path, state, after);
+
+	if(state == '0' && after == generation)
+		return opened;
+
+	delete(opened);
+	return NULL;
+}
+
+// reopen the files if a new generation was published since they were opened.
+// returns whether they were. snapshots taken before keep the files they had
+
+bool AnnotationReader::refresh()
+{
+	char state;
+	unsigned long generation;
+	AnnotationSnapshot *opened = NULL;
+
+	last_refresh = Clock::now();
+	AnnotationSet::read_commit_state(directory_path, state, generation);
+
+	if(state != '0' || generation == files_generation)
+		return false;
+
+	if((opened = open_files(generation)) == NULL)
+		return false;
+
+	delete(files);
+	files = opened;
+	files_generation = generation;
+
+	return true;
+}
+
+// 0 checks for a new generation on every call
+
+void AnnotationReader::set_refresh_interval(unsigned long milliseconds)
+{
+	refresh_interval = chrono::milliseconds(milliseconds);
+}
+
+AnnotationSnapshot &AnnotationReader::current()
+{
+	if(Clock::now() - last_refresh >= refresh_interval)
+		refresh();
+
+	return *files;
+}
+
+unsigned long AnnotationReader::generation()
+{
+	return current().generation();
+}
+
+unsigned int AnnotationReader::keyWidth()
+{
+	return current().keyWidth();
+}
+
+// a view that stays on the files open now, whatever is published later
+
+AnnotationSnapshot AnnotationReader::snapshot()
+{
+	return current();
+}
+
+set<string> AnnotationReader::list_annotations(string_view C)
+{
+	return current().list_annotations(C);
+}
+
+set<string> AnnotationReader::list_entries(string_view A)
+{
+	return current().list_entries(A);
+}
+
+ValuePage AnnotationReader::list_annotations(string_view C, unsigned long limit, string_view cursor)
+{
+	return current().list_annotations(C, limit, cursor);
+}
+
+ValuePage AnnotationReader::list_entries(string_view A, unsigned long limit, string_view cursor)
+{
+	return current().list_entries(A, limit, cursor);
+}
+
+void AnnotationReader::sweep_entries(vector<string> As, SweepCallback callback)
+{
+	current().sweep_entries(As, callback);
+}
+
+void AnnotationReader::sweep_annotations(vector<string> Cs, SweepCallback callback)
+{
+	current().sweep_annotations(Cs, callback);
+}
+
+bool AnnotationReader::has_annotation(string_view A, string_view C)
+{
+	return current().has_annotation(A, C);
+}
+
+unsigned long AnnotationReader::count_entries(string_view A)
+{
+	return current().count_entries(A);
+}
+
+unsigned long AnnotationReader::count_annotations(string_view C)
+{
+	return current().count_annotations(C);
+}
+
+map<string, set<string> > AnnotationReader::list_entries_by_prefix(string prefix)
+{
+	return current().list_entries_by_prefix(prefix);
+}
+
+map<string, set<string> > AnnotationReader::list_entries_in_range(string low, string high)
+{
+	return current().list_entries_in_range(low, high);
+}
+
+map<string, set<string> > AnnotationReader::list_annotations_by_prefix(string prefix)
+{
+	return current().list_annotations_by_prefix(prefix);
+}
+
+map<string, set<string> > AnnotationReader::list_annotations_in_range(string low, string high)
+{
+	return current().list_annotations_in_range(low, high);
+}
+
+AnnotationScanner AnnotationReader::scan_entries()
+{
+	return current().scan_entries();
+}
+
+AnnotationScanner AnnotationReader::scan_annotations()
+{
+	return current().scan_annotations();
+}
@@ -0,0 +1,29 @@
+#include <iostream>
+#include <string>
+#include <stdlib.h>
+
+#include "shardedset.h"
+
+using namespace std;
+
+int main(int argc, char *argv[])
+{
+	string hashTableType("");
+
+	if(argc < 3)
+	{
+		cout << "USAGE: [ANNOTATION SET DIRECTORY] [SHARD BITS] [optional: \"BTreeFile\"]" << endl;
+		return 0;
+	}
+
+	if(argc > 3)
+		hashTableType = string(argv[3]);
+
+	if(!reshard_directory(string(argv[1]), atoi(argv[2]), hashTableType))
+	{
+		cout << "could not swap in the resharded store; opening the directory again finishes or drops the reshard" << endl;
+		return 1;
+	}
+
+	return 0;
+}
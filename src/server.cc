@@ -0,0 +1,691 @@
+#include "server.h"
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <errno.h>
+
+//////////////////////////////////// framing ///////////////////////////////////
+
+static void put_u32(string &out, unsigned int n)
+{
+	for(int i=0; i<4; i++)
+		out.push_back((char)((n >> (8 * i)) & 0xff));
+}
+
+static void put_u64(string &out, unsigned long n)
+{
+	for(int i=0; i<8; i++)
+		out.push_back((char)((n >> (8 * i)) & 0xff));
+}
+
+static unsigned int get_u32(const char *p)
+{
+	unsigned int n = 0;
+
+	for(int i=0; i<4; i++)
+		n |= (unsigned int)(unsigned char) p[i] << (8 * i);
+
+	return n;
+}
+
+static unsigned long get_u64(const char *p)
+{
+	unsigned long n = 0;
+
+	for(int i=0; i<8; i++)
+		n |= (unsigned long)(unsigned char) p[i] << (8 * i);
+
+	return n;
+}
+
+static void put_frame_header(string &out, unsigned int length, unsigned char code, unsigned int tag)
+{
+	put_u32(out, length);
+	out.push_back((char) code);
+	put_u32(out, tag);
+}
+
+// keys go over the wire as the leading bytes of their Digest
+
+static void put_key(string &out, string_view hex)
+{
+	Digest digest;
+
+	convertHexToDigest(digest, hex);
+	out.append((const char *) digest.bytes, hex.size() / 2);
+}
+
+static string get_key(const char *p, unsigned int width)
+{
+	Digest digest;
+
+	memset(digest.bytes, 0, DIGEST_WIDTH);
+	memcpy(digest.bytes, p, min(width / 2, (unsigned int) DIGEST_WIDTH));
+	return convertDigestToHex(digest, width);
+}
+
+// how many keys the body of each op holds; -1 for an unknown op
+
+static int keys_of(unsigned char op)
+{
+	switch(op)
+	{
+		case SERVER_ANNOTATE:
+		case SERVER_UNANNOTATE:
+		case SERVER_HAS:
+			return 2;
+		case SERVER_LIST_ENTRIES:
+		case SERVER_LIST_ANNOTATIONS:
+		case SERVER_COUNT_ENTRIES:
+		case SERVER_COUNT_ANNOTATIONS:
+			return 1;
+		case SERVER_COMMIT:
+			return 0;
+		default:
+			return -1;
+	}
+}
+
+/////////////////////////////// AnnotationServer ///////////////////////////////
+
+AnnotationServer::AnnotationServer(ShardedAnnotationSet *s, string socketPath, unsigned int threadCount)
+{
+	store = s;
+	socket_path = socketPath;
+	threads = max(threadCount, 1u);
+	key_width = store->keyWidth();
+	key_bytes = key_width / 2;
+
+	// keys are decoded through a Digest
+	if(!supportedKeyWidth(key_width))
+		throw KeyWidthError(key_width);
+	listen_fd = stop_fd = -1;
+	warmer = NULL;
+	stop_warming = false;
+}
+
+AnnotationServer::~AnnotationServer()
+{
+	stop();
+}
+
+// a stale socket file, left by a server that did not stop cleanly, is replaced
+
+bool AnnotationServer::start()
+{
+	struct sockaddr_un address;
+
+	if(socket_path.size() >= sizeof(address.sun_path))
+		return false;
+
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strcpy(address.sun_path, socket_path.c_str());
+	unlink(socket_path.c_str());
+
+	listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+
+	if(listen_fd < 0 || bind(listen_fd, (struct sockaddr *) &address, sizeof(address)) != 0 || listen(listen_fd, 128) != 0)
+	{
+		stop();
+		return false;
+	}
+
+	stop_fd = eventfd(0, EFD_NONBLOCK);
+
+	for(unsigned int i=0; i<threads; i++)
+		workers.push_back(new thread(&AnnotationServer::worker, this));
+
+	return true;
+}
+
+// the stop event is never read, so it wakes every worker, and keeps waking them
+
+void AnnotationServer::stop()
+{
+	if(warmer != NULL)
+	{
+		stop_warming = true;
+		warmer->join();
+		delete(warmer);
+		warmer = NULL;
+	}
+
+	if(stop_fd >= 0)
+		eventfd_write(stop_fd, 1);
+
+	for(unsigned long i=0; i<workers.size(); i++)
+	{
+		workers[i]->join();
+		delete(workers[i]);
+	}
+
+	workers.clear();
+
+	if(listen_fd >= 0)
+	{
+		close(listen_fd);
+		unlink(socket_path.c_str());
+	}
+
+	if(stop_fd >= 0)
+		close(stop_fd);
+
+	listen_fd = stop_fd = -1;
+}
+
+// For a store opened without prefetching: read its hot keys in behind the
+// workers, so requests are served from the first moment, and the hot keys are
+// served from memory soon after. the warmer takes the store lock a chunk of
+// keys at a time, so requests wait at most for one chunk
+
+void AnnotationServer::warm_cache()
+{
+	if(warmer == NULL)
+	{
+		stop_warming = false;
+		warmer = new thread(&AnnotationServer::warm, this);
+	}
+}
+
+void AnnotationServer::warm()
+{
+	vector<string> As, Cs;
+
+	{
+		unique_lock<mutex> guard(store_lock);
+		store->hot_keys(As, Cs);
+	}
+
+	for(unsigned long i=0; !stop_warming && (i < As.size() || i < Cs.size()); i += WARM_CHUNK_KEYS)
+	{
+		vector<string> A_chunk(As.begin() + min(i, (unsigned long) As.size()),
+							   As.begin() + min(i + WARM_CHUNK_KEYS, (unsigned long) As.size()));
+		vector<string> C_chunk(Cs.begin() + min(i, (unsigned long) Cs.size()),
+							   Cs.begin() + min(i + WARM_CHUNK_KEYS, (unsigned long) Cs.size()));
+
+		unique_lock<mutex> guard(store_lock);
+		store->prefetch(A_chunk, C_chunk);
+	}
+}
+
+// each worker waits on the listening socket too; EPOLLEXCLUSIVE wakes only one
+// of them per new connection. the listening socket and the stop event are told
+// apart from connections by their data pointers. epoll reports a descriptor at
+// most once per wait, so a connection can be freed as soon as it closes
+
+void AnnotationServer::worker()
+{
+	const int MAX_EVENTS = 64;
+	struct epoll_event event, events[MAX_EVENTS];
+	int epoll_fd = epoll_create1(0);
+	set<Connection*> connections;
+	char *buffer = new char[SERVER_READ_BYTES];
+	bool stopping = false;
+
+	event.events = EPOLLIN | EPOLLEXCLUSIVE;
+	event.data.ptr = &listen_fd;
+	epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &event);
+
+	event.events = EPOLLIN;
+	event.data.ptr = &stop_fd;
+	epoll_ctl(epoll_fd, EPOLL_CTL_ADD, stop_fd, &event);
+
+	while(!stopping)
+	{
+		int n = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+
+		for(int i=0; i<n; i++)
+		{
+			if(events[i].data.ptr == &stop_fd)
+				stopping = true;
+			else if(events[i].data.ptr == &listen_fd)
+				accept_connections(epoll_fd, connections);
+			else
+			{
+				Connection *connection = (Connection *) events[i].data.ptr;
+				bool open = serve(epoll_fd, connection, buffer);
+
+				// closing the descriptor takes it out of the epoll set
+				if(!open)
+				{
+					close(connection->fd);
+					connections.erase(connection);
+					delete(connection);
+				}
+			}
+		}
+	}
+
+	for(set<Connection*>::iterator it = connections.begin(); it != connections.end(); it++)
+	{
+		close((*it)->fd);
+		delete(*it);
+	}
+
+	close(epoll_fd);
+	delete[] buffer;
+}
+
+// take every pending connection, greet it, and watch it from this worker
+
+void AnnotationServer::accept_connections(int epoll_fd, set<Connection*> &connections)
+{
+	int fd;
+
+	while((fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK)) >= 0)
+	{
+		Connection *connection = new Connection;
+		struct epoll_event event;
+
+		connection->fd = fd;
+		connection->paused = connection->read_closed = false;
+		connection->events = EPOLLIN;
+		put_u32(connection->output, SERVER_MAGIC);
+		connection->output.push_back((char) key_width);
+
+		event.events = EPOLLIN;
+		event.data.ptr = connection;
+		epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event);
+		connections.insert(connection);
+
+		if(!flush_output(connection))
+		{
+			close(fd);
+			connections.erase(connection);
+			delete(connection);
+		}
+		else
+			watch(epoll_fd, connection);
+	}
+}
+
+// read what is available, apply the complete requests read as one batch, and
+// write back what the socket takes. returns false once the connection should
+// be closed: it failed, sent a frame too large to be a request, or hung up
+// with every request it sent answered. requests stop being applied once the
+// output passes SERVER_HIGH_WATER, and the connection is paused, unread, until
+// that output is written; the requests left over are then applied on the next
+// round, which watching for EPOLLOUT brings about
+
+bool AnnotationServer::serve(int epoll_fd, Connection *connection, char *buffer)
+{
+	if(!read_input(connection, buffer) || !apply_input(connection) || !flush_output(connection))
+		return false;
+
+	if(connection->paused && connection->output.empty())
+		connection->paused = false;
+
+	// a peer that stopped sending is answered in full before it is closed
+	if(connection->read_closed && connection->output.empty() && !has_request(connection))
+		return false;
+
+	watch(epoll_fd, connection);
+	return true;
+}
+
+// read until the socket is empty, or SERVER_HIGH_WATER is buffered. the end of
+// the stream marks the connection read_closed; it is not read again
+
+bool AnnotationServer::read_input(Connection *connection, char *buffer)
+{
+	long n;
+
+	if(connection->paused || connection->read_closed)
+		return true;
+
+	while(connection->input.size() < SERVER_HIGH_WATER)
+	{
+		if((n = read(connection->fd, buffer, SERVER_READ_BYTES)) > 0)
+		{
+			connection->input.append(buffer, n);
+			continue;
+		}
+
+		if(n == 0)
+			connection->read_closed = true;
+		else if(errno != EAGAIN && errno != EWOULDBLOCK)
+			return false;
+
+		break;
+	}
+
+	return true;
+}
+
+// apply the complete requests buffered, under a single hold of the store lock,
+// until the output passes SERVER_HIGH_WATER
+
+bool AnnotationServer::apply_input(Connection *connection)
+{
+	vector<unsigned long> frames;
+	unsigned long pos = 0;
+
+	if(connection->paused)
+		return true;
+
+	while(connection->input.size() - pos >= SERVER_FRAME_HEADER)
+	{
+		unsigned int length = get_u32(connection->input.data() + pos);
+
+		if(length > SERVER_MAX_REQUEST)
+			return false;
+
+		if(connection->input.size() - pos < SERVER_FRAME_HEADER + length)
+			break;
+
+		frames.push_back(pos);
+		pos += SERVER_FRAME_HEADER + length;
+	}
+
+	if(!frames.empty())
+	{
+		unique_lock<mutex> guard(store_lock);
+
+		for(unsigned long i=0; i<frames.size(); i++)
+		{
+			const char *frame = connection->input.data() + frames[i];
+			unsigned int length = get_u32(frame);
+
+			if(connection->output.size() >= SERVER_HIGH_WATER)
+			{
+				pos = frames[i];
+				break;
+			}
+
+			apply(frame[4], get_u32(frame + 5), string_view(frame + SERVER_FRAME_HEADER, length), connection->output);
+		}
+	}
+
+	connection->input.erase(0, pos);
+	connection->paused = (connection->output.size() >= SERVER_HIGH_WATER);
+
+	return true;
+}
+
+// write what the socket takes
+
+bool AnnotationServer::flush_output(Connection *connection)
+{
+	unsigned long written = 0;
+	long n = 0;
+
+	while(written < connection->output.size() &&
+		  (n = send(connection->fd, connection->output.data() + written, connection->output.size() - written, MSG_NOSIGNAL)) > 0)
+		written += n;
+
+	if(n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+		return false;
+
+	connection->output.erase(0, written);
+	return true;
+}
+
+// whether a complete request, or one too large to be, waits in the input
+
+bool AnnotationServer::has_request(Connection *connection)
+{
+	if(connection->input.size() < SERVER_FRAME_HEADER)
+		return false;
+
+	unsigned int length = get_u32(connection->input.data());
+
+	return(length > SERVER_MAX_REQUEST || connection->input.size() >= SERVER_FRAME_HEADER + length);
+}
+
+// reads unless paused or read_closed; writes while there is output. requests
+// held over from a pause are waiting to be applied too: a socket with room is
+// reported writable at once, so they get their round without being read for
+
+void AnnotationServer::watch(int epoll_fd, Connection *connection)
+{
+	bool pending = !connection->output.empty() || (!connection->paused && has_request(connection));
+	unsigned int events = (connection->paused || connection->read_closed ? 0 : EPOLLIN) | (pending ? EPOLLOUT : 0);
+
+	if(events == connection->events)
+		return;
+
+	struct epoll_event event;
+
+	event.events = events;
+	event.data.ptr = connection;
+	epoll_ctl(epoll_fd, EPOLL_CTL_MOD, connection->fd, &event);
+	connection->events = events;
+}
+
+// run one request against the store, with the store lock held, and append
+// its response
+
+void AnnotationServer::apply(unsigned char op, unsigned int tag, string_view body, string &output)
+{
+	int keys = keys_of(op);
+	string response;
+
+	if(keys < 0 || body.size() != keys * key_bytes)
+	{
+		put_frame_header(output, 0, SERVER_BAD_REQUEST, tag);
+		return;
+	}
+
+	string first = (keys > 0 ? get_key(body.data(), key_width) : string());
+	string second = (keys > 1 ? get_key(body.data() + key_bytes, key_width) : string());
+	set<string> values;
+
+	switch(op)
+	{
+		case SERVER_ANNOTATE:
+			store->annotate_entry(first, second);
+			break;
+		case SERVER_UNANNOTATE:
+			store->unannotate_entry(first, second);
+			break;
+		case SERVER_LIST_ENTRIES:
+		case SERVER_LIST_ANNOTATIONS:
+			values = (op == SERVER_LIST_ENTRIES ? store->list_entries(first) : store->list_annotations(first));
+			put_u32(response, values.size());
+
+			for(set<string>::iterator it = values.begin(); it != values.end(); it++)
+				put_key(response, *it);
+			break;
+		case SERVER_HAS:
+			response.push_back((char) store->has_annotation(first, second));
+			break;
+		case SERVER_COUNT_ENTRIES:
+			put_u64(response, store->count_entries(first));
+			break;
+		case SERVER_COUNT_ANNOTATIONS:
+			put_u64(response, store->count_annotations(first));
+			break;
+		case SERVER_COMMIT:
+			store->commit_to_disk();
+			break;
+	}
+
+	put_frame_header(output, response.size(), SERVER_OK, tag);
+	output.append(response);
+}
+
+/////////////////////////////// AnnotationClient ///////////////////////////////
+
+// connected() tells whether the server was reached and greeted us
+
+AnnotationClient::AnnotationClient(string socketPath)
+{
+	struct sockaddr_un address;
+	char greeting[5];
+
+	key_width = next_tag = 0;
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strncpy(address.sun_path, socketPath.c_str(), sizeof(address.sun_path) - 1);
+
+	if(fd >= 0 && connect(fd, (struct sockaddr *) &address, sizeof(address)) == 0 &&
+	   read_exactly(greeting, sizeof(greeting)) && get_u32(greeting) == SERVER_MAGIC)
+		key_width = (unsigned char) greeting[4];
+	else if(fd >= 0)
+	{
+		close(fd);
+		fd = -1;
+	}
+}
+
+AnnotationClient::~AnnotationClient()
+{
+	if(fd >= 0)
+		close(fd);
+}
+
+bool AnnotationClient::connected()
+{
+	return(fd >= 0);
+}
+
+unsigned int AnnotationClient::keyWidth()
+{
+	return key_width;
+}
+
+// add a request to those waiting to be flushed; returns its tag
+
+unsigned int AnnotationClient::queue(ServerOp op, string_view first, string_view second)
+{
+	unsigned int tag = next_tag++;
+
+	put_frame_header(output, (first.size() + second.size()) / 2, op, tag);
+
+	if(!first.empty())
+		put_key(output, first);
+	if(!second.empty())
+		put_key(output, second);
+
+	return tag;
+}
+
+bool AnnotationClient::flush()
+{
+	unsigned long written = 0;
+	long n;
+
+	while(written < output.size() && (n = send(fd, output.data() + written, output.size() - written, MSG_NOSIGNAL)) > 0)
+		written += n;
+
+	bool sent = (written == output.size());
+	output.clear();
+
+	return sent;
+}
+
+// stop sending; the answers to what was sent still come back
+
+bool AnnotationClient::finish()
+{
+	return(fd >= 0 && shutdown(fd, SHUT_WR) == 0);
+}
+
+bool AnnotationClient::read_exactly(char *buf, unsigned long bytes)
+{
+	unsigned long done = 0;
+	long n;
+
+	while(done < bytes && (n = read(fd, buf + done, bytes - done)) > 0)
+		done += n;
+
+	return(done == bytes);
+}
+
+// the next response, in the order the requests were sent
+
+bool AnnotationClient::receive(ServerResponse &response)
+{
+	char header[SERVER_FRAME_HEADER];
+
+	if(fd < 0 || !read_exactly(header, sizeof(header)))
+		return false;
+
+	response.status = header[4];
+	response.tag = get_u32(header + 5);
+	response.body.resize(get_u32(header));
+
+	return read_exactly(&response.body[0], response.body.size());
+}
+
+set<string> AnnotationClient::decodeKeys(const ServerResponse &response)
+{
+	set<string> keys;
+	unsigned int key_bytes = key_width / 2;
+
+	if(response.status != SERVER_OK || response.body.size() < 4)
+		return keys;
+
+	unsigned long count = get_u32(response.body.data());
+
+	for(unsigned long i=0; i<count && 4 + (i + 1) * key_bytes <= response.body.size(); i++)
+		keys.insert(keys.end(), get_key(response.body.data() + 4 + i * key_bytes, key_width));
+
+	return keys;
+}
+
+unsigned long AnnotationClient::decodeCount(const ServerResponse &response)
+{
+	if(response.status != SERVER_OK || response.body.size() < 8)
+		return 0;
+
+	return get_u64(response.body.data());
+}
+
+ServerResponse AnnotationClient::call(ServerOp op, string_view first, string_view second)
+{
+	ServerResponse response;
+
+	queue(op, first, second);
+	response.status = SERVER_BAD_REQUEST;
+
+	if(!flush() || !receive(response))
+		response.status = SERVER_BAD_REQUEST;
+
+	return response;
+}
+
+void AnnotationClient::annotate_entry(string_view A, string_view C)
+{
+	call(SERVER_ANNOTATE, A, C);
+}
+
+void AnnotationClient::unannotate_entry(string_view A, string_view C)
+{
+	call(SERVER_UNANNOTATE, A, C);
+}
+
+set<string> AnnotationClient::list_entries(string_view A)
+{
+	return decodeKeys(call(SERVER_LIST_ENTRIES, A));
+}
+
+set<string> AnnotationClient::list_annotations(string_view C)
+{
+	return decodeKeys(call(SERVER_LIST_ANNOTATIONS, C));
+}
+
+bool AnnotationClient::has_annotation(string_view A, string_view C)
+{
+	ServerResponse response = call(SERVER_HAS, A, C);
+	return(response.status == SERVER_OK && response.body.size() == 1 && response.body[0] != 0);
+}
+
+unsigned long AnnotationClient::count_entries(string_view A)
+{
+	return decodeCount(call(SERVER_COUNT_ENTRIES, A));
+}
+
+unsigned long AnnotationClient::count_annotations(string_view C)
+{
+	return decodeCount(call(SERVER_COUNT_ANNOTATIONS, C));
+}
+
+void AnnotationClient::commit_to_disk()
+{
+	call(SERVER_COMMIT);
+}
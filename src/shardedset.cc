@@ -0,0 +1,668 @@
+#include "shardedset.h"
+
+static string shards_filename(string directory_path)
+{
+	return directory_path + "/shards.txt";
+}
+
+static string shard_directory(string directory_path, unsigned int index)
+{
+	return directory_path + "/shard-" + convertIntToHex(index, 4);
+}
+
+// an existing directory keeps the shard count and key width it was created
+// with. directories from before the width was recorded hold SHA-1 keys
+
+ShardedAnnotationSet::ShardedAnnotationSet(string dir_path, string hashTableType, unsigned int shardBits,
+										   unsigned int keyWidth)
+{
+	directory_path = dir_path;
+	shard_bits = shardBits;
+	key_width = keyWidth;
+
+	finish_reshard(directory_path);
+	mkdir(directory_path.c_str(),0777);
+
+	fstream file(shards_filename(directory_path).c_str(), fstream::in);
+
+	if(file.good())
+	{
+		file >> shard_bits;
+		if(!(file >> key_width))
+			key_width = SHA_WIDTH;
+	}
+	else
+	{
+		fstream newFile(shards_filename(directory_path).c_str(), fstream::out | fstream::trunc);
+		newFile << shard_bits << " " << key_width << endl;
+		newFile.close();
+	}
+
+	file.close();
+
+	if(!supportedKeyWidth(key_width))
+		throw KeyWidthError(key_width);
+
+	for(unsigned int i=0; i < (1u << shard_bits); i++)
+		shards.push_back(new AnnotationSet(shard_directory(directory_path, i), hashTableType, shard_bits, i, key_width));
+
+	Cross_Log.setPath(directory_path + "/cross-");
+}
+
+ShardedAnnotationSet::~ShardedAnnotationSet()
+{
+	for(unsigned long i=0; i<shards.size(); i++)
+		delete(shards[i]);
+}
+
+unsigned int ShardedAnnotationSet::shardBits()
+{
+	return shard_bits;
+}
+
+unsigned int ShardedAnnotationSet::keyWidth()
+{
+	return key_width;
+}
+
+AnnotationSet *ShardedAnnotationSet::shard_for(string_view key)
+{
+	return shards[convertKeyToShard(key, shard_bits)];
+}
+
+// run a method on every shard, one thread per shard, at most as many at once
+// as there are hardware threads
+
+void ShardedAnnotationSet::run_parallel(void (AnnotationSet::*method)())
+{
+	unsigned long width = max(thread::hardware_concurrency(), 1u);
+
+	for(unsigned long i=0; i<shards.size(); i += width)
+	{
+		vector<thread*> workers;
+
+		for(unsigned long j=i; j<shards.size() && j<i+width; j++)
+			workers.push_back(new thread(method, shards[j]));
+
+		for(unsigned long j=0; j<workers.size(); j++)
+		{
+			workers[j]->join();
+			delete workers[j];
+		}
+	}
+}
+
+static void apply_entry(AnnotationSet *shard, Log::Op cmd, string_view A, string_view C)
+{
+	if(cmd == Log::ANNOTATE)
+		shard->annotate_entry(A, C);
+	else
+		shard->unannotate_entry(A, C);
+}
+
+void ShardedAnnotationSet::initialize()
+{
+	run_parallel(&AnnotationSet::initialize);
+	replay_cross_log();
+}
+
+// a cross-shard write may have reached one shard's log, both or neither when
+// the last run stopped. each is applied to both shards again, in order, which
+// also logs it in both; the shard logs then hold everything the cross log did.
+// a line cut short by the crash is dropped
+
+void ShardedAnnotationSet::replay_cross_log()
+{
+	{
+		LogFileReader reader(Cross_Log);
+		Log::command entry;
+
+		while(reader.next(entry))
+		{
+			if(entry.A.size() != key_width || entry.C.size() != key_width || (entry.cmd != Log::ANNOTATE && entry.cmd != Log::UNANNOTATE))
+				continue;
+
+			apply_entry(shard_for(entry.A), entry.cmd, entry.A, entry.C);
+			apply_entry(shard_for(entry.C), entry.cmd, entry.A, entry.C);
+		}
+	}
+
+	Cross_Log.clear();
+}
+
+// every shard's commit covers its side of the cross-shard writes, so the cross
+// log is only dropped once they all finish
+
+void ShardedAnnotationSet::commit_to_disk()
+{
+	run_parallel(&AnnotationSet::commit_to_disk);
+	Cross_Log.clear();
+}
+
+void ShardedAnnotationSet::set_commit_memory_limit(unsigned long bytes)
+{
+	for(unsigned long i=0; i<shards.size(); i++)
+		shards[i]->set_commit_memory_limit(bytes);
+}
+
+void ShardedAnnotationSet::set_search_mode(SearchMode mode)
+{
+	for(unsigned long i=0; i<shards.size(); i++)
+		shards[i]->set_search_mode(mode);
+}
+
+// shard by shard, so the timings are not taken while other shards compete
+
+void ShardedAnnotationSet::tune_index(unsigned long lookups)
+{
+	for(unsigned long i=0; i<shards.size(); i++)
+		shards[i]->tune_index(lookups);
+}
+
+// the snapshot is read once, each side of every pair going to the sorter of
+// the shard that owns its key; the memory budget is split between the 2^k
+// pairs of sorters. the shards are then written threads at a time
+
+void ShardedAnnotationSet::bulk_load(string snapshot_filename, unsigned long memory_limit, unsigned int threads)
+{
+	vector<ExternalSorter*> A2C_Sorters, C2A_Sorters;
+	unsigned long sorter_memory = memory_limit / (2 * shards.size());
+
+	for(unsigned int i=0; i<shards.size(); i++)
+	{
+		string shard_path = shard_directory(directory_path, i);
+
+		A2C_Sorters.push_back(new ExternalSorter(shard_path + "/A2C-tmp/bulk-", 2 * key_width, sorter_memory));
+		C2A_Sorters.push_back(new ExternalSorter(shard_path + "/C2A-tmp/bulk-", 2 * key_width, sorter_memory));
+	}
+
+	fstream file(snapshot_filename.c_str(), fstream::in);
+	string line;
+	char record[2 * MAX_KEY_WIDTH];
+
+	while(getline(file, line))
+	{
+		if(line.size() < 2 * key_width + 1)
+			continue;
+
+		const char *A = line.c_str(), *C = line.c_str() + key_width + 1;
+
+		memcpy(record, A, key_width);
+		memcpy(record + key_width, C, key_width);
+		A2C_Sorters[convertKeyToShard(string_view(A, key_width), shard_bits)]->add(record);
+
+		memcpy(record, C, key_width);
+		memcpy(record + key_width, A, key_width);
+		C2A_Sorters[convertKeyToShard(string_view(C, key_width), shard_bits)]->add(record);
+	}
+
+	file.close();
+
+	unsigned long width = min((unsigned long)max(threads, 1u), (unsigned long)shards.size());
+
+	for(unsigned long i=0; i<shards.size(); i += width)
+	{
+		vector<thread*> workers;
+
+		for(unsigned long j=i; j<shards.size() && j<i+width; j++)
+			workers.push_back(new thread([this, j, &A2C_Sorters, &C2A_Sorters]()
+				{ shards[j]->bulk_load(A2C_Sorters[j], C2A_Sorters[j]); }));
+
+		for(unsigned long j=0; j<workers.size(); j++)
+		{
+			workers[j]->join();
+			delete workers[j];
+		}
+	}
+
+	for(unsigned long i=0; i<shards.size(); i++)
+	{
+		delete A2C_Sorters[i];
+		delete C2A_Sorters[i];
+	}
+}
+
+void ShardedAnnotationSet::annotate_entry(string_view A, string_view C)
+{
+	modify_entry(Log::ANNOTATE, A, C);
+}
+
+void ShardedAnnotationSet::unannotate_entry(string_view A, string_view C)
+{
+	modify_entry(Log::UNANNOTATE, A, C);
+}
+
+// a pair is written to the shard of A (for its A2C side) and, if different,
+// to the shard of C (for its C2A side), after going into the cross log
+
+void ShardedAnnotationSet::modify_entry(Log::Op cmd, string_view A, string_view C)
+{
+	AnnotationSet *A_shard = shard_for(A), *C_shard = shard_for(C);
+
+	if(C_shard != A_shard)
+		Cross_Log.addEntry(cmd, A, C);
+
+	apply_entry(A_shard, cmd, A, C);
+	if(C_shard != A_shard)
+		apply_entry(C_shard, cmd, A, C);
+}
+
+set<string> ShardedAnnotationSet::list_annotations(string_view C)
+{
+	return shard_for(C)->list_annotations(C);
+}
+
+set<string> ShardedAnnotationSet::list_entries(string_view A)
+{
+	return shard_for(A)->list_entries(A);
+}
+
+ValuePage ShardedAnnotationSet::list_annotations(string_view C, unsigned long limit, string_view cursor)
+{
+	return shard_for(C)->list_annotations(C, limit, cursor);
+}
+
+ValuePage ShardedAnnotationSet::list_entries(string_view A, unsigned long limit, string_view cursor)
+{
+	return shard_for(A)->list_entries(A, limit, cursor);
+}
+
+bool ShardedAnnotationSet::has_annotation(string_view A, string_view C)
+{
+	return shard_for(A)->has_annotation(A, C);
+}
+
+unsigned long ShardedAnnotationSet::count_entries(string_view A)
+{
+	return shard_for(A)->count_entries(A);
+}
+
+unsigned long ShardedAnnotationSet::count_annotations(string_view C)
+{
+	return shard_for(C)->count_annotations(C);
+}
+
+// shards are ordered by key, so a range covers a contiguous run of them: from
+// the shard of the smallest key >= low, to that of the largest key under high
+
+void ShardedAnnotationSet::shard_range(string low, string high, unsigned int &first, unsigned int &last)
+{
+	low.append(key_width - min(low.size(), (size_t)key_width), '0');
+	high.append(key_width - min(high.size(), (size_t)key_width), 'f');
+
+	first = convertKeyToShard(low, shard_bits);
+	last = convertKeyToShard(high, shard_bits);
+}
+
+map<string, set<string> > ShardedAnnotationSet::list_entries_by_prefix(string prefix)
+{
+	return list_entries_in_range(prefix, prefix);
+}
+
+map<string, set<string> > ShardedAnnotationSet::list_annotations_by_prefix(string prefix)
+{
+	return list_annotations_in_range(prefix, prefix);
+}
+
+map<string, set<string> > ShardedAnnotationSet::list_entries_in_range(string low, string high)
+{
+	map<string, set<string> > result, part;
+	unsigned int first, last;
+
+	shard_range(low, high, first, last);
+
+	for(unsigned int i=first; i<=last && i<shards.size(); i++)
+	{
+		part = shards[i]->list_entries_in_range(low, high);
+		result.insert(part.begin(), part.end());
+	}
+
+	return result;
+}
+
+map<string, set<string> > ShardedAnnotationSet::list_annotations_in_range(string low, string high)
+{
+	map<string, set<string> > result, part;
+	unsigned int first, last;
+
+	shard_range(low, high, first, last);
+
+	for(unsigned int i=first; i<=last && i<shards.size(); i++)
+	{
+		part = shards[i]->list_annotations_in_range(low, high);
+		result.insert(part.begin(), part.end());
+	}
+
+	return result;
+}
+
+set<string> ShardedAnnotationSet::intersect_entries(vector<string> As)
+{
+	return multi_lookup(As, true, true);
+}
+
+set<string> ShardedAnnotationSet::union_entries(vector<string> As)
+{
+	return multi_lookup(As, true, false);
+}
+
+set<string> ShardedAnnotationSet::intersect_annotations(vector<string> Cs)
+{
+	return multi_lookup(Cs, false, true);
+}
+
+set<string> ShardedAnnotationSet::union_annotations(vector<string> Cs)
+{
+	return multi_lookup(Cs, false, false);
+}
+
+// group the keys by shard, let each shard combine its own group, then combine
+// the per-shard results. an empty intersection stops at once
+
+set<string> ShardedAnnotationSet::multi_lookup(vector<string> keys, bool entries, bool intersect)
+{
+	map<unsigned int, vector<string> > groups;
+	map<unsigned int, vector<string> >::iterator it;
+	set<string> result, part;
+
+	for(unsigned long i=0; i<keys.size(); i++)
+		groups[convertKeyToShard(keys[i], shard_bits)].push_back(keys[i]);
+
+	for(it = groups.begin(); it != groups.end(); it++)
+	{
+		AnnotationSet *shard = shards[it->first];
+
+		if(intersect)
+			part = (entries ? shard->intersect_entries(it->second) : shard->intersect_annotations(it->second));
+		else
+			part = (entries ? shard->union_entries(it->second) : shard->union_annotations(it->second));
+
+		if(!intersect)
+			result.insert(part.begin(), part.end());
+		else if(it == groups.begin())
+			result = part;
+		else
+		{
+			set<string> combined;
+			set_intersection(result.begin(), result.end(), part.begin(), part.end(),
+							 inserter(combined, combined.begin()));
+			result = combined;
+		}
+
+		if(intersect && result.empty())
+			break;
+	}
+
+	return result;
+}
+
+vector<set<string> > ShardedAnnotationSet::list_entries_batch(vector<string> As)
+{
+	return batch_lookup(As, true);
+}
+
+vector<set<string> > ShardedAnnotationSet::list_annotations_batch(vector<string> Cs)
+{
+	return batch_lookup(Cs, false);
+}
+
+// the hot key capacity applies to each shard, and every shard keeps, saves and
+// prefetches its own hot keys; on initialize, they are read in by all shards at
+// once
+
+void ShardedAnnotationSet::set_hot_key_capacity(unsigned long keys)
+{
+	for(unsigned long i=0; i<shards.size(); i++)
+		shards[i]->set_hot_key_capacity(keys);
+}
+
+void ShardedAnnotationSet::set_prefetch_on_start(bool prefetch)
+{
+	for(unsigned long i=0; i<shards.size(); i++)
+		shards[i]->set_prefetch_on_start(prefetch);
+}
+
+void ShardedAnnotationSet::save_hot_keys()
+{
+	for(unsigned long i=0; i<shards.size(); i++)
+		shards[i]->save_hot_keys();
+}
+
+// the shards' lists taken in turns, so the hottest keys of every shard come
+// before the cooler keys of any
+
+void ShardedAnnotationSet::hot_keys(vector<string> &As, vector<string> &Cs)
+{
+	vector<vector<string> > shard_As(shards.size()), shard_Cs(shards.size());
+	unsigned long longest = 0;
+
+	As.clear();
+	Cs.clear();
+
+	for(unsigned long i=0; i<shards.size(); i++)
+	{
+		shards[i]->hot_keys(shard_As[i], shard_Cs[i]);
+		longest = max(longest, (unsigned long) max(shard_As[i].size(), shard_Cs[i].size()));
+	}
+
+	for(unsigned long rank=0; rank<longest; rank++)
+		for(unsigned long i=0; i<shards.size(); i++)
+		{
+			if(rank < shard_As[i].size())
+				As.push_back(shard_As[i][rank]);
+			if(rank < shard_Cs[i].size())
+				Cs.push_back(shard_Cs[i][rank]);
+		}
+}
+
+void ShardedAnnotationSet::prefetch(vector<string> As, vector<string> Cs)
+{
+	vector<vector<string> > shard_As(shards.size()), shard_Cs(shards.size());
+
+	for(unsigned long i=0; i<As.size(); i++)
+		shard_As[convertKeyToShard(As[i], shard_bits)].push_back(As[i]);
+
+	for(unsigned long i=0; i<Cs.size(); i++)
+		shard_Cs[convertKeyToShard(Cs[i], shard_bits)].push_back(Cs[i]);
+
+	for(unsigned long i=0; i<shards.size(); i++)
+		if(!shard_As[i].empty() || !shard_Cs[i].empty())
+			shards[i]->prefetch(shard_As[i], shard_Cs[i]);
+}
+
+void ShardedAnnotationSet::prefetch_hot_keys()
+{
+	run_parallel(&AnnotationSet::prefetch_hot_keys);
+}
+
+// each shard answers its own keys as one batch; results go back to the
+// positions the keys came from
+
+vector<set<string> > ShardedAnnotationSet::batch_lookup(vector<string> keys, bool entries)
+{
+	map<unsigned int, vector<unsigned long> > groups;
+	map<unsigned int, vector<unsigned long> >::iterator it;
+	vector<set<string> > results(keys.size()), part;
+
+	for(unsigned long i=0; i<keys.size(); i++)
+		groups[convertKeyToShard(keys[i], shard_bits)].push_back(i);
+
+	for(it = groups.begin(); it != groups.end(); it++)
+	{
+		vector<string> group_keys;
+
+		for(unsigned long j=0; j<it->second.size(); j++)
+			group_keys.push_back(keys[it->second[j]]);
+
+		AnnotationSet *shard = shards[it->first];
+		part = (entries ? shard->list_entries_batch(group_keys) : shard->list_annotations_batch(group_keys));
+
+		for(unsigned long j=0; j<it->second.size(); j++)
+			results[it->second[j]].swap(part[j]);
+	}
+
+	return results;
+}
+
+void ShardedAnnotationSet::sweep_entries(vector<string> As, SweepCallback callback)
+{
+	sweep_lookup(As, callback, true);
+}
+
+void ShardedAnnotationSet::sweep_annotations(vector<string> Cs, SweepCallback callback)
+{
+	sweep_lookup(Cs, callback, false);
+}
+
+// shards split the key space on the leading bits, so sweeping each shard's
+// keys, shard by shard, hands over the whole batch in key order
+
+void ShardedAnnotationSet::sweep_lookup(vector<string> keys, SweepCallback callback, bool entries)
+{
+	vector<vector<string> > groups(shards.size());
+
+	for(unsigned long i=0; i<keys.size(); i++)
+		groups[convertKeyToShard(keys[i], shard_bits)].push_back(keys[i]);
+
+	for(unsigned int shard=0; shard<shards.size(); shard++)
+	{
+		if(groups[shard].empty())
+			continue;
+
+		if(entries)
+			shards[shard]->sweep_entries(groups[shard], callback);
+		else
+			shards[shard]->sweep_annotations(groups[shard], callback);
+	}
+}
+
+static string reshard_directory_name(string directory_path)
+{
+	return directory_path + ".reshard";
+}
+
+static string old_directory_name(string directory_path)
+{
+	return directory_path + ".old";
+}
+
+// written once the new store is complete, and removed once the old one is
+// gone; while it exists, the new store is to replace the old
+static string swap_marker_filename(string directory_path)
+{
+	return directory_path + ".reshard-swap";
+}
+
+// the swap renames the store aside, renames the new one into its place, then
+// deletes the old one. without the marker, any new store is an unfinished
+// build and is dropped; with it, whichever renames are missing are redone
+
+bool finish_reshard(string directory_path)
+{
+	string new_directory = reshard_directory_name(directory_path), old_directory = old_directory_name(directory_path);
+	struct stat st;
+
+	if(stat(swap_marker_filename(directory_path).c_str(), &st) != 0)
+	{
+		if(stat(new_directory.c_str(), &st) == 0)
+			dir_delete(new_directory);
+
+		unlink((directory_path + ".reshard-snapshot").c_str());
+		return true;
+	}
+
+	if(stat(new_directory.c_str(), &st) == 0)
+	{
+		if(stat(directory_path.c_str(), &st) == 0 && rename(directory_path.c_str(), old_directory.c_str()) != 0)
+			return false;
+
+		if(rename(new_directory.c_str(), directory_path.c_str()) != 0)
+			return false;
+	}
+
+	if(stat(old_directory.c_str(), &st) == 0)
+		dir_delete(old_directory);
+
+	unlink(swap_marker_filename(directory_path).c_str());
+	return true;
+}
+
+// dump every committed pair to a snapshot (each pair appears exactly once across
+// the A2C files), build the new store aside from it with the same key width,
+// then swap directories
+
+bool reshard_directory(string directory_path, unsigned int shardBits, string hashTableType)
+{
+	string snapshot_filename = directory_path + ".reshard-snapshot";
+	string new_directory = reshard_directory_name(directory_path);
+	vector<string> A2C_directories;
+	unsigned int key_width;
+	struct stat st;
+
+	// settle any earlier attempt before reading the store
+	if(!finish_reshard(directory_path))
+		return false;
+
+	if(stat(shards_filename(directory_path).c_str(), &st) == 0)
+	{
+		ShardedAnnotationSet source(directory_path, hashTableType);
+		source.initialize();
+		source.commit_to_disk();
+		key_width = source.keyWidth();
+
+		for(unsigned int i=0; i < (1u << source.shardBits()); i++)
+			A2C_directories.push_back(shard_directory(directory_path, i) + "/A2C/");
+	}
+	else
+	{
+		AnnotationSet source(directory_path, hashTableType);
+		source.initialize();
+		source.commit_to_disk();
+		key_width = source.keyWidth();
+
+		A2C_directories.push_back(directory_path + "/A2C/");
+	}
+
+	fstream snapshot(snapshot_filename.c_str(), fstream::out | fstream::trunc);
+	string key, value;
+
+	for(unsigned long i=0; i<A2C_directories.size(); i++)
+	{
+		HashFile *A2C_File;
+
+		if(hashTableType == "GappedHashFile")
+			A2C_File = new GappedHashFile(A2C_directories[i]);
+		else if(hashTableType == "EncodedHashFile")
+			A2C_File = new EncodedHashFile(A2C_directories[i]);
+		else
+			A2C_File = new HashFile(A2C_directories[i]);
+
+		HashFileScanner *scanner = new HashFileScanner(A2C_File);
+
+		while(scanner->next(key, value))
+			snapshot << key << " " << value << "\n";
+
+		delete(scanner);
+		delete(A2C_File);
+	}
+
+	snapshot.close();
+
+	dir_delete(new_directory);
+	{
+		ShardedAnnotationSet target(new_directory, hashTableType, shardBits, key_width);
+		target.initialize();
+		target.bulk_load(snapshot_filename);
+	}
+
+	unlink(snapshot_filename.c_str());
+
+	fstream marker(swap_marker_filename(directory_path).c_str(), fstream::out | fstream::trunc);
+	marker << new_directory << endl;
+	marker.close();
+
+	if(!marker)
+		return false;
+
+	return finish_reshard(directory_path);
+}
@@ -0,0 +1,510 @@
+#include "snapshot.h"
+
+///////////////////////////////// SnapshotFiles ////////////////////////////////
+
+// a snapshot directory left over from an earlier process of the same pid is
+// stale, and is replaced
+
+SnapshotFiles::SnapshotFiles(string directory_path, string snapshotPath)
+{
+	snapshot_path = snapshotPath;
+	linked = true;
+
+	dir_delete(snapshot_path);
+	mkdir(snapshot_path.c_str(), 0777);
+	mkdir((snapshot_path + "A2C/").c_str(), 0777);
+	mkdir((snapshot_path + "C2A/").c_str(), 0777);
+
+	link_directory(directory_path + "/A2C/", snapshot_path + "A2C/");
+	link_directory(directory_path + "/C2A/", snapshot_path + "C2A/");
+}
+
+// the live files of a set, left where they are
+
+SnapshotFiles::SnapshotFiles(string directory_path)
+{
+	snapshot_path = directory_path + "/";
+	linked = false;
+}
+
+SnapshotFiles::~SnapshotFiles()
+{
+	if(linked)
+		dir_delete(snapshot_path);
+}
+
+string SnapshotFiles::getPath()
+{
+	return snapshot_path;
+}
+
+// a hard link is a new name for the same file, so it costs nothing to make and
+// keeps the file alive after the original name is renamed over. copy instead
+// on a file system without them
+
+void SnapshotFiles::link_directory(string from, string to)
+{
+	struct dirent *de = NULL;
+	DIR *d = NULL;
+
+	if((d = opendir(from.c_str())) == NULL)
+		return;
+
+	while((de = readdir(d)) != NULL)
+	{
+		if(de->d_type == DT_DIR)
+			continue;
+
+		string source = from + de->d_name, target = to + de->d_name;
+
+		if(link(source.c_str(), target.c_str()) != 0)
+			file_copy(source.c_str(), target.c_str());
+	}
+
+	closedir(d);
+}
+
+////////////////////////////// AnnotationSnapshot //////////////////////////////
+
+// orders changes by key alone, to find the run of changes of one key
+
+struct DeltaKeyLess
+{
+	bool operator()(const DeltaChange &c1, const DeltaChange &c2) const
+	{
+		return c1.key < c2.key;
+	}
+};
+
+// the changes of a key, as [first, last). a key of another width has none
+
+static void key_changes(const DeltaList &delta, string_view key, unsigned int width,
+						DeltaList::const_iterator &first, DeltaList::const_iterator &last)
+{
+	DeltaChange probe;
+
+	if(key.size() != width)
+	{
+		first = last = delta.end();
+		return;
+	}
+
+	convertHexToDigest(probe.key, key);
+	first = lower_bound(delta.begin(), delta.end(), probe, DeltaKeyLess());
+	last = upper_bound(first, delta.end(), probe, DeltaKeyLess());
+}
+
+AnnotationSnapshot::AnnotationSnapshot(
+	shared_ptr<SnapshotFiles> files,
+	shared_ptr<const SnapshotDelta> delta,
+	string hashTableType,
+	unsigned long generation,
+	unsigned long sequence
+	)
+	: state(new State, release)
+{
+	string path = files->getPath();
+
+	state->files = files;
+	state->delta = delta;
+	state->generation = generation;
+	state->sequence = sequence;
+
+	if(hashTableType == string("BTreeFile"))
+	{
+		state->A2C_File = new BTreeFile(path + "A2C/");
+		state->C2A_File = new BTreeFile(path + "C2A/");
+	}
+	else if(hashTableType == string("GappedHashFile"))
+	{
+		state->A2C_File = new GappedHashFile(path + "A2C/");
+		state->C2A_File = new GappedHashFile(path + "C2A/");
+	}
+	else if(hashTableType == string("EncodedHashFile"))
+	{
+		state->A2C_File = new EncodedHashFile(path + "A2C/");
+		state->C2A_File = new EncodedHashFile(path + "C2A/");
+	}
+	else
+	{
+		state->A2C_File = new HashFile(path + "A2C/");
+		state->C2A_File = new HashFile(path + "C2A/");
+	}
+
+	state->A2C_File->setMapped(true);
+	state->C2A_File->setMapped(true);
+	state->arena.setKeyWidth(state->A2C_File->keyWidth());
+}
+
+// the files are closed before the last reference to their directory goes
+
+void AnnotationSnapshot::release(State *state)
+{
+	delete(state->A2C_File);
+	delete(state->C2A_File);
+	delete(state);
+}
+
+unsigned long AnnotationSnapshot::generation()
+{
+	return state->generation;
+}
+
+unsigned long AnnotationSnapshot::sequence()
+{
+	return state->sequence;
+}
+
+unsigned int AnnotationSnapshot::keyWidth()
+{
+	return state->A2C_File->keyWidth();
+}
+
+set<string> AnnotationSnapshot::list_annotations(string_view C)
+{
+	return point_lookup(C, state->delta->C2A, state->C2A_File);
+}
+
+set<string> AnnotationSnapshot::list_entries(string_view A)
+{
+	return point_lookup(A, state->delta->A2C, state->A2C_File);
+}
+
+ValuePage AnnotationSnapshot::list_annotations(string_view C, unsigned long limit, string_view cursor)
+{
+	return page_lookup(C, limit, cursor, state->delta->C2A, state->C2A_File);
+}
+
+ValuePage AnnotationSnapshot::list_entries(string_view A, unsigned long limit, string_view cursor)
+{
+	return page_lookup(A, limit, cursor, state->delta->A2C, state->A2C_File);
+}
+
+void AnnotationSnapshot::sweep_annotations(vector<string> Cs, SweepCallback callback)
+{
+	sweep_lookup(Cs, callback, state->delta->C2A, state->C2A_File);
+}
+
+void AnnotationSnapshot::sweep_entries(vector<string> As, SweepCallback callback)
+{
+	sweep_lookup(As, callback, state->delta->A2C, state->A2C_File);
+}
+
+bool AnnotationSnapshot::has_annotation(string_view A, string_view C)
+{
+	const DeltaList &delta = state->delta->A2C;
+	unsigned int width = keyWidth();
+
+	if(A.size() == width && C.size() == width)
+	{
+		DeltaChange probe;
+
+		convertHexToDigest(probe.key, A);
+		convertHexToDigest(probe.value, C);
+
+		DeltaList::const_iterator change = lower_bound(delta.begin(), delta.end(), probe);
+
+		if(change != delta.end() && change->key == probe.key && change->value == probe.value)
+			return change->bound;
+	}
+
+	return state->A2C_File->has(string(A), string(C));
+}
+
+unsigned long AnnotationSnapshot::count_entries(string_view A)
+{
+	return count_lookup(A, state->delta->A2C, state->A2C_File);
+}
+
+unsigned long AnnotationSnapshot::count_annotations(string_view C)
+{
+	return count_lookup(C, state->delta->C2A, state->C2A_File);
+}
+
+map<string, set<string> > AnnotationSnapshot::list_entries_by_prefix(string prefix)
+{
+	return range_lookup(prefix, prefix, state->delta->A2C, state->A2C_File);
+}
+
+map<string, set<string> > AnnotationSnapshot::list_entries_in_range(string low, string high)
+{
+	return range_lookup(low, high, state->delta->A2C, state->A2C_File);
+}
+
+map<string, set<string> > AnnotationSnapshot::list_annotations_by_prefix(string prefix)
+{
+	return range_lookup(prefix, prefix, state->delta->C2A, state->C2A_File);
+}
+
+map<string, set<string> > AnnotationSnapshot::list_annotations_in_range(string low, string high)
+{
+	return range_lookup(low, high, state->delta->C2A, state->C2A_File);
+}
+
+// the values on file, with the key's changes applied over them
+
+set<string> AnnotationSnapshot::point_lookup(string_view key, const DeltaList &delta, HashFile *hash_file)
+{
+	ValueSet values(&state->arena);
+	hash_file->get(string(key), values);
+
+	set<string> result = values.toStringSet();
+	apply_changes(result, key, delta);
+
+	return result;
+}
+
+void AnnotationSnapshot::apply_changes(set<string> &values, string_view key, const DeltaList &delta)
+{
+	DeltaList::const_iterator change, last;
+	unsigned int width = keyWidth();
+
+	for(key_changes(delta, key, width, change, last); change != last; change++)
+	{
+		if(change->bound)
+			values.insert(convertDigestToHex(change->value, width));
+		else
+			values.erase(convertDigestToHex(change->value, width));
+	}
+}
+
+// a sweep of the files, in key order, with each key's changes applied as it
+// is handed over
+
+void AnnotationSnapshot::sweep_lookup(vector<string> keys, SweepCallback callback, const DeltaList &delta, HashFile *hash_file)
+{
+	sort(keys.begin(), keys.end());
+	keys.erase(unique(keys.begin(), keys.end()), keys.end());
+
+	hash_file->sweep(keys, [&](const string &key, ValueSet &values)
+	{
+		set<string> result = values.toStringSet();
+		apply_changes(result, key, delta);
+		callback(key, result);
+	});
+}
+
+// the values after the cursor, on file, merged in order with the key's changes
+// after it. the file is read a page at a time until the page fills, so only as
+// many values are held as the page has, plus any unbound on the way
+
+ValuePage AnnotationSnapshot::page_lookup(
+	string_view key,
+	unsigned long limit,
+	string_view cursor,
+	const DeltaList &delta,
+	HashFile *hash_file
+	)
+{
+	ValuePage page;
+	DeltaList::const_iterator change, last;
+	unsigned int width = keyWidth();
+	vector<string> chunk;
+	string file_after(cursor), change_value;
+	unsigned long next = 0;
+	bool file_done = false;
+
+	key_changes(delta, key, width, change, last);
+
+	while(change != last && (change_value = convertDigestToHex(change->value, width)) <= cursor)
+		change++;
+
+	if(limit == 0)
+	{
+		page.cursor = string(cursor);
+		return page;
+	}
+
+	// room for the one extra value read from the file
+	limit = min(limit, ULONG_MAX - 1);
+
+	while(page.values.size() <= limit)
+	{
+		if(next == chunk.size() && !file_done)
+		{
+			chunk.clear();
+			next = 0;
+			hash_file->getPage(string(key), file_after, limit + 1, chunk);
+			file_done = (chunk.size() < limit + 1);
+
+			if(!chunk.empty())
+				file_after = chunk.back();
+		}
+
+		bool file_valid = (next < chunk.size());
+
+		if(change != last && (!file_valid || change_value <= chunk[next]))
+		{
+			// the change overrides the file's state for its value
+			if(file_valid && change_value == chunk[next])
+				next++;
+			if(change->bound)
+				page.values.push_back(change_value);
+
+			if(++change != last)
+				change_value = convertDigestToHex(change->value, width);
+		}
+		else if(file_valid)
+			page.values.push_back(chunk[next++]);
+		else
+			break;
+	}
+
+	if(page.values.size() > limit)
+	{
+		page.values.pop_back();
+		page.cursor = page.values.back();
+	}
+
+	return page;
+}
+
+// a change is only recorded against the state on file, so every bound value
+// in it is missing from the file and every unbound one is present
+
+unsigned long AnnotationSnapshot::count_lookup(string_view key, const DeltaList &delta, HashFile *hash_file)
+{
+	unsigned long count = hash_file->count(string(key));
+	DeltaList::const_iterator change, last;
+
+	for(key_changes(delta, key, keyWidth(), change, last); change != last; change++)
+		count += (change->bound ? 1 : -1);
+
+	return count;
+}
+
+// like AnnotationSet::range_lookup: stream the run of keys on file, then apply
+// the changes of the keys in range over them
+
+map<string, set<string> > AnnotationSnapshot::range_lookup(
+	string low,
+	string high,
+	const DeltaList &delta,
+	HashFile *hash_file
+	)
+{
+	map<string, set<string> > result;
+	HashFileScanner scanner(hash_file, hash_file->lowerBound(low));
+	string key, value;
+
+	while(scanner.next(key, value) && key.compare(0, high.size(), high) <= 0)
+		result[key].insert(value);
+
+	// a low bound of odd length loses its last digit here, so the run may
+	// start a little early
+	DeltaChange probe;
+	DeltaList::const_iterator change;
+	unsigned int width = keyWidth();
+
+	convertHexToDigest(probe.key, low);
+
+	for(change = lower_bound(delta.begin(), delta.end(), probe, DeltaKeyLess()); change != delta.end(); change++)
+	{
+		string key = convertDigestToHex(change->key, width);
+
+		if(key.compare(0, high.size(), high) > 0)
+			break;
+		if(key < low)
+			continue;
+
+		set<string> &values = result[key];
+
+		if(change->bound)
+			values.insert(convertDigestToHex(change->value, width));
+		else
+			values.erase(convertDigestToHex(change->value, width));
+
+		if(values.empty())
+			result.erase(key);
+	}
+
+	return result;
+}
+
+AnnotationScanner AnnotationSnapshot::scan_entries()
+{
+	return AnnotationScanner(*this, true);
+}
+
+AnnotationScanner AnnotationSnapshot::scan_annotations()
+{
+	return AnnotationScanner(*this, false);
+}
+
+/////////////////////////////// AnnotationScanner //////////////////////////////
+
+// entries: stream A2C (by A, then C) rather than C2A
+
+AnnotationScanner::AnnotationScanner(AnnotationSnapshot Snapshot, bool entries) : snapshot(Snapshot)
+{
+	const DeltaList &delta = (entries ? snapshot.state->delta->A2C : snapshot.state->delta->C2A);
+
+	scanner = new HashFileScanner(entries ? snapshot.state->A2C_File : snapshot.state->C2A_File);
+	file_valid = scanner->next(file_key, file_value);
+
+	key_width = snapshot.keyWidth();
+	change = delta.begin();
+	changes_end = delta.end();
+	read_change();
+}
+
+AnnotationScanner::~AnnotationScanner()
+{
+	delete(scanner);
+}
+
+// the hex form of the current change, to merge against the file's lines
+
+void AnnotationScanner::read_change()
+{
+	if(change == changes_end)
+		return;
+
+	change_key = convertDigestToHex(change->key, key_width);
+	change_value = convertDigestToHex(change->value, key_width);
+}
+
+// a bound change is a pair missing from the file, and an unbound one hides a
+// pair of the file; either way, both sides advance together on a tie
+
+bool AnnotationScanner::next(string &key, string &value)
+{
+	while(file_valid || change != changes_end)
+	{
+		int order = 0;
+
+		if(!file_valid)
+			order = 1;
+		else if(change == changes_end)
+			order = -1;
+		else if((order = file_key.compare(change_key)) == 0)
+			order = file_value.compare(change_value);
+
+		if(order < 0)
+		{
+			key.swap(file_key);
+			value.swap(file_value);
+			file_valid = scanner->next(file_key, file_value);
+			return true;
+		}
+
+		bool bound = change->bound;
+
+		if(bound)
+		{
+			key = change_key;
+			value = change_value;
+		}
+
+		if(order == 0)
+			file_valid = scanner->next(file_key, file_value);
+
+		change++;
+		read_change();
+
+		if(bound)
+			return true;
+	}
+
+	return false;
+}
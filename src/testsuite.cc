@@ -2,9 +2,19 @@
 #include <string>
 #include <assert.h>
 #include <fstream>
+#include <map>
+#include <algorithm>
+#include <iterator>
+#include <thread>
+#include <sys/wait.h>
 
 #include "annotations.h"
+#include "shardedset.h"
+#include "asyncset.h"
 #include "utils.h"
+#include "trace.h"
+#include "reader.h"
+#include "server.h"
 
 using namespace std;
 
@@ -45,8 +55,24 @@ vector<AnnotationPair> read_initial_annotations(string filename)
 	return pairs;
 }
 
+//stretch every key to SHA256_WIDTH digits by repeating its leading digits, so
+//distinct keys stay distinct and keep their order
+vector<AnnotationPair> widen_annotations(vector<AnnotationPair> pairs)
+{
+	unsigned int extra = SHA256_WIDTH - SHA_WIDTH;
+
+	for(unsigned long i=0; i<pairs.size(); i++)
+	{
+		pairs[i].annotation += pairs[i].annotation.substr(0, extra);
+		pairs[i].message += pairs[i].message.substr(0, extra);
+	}
+
+	return pairs;
+}
+
 //verify that all pairs are either bound or unbound
-void verifyAllEntries(AnnotationSet *AS, vector<AnnotationPair> pairs, int state)
+template <class Store>
+void verifyAllEntries(Store *AS, vector<AnnotationPair> pairs, int state)
 {
 	for(unsigned long i=0; i<pairs.size(); i++)
 	{
@@ -63,9 +89,748 @@ void verifyAllEntries(AnnotationSet *AS, vector<AnnotationPair> pairs, int state
 	}	
 }
 
+//verify membership and cardinality queries; run these first after a boot,
+//so that they are answered from disk rather than from the memory maps
+template <class Store>
+void verifyPointQueries(Store *AS, vector<AnnotationPair> pairs, int state)
+{
+	map<string, unsigned long> entry_counts, annotation_counts;
+
+	for(unsigned long i=0; i<pairs.size(); i++)
+	{
+		assert(AS->has_annotation(pairs[i].annotation, pairs[i].message) == state);
+
+		entry_counts[pairs[i].annotation] += state;
+		annotation_counts[pairs[i].message] += state;
+	}
+
+	map<string, unsigned long>::iterator it;
+
+	for(it = entry_counts.begin(); it != entry_counts.end(); it++)
+		assert(AS->count_entries(it->first) == it->second);
+
+	for(it = annotation_counts.begin(); it != annotation_counts.end(); it++)
+		assert(AS->count_annotations(it->first) == it->second);
+}
+
+//verify prefix and range queries in both directions against the pairs,
+//using each leading hex digit as a prefix and a few ranges of them
+template <class Store>
+void verifyRangeQueries(Store *AS, vector<AnnotationPair> pairs, int state)
+{
+	string digits("0123456789abcdef");
+
+	for(unsigned int i=0; i<digits.size(); i++)
+	{
+		string low = digits.substr(i, 1), high = digits.substr(min(i + 2, 15u), 1);
+		map<string, set<string> > entries, annotations, entries_range, annotations_range;
+
+		for(unsigned long j=0; j<pairs.size() && state == 1; j++)
+		{
+			string A = pairs[j].annotation, C = pairs[j].message;
+
+			if(A.compare(0, 1, low) == 0)
+				entries[A].insert(C);
+			if(C.compare(0, 1, low) == 0)
+				annotations[C].insert(A);
+			if(A.compare(0, 1, low) >= 0 && A.compare(0, 1, high) <= 0)
+				entries_range[A].insert(C);
+			if(C.compare(0, 1, low) >= 0 && C.compare(0, 1, high) <= 0)
+				annotations_range[C].insert(A);
+		}
+
+		assert(AS->list_entries_by_prefix(low) == entries);
+		assert(AS->list_annotations_by_prefix(low) == annotations);
+		assert(AS->list_entries_in_range(low, high) == entries_range);
+		assert(AS->list_annotations_in_range(low, high) == annotations_range);
+	}
+}
+
+//walk every key's values a page at a time, in both directions, with pages of
+//one to three values; the pages must join up into the key's sorted values
+template <class Store>
+vector<string> collectPages(Store *AS, string key, bool entries, unsigned long limit)
+{
+	vector<string> values;
+	ValuePage page;
+
+	do
+	{
+		page = (entries ? AS->list_entries(key, limit, page.cursor) : AS->list_annotations(key, limit, page.cursor));
+		assert(page.values.size() <= limit);
+		assert(page.cursor.empty() || page.values.size() == limit);
+		values.insert(values.end(), page.values.begin(), page.values.end());
+	} while(!page.cursor.empty());
+
+	return values;
+}
+
+template <class Store>
+void verifyPagedQueries(Store *AS, vector<AnnotationPair> pairs, int state)
+{
+	map<string, set<string> > entries, annotations;
+
+	for(unsigned long i=0; i<pairs.size(); i++)
+	{
+		entries[pairs[i].annotation];
+		annotations[pairs[i].message];
+
+		if(state == 1)
+		{
+			entries[pairs[i].annotation].insert(pairs[i].message);
+			annotations[pairs[i].message].insert(pairs[i].annotation);
+		}
+	}
+
+	unsigned long i = 0;
+	map<string, set<string> >::iterator it;
+
+	for(it = entries.begin(); it != entries.end(); it++, i++)
+		assert(collectPages(AS, it->first, true, 1 + i % 3) == vector<string>(it->second.begin(), it->second.end()));
+
+	for(it = annotations.begin(); it != annotations.end(); it++, i++)
+		assert(collectPages(AS, it->first, false, 1 + i % 3) == vector<string>(it->second.begin(), it->second.end()));
+
+	assert(AS->list_entries(entries.begin()->first, 0, "").values.empty());
+
+	// an unlimited page holds every value, whether or not the key is cached
+	for(it = annotations.begin(); it != annotations.end(); it++)
+	{
+		ValuePage page = AS->list_annotations(it->first, ULONG_MAX);
+		assert(page.values == vector<string>(it->second.begin(), it->second.end()) && page.cursor.empty());
+	}
+}
+
+//sweep every key, plus keys that are absent, shuffled and each asked for twice;
+//the callback must see each key once, in order, with its values
+template <class Store>
+void verifySweepQueries(Store *AS, vector<AnnotationPair> pairs, int state)
+{
+	for(int direction = 0; direction < 2; direction++)
+	{
+		map<string, set<string> > expected;
+		vector<string> keys;
+
+		for(unsigned long i=0; i<pairs.size(); i++)
+		{
+			string key = (direction == 0 ? pairs[i].annotation : pairs[i].message);
+			string value = (direction == 0 ? pairs[i].message : pairs[i].annotation);
+
+			if(state == 1)
+				expected[key].insert(value);
+			else
+				expected[key];
+
+			keys.push_back(key);
+			keys.push_back(key);
+		}
+
+		for(unsigned long i=0; i<pairs.size(); i+=7)
+		{
+			string absent = pairs[i].annotation;
+			absent[absent.size() - 1] = (absent.back() == '0' ? '1' : '0');
+
+			if(expected.find(absent) == expected.end())
+			{
+				expected[absent];
+				keys.push_back(absent);
+			}
+		}
+
+		for(unsigned long i = keys.size()-1; i>=1; i--)
+			swap(keys[i], keys[rand()%(i+1)]);
+
+		map<string, set<string> >::iterator it = expected.begin();
+		auto check = [&](const string &key, const set<string> &values)
+		{
+			assert(it != expected.end() && key == it->first && values == it->second);
+			it++;
+		};
+
+		if(direction == 0)
+			AS->sweep_entries(keys, check);
+		else
+			AS->sweep_annotations(keys, check);
+
+		assert(it == expected.end());
+	}
+}
+
+//verify intersection and union queries in both directions. each message's set
+//of annotations is used as a key group, so intersections are never trivially empty
+template <class Store>
+void verifyMultiKeyQueries(Store *AS, vector<AnnotationPair> pairs, int state)
+{
+	map<string, set<string> > entries, annotations;
+	map<string, set<string> >::iterator it;
+
+	for(unsigned long i=0; i<pairs.size(); i++)
+	{
+		entries[pairs[i].annotation].insert(pairs[i].message);
+		annotations[pairs[i].message].insert(pairs[i].annotation);
+	}
+
+	for(int direction = 0; direction < 2; direction++)
+	{
+		map<string, set<string> > &groups = (direction == 0 ? annotations : entries);
+		map<string, set<string> > &lists = (direction == 0 ? entries : annotations);
+		unsigned long tested = 0;
+
+		for(it = groups.begin(); it != groups.end() && tested < 50; it++)
+		{
+			if(it->second.size() < 2)
+				continue;
+
+			vector<string> keys(it->second.begin(), it->second.end());
+			set<string> expected_intersection, expected_union;
+
+			if(state == 1)
+			{
+				expected_intersection = lists[keys[0]];
+				for(unsigned long k=0; k<keys.size(); k++)
+				{
+					set<string> tmp;
+					set_intersection(expected_intersection.begin(), expected_intersection.end(),
+						lists[keys[k]].begin(), lists[keys[k]].end(), inserter(tmp, tmp.begin()));
+					expected_intersection = tmp;
+					expected_union.insert(lists[keys[k]].begin(), lists[keys[k]].end());
+				}
+			}
+
+			if(direction == 0)
+			{
+				assert(AS->intersect_entries(keys) == expected_intersection);
+				assert(AS->union_entries(keys) == expected_union);
+			}
+			else
+			{
+				assert(AS->intersect_annotations(keys) == expected_intersection);
+				assert(AS->union_annotations(keys) == expected_union);
+			}
+			tested++;
+		}
+	}
+}
+
+//verify batch lookups in both directions, including a repeated and an unknown
+//key. run these first after a boot, so that the probe engine reads from disk
+template <class Store>
+void verifyBatchQueries(Store *AS, vector<AnnotationPair> pairs, int state)
+{
+	map<string, set<string> > entries, annotations;
+	vector<string> As, Cs;
+
+	for(unsigned long i=0; i<pairs.size(); i++)
+	{
+		if(state == 1)
+		{
+			entries[pairs[i].annotation].insert(pairs[i].message);
+			annotations[pairs[i].message].insert(pairs[i].annotation);
+		}
+		As.push_back(pairs[i].annotation);
+		Cs.push_back(pairs[i].message);
+	}
+
+	As.push_back(string(pairs[0].annotation.size(), 'f'));
+	Cs.push_back(string(pairs[0].message.size(), '0'));
+
+	vector<set<string> > messages = AS->list_entries_batch(As);
+	vector<set<string> > annotated = AS->list_annotations_batch(Cs);
+
+	assert(messages.size() == As.size() && annotated.size() == Cs.size());
+
+	for(unsigned long i=0; i<As.size(); i++)
+	{
+		assert(messages[i] == entries[As[i]]);
+		assert(annotated[i] == annotations[Cs[i]]);
+	}
+}
+
+//verify that both probe engine backends agree with a plain lookup on a
+//committed A2C index
+void verifyProbeBackends(string directory, string hashTableType, vector<AnnotationPair> pairs)
+{
+	HashFile *index;
+
+	if(hashTableType == "BTreeFile")
+		index = new BTreeFile(directory + "/A2C/");
+	else if(hashTableType == "GappedHashFile")
+		index = new GappedHashFile(directory + "/A2C/");
+	else if(hashTableType == "EncodedHashFile")
+		index = new EncodedHashFile(directory + "/A2C/");
+	else
+		index = new HashFile(directory + "/A2C/");
+	vector<string> keys;
+	DigestArena arena;
+
+	for(unsigned long i=0; i<pairs.size(); i++)
+		keys.push_back(pairs[i].annotation);
+
+	for(int pool = 0; pool < 2; pool++)
+	{
+		ProbeEngine engine(16, pool == 1);
+		vector<ValueSet> results(keys.size(), ValueSet(&arena));
+		vector<ValueSet*> targets;
+
+		for(unsigned long i=0; i<keys.size(); i++)
+			targets.push_back(&results[i]);
+
+		engine.lookup(index, keys, targets);
+
+		for(unsigned long i=0; i<keys.size(); i++)
+		{
+			ValueSet expected(&arena);
+			index->get(keys[i], expected);
+			assert(results[i].toStringSet() == expected.toStringSet());
+		}
+	}
+
+	delete(index);
+}
+
+//commit a log of changes to a gapped file, and publish the result as a set does
+void commitGapped(GappedHashFile *index, string directory, vector<AnnotationPair> pairs, Log::Op cmd)
+{
+	LogFile log(directory + "/gapped-log/");
+
+	log.clear();
+
+	for(unsigned long i=0; i<pairs.size(); i++)
+		log.addEntry(cmd, pairs[i].annotation, pairs[i].message);
+
+	log.close();
+
+	index->commit(directory + "/gapped-tmp/", log, false);
+	index->moveState(directory + "/gapped-tmp/", directory + "/gapped/");
+}
+
+//verify that a gapped file agrees with the pairs as it is committed to, that a
+//commit of a few changes rewrites only the pages they fall in, and that a file
+//left mostly dead is compacted
+void verifyGappedCommits(string directory, vector<AnnotationPair> all)
+{
+	set<pair<string, string> > seen;
+	vector<AnnotationPair> pairs;
+
+	// a log straight to the file is not compacted, so each pair goes in once
+	for(unsigned long i=0; i<all.size(); i++)
+		if(seen.insert(make_pair(all[i].annotation, all[i].message)).second)
+			pairs.push_back(all[i]);
+
+	vector<AnnotationPair> half(pairs.begin(), pairs.begin() + pairs.size() / 2);
+	vector<AnnotationPair> one(pairs.begin() + pairs.size() / 2, pairs.begin() + pairs.size() / 2 + 1);
+	vector<AnnotationPair> rest(pairs.begin() + pairs.size() / 2 + 1, pairs.end());
+
+	mkdir((directory + "/gapped/").c_str(), 0777);
+	mkdir((directory + "/gapped-tmp/").c_str(), 0777);
+	mkdir((directory + "/gapped-log/").c_str(), 0777);
+	HashFileWriter(directory + "/gapped/").close();
+
+	GappedHashFile *index = new GappedHashFile(directory + "/gapped/", 8);
+
+	commitGapped(index, directory, half, Log::ANNOTATE);
+	unsigned long pages = index->pageCount();
+
+	for(unsigned long i=0; i<pairs.size(); i++)
+		assert(index->has(pairs[i].annotation, pairs[i].message) == (i < half.size()));
+
+	commitGapped(index, directory, one, Log::ANNOTATE);
+	assert(index->pagesWritten() <= 2 && index->pageCount() <= pages + 1);
+	assert(index->has(one[0].annotation, one[0].message));
+
+	commitGapped(index, directory, rest, Log::ANNOTATE);
+
+	map<string, set<string> > entries;
+
+	for(unsigned long i=0; i<pairs.size(); i++)
+		entries[pairs[i].annotation].insert(pairs[i].message);
+
+	for(map<string, set<string> >::iterator it = entries.begin(); it != entries.end(); it++)
+	{
+		ValueSet values;
+		index->get(it->first, values);
+		assert(values.toStringSet() == it->second);
+		assert(index->count(it->first) == it->second.size());
+	}
+
+	HashFileScanner *scanner = new HashFileScanner(index);
+	string key, value, last;
+	unsigned long lines = 0;
+
+	for(; scanner->next(key, value); lines++)
+	{
+		assert(last < key + " " + value);
+		last = key + " " + value;
+	}
+
+	delete(scanner);
+	assert(lines == pairs.size());
+
+	// the file is now mostly dead pages; the next commit packs what is left
+	commitGapped(index, directory, pairs, Log::UNANNOTATE);
+	assert(index->pageCount() == 0);
+
+	commitGapped(index, directory, one, Log::ANNOTATE);
+	assert(index->pageCount() == 1 && index->has(one[0].annotation, one[0].message));
+
+	struct stat st;
+	stat((directory + "/gapped/HashFile.txt").c_str(), &st);
+	assert((unsigned long) st.st_size < 8 * 2 * (2 * index->keyWidth() + 2));
+
+	delete(index);
+	dir_delete(directory + "/gapped/");
+	dir_delete(directory + "/gapped-tmp/");
+	dir_delete(directory + "/gapped-log/");
+}
+
+//verify that a BTreeFile answers lookups, through its trie and through the
+//probe engine, as the HashFile under it does
+void verifyIndexAgrees(HashFile *index, HashFile *plain, vector<string> keys)
+{
+	DigestArena arena;
+	ProbeEngine engine(16, false);
+	vector<ValueSet> results(keys.size(), ValueSet(&arena));
+	vector<ValueSet*> targets;
+
+	for(unsigned long i=0; i<keys.size(); i++)
+	{
+		ValueSet expected(&arena), values(&arena);
+		string prefix = keys[i].substr(0, 1 + i % keys[i].size());
+
+		plain->get(keys[i], expected);
+		index->get(keys[i], values);
+		assert(values.toStringSet() == expected.toStringSet());
+		assert(index->lowerBound(prefix) == plain->lowerBound(prefix));
+
+		targets.push_back(&results[i]);
+	}
+
+	engine.lookup(index, keys, targets);
+
+	for(unsigned long i=0; i<keys.size(); i++)
+	{
+		ValueSet expected(&arena);
+		plain->get(keys[i], expected);
+		assert(results[i].toStringSet() == expected.toStringSet());
+	}
+}
+
+//verify BTreeFile tries of several geometries over a HashFile of the pairs:
+//each is recorded in its file and padded as asked, and answers as the HashFile
+//does. a file with the header of old keeps working, a rebuild keeps the
+//geometry of the file it opened, and tuning picks one of its candidates
+void verifyBTreeGeometries(string directory, vector<AnnotationPair> all)
+{
+	set<pair<string, string> > sorted;
+	string path = directory + "/btree-geometry/";
+	vector<string> keys, sample, tuning;
+	struct stat st;
+
+	for(unsigned long i=0; i<all.size(); i++)
+	{
+		sorted.insert(make_pair(all[i].annotation, all[i].message));
+		keys.push_back(all[i].annotation);
+
+		// absent too: the last digit flipped
+		string absent = all[i].annotation;
+		absent[absent.size() - 1] = (absent[absent.size() - 1] == '0' ? '1' : '0');
+		keys.push_back(absent);
+	}
+
+	// each geometry is checked on a quarter of the keys, and timed on a 16th
+	for(unsigned long i=0; i<keys.size(); i++)
+	{
+		if(i % 4 == 0)
+			sample.push_back(keys[i]);
+		if(i % 16 == 0)
+			tuning.push_back(keys[i]);
+	}
+
+	dir_delete(path);
+	mkdir(path.c_str(), 0777);
+
+	HashFileWriter writer(path);
+
+	for(set<pair<string, string> >::iterator it = sorted.begin(); it != sorted.end(); it++)
+		writer.append(it->first.c_str(), it->second.c_str());
+
+	writer.close();
+
+	// read through mappings, which the tuning runs inherit
+	HashFile plain(path);
+	plain.setMapped(true);
+
+	vector<BTreeGeometry> geometries = BTreeFile::candidateGeometries();
+	BTreeGeometry deepest = { 1, 8, 1, 1 }, legacy = { 2, 4, 1, BTreeFile::DEFAULT_MIN_CHILDREN };
+
+	geometries.push_back(deepest);
+	geometries.push_back(legacy);
+
+	for(unsigned long g=0; g<geometries.size(); g++)
+	{
+		IndexLayout layout;
+
+		BTreeFile(path, geometries[g]).buildIndex(path);
+
+		BTreeFile index(path);
+		index.setMapped(true);
+		index.getLayout(layout);
+
+		assert(index.geometry() == geometries[g]);
+		assert(layout.table_size > 0 && layout.table_offset % geometries[g].alignment == 0);
+		assert(layout.table_line_width == (int) BTreeFile::nodeWidth(geometries[g]));
+		assert(layout.table_line_width % geometries[g].alignment == 0);
+
+		verifyIndexAgrees(&index, &plain, sample);
+	}
+
+	// the last file built has the legacy geometry; rewrite it with the 4-byte
+	// header of old, in front of the same nodes
+	{
+		fstream file((path + "BTreeFile.txt").c_str(), fstream::in | fstream::binary);
+		string contents((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+		unsigned long header[8];
+
+		file.close();
+		memcpy(header, contents.data(), sizeof(header));
+
+		unsigned int table_lines = header[1];
+		fstream legacy_file((path + "BTreeFile.txt").c_str(), fstream::out | fstream::trunc | fstream::binary);
+		legacy_file.write((char *) &table_lines, 4);
+		legacy_file.write(contents.data() + header[6], contents.size() - header[6]);
+		legacy_file.close();
+
+		BTreeFile index(path);
+		index.setMapped(true);
+		assert(index.geometry() == legacy);
+		verifyIndexAgrees(&index, &plain, sample);
+	}
+
+	BTreeFile(path, geometries[0]).buildIndex(path);
+
+	{
+		BTreeFile index(path);
+		index.buildIndex(path);
+		index.setPath(path);
+		assert(index.geometry() == geometries[0]);
+	}
+
+	BTreeFile tuned(path);
+	vector<double> nanos;
+
+	tuned.setMapped(true);
+	BTreeGeometry best = tuned.tuneGeometry(geometries, tuning, nanos);
+
+	assert(find(geometries.begin(), geometries.end(), best) != geometries.end());
+	assert(nanos.size() == geometries.size() && *min_element(nanos.begin(), nanos.end()) > 0);
+	assert(stat((path + "tune/").c_str(), &st) != 0);
+
+	tuned.buildIndex(path);
+	tuned.setPath(path);
+	assert(tuned.geometry() == best);
+	verifyIndexAgrees(&tuned, &plain, sample);
+
+	dir_delete(path);
+}
+
+//verify that an encoded file built from the pairs is smaller than the plain
+//one, lists each digest once, and answers every lookup and scan as the pairs
+//do, before and after a commit unannotates half of them
+void verifyEncodedFile(string directory, vector<AnnotationPair> all)
+{
+	set<pair<string, string> > sorted;
+	set<string> digests;
+	string path = directory + "/encoded/", tmp = directory + "/encoded-tmp/";
+
+	for(unsigned long i=0; i<all.size(); i++)
+	{
+		sorted.insert(make_pair(all[i].annotation, all[i].message));
+		digests.insert(all[i].annotation);
+		digests.insert(all[i].message);
+	}
+
+	mkdir(path.c_str(), 0777);
+	mkdir(tmp.c_str(), 0777);
+	mkdir((directory + "/encoded-log/").c_str(), 0777);
+
+	HashFileWriter writer(path);
+
+	for(set<pair<string, string> >::iterator it = sorted.begin(); it != sorted.end(); it++)
+		writer.append(it->first.c_str(), it->second.c_str());
+
+	writer.close();
+
+	struct stat plain, encoded;
+	stat((path + "HashFile.txt").c_str(), &plain);
+
+	EncodedHashFile *index = new EncodedHashFile(path);
+	index->buildIndex(path);
+	index->setPath(path);
+
+	stat((path + "HashFile.txt").c_str(), &encoded);
+	assert(encoded.st_size < plain.st_size / 2);
+	assert(index->dictionarySize() == digests.size());
+
+	LogFile log(directory + "/encoded-log/");
+	log.clear();
+
+	for(int round = 0; round < 2; round++)
+	{
+		map<string, set<string> > entries;
+		vector<Digest> all_values;
+		unsigned long i = 0;
+		Digest digest;
+
+		for(set<pair<string, string> >::iterator it = sorted.begin(); it != sorted.end(); it++, i++)
+		{
+			if(round == 0 || i % 2 == 0)
+			{
+				entries[it->first].insert(it->second);
+				convertHexToDigest(digest, it->second);
+				all_values.push_back(digest);
+			}
+		}
+
+		sort(all_values.begin(), all_values.end());
+		all_values.erase(unique(all_values.begin(), all_values.end()), all_values.end());
+
+		for(map<string, set<string> >::iterator it = entries.begin(); it != entries.end(); it++)
+		{
+			vector<string> expected(it->second.begin(), it->second.end()), page;
+			vector<Digest> candidates;
+			ValueSet values;
+
+			index->get(it->first, values);
+			assert(values.toStringSet() == it->second);
+			assert(index->count(it->first) == it->second.size());
+			assert(index->has(it->first, expected[0]) && !index->has(it->first, it->first));
+
+			index->getPage(it->first, expected[0], 2, page);
+			assert(page == vector<string>(expected.begin() + 1, expected.begin() + min(expected.size(), (size_t) 3)));
+
+			// of the key's own values and a spread of others, only its own are kept
+			for(unsigned long j=0; j<all_values.size(); j+=16)
+				candidates.push_back(all_values[j]);
+
+			candidates.insert(candidates.end(), values.begin(), values.end());
+			sort(candidates.begin(), candidates.end());
+			candidates.erase(unique(candidates.begin(), candidates.end()), candidates.end());
+			index->intersect(it->first, candidates);
+			assert(candidates.size() == it->second.size());
+		}
+
+		HashFileScanner *scanner = new HashFileScanner(index);
+		map<string, set<string> > scanned;
+		string key, value;
+
+		while(scanner->next(key, value))
+			scanned[key].insert(value);
+
+		delete(scanner);
+		assert(scanned == entries);
+
+		if(round == 0)
+		{
+			i = 0;
+
+			for(set<pair<string, string> >::iterator it = sorted.begin(); it != sorted.end(); it++, i++)
+				if(i % 2 == 1)
+					log.addEntry(Log::UNANNOTATE, it->first, it->second);
+
+			log.close();
+			index->commit(tmp, log, false);
+			index->moveState(tmp, path);
+		}
+	}
+
+	delete(index);
+	dir_delete(path);
+	dir_delete(tmp);
+	dir_delete(directory + "/encoded-log/");
+}
+
+//verify asynchronous lookups and writes against the pairs (all bound), and
+//that deadlines, cancellation and a full pool are reported as such
+template <class Store>
+void verifyAsyncQueries(Store *AS, vector<AnnotationPair> pairs)
+{
+	map<string, set<string> > entries;
+
+	for(unsigned long i=0; i<pairs.size(); i++)
+		entries[pairs[i].annotation].insert(pairs[i].message);
+
+	{
+		AsyncAnnotationSet<Store> async(AS, 2, 64);
+		vector<pair<string, typename AsyncAnnotationSet<Store>::SetResult> > results;
+		map<string, set<string> >::iterator it;
+
+		for(it = entries.begin(); it != entries.end(); it++)
+		{
+			typename AsyncAnnotationSet<Store>::SetResult result = async.list_entries_async(it->first);
+
+			// a full pool refuses at once; wait for an earlier call and retry
+			while(result.status() == ASYNC_REJECTED)
+			{
+				results.back().second.wait();
+				result = async.list_entries_async(it->first);
+			}
+			results.push_back(make_pair(it->first, result));
+		}
+
+		for(unsigned long i=0; i<results.size(); i++)
+		{
+			assert(results[i].second.wait() == ASYNC_DONE);
+			assert(results[i].second.get() == entries[results[i].first]);
+		}
+
+		string A = pairs[0].annotation, C = pairs[0].message;
+		assert(async.unannotate_entry_async(A, C).get() == true);
+		assert(async.list_entries_async(A).get().count(C) == 0);
+		assert(async.annotate_entry_async(A, C).get() == true);
+		assert(async.list_annotations_async(C).get().count(A) == 1);
+	}
+
+	{
+		// writes to one pair, queued together, apply in the order submitted
+		AsyncAnnotationSet<Store> async(AS, 4, 64);
+		string A = pairs[0].annotation, C = pairs[0].message;
+
+		for(unsigned long writes=31; writes<=32; writes++)
+		{
+			typename AsyncAnnotationSet<Store>::WriteResult last;
+
+			for(unsigned long i=0; i<writes; i++)
+				last = (i % 2 == 0 ? async.unannotate_entry_async(A, C) : async.annotate_entry_async(A, C));
+
+			assert(last.get() == true);
+			assert(async.list_entries_async(A).get().count(C) == (writes % 2 == 0 ? 1u : 0u));
+		}
+	}
+
+	{
+		// one worker, held up by a slow callback, so the next calls stay queued
+		AsyncAnnotationSet<Store> async(AS, 1, 2);
+		string A = pairs[0].annotation;
+
+		async.list_entries_async(A, 0, [](typename AsyncAnnotationSet<Store>::SetResult) { usleep(50000); });
+		usleep(10000);
+
+		typename AsyncAnnotationSet<Store>::SetResult expired = async.list_entries_async(A, 1);
+		typename AsyncAnnotationSet<Store>::SetResult cancelled = async.list_entries_async(A);
+		typename AsyncAnnotationSet<Store>::SetResult rejected = async.list_entries_async(A);
+
+		assert(rejected.status() == ASYNC_REJECTED);
+		assert(cancelled.cancel() == true);
+		assert(cancelled.wait() == ASYNC_CANCELLED);
+		assert(expired.wait() == ASYNC_EXPIRED);
+		assert(expired.get().empty());
+	}
+}
+
 //set all pairs to be bound or unbound
 //where 1: annotate, 0: unannotate
-void setAllEntries(AnnotationSet *AS, vector<AnnotationPair> pairs, int state)
+template <class Store>
+void setAllEntries(Store *AS, vector<AnnotationPair> pairs, int state)
 {
 	//randomizePairs(pairs);
 
@@ -87,13 +852,15 @@ void setAllEntries(AnnotationSet *AS, vector<AnnotationPair> pairs, int state)
 //  4. A / U / U / A
 //  5. A / U / U / A / A
 
-void runLiveVerification(AnnotationSet *AS, vector<AnnotationPair> pairs)
+template <class Store>
+void runLiveVerification(Store *AS, vector<AnnotationPair> pairs)
 {
 	setAllEntries(AS, pairs, 1);
 	verifyAllEntries(AS, pairs, 1);
 
 	setAllEntries(AS, pairs, 0);
 	verifyAllEntries(AS, pairs, 0);
+	verifyRangeQueries(AS, pairs, 0);
 
 	setAllEntries(AS, pairs, 0);
 	verifyAllEntries(AS, pairs, 0);
@@ -103,8 +870,387 @@ void runLiveVerification(AnnotationSet *AS, vector<AnnotationPair> pairs)
 
 	setAllEntries(AS, pairs, 1);
 	verifyAllEntries(AS, pairs, 1);
+	verifyRangeQueries(AS, pairs, 1);
+	verifyMultiKeyQueries(AS, pairs, 1);
+}
+
+//Test that a set keeps committing correctly after its first commit: changes
+//made since are the only ones the next commit sees. ends with all pairs bound
+//on disk, but only a reboot shows whether they were written
+template <class Store>
+void runRepeatedCommits(Store *AS, vector<AnnotationPair> pairs)
+{
+	setAllEntries(AS, pairs, 0);
+	AS->commit_to_disk();
+	verifyAllEntries(AS, pairs, 0);
+
+	setAllEntries(AS, pairs, 1);
+	AS->commit_to_disk();
+	verifyAllEntries(AS, pairs, 1);
+}
+
+//verify that full scans in both orders stream exactly the bound pairs, sorted
+template <class Store>
+void verifyFullScan(Store *AS, vector<AnnotationPair> bound)
+{
+	typedef vector<pair<string, string> > PairList;
+	set<pair<string, string> > entries, annotations;
+	PairList scanned;
+	string key, value;
+
+	for(unsigned long i=0; i<bound.size(); i++)
+	{
+		entries.insert(make_pair(bound[i].annotation, bound[i].message));
+		annotations.insert(make_pair(bound[i].message, bound[i].annotation));
+	}
+
+	AnnotationScanner entry_scan = AS->scan_entries();
+
+	while(entry_scan.next(key, value))
+		scanned.push_back(make_pair(key, value));
+
+	assert(scanned == PairList(entries.begin(), entries.end()));
+	scanned.clear();
+
+	AnnotationScanner annotation_scan = AS->scan_annotations();
+
+	while(annotation_scan.next(key, value))
+		scanned.push_back(make_pair(key, value));
+
+	assert(scanned == PairList(annotations.begin(), annotations.end()));
+}
+
+//count the snapshot directories held open in a set's directory
+unsigned long countSnapshotDirectories(string directory)
+{
+	struct dirent *de = NULL;
+	DIR *d = opendir(directory.c_str());
+	unsigned long count = 0;
+
+	while(d != NULL && (de = readdir(d)) != NULL)
+		count += (strncmp(de->d_name, "SNAP-", 5) == 0);
+
+	if(d != NULL)
+		closedir(d);
+
+	return count;
 }
 
+//Test that snapshots keep seeing the state they were taken in, through
+//uncommitted changes and commits, and that their files go once released.
+//starts and ends with all pairs bound and committed
+void runSnapshotVerification(AnnotationSet *AS, string directory, vector<AnnotationPair> pairs)
+{
+	{
+		AnnotationSnapshot bound = AS->snapshot();
+
+		setAllEntries(AS, pairs, 0);
+		AnnotationSnapshot unbound = AS->snapshot();
+		verifyAllEntries(&bound, pairs, 1);
+		verifyAllEntries(&unbound, pairs, 0);
+
+		AS->commit_to_disk();
+		setAllEntries(AS, pairs, 1);
+		AS->commit_to_disk();
+		verifyAllEntries(AS, pairs, 1);
+
+		assert(countSnapshotDirectories(directory) == 1);
+		verifyPointQueries(&bound, pairs, 1);
+		verifyRangeQueries(&bound, pairs, 1);
+		verifyAllEntries(&bound, pairs, 1);
+		verifyPointQueries(&unbound, pairs, 0);
+		verifyRangeQueries(&unbound, pairs, 0);
+		verifyAllEntries(&unbound, pairs, 0);
+		verifyFullScan(&bound, pairs);
+		verifyPagedQueries(&bound, pairs, 1);
+		verifyPagedQueries(&unbound, pairs, 0);
+		verifyFullScan(&unbound, vector<AnnotationPair>());
+		assert(unbound.sequence() > bound.sequence());
+	}
+
+	assert(countSnapshotDirectories(directory) == 0);
+}
+
+//Test that opening a set removes the snapshot directories of processes that
+//have exited, and leaves those of running ones
+void verifyStaleSnapshotRemoval(AnnotationSet *AS, string directory, string hashTableType)
+{
+	pid_t child = fork();
+
+	if(child == 0)
+		_exit(0);
+
+	waitpid(child, NULL, 0);
+
+	string dead = directory + "/SNAP-" + to_string(child) + "-0", running = directory + "/SNAP-1-0";
+	mkdir(dead.c_str(), 0777);
+	mkdir(running.c_str(), 0777);
+
+	{
+		AnnotationSnapshot own = AS->snapshot();
+		assert(countSnapshotDirectories(directory) == 3);
+
+		delete(new AnnotationSet(directory, hashTableType));
+		assert(countSnapshotDirectories(directory) == 2);
+		assert(access(dead.c_str(), F_OK) != 0);
+		assert(access(running.c_str(), F_OK) == 0);
+	}
+
+	rmdir(running.c_str());
+	assert(countSnapshotDirectories(directory) == 0);
+}
+
+//Reopen a sharded set (all pairs bound) as if it had stopped midway through
+//unbinding a cross-shard pair: logged in the cross log and by the shard of A
+//only, then a line cut short. both sides must come back unbound
+void verifyCrossShardRecovery(string directory, string hashTableType, vector<AnnotationPair> pairs)
+{
+	unsigned int bits;
+	fstream shards((directory + "/shards.txt").c_str(), fstream::in);
+	shards >> bits;
+	shards.close();
+
+	unsigned long i = 0;
+
+	while(convertKeyToShard(pairs[i].annotation, bits) == convertKeyToShard(pairs[i].message, bits))
+		i++;
+
+	string A = pairs[i].annotation, C = pairs[i].message;
+	string entry = "U " + A + " " + C + "\n";
+	string A_log = directory + "/shard-" + convertIntToHex(convertKeyToShard(A, bits), 4) + "/LOG/log.txt";
+
+	fstream cross((directory + "/cross-log.txt").c_str(), fstream::out | fstream::app);
+	cross << entry << "A " << A.substr(0, 7);
+	cross.close();
+
+	fstream log(A_log.c_str(), fstream::out | fstream::app);
+	log << entry;
+	log.close();
+
+	ShardedAnnotationSet *SAS = new ShardedAnnotationSet(directory, hashTableType);
+	SAS->initialize();
+	assert(SAS->has_annotation(A, C) == false);
+	assert(SAS->list_annotations(C).count(A) == 0);
+	delete(SAS);
+
+	// the replay was logged by both shards, so it survives another reopen
+	SAS = new ShardedAnnotationSet(directory, hashTableType);
+	SAS->initialize();
+	assert(SAS->list_entries(A).count(C) == 0);
+	assert(SAS->list_annotations(C).count(A) == 0);
+	SAS->annotate_entry(A, C);
+	delete(SAS);
+}
+
+//Test the daemon against a sharded set with all pairs bound: point calls, a
+//pipelined batch answered in order on a second connection, commits, and a
+//malformed request. ends with all pairs bound and committed
+void runServerVerification(ShardedAnnotationSet *SAS, string directory, vector<AnnotationPair> pairs)
+{
+	string socket_path = directory + "/server.sock";
+	AnnotationServer server(SAS, socket_path, 2);
+	ServerResponse response;
+	struct stat st;
+
+	assert(server.start());
+	server.warm_cache();
+
+	AnnotationClient client(socket_path), other(socket_path);
+	assert(client.connected() && other.connected());
+	assert(client.keyWidth() == SAS->keyWidth());
+
+	verifyPointQueries(&client, pairs, 1);
+	verifyAllEntries(&client, pairs, 1);
+
+	for(unsigned long i=0; i<pairs.size(); i++)
+		other.queue(SERVER_UNANNOTATE, pairs[i].annotation, pairs[i].message);
+
+	other.queue(SERVER_LIST_ENTRIES, pairs[0].annotation);
+	assert(other.flush());
+
+	for(unsigned long i=0; i<=pairs.size(); i++)
+		assert(other.receive(response) && response.status == SERVER_OK && response.tag == i);
+
+	assert(other.decodeKeys(response).empty());
+	verifyAllEntries(&client, pairs, 0);
+	runRepeatedCommits(&client, pairs);
+
+	// a body of the wrong size is refused, and the connection goes on
+	other.queue(SERVER_HAS, pairs[0].annotation);
+	assert(other.flush() && other.receive(response) && response.status == SERVER_BAD_REQUEST);
+	assert(other.has_annotation(pairs[0].annotation, pairs[0].message));
+
+	// requests and answers of several times SERVER_HIGH_WATER, sent by one
+	// thread while another reads, which then stops sending: the server stops
+	// reading while the answers back up, and they still all come back, in
+	// order, before it closes the connection
+	{
+		AnnotationClient flood(socket_path);
+		vector<set<string> > expected;
+		unsigned long requests = 4 * SERVER_HIGH_WATER / (SERVER_FRAME_HEADER + client.keyWidth() / 2);
+
+		for(unsigned long i=0; i<16; i++)
+			expected.push_back(client.list_entries(pairs[i % pairs.size()].annotation));
+
+		for(unsigned long i=0; i<requests; i++)
+			flood.queue(SERVER_LIST_ENTRIES, pairs[i % 16 % pairs.size()].annotation);
+
+		thread sender([&flood]() { assert(flood.flush() && flood.finish()); });
+
+		for(unsigned long i=0; i<requests; i++)
+		{
+			assert(flood.receive(response) && response.status == SERVER_OK && response.tag == i);
+			assert(flood.decodeKeys(response) == expected[i % 16]);
+		}
+
+		assert(!flood.receive(response));
+
+		sender.join();
+	}
+
+	server.stop();
+	assert(stat(socket_path.c_str(), &st) != 0);
+}
+
+//Test a read-only reader next to the writer: it sees committed pairs only,
+//moves to each new commit while its snapshots stay put, and creates nothing.
+//starts and ends with all pairs bound and committed
+void runReaderVerification(AnnotationSet *AS, string directory, string hashTableType, vector<AnnotationPair> pairs)
+{
+	struct stat st;
+
+	{
+		AnnotationReader missing(directory + "-missing");
+		verifyAllEntries(&missing, pairs, 0);
+		assert(stat((directory + "-missing").c_str(), &st) != 0);
+	}
+
+	AnnotationReader reader(directory, hashTableType);
+	unsigned long generation = reader.generation();
+
+	reader.set_refresh_interval(0);
+	verifyPointQueries(&reader, pairs, 1);
+	verifyRangeQueries(&reader, pairs, 1);
+	verifySweepQueries(&reader, pairs, 1);
+	verifyFullScan(&reader, pairs);
+
+	setAllEntries(AS, pairs, 0);
+	verifyAllEntries(&reader, pairs, 1);
+
+	AnnotationSnapshot before = reader.snapshot();
+	AS->commit_to_disk();
+	verifyPointQueries(&reader, pairs, 0);
+	verifyAllEntries(&reader, pairs, 0);
+	verifyAllEntries(&before, pairs, 1);
+	assert(reader.generation() == generation + 1);
+
+	setAllEntries(AS, pairs, 1);
+	AS->commit_to_disk();
+	verifyAllEntries(&reader, pairs, 1);
+	verifyFullScan(&reader, pairs);
+}
+
+//Test that spans recorded on several threads come out of a dump, that a full
+//buffer keeps only its newest spans, and, with the trace points compiled in,
+//that a commit is traced
+void runTraceVerification(AnnotationSet *AS, string directory)
+{
+	string filename = directory + "/trace.json", line;
+	map<string, unsigned long> counts;
+	unsigned long total = 0;
+
+	Trace::clear();
+	Trace::start(0);
+
+	thread other([]() { TraceScope scope("other thread"); });
+	other.join();
+
+	for(unsigned long i=0; i<Trace::BUFFER_EVENTS + 10; i++)
+		Trace::record(i < 10 ? "overwritten" : "kept", Trace::now(), Trace::now());
+
+	AS->commit_to_disk();
+	Trace::stop();
+
+	{ TraceScope scope("stopped"); }
+
+	assert(Trace::dump(filename));
+
+	fstream file(filename.c_str(), fstream::in);
+
+	while(getline(file, line))
+		if(line.compare(0, 9, "{\"name\":\"") == 0)
+			counts[line.substr(9, line.find('"', 9) - 9)]++;
+
+	file.close();
+	remove(filename.c_str());
+
+	// everything else was recorded on this thread, whose buffer has wrapped
+	for(map<string, unsigned long>::iterator it = counts.begin(); it != counts.end(); it++)
+		total += it->second;
+
+	assert(counts["other thread"] == 1);
+	assert(counts["overwritten"] == 0 && counts["stopped"] == 0);
+	assert(total - counts["other thread"] == Trace::BUFFER_EVENTS);
+#ifdef TRACE
+	assert(counts["AnnotationSet::commit_to_disk"] == 1);
+#endif
+
+	Trace::clear();
+}
+
+//Test the hot keys a commit saves: the most read keys of each side, most read
+//first, and nothing at all at a capacity of 0. leaves the capacity at 2, the
+//hot keys being the annotations of pairs 0 and 1, and the message of pair 0
+void recordHotKeys(AnnotationSet *AS, string directory, vector<AnnotationPair> pairs)
+{
+	string filename = directory + "/HotKeys.txt", side, key;
+	unsigned long reads;
+	struct stat st;
+
+	AS->set_hot_key_capacity(0);
+	remove(filename.c_str());
+	AS->list_entries(pairs[0].annotation);
+	AS->commit_to_disk();
+	assert(stat(filename.c_str(), &st) != 0);
+
+	assert(pairs[0].annotation != pairs[1].annotation && pairs[1].annotation != pairs[2].annotation &&
+		   pairs[0].annotation != pairs[2].annotation);
+
+	AS->set_hot_key_capacity(2);
+
+	for(int i=0; i<3; i++)
+		AS->list_entries(pairs[0].annotation);
+
+	AS->count_entries(pairs[1].annotation);
+	AS->list_entries(pairs[1].annotation, 1);
+	AS->list_entries_batch(vector<string>(1, pairs[2].annotation));
+	AS->list_annotations(pairs[0].message);
+	AS->commit_to_disk();
+
+	fstream file(filename.c_str(), fstream::in);
+
+	assert(file >> side >> key >> reads && side == "A" && key == pairs[0].annotation && reads == 3);
+	assert(file >> side >> key >> reads && side == "A" && key == pairs[1].annotation && reads == 2);
+	assert(file >> side >> key >> reads && side == "C" && key == pairs[0].message && reads == 1);
+	assert(!(file >> side));
+
+	file.close();
+}
+
+//verify that a set reopened after recordHotKeys starts from the saved counts,
+//and that the keys it prefetched answer as they should. all pairs are bound
+void verifyHotKeys(AnnotationSet *AS, vector<AnnotationPair> pairs)
+{
+	vector<string> As, Cs;
+
+	AS->hot_keys(As, Cs);
+	assert(As.size() == 2 && As[0] == pairs[0].annotation && As[1] == pairs[1].annotation);
+	assert(Cs.size() == 1 && Cs[0] == pairs[0].message);
+
+	AS->prefetch(As, Cs);
+	verifyPointQueries(AS, pairs, 1);
+	verifyAllEntries(AS, pairs, 1);
+}
 
 int main(int argc, char *argv[]) 
 {
@@ -139,6 +1285,10 @@ int main(int argc, char *argv[])
 	AS->initialize();
 
 	cout<<"verifying initial bootup from log..." << endl;
+	verifyPointQueries(AS, pairs, 1);
+	verifyFullScan(AS, pairs);
+	verifyRangeQueries(AS, pairs, 1);
+	verifyMultiKeyQueries(AS, pairs, 1);
 	verifyAllEntries(AS, pairs, 1);
 	cout<<"done."<<endl<<endl;
 
@@ -147,6 +1297,9 @@ int main(int argc, char *argv[])
 	cout<<"done."<<endl<<endl;
 
 	setAllEntries(AS, pairs, 1);
+
+	// keep commits to a small memory budget, so that they sort the log in several runs
+	AS->set_commit_memory_limit(64 * 1024);
 	AS->commit_to_disk();
 	delete(AS);
 
@@ -155,6 +1308,18 @@ int main(int argc, char *argv[])
 	AS->initialize();
 
 	cout<<"verifying initial bootup from commited hashfile..." << endl;
+	verifyPagedQueries(AS, pairs, 1);
+	verifySweepQueries(AS, pairs, 1);
+	verifyBatchQueries(AS, pairs, 1);
+	verifyProbeBackends(test_bed_directory, hashTableType, pairs);
+	verifyPointQueries(AS, pairs, 1);
+	verifyRangeQueries(AS, pairs, 1);
+	verifyMultiKeyQueries(AS, pairs, 1);
+	verifyAllEntries(AS, pairs, 1);
+	cout<<"done."<<endl<<endl;
+
+	cout<<"testing asynchronous calls..." << endl;
+	verifyAsyncQueries(AS, pairs);
 	verifyAllEntries(AS, pairs, 1);
 	cout<<"done."<<endl<<endl;
 
@@ -164,6 +1329,67 @@ int main(int argc, char *argv[])
 
 	// ************ Below tests are on a FULLY-DELETED system *********************** //
 
+	cout<<"testing repeated commits..." << endl;
+	runRepeatedCommits(AS, pairs);
+	delete(AS);
+
+	AS = new AnnotationSet(test_bed_directory, hashTableType);
+	AS->initialize();
+	verifyPointQueries(AS, pairs, 1);
+	verifyAllEntries(AS, pairs, 1);
+	cout<<"done."<<endl<<endl;
+
+	cout<<"testing snapshots..." << endl;
+	runSnapshotVerification(AS, test_bed_directory, pairs);
+	verifyStaleSnapshotRemoval(AS, test_bed_directory, hashTableType);
+	cout<<"done."<<endl<<endl;
+
+	cout<<"testing read-only readers..." << endl;
+	runReaderVerification(AS, test_bed_directory, hashTableType, pairs);
+	cout<<"done."<<endl<<endl;
+
+	cout<<"testing timeline tracing..." << endl;
+	runTraceVerification(AS, test_bed_directory);
+	cout<<"done."<<endl<<endl;
+
+	cout<<"testing hot keys across restarts..." << endl;
+	recordHotKeys(AS, test_bed_directory, pairs);
+	delete(AS);
+
+	AS = new AnnotationSet(test_bed_directory, hashTableType);
+	AS->set_hot_key_capacity(2);
+	AS->initialize();
+	verifyHotKeys(AS, pairs);
+	cout<<"done."<<endl<<endl;
+
+	cout<<"testing commits to a gapped file..." << endl;
+	verifyGappedCommits(test_bed_directory, pairs);
+	cout<<"done."<<endl<<endl;
+
+	cout<<"testing dictionary-encoded files..." << endl;
+	verifyEncodedFile(test_bed_directory, pairs);
+	cout<<"done."<<endl<<endl;
+
+	cout<<"testing BTreeFile geometries..." << endl;
+	verifyBTreeGeometries(test_bed_directory, pairs);
+	AS->tune_index(256);
+	verifyAllEntries(AS, pairs, 1);
+	cout<<"done."<<endl<<endl;
+
+	cout<<"testing full scans merged with uncommitted changes..." << endl;
+	vector<AnnotationPair> half(pairs.begin(), pairs.begin() + pairs.size() / 2);
+	verifyFullScan(AS, pairs);
+	setAllEntries(AS, pairs, 0);
+	setAllEntries(AS, half, 1);
+	verifyFullScan(AS, half);
+	verifyPagedQueries(AS, half, 1);
+	verifySweepQueries(AS, half, 1);
+	AnnotationSnapshot changed = AS->snapshot();
+	verifyPagedQueries(&changed, half, 1);
+	verifySweepQueries(&changed, half, 1);
+	verifyFullScan(AS, half);
+	cout<<"done."<<endl<<endl;
+
 	//unannotate all entries
 	setAllEntries(AS, pairs, 0);
 	delete(AS);
@@ -176,14 +1402,210 @@ int main(int argc, char *argv[])
 	verifyAllEntries(AS, pairs, 0);
 	cout<<"done."<<endl<<endl;
 
+	AS->set_commit_memory_limit(64 * 1024);
 	AS->commit_to_disk();
 	delete(AS);
 
 	AS = new AnnotationSet(test_bed_directory, hashTableType);
 	AS->initialize();
 	cout<<"verifying fully-deleted system booted from commited hashfile..."<<endl;
+	verifyPagedQueries(AS, pairs, 0);
+	verifySweepQueries(AS, pairs, 0);
+	verifyBatchQueries(AS, pairs, 0);
+	verifyPointQueries(AS, pairs, 0);
+	verifyRangeQueries(AS, pairs, 0);
+	verifyMultiKeyQueries(AS, pairs, 0);
 	verifyAllEntries(AS, pairs, 0);
 	cout<<"done."<<endl<<endl;
+
+	// ************ Below tests are on a BULK-LOADED system *********************** //
+
+	delete(AS);
+	dir_delete(test_bed_directory);
+
+	AS = new AnnotationSet(test_bed_directory, hashTableType);
+	AS->initialize();
+
+	// a small memory budget forces the snapshot to be sorted in several runs
+	cout<<"verifying system bulk-loaded from snapshot..."<<endl;
+	AS->bulk_load(string(argv[1]), 64 * 1024, 2);
+	verifyPointQueries(AS, pairs, 1);
+	verifyRangeQueries(AS, pairs, 1);
+	verifyAllEntries(AS, pairs, 1);
+	delete(AS);
+
+	AS = new AnnotationSet(test_bed_directory, hashTableType);
+	AS->initialize();
+	verifyPointQueries(AS, pairs, 1);
+	verifyAllEntries(AS, pairs, 1);
+	cout<<"done."<<endl<<endl;
+
+	cout<<"verifying bulk-loaded system with interpolation search..."<<endl;
+	delete(AS);
+	AS = new AnnotationSet(test_bed_directory, hashTableType);
+	AS->initialize();
+	AS->set_search_mode(SEARCH_INTERPOLATION);
+	verifyPointQueries(AS, pairs, 1);
+	verifyRangeQueries(AS, pairs, 1);
+	verifyMultiKeyQueries(AS, pairs, 1);
+	verifyAllEntries(AS, pairs, 1);
+	cout<<"done."<<endl<<endl;
+
+	cout<<"testing bulk-loaded system..."<<endl;
+	runLiveVerification(AS, pairs);
+	AS->commit_to_disk();
+	delete(AS);
+
+	AS = new AnnotationSet(test_bed_directory, hashTableType);
+	AS->initialize();
+	verifyPointQueries(AS, pairs, 1);
+	verifyAllEntries(AS, pairs, 1);
+	cout<<"done."<<endl<<endl;
+
+	delete(AS);
+
+	// ************ Below tests are on a SHARDED system *************************** //
+
+	dir_delete(test_bed_directory);
+
+	ShardedAnnotationSet *SAS = new ShardedAnnotationSet(test_bed_directory, hashTableType, 2);
+	SAS->initialize();
+
+	cout<<"testing brand-new sharded system..."<<endl;
+	runLiveVerification(SAS, pairs);
+	verifyPointQueries(SAS, pairs, 1);
+	verifyMultiKeyQueries(SAS, pairs, 1);
+	cout<<"done."<<endl<<endl;
+
+	delete(SAS);
+
+	SAS = new ShardedAnnotationSet(test_bed_directory, hashTableType);
+	SAS->initialize();
+
+	cout<<"verifying sharded system booted from log..."<<endl;
+	assert(SAS->shardBits() == 2);
+	verifyPointQueries(SAS, pairs, 1);
+	verifyAllEntries(SAS, pairs, 1);
+	cout<<"done."<<endl<<endl;
+
+	SAS->set_commit_memory_limit(64 * 1024);
+	SAS->commit_to_disk();
+	delete(SAS);
+
+	SAS = new ShardedAnnotationSet(test_bed_directory, hashTableType);
+	SAS->initialize();
+
+	cout<<"verifying sharded system booted from commited hashfile..."<<endl;
+	verifyPagedQueries(SAS, pairs, 1);
+	verifySweepQueries(SAS, pairs, 1);
+	verifyBatchQueries(SAS, pairs, 1);
+	verifyAsyncQueries(SAS, pairs);
+	verifyPointQueries(SAS, pairs, 1);
+	verifyRangeQueries(SAS, pairs, 1);
+	verifyMultiKeyQueries(SAS, pairs, 1);
+	verifyAllEntries(SAS, pairs, 1);
+	cout<<"done."<<endl<<endl;
+
+	// leave some changes uncommitted, so resharding has to fold in the logs
+	setAllEntries(SAS, pairs, 0);
+	setAllEntries(SAS, pairs, 1);
+	delete(SAS);
+
+	cout<<"testing recovery of cross-shard writes..."<<endl;
+	verifyCrossShardRecovery(test_bed_directory, hashTableType, pairs);
+	cout<<"done."<<endl<<endl;
+
+	cout<<"verifying resharded system..."<<endl;
+	assert(reshard_directory(test_bed_directory, 3, hashTableType));
+
+	// as if stopped between the two renames of the swap; opening completes it
+	rename(test_bed_directory.c_str(), (test_bed_directory + ".reshard").c_str());
+	fstream marker((test_bed_directory + ".reshard-swap").c_str(), fstream::out | fstream::trunc);
+	marker.close();
+
+	SAS = new ShardedAnnotationSet(test_bed_directory, hashTableType);
+	SAS->initialize();
+	assert(SAS->shardBits() == 3);
+	assert(access((test_bed_directory + ".reshard-swap").c_str(), F_OK) != 0);
+	verifyPointQueries(SAS, pairs, 1);
+	verifyRangeQueries(SAS, pairs, 1);
+	verifyAllEntries(SAS, pairs, 1);
+	runLiveVerification(SAS, pairs);
+	cout<<"done."<<endl<<endl;
+
+	cout<<"testing the server..."<<endl;
+	runServerVerification(SAS, test_bed_directory, pairs);
+	verifyAllEntries(SAS, pairs, 1);
+	cout<<"done."<<endl<<endl;
+
+	delete(SAS);
+
+	// ************ Below tests are on a SHA-256 system *************************** //
+
+	vector<AnnotationPair> wide_pairs = widen_annotations(pairs);
+	dir_delete(test_bed_directory);
+
+	// a build with SHA-1 sized Digests must refuse the wider keys outright
+	if(!supportedKeyWidth(SHA256_WIDTH))
+	{
+		cout<<"verifying SHA-256 system is refused by this build..."<<endl;
+		bool refused = false;
+
+		try
+		{
+			AS = new AnnotationSet(test_bed_directory, hashTableType, 0, 0, SHA256_WIDTH);
+		}
+		catch(KeyWidthError &error)
+		{
+			refused = true;
+		}
+
+		assert(refused);
+		cout<<"done."<<endl<<endl;
+		cout<<"All tests passed."<<endl;
+
+		return 0;
+	}
+
+	AS = new AnnotationSet(test_bed_directory, hashTableType, 0, 0, SHA256_WIDTH);
+	AS->initialize();
+
+	cout<<"testing brand-new SHA-256 system..."<<endl;
+	runLiveVerification(AS, wide_pairs);
+	cout<<"done."<<endl<<endl;
+
+	AS->set_commit_memory_limit(64 * 1024);
+	AS->commit_to_disk();
+	delete(AS);
+
+	// opened with the default width; the one recorded in the headers wins
+	AS = new AnnotationSet(test_bed_directory, hashTableType);
+	AS->initialize();
+
+	cout<<"verifying SHA-256 system booted from commited hashfile..."<<endl;
+	assert(AS->keyWidth() == SHA256_WIDTH);
+	verifyBatchQueries(AS, wide_pairs, 1);
+	verifyProbeBackends(test_bed_directory, hashTableType, wide_pairs);
+	verifyPointQueries(AS, wide_pairs, 1);
+	verifyRangeQueries(AS, wide_pairs, 1);
+	verifyMultiKeyQueries(AS, wide_pairs, 1);
+	verifyAllEntries(AS, wide_pairs, 1);
+	cout<<"done."<<endl<<endl;
+
+	delete(AS);
+
+	cout<<"verifying resharded SHA-256 system..."<<endl;
+	assert(reshard_directory(test_bed_directory, 1, hashTableType));
+
+	SAS = new ShardedAnnotationSet(test_bed_directory, hashTableType);
+	SAS->initialize();
+	assert(SAS->keyWidth() == SHA256_WIDTH);
+	verifyPointQueries(SAS, wide_pairs, 1);
+	verifyRangeQueries(SAS, wide_pairs, 1);
+	verifyAllEntries(SAS, wide_pairs, 1);
+	cout<<"done."<<endl<<endl;
+
+	delete(SAS);
 	cout<<"All tests passed."<<endl;
 
 	return 0;	
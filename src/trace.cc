@@ -0,0 +1,113 @@
+#include "trace.h"
+#include <fstream>
+#include <iomanip>
+#include <unistd.h>
+
+atomic<bool> Trace::recording(false);
+atomic<unsigned long> Trace::slow_lookup_nanos(0);
+mutex Trace::buffers_lock;
+vector<Trace::Buffer*> Trace::buffers;
+
+// lookups that take at least slowLookupNanos are traced; every other trace
+// point records each time it is passed
+
+void Trace::start(unsigned long slowLookupNanos)
+{
+	slow_lookup_nanos.store(slowLookupNanos, memory_order_relaxed);
+	recording.store(true, memory_order_relaxed);
+}
+
+void Trace::stop()
+{
+	recording.store(false, memory_order_relaxed);
+}
+
+unsigned long Trace::slowLookupNanos()
+{
+	return slow_lookup_nanos.load(memory_order_relaxed);
+}
+
+// a thread gets its buffer the first time it records, and the buffer stays
+// registered after the thread exits so that its spans can still be dumped
+
+Trace::Buffer *Trace::thread_buffer()
+{
+	static thread_local Buffer *buffer = NULL;
+
+	if(buffer == NULL)
+	{
+		buffer = new Buffer;
+		buffer->written.store(0, memory_order_relaxed);
+
+		lock_guard<mutex> guard(buffers_lock);
+		buffer->thread_id = buffers.size() + 1;
+		buffers.push_back(buffer);
+	}
+
+	return buffer;
+}
+
+// only the owning thread writes a buffer: fill the slot, then publish it
+
+void Trace::record(const char *name, unsigned long long begin, unsigned long long end)
+{
+	Buffer *buffer = thread_buffer();
+	unsigned long written = buffer->written.load(memory_order_relaxed);
+	Event &event = buffer->events[written % BUFFER_EVENTS];
+
+	event.name = name;
+	event.begin = begin;
+	event.end = end;
+
+	buffer->written.store(written + 1, memory_order_release);
+}
+
+// drop everything recorded so far; call while stopped
+
+void Trace::clear()
+{
+	lock_guard<mutex> guard(buffers_lock);
+
+	for(unsigned long i=0; i<buffers.size(); i++)
+		buffers[i]->written.store(0, memory_order_relaxed);
+}
+
+// write the spans of every buffer, oldest first, as complete ("X") events with
+// microsecond timestamps. call while stopped, or spans still being written may
+// come out torn
+
+bool Trace::dump(string filename)
+{
+	lock_guard<mutex> guard(buffers_lock);
+	fstream file(filename.c_str(), fstream::out | fstream::trunc);
+	bool first = true;
+
+	if(!file.is_open())
+		return false;
+
+	file << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[" << fixed << setprecision(3);
+
+	for(unsigned long i=0; i<buffers.size(); i++)
+	{
+		unsigned long written = buffers[i]->written.load(memory_order_acquire);
+		unsigned long oldest = (written > BUFFER_EVENTS ? written - BUFFER_EVENTS : 0);
+
+		for(unsigned long n=oldest; n<written; n++)
+		{
+			const Event &event = buffers[i]->events[n % BUFFER_EVENTS];
+
+			file << (first ? "\n" : ",\n")
+				 << "{\"name\":\"" << event.name << "\",\"ph\":\"X\",\"pid\":" << getpid()
+				 << ",\"tid\":" << buffers[i]->thread_id
+				 << ",\"ts\":" << event.begin / 1000.0
+				 << ",\"dur\":" << (event.end - event.begin) / 1000.0 << "}";
+
+			first = false;
+		}
+	}
+
+	file << "\n]}\n";
+	file.close();
+
+	return !file.fail();
+}
@@ -94,3 +94,99 @@ void swapString(string &first, string &second)
 	first = second;
 	second = tmp;
 }
+
+// returns the shard owning key: the value of its leading `bits` bits (at most 32)
+
+unsigned int convertKeyToShard(string_view key, unsigned int bits)
+{
+	if(bits == 0)
+		return 0;
+
+	// short enough to stay in the string's inline buffer
+	unsigned int n = convertHexToInt(string(key.substr(0, 8)));
+	return n >> (32 - bits);
+}
+
+/////////////////////////////////// MappedFile /////////////////////////////////
+
+MappedFile::MappedFile()
+{
+	fd = -1;
+	map = NULL;
+	length = 0;
+}
+
+MappedFile::~MappedFile()
+{
+	close();
+}
+
+// lookups land anywhere in the file, so the kernel should not read ahead of them
+
+bool MappedFile::open(string filename)
+{
+	struct stat st;
+
+	close();
+
+	if((fd = ::open(filename.c_str(), O_RDONLY)) < 0)
+		return false;
+
+	if(fstat(fd, &st) != 0 || st.st_size == 0)
+	{
+		close();
+		return false;
+	}
+
+	void *m = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+
+	if(m == MAP_FAILED)
+	{
+		close();
+		return false;
+	}
+
+	map = (char *) m;
+	length = st.st_size;
+	madvise(map, length, MADV_RANDOM);
+
+	return true;
+}
+
+void MappedFile::close()
+{
+	if(map != NULL)
+		munmap(map, length);
+
+	if(fd >= 0)
+		::close(fd);
+
+	fd = -1;
+	map = NULL;
+	length = 0;
+}
+
+const char *MappedFile::data()
+{
+	return map;
+}
+
+unsigned long MappedFile::size()
+{
+	return length;
+}
+
+int MappedFile::descriptor()
+{
+	return fd;
+}
+
+// copy out bytes at offset; false, copying what there is, if the file ends first
+
+bool MappedFile::read(char *buf, unsigned long offset, unsigned long bytes)
+{
+	unsigned long available = (offset < length ? length - offset : 0);
+
+	memcpy(buf, map + offset, min(bytes, available));
+	return(available >= bytes);
+}
@@ -0,0 +1,389 @@
+#include "valueset.h"
+
+// value of each hex digit, by character; anything else reads as 0
+static const struct NibbleTable
+{
+	unsigned char values[256];
+
+	NibbleTable()
+	{
+		memset(values, 0, sizeof(values));
+
+		for(int i=0; i<10; i++)
+			values['0' + i] = i;
+
+		for(int i=0; i<6; i++)
+			values['a' + i] = values['A' + i] = 10 + i;
+	}
+} hex_nibbles;
+
+void convertHexToDigest(Digest &digest, string_view hex)
+{
+	const unsigned char *digits = (const unsigned char *) hex.data();
+	unsigned int bytes = min((unsigned int) hex.size() / 2, (unsigned int) DIGEST_WIDTH);
+
+	for(unsigned int i=0; i<bytes; i++)
+		digest.bytes[i] = (hex_nibbles.values[digits[2*i]] << 4) | hex_nibbles.values[digits[2*i+1]];
+
+	memset(digest.bytes + bytes, 0, DIGEST_WIDTH - bytes);
+}
+
+// width is the number of hex digits of the original key
+
+string convertDigestToHex(const Digest &digest, unsigned int width)
+{
+	const char *digits = "0123456789abcdef";
+	unsigned int bytes = min(width / 2, (unsigned int) DIGEST_WIDTH);
+	string hex(bytes * 2, '0');
+
+	for(unsigned int i=0; i<bytes; i++)
+	{
+		hex[2*i] = digits[digest.bytes[i] >> 4];
+		hex[2*i+1] = digits[digest.bytes[i] & 0x0f];
+	}
+	return hex;
+}
+
+////////////////////////////////// DigestArena /////////////////////////////////
+
+DigestArena::DigestArena()
+{
+	chunk_cursor = NULL;
+	chunk_remaining = 0;
+	bytes_reserved = 0;
+	key_width = SHA_WIDTH;
+	digest_bytes = DIGEST_WIDTH;
+
+	for(int i=0; i<NUM_CLASSES; i++)
+		free_lists[i] = NULL;
+}
+
+DigestArena::~DigestArena()
+{
+	for(unsigned long i=0; i<chunks.size(); i++)
+		delete[] chunks[i];
+}
+
+int DigestArena::size_class(unsigned int capacity)
+{
+	int cls = 0;
+	while((1u << cls) < capacity)
+		cls++;
+	return cls;
+}
+
+// capacity must be a power of two. blocks larger than a quarter chunk get a
+// chunk of their own, everything else is carved from the current chunk
+
+unsigned char *DigestArena::allocate(unsigned int capacity)
+{
+	int cls = size_class(capacity);
+	unsigned long bytes = (unsigned long)capacity * digest_bytes;
+
+	// reuse a released block of the same size; its first bytes hold the
+	// pointer to the next free block
+	if(free_lists[cls] != NULL)
+	{
+		unsigned char *block = free_lists[cls];
+		memcpy(&free_lists[cls], block, sizeof(unsigned char *));
+		return block;
+	}
+
+	if(bytes > CHUNK_SIZE / 4)
+	{
+		chunks.push_back(new char[bytes]);
+		bytes_reserved += bytes;
+		return (unsigned char *) chunks.back();
+	}
+
+	if(bytes > chunk_remaining)
+	{
+		chunks.push_back(new char[CHUNK_SIZE]);
+		bytes_reserved += CHUNK_SIZE;
+		chunk_cursor = chunks.back();
+		chunk_remaining = CHUNK_SIZE;
+	}
+
+	unsigned char *block = (unsigned char *) chunk_cursor;
+	chunk_cursor += bytes;
+	chunk_remaining -= bytes;
+	return block;
+}
+
+void DigestArena::release(unsigned char *block, unsigned int capacity)
+{
+	int cls = size_class(capacity);
+	memcpy(block, &free_lists[cls], sizeof(unsigned char *));
+	free_lists[cls] = block;
+}
+
+unsigned long DigestArena::bytesReserved()
+{
+	return bytes_reserved;
+}
+
+// the size of the values changes with the width, so it must be set before the
+// first block is handed out
+
+void DigestArena::setKeyWidth(unsigned int width)
+{
+	key_width = width;
+	digest_bytes = min(width / 2, (unsigned int) DIGEST_WIDTH);
+}
+
+unsigned int DigestArena::keyWidth()
+{
+	return key_width;
+}
+
+unsigned int DigestArena::digestBytes()
+{
+	return digest_bytes;
+}
+
+/////////////////////////////////// ValueSet ///////////////////////////////////
+
+ValueSet::ValueSet(DigestArena *Arena)
+{
+	arena = Arena;
+	values = NULL;
+	sorted_count = pending_count = capacity = 0;
+	width = (arena != NULL ? arena->digestBytes() : DIGEST_WIDTH);
+}
+
+ValueSet::ValueSet(const ValueSet &other)
+{
+	arena = other.arena;
+	values = NULL;
+	sorted_count = pending_count = capacity = 0;
+	width = other.width;
+	*this = other;
+}
+
+// a set of another arena may store its values at another size
+
+ValueSet& ValueSet::operator=(const ValueSet &other)
+{
+	if(this == &other)
+		return *this;
+
+	clear();
+	reserve(other.capacity);
+
+	unsigned int total = other.sorted_count + other.pending_count;
+
+	if(other.width == width)
+		memcpy(values, other.values, (unsigned long) total * width);
+	else
+	{
+		for(unsigned int i=0; i<total; i++)
+		{
+			Digest value = *const_iterator(other.slot(i), other.width);
+			memcpy(slot(i), value.bytes, width);
+		}
+	}
+
+	sorted_count = other.sorted_count;
+	pending_count = other.pending_count;
+	return *this;
+}
+
+ValueSet::~ValueSet()
+{
+	release();
+}
+
+void ValueSet::release()
+{
+	if(values == NULL)
+		return;
+
+	if(arena != NULL)
+		arena->release(values, capacity);
+	else
+		delete[] values;
+
+	values = NULL;
+	capacity = 0;
+}
+
+// grow the backing block to new_capacity (rounded up to a power of two),
+// moving the existing values across
+
+void ValueSet::reserve(unsigned int new_capacity)
+{
+	if(new_capacity <= capacity)
+		return;
+
+	unsigned int rounded = 1;
+	while(rounded < new_capacity)
+		rounded <<= 1;
+
+	unsigned char *block = (arena != NULL ? arena->allocate(rounded) : new unsigned char[(unsigned long) rounded * width]);
+
+	if(values != NULL)
+		memcpy(block, values, (unsigned long)(sorted_count + pending_count) * width);
+
+	release();
+	values = block;
+	capacity = rounded;
+}
+
+void ValueSet::clear()
+{
+	release();
+	sorted_count = pending_count = 0;
+}
+
+unsigned long ValueSet::size() const
+{
+	return sorted_count + pending_count;
+}
+
+// the first position in the sorted prefix not below value
+
+unsigned int ValueSet::lower_bound_of(const Digest &value) const
+{
+	unsigned int low = 0, high = sorted_count, mid;
+
+	while(low < high)
+	{
+		mid = low + (high - low) / 2;
+
+		if(compare(mid, value) < 0)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	return low;
+}
+
+bool ValueSet::contains(const Digest &value) const
+{
+	unsigned int pos = lower_bound_of(value);
+
+	if(pos < sorted_count && compare(pos, value) == 0)
+		return true;
+
+	for(unsigned int i=sorted_count; i<sorted_count + pending_count; i++)
+		if(compare(i, value) == 0)
+			return true;
+
+	return false;
+}
+
+// returns whether the value was newly added
+
+bool ValueSet::insert(const Digest &value)
+{
+	if(contains(value))
+		return false;
+
+	if(sorted_count + pending_count == capacity)
+		reserve(capacity == 0 ? 1 : capacity * 2);
+
+	memcpy(slot(sorted_count + pending_count), value.bytes, width);
+	pending_count++;
+
+	if(pending_count == PENDING_LIMIT)
+		merge_pending();
+
+	return true;
+}
+
+// returns whether the value was present
+
+bool ValueSet::erase(const Digest &value)
+{
+	unsigned int total = sorted_count + pending_count;
+
+	// values in the insert buffer are unordered, so fill the hole with the last one
+	for(unsigned int i=sorted_count; i<total; i++)
+	{
+		if(compare(i, value) == 0)
+		{
+			memmove(slot(i), slot(total - 1), width);
+			pending_count--;
+			return true;
+		}
+	}
+
+	unsigned int pos = lower_bound_of(value);
+	if(pos == sorted_count || compare(pos, value) != 0)
+		return false;
+
+	memmove(slot(pos), slot(pos + 1), (unsigned long)(total - pos - 1) * width);
+	sorted_count--;
+	return true;
+}
+
+// values read from disk arrive in ascending order, and can be appended to the
+// sorted prefix directly
+
+void ValueSet::appendSorted(const Digest &value)
+{
+	if(pending_count != 0 || (sorted_count != 0 && compare(sorted_count - 1, value) >= 0))
+	{
+		insert(value);
+		return;
+	}
+
+	if(sorted_count == capacity)
+		reserve(capacity == 0 ? 1 : capacity * 2);
+
+	memcpy(slot(sorted_count++), value.bytes, width);
+}
+
+// sort the insert buffer, then merge it into the sorted prefix from the back so
+// that no scratch space beyond the (small) buffer itself is needed
+
+void ValueSet::merge_pending()
+{
+	if(pending_count == 0)
+		return;
+
+	Digest buffer[PENDING_LIMIT];
+
+	for(unsigned int i=0; i<pending_count; i++)
+		buffer[i] = *const_iterator(slot(sorted_count + i), width);
+
+	sort(buffer, buffer + pending_count);
+
+	long long src = (long long)sorted_count - 1, buf = (long long)pending_count - 1;
+	long long dst = (long long)sorted_count + pending_count - 1;
+
+	while(buf >= 0)
+	{
+		if(src >= 0 && compare(src, buffer[buf]) > 0)
+			memmove(slot(dst--), slot(src--), width);
+		else
+			memcpy(slot(dst--), buffer[buf--].bytes, width);
+	}
+
+	sorted_count += pending_count;
+	pending_count = 0;
+}
+
+ValueSet::const_iterator ValueSet::begin()
+{
+	merge_pending();
+	return const_iterator(values, width);
+}
+
+ValueSet::const_iterator ValueSet::end()
+{
+	merge_pending();
+	return const_iterator(slot(sorted_count), width);
+}
+
+set<string> ValueSet::toStringSet()
+{
+	set<string> list;
+	unsigned int key_width = (arena != NULL ? arena->keyWidth() : SHA_WIDTH);
+
+	for(const_iterator it = begin(); it != end(); it++)
+		list.insert(list.end(), convertDigestToHex(*it, key_width));
+
+	return list;
+}
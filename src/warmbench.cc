@@ -0,0 +1,187 @@
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <math.h>
+#include <stdlib.h>
+
+#include "utils.h"
+#include "annotations.h"
+
+using namespace std;
+
+// Time to steady state after a restart. a set is loaded, read under a skewed
+// workload, and committed, which saves its hot keys. it is then reopened twice,
+// cold (no prefetch) and warm (hot keys prefetched by initialize), with its
+// files dropped from the page cache first, and read under the same workload
+// again. reports the latency of each window of reads, and how long after the
+// reopen the reads first came within STEADY_FACTOR of the steady latency, the
+// mean of the last STEADY_WINDOWS windows
+
+typedef chrono::steady_clock Clock;
+
+const unsigned long VALUES_PER_KEY = 4, WINDOW = 2000, WINDOWS = 60, STEADY_WINDOWS = 10, REPORT_EVERY = 5;
+const double SKEW = 6.0, STEADY_FACTOR = 1.5;
+
+string random_key()
+{
+	const char *digits = "0123456789abcdef";
+	string key(SHA_WIDTH, '0');
+
+	for(unsigned int i=0; i<SHA_WIDTH; i++)
+		key[i] = digits[rand() % 16];
+
+	return key;
+}
+
+// key i is read with a probability falling off as a power of its rank
+unsigned long skewed_index(unsigned long keys)
+{
+	return (unsigned long)(keys * pow(rand() / (RAND_MAX + 1.0), SKEW));
+}
+
+// written back, then dropped, so the reopened set reads from disk
+void evict_directory(string directory)
+{
+	struct dirent *de = NULL;
+	DIR *d = NULL;
+
+	if((d = opendir(directory.c_str())) == NULL)
+		return;
+
+	while((de = readdir(d)) != NULL)
+	{
+		if(de->d_name[0] == '.')
+			continue;
+
+		string path = directory + "/" + de->d_name;
+		struct stat st;
+
+		if(stat(path.c_str(), &st) != 0)
+			continue;
+
+		if(S_ISDIR(st.st_mode))
+		{
+			evict_directory(path);
+			continue;
+		}
+
+		int fd = open(path.c_str(), O_RDONLY);
+
+		if(fd < 0)
+			continue;
+
+		fdatasync(fd);
+		posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+		close(fd);
+	}
+
+	closedir(d);
+}
+
+void run_reads(string directory, string hashTableType, vector<string> &As, bool prefetch)
+{
+	evict_directory(directory);
+	srand(2);
+
+	Clock::time_point open = Clock::now();
+
+	AnnotationSet *AS = new AnnotationSet(directory, hashTableType);
+	AS->set_prefetch_on_start(prefetch);
+	AS->initialize();
+
+	double initialize_ms = chrono::duration_cast<chrono::microseconds>(Clock::now() - open).count() / 1000.0;
+	vector<double> window_us, window_end_ms;
+
+	for(unsigned long w=0; w<WINDOWS; w++)
+	{
+		Clock::time_point start = Clock::now();
+
+		for(unsigned long i=0; i<WINDOW; i++)
+			AS->list_entries(As[skewed_index(As.size())]);
+
+		Clock::time_point end = Clock::now();
+
+		window_us.push_back(chrono::duration_cast<chrono::nanoseconds>(end - start).count() / 1000.0 / WINDOW);
+		window_end_ms.push_back(chrono::duration_cast<chrono::microseconds>(end - open).count() / 1000.0);
+	}
+
+	double steady = 0;
+
+	for(unsigned long w=WINDOWS-STEADY_WINDOWS; w<WINDOWS; w++)
+		steady += window_us[w] / STEADY_WINDOWS;
+
+	unsigned long reached = 0;
+
+	while(reached < WINDOWS && window_us[reached] > STEADY_FACTOR * steady)
+		reached++;
+
+	cout << fixed << setprecision(2) << (prefetch ? "warm" : "cold") << " restart: initialize "
+		 << initialize_ms << " ms" << endl;
+
+	for(unsigned long w=0; w<WINDOWS; w += REPORT_EVERY)
+		cout << "  reads " << setw(7) << w * WINDOW << ": " << window_us[w] << " us/read" << endl;
+
+	cout << "  steady " << steady << " us/read, reached after " << window_end_ms[reached] << " ms ("
+		 << reached * WINDOW << " reads)" << endl;
+
+	delete(AS);
+}
+
+int main(int argc, char *argv[])
+{
+	string test_bed_directory("testbed");
+	string hashTableType("");
+	unsigned long keys, hot_keys = 1024;
+
+	if(argc < 2)
+	{
+		cout << "USAGE: [KEYS] [optional: HOT KEYS] [optional: \"BTreeFile\"]" << endl;
+		return 0;
+	}
+
+	keys = strtoul(argv[1], NULL, 10);
+
+	if(argc > 2)
+		hot_keys = strtoul(argv[2], NULL, 10);
+	if(argc > 3)
+		hashTableType = string(argv[3]);
+
+	dir_delete(test_bed_directory);
+	srand(1);
+
+	vector<string> As;
+	string snapshot_filename("warmbench-snapshot.txt");
+	fstream snapshot(snapshot_filename.c_str(), fstream::out | fstream::trunc);
+
+	for(unsigned long i=0; i<keys; i++)
+	{
+		As.push_back(random_key());
+
+		for(unsigned long j=0; j<VALUES_PER_KEY; j++)
+			snapshot << As[i] << " " << random_key() << "\n";
+	}
+
+	snapshot.close();
+
+	// the first run finds the hot keys, and its commit saves them
+	AnnotationSet *AS = new AnnotationSet(test_bed_directory, hashTableType);
+	AS->set_hot_key_capacity(hot_keys);
+	AS->initialize();
+	AS->bulk_load(snapshot_filename);
+
+	for(unsigned long i=0; i<WINDOWS * WINDOW; i++)
+		AS->list_entries(As[skewed_index(keys)]);
+
+	AS->commit_to_disk();
+	delete(AS);
+	remove(snapshot_filename.c_str());
+
+	run_reads(test_bed_directory, hashTableType, As, false);
+	run_reads(test_bed_directory, hashTableType, As, true);
+
+	dir_delete(test_bed_directory);
+
+	return 0;
+}
@@ -0,0 +1,195 @@
+#include "workpool.h"
+
+WorkPool::WorkPool(unsigned int threads, unsigned long maxPending)
+{
+	max_pending = maxPending;
+	queued = 0;
+	stealable = 0;
+	next_queue = 0;
+	ordered_draining = false;
+	stopping = false;
+
+	threads = max(threads, 1u);
+
+	for(unsigned int i=0; i<threads; i++)
+		queues.push_back(new TaskQueue);
+
+	for(unsigned int i=0; i<threads; i++)
+		workers.push_back(new thread(&WorkPool::worker, this, i));
+}
+
+WorkPool::~WorkPool()
+{
+	{
+		unique_lock<mutex> guard(idle_lock);
+		stopping = true;
+	}
+	wakeup.notify_all();
+
+	for(unsigned long i=0; i<workers.size(); i++)
+	{
+		workers[i]->join();
+		delete workers[i];
+	}
+
+	for(unsigned long i=0; i<queues.size(); i++)
+		delete queues[i];
+}
+
+unsigned long WorkPool::pending()
+{
+	return queued;
+}
+
+// returns false, without queueing the task, when the pool is full
+
+bool WorkPool::submit(function<void()> task)
+{
+	if(queued.fetch_add(1) >= max_pending)
+	{
+		queued--;
+		return false;
+	}
+
+	TaskQueue *queue = queues[next_queue++ % queues.size()];
+
+	{
+		unique_lock<mutex> guard(queue->lock);
+		queue->tasks.push_back(task);
+		stealable++;
+	}
+
+	// taking idle_lock orders this against a worker deciding to sleep
+	{
+		unique_lock<mutex> guard(idle_lock);
+	}
+	wakeup.notify_one();
+
+	return true;
+}
+
+// as submit(), but the task runs only once every ordered task submitted before
+// it has finished
+
+bool WorkPool::submitOrdered(function<void()> task)
+{
+	if(queued.fetch_add(1) >= max_pending)
+	{
+		queued--;
+		return false;
+	}
+
+	{
+		unique_lock<mutex> guard(idle_lock);
+		ordered.push_back(task);
+	}
+	wakeup.notify_one();
+
+	return true;
+}
+
+// pop the newest task of our own queue, or else steal the oldest of another's
+
+bool WorkPool::take(unsigned int index, function<void()> &task)
+{
+	for(unsigned long i=0; i<queues.size(); i++)
+	{
+		TaskQueue *queue = queues[(index + i) % queues.size()];
+		unique_lock<mutex> guard(queue->lock);
+
+		if(queue->tasks.empty())
+			continue;
+
+		if(i == 0)
+		{
+			task = queue->tasks.back();
+			queue->tasks.pop_back();
+		}
+		else
+		{
+			task = queue->tasks.front();
+			queue->tasks.pop_front();
+		}
+
+		stealable--;
+		return true;
+	}
+
+	return false;
+}
+
+// claim the ordered queue and pop its oldest task, unless another worker owns
+// it. its owner calls again with draining set after each task, and gives the
+// queue up once it is empty
+
+bool WorkPool::take_ordered(bool draining, function<void()> &task)
+{
+	unique_lock<mutex> guard(idle_lock);
+
+	if(ordered_draining && !draining)
+		return false;
+
+	if(ordered.empty())
+	{
+		ordered_draining = false;
+		return false;
+	}
+
+	ordered_draining = true;
+	task = ordered.front();
+	ordered.pop_front();
+
+	return true;
+}
+
+// a pool being destroyed may have workers asleep while the ordered queue drains
+
+void WorkPool::task_taken()
+{
+	if(--queued != 0)
+		return;
+
+	unique_lock<mutex> guard(idle_lock);
+
+	if(stopping)
+		wakeup.notify_all();
+}
+
+void WorkPool::worker(unsigned int index)
+{
+	function<void()> task;
+
+	while(true)
+	{
+		if(take(index, task))
+		{
+			task_taken();
+			task();
+			task = NULL;
+			continue;
+		}
+
+		if(take_ordered(false, task))
+		{
+			do
+			{
+				task_taken();
+				task();
+				task = NULL;
+			}
+			while(take_ordered(true, task));
+
+			continue;
+		}
+
+		// a task may still be on its way into a queue, in which case its
+		// submit() wakes us once it is there
+		unique_lock<mutex> guard(idle_lock);
+
+		if(queued == 0 && stopping)
+			return;
+
+		if(stealable == 0 && (ordered.empty() || ordered_draining))
+			wakeup.wait(guard);
+	}
+}